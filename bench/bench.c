@@ -0,0 +1,1487 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../src/physics.h"
+#include "../src/solver.h"
+#include "../src/jobs.h"
+#include "../src/checkpoint.h"
+#include "../src/narrow.h"
+#include "../src/instance.h"
+#include "../src/mesh.h"
+#include "../src/sdf.h"
+#include "../src/granular.h"
+#include "../src/sort.h"
+#include "../src/texture.h"
+#include "../src/assets.h"
+#include <stb_image.h>
+#ifdef BENCH_GPU
+#include "../src/gpuphysics.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#define BENCH_DT (1.0f / 120.0f)
+
+typedef struct {
+    const char *name;
+    const char *usage;
+    int (*run)(int argc, char **argv);
+} Bench;
+
+static const char *option(int argc, char **argv, const char *name, const char *fallback) {
+    for (int i = 0; i < argc - 1; i++) {
+        if (strcmp(argv[i], name) == 0)
+            return argv[i + 1];
+    }
+    return fallback;
+}
+
+static int flag(int argc, char **argv, const char *name) {
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static PhysicsConfig configFromArgs(int argc, char **argv) {
+    PhysicsConfig config = physics_default_config();
+    config.deterministic = flag(argc, argv, "--deterministic");
+    config.threads = atoi(option(argc, argv, "--threads", "0"));
+    config.seed = strtoull(option(argc, argv, "--seed", "1"), NULL, 10);
+    config.solverIterations = atoi(option(argc, argv, "--iterations", "10"));
+    config.broadphaseSkin = atof(option(argc, argv, "--skin", "0"));
+    config.reorderInterval = atoi(option(argc, argv, "--reorder", "0"));
+    return config;
+}
+
+// Random spheres filling a box that grows with the body count, about 8 units^3 per body.
+static void spawnSpheres(PhysicsConfig *config, int count) {
+    float half = 0.5f * cbrtf(8.0f * count);
+    for (int k = 0; k < 3; k++) {
+        config->boundsMin[k] = -half;
+        config->boundsMax[k] = half;
+    }
+    physics_init(*config);
+
+    for (int i = 0; i < count; i++) {
+        float radius = 0.25f + 0.25f * physics_random();
+        float position[3], velocity[3];
+        for (int k = 0; k < 3; k++) {
+            position[k] = (2.0f * physics_random() - 1.0f) * (half - radius);
+            velocity[k] = (2.0f * physics_random() - 1.0f) * 2.0f;
+        }
+        physics_add_body(position, velocity, radius, 1.0f, SHAPE_SPHERE);
+    }
+}
+
+// Unit bodies dropped on a jittered grid into a narrow container, so they settle into a pile.
+static void spawnPile(PhysicsConfig *config, int count) {
+    int side = (int)ceilf(cbrtf(count / 4.0f));
+    float width = side * 1.1f;
+    config->boundsMin[0] = config->boundsMin[2] = -0.5f * width;
+    config->boundsMax[0] = config->boundsMax[2] = 0.5f * width;
+    config->boundsMin[1] = 0.0f;
+    config->boundsMax[1] = 1.1f * (count / (side * side) + 2);
+    physics_init(*config);
+
+    for (int i = 0; i < count; i++) {
+        int x = i % side;
+        int z = (i / side) % side;
+        int y = i / (side * side);
+        float position[3] = {
+            (x + 0.5f) * 1.1f - 0.5f * width + 0.02f * physics_random(),
+            (y + 0.5f) * 1.1f,
+            (z + 0.5f) * 1.1f - 0.5f * width + 0.02f * physics_random()
+        };
+        float velocity[3] = {0.0f, 0.0f, 0.0f};
+        physics_add_body(position, velocity, 0.5f, 1.0f, SHAPE_BOX);
+    }
+}
+
+static unsigned long long *runSteps(int steps) {
+    unsigned long long *hashes = malloc(steps * sizeof(unsigned long long));
+    for (int s = 0; s < steps; s++) {
+        physics_step(BENCH_DT);
+        hashes[s] = physicsStats.stateHash;
+    }
+    return hashes;
+}
+
+static int benchStep(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "10000"));
+    int steps = atoi(option(argc, argv, "--steps", "300"));
+    const char *record = option(argc, argv, "--record", NULL);
+    const char *check = option(argc, argv, "--check", NULL);
+    PhysicsConfig config = configFromArgs(argc, argv);
+    if (record || check)
+        config.deterministic = 1;
+
+    spawnSpheres(&config, count);
+    double start = now();
+    unsigned long long *hashes = runSteps(steps);
+    double elapsed = now() - start;
+
+    printf("step: %d bodies, %d steps, %d threads%s\n", count, steps, jobs_thread_count(),
+           config.deterministic ? ", deterministic" : "");
+    printf("  %.3f ms/step, %d pairs, %d contacts, kinetic energy %.3f\n",
+           elapsed * 1000.0 / steps, physicsStats.pairs, physicsStats.contacts, physicsStats.kineticEnergy);
+    if (config.deterministic)
+        printf("  final state hash %016llx\n", physicsStats.stateHash);
+    physics_shutdown();
+
+    int result = 0;
+    if (record) {
+        FILE *f = fopen(record, "w");
+        if (!f) {
+            printf("Failed to open %s\n", record);
+            result = 1;
+        }
+        else {
+            for (int s = 0; s < steps; s++) {
+                fprintf(f, "%d %016llx\n", s + 1, hashes[s]);
+            }
+            fclose(f);
+            printf("  recorded %d hashes to %s\n", steps, record);
+        }
+    }
+    if (check) {
+        FILE *f = fopen(check, "r");
+        if (!f) {
+            printf("Failed to open %s\n", check);
+            result = 1;
+        }
+        else {
+            int step, checked = 0;
+            unsigned long long golden;
+            while (fscanf(f, "%d %llx", &step, &golden) == 2 && step >= 1 && step <= steps) {
+                if (hashes[step - 1] != golden) {
+                    printf("  MISMATCH at step %d: %016llx, golden %016llx\n", step, hashes[step - 1], golden);
+                    result = 1;
+                    break;
+                }
+                checked++;
+            }
+            fclose(f);
+            if (!result)
+                printf("  %d hashes match %s\n", checked, check);
+        }
+    }
+    free(hashes);
+    return result;
+}
+
+// Runs the same scene on one thread and on --threads workers and compares every step.
+static int benchDeterminism(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "5000"));
+    int steps = atoi(option(argc, argv, "--steps", "200"));
+    PhysicsConfig config = configFromArgs(argc, argv);
+    config.deterministic = 1;
+    int threads = config.threads > 1 ? config.threads : 4;
+
+    config.threads = 1;
+    spawnSpheres(&config, count);
+    unsigned long long *serial = runSteps(steps);
+    physics_shutdown();
+
+    config.threads = threads;
+    spawnSpheres(&config, count);
+    unsigned long long *parallel = runSteps(steps);
+    physics_shutdown();
+
+    int result = 0;
+    for (int s = 0; s < steps; s++) {
+        if (serial[s] != parallel[s]) {
+            printf("determinism: MISMATCH at step %d between 1 and %d threads\n", s + 1, threads);
+            result = 1;
+            break;
+        }
+    }
+    if (!result)
+        printf("determinism: %d bodies, %d steps identical on 1 and %d threads (%016llx)\n",
+               count, steps, threads, serial[steps - 1]);
+    free(serial);
+    free(parallel);
+    return result;
+}
+
+// Saves mid-run, continues, then restores and checks the continuation is bit-identical.
+static int benchCheckpoint(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "10000"));
+    int steps = atoi(option(argc, argv, "--steps", "100"));
+    const char *path = option(argc, argv, "--file", "checkpoint.bin");
+    PhysicsConfig config = configFromArgs(argc, argv);
+    config.deterministic = 1;
+
+    spawnSpheres(&config, count);
+    free(runSteps(steps));
+    if (!checkpoint_save(path))
+        return 1;
+    double snapshotTime = checkpointStats.snapshotTime;
+    unsigned long long *original = runSteps(steps);
+    if (!checkpoint_wait())
+        return 1;
+
+    double start = now();
+    if (!checkpoint_load(path))
+        return 1;
+    double loadTime = now() - start;
+    unsigned long long *restored = runSteps(steps);
+    physics_shutdown();
+
+    int result = memcmp(original, restored, steps * sizeof(unsigned long long)) != 0;
+    printf("checkpoint: %d bodies, %llu bytes\n", count, checkpointStats.bytes);
+    printf("  snapshot %.3f ms, background write %.3f ms, load %.3f ms\n",
+           snapshotTime * 1000.0, checkpointStats.writeTime * 1000.0, loadTime * 1000.0);
+    printf("  continuation after restore %s\n", result ? "DIFFERS" : "is bit-identical");
+    free(original);
+    free(restored);
+    return result;
+}
+
+// Lets a pile settle and reports how well the contact solver converges.
+static int benchPile(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "10000"));
+    int steps = atoi(option(argc, argv, "--steps", "300"));
+    PhysicsConfig config = configFromArgs(argc, argv);
+
+    spawnPile(&config, count);
+    printf("pile: %d bodies, %d iterations, %d threads\n", count, config.solverIterations, jobs_thread_count());
+    double total = 0.0;
+    int rebuilds = 0, allocations = 0;
+    for (int s = 1; s <= steps; s++) {
+        physics_step(BENCH_DT);
+        total += physicsStats.stepTime;
+        if (s % 50 == 0 || s == steps) {
+            printf("  step %4d: %.3f ms/step, %d contacts, residual %.5f, kinetic energy %.3f, %d awake in %d islands\n",
+                   s, total * 1000.0 / s, physicsStats.contacts, physicsStats.solverResidual, physicsStats.kineticEnergy,
+                   physicsStats.awakeBodies, physicsStats.islands);
+            if (config.broadphaseSkin > 0.0f)
+                printf("             Verlet lists rebuilt %d times, %d listed pairs for %d overlapping\n",
+                       physicsStats.verletRebuilds - rebuilds, physicsStats.verletPairs, physicsStats.pairs);
+            rebuilds = physicsStats.verletRebuilds;
+        }
+        if (s == steps / 2)
+            allocations = physicsStats.arenaAllocations;
+    }
+    printf("  step arenas peaked at %llu KB, %d heap allocations, %d of them in the second half\n",
+           physicsStats.arenaHighWater / 1024, physicsStats.arenaAllocations, physicsStats.arenaAllocations - allocations);
+    physics_shutdown();
+    return 0;
+}
+
+// A heavy sphere with small ones pushed against it from every side, more of them than there
+// are colors, so its contacts spill into the overflow batch. Without gravity these are the
+// only contacts, and the colored solver visits them in the same order as the serial one.
+static unsigned long long solveHub(PhysicsConfig config, int count, int steps, int *colors) {
+    for (int k = 0; k < 3; k++) {
+        config.gravity[k] = 0.0f;
+        config.boundsMin[k] = -20.0f;
+        config.boundsMax[k] = 20.0f;
+    }
+    config.deterministic = 1;
+    physics_init(config);
+
+    float zero[3] = {0.0f, 0.0f, 0.0f};
+    physics_add_body(zero, zero, 4.0f, 50.0f, SHAPE_SPHERE);
+    for (int i = 0; i < count; i++) {
+        // spread evenly over the sphere along a golden angle spiral
+        float y = 1.0f - (2.0f * i + 1.0f) / count;
+        float r = sqrtf(1.0f - y * y);
+        float angle = 2.39996323f * i;
+        float direction[3] = {r * cosf(angle), y, r * sinf(angle)};
+        float position[3], velocity[3];
+        for (int k = 0; k < 3; k++) {
+            position[k] = 4.24f * direction[k];
+            velocity[k] = -2.0f * direction[k];
+        }
+        physics_add_body(position, velocity, 0.25f, 1.0f, SHAPE_SPHERE);
+    }
+
+    *colors = 0;
+    for (int s = 0; s < steps; s++) {
+        physics_step(BENCH_DT);
+        if (physicsStats.solverColors > *colors)
+            *colors = physicsStats.solverColors;
+    }
+    unsigned long long hash = physicsStats.stateHash;
+    physics_shutdown();
+    return hash;
+}
+
+// Serial Gauss-Seidel against the graph colored solver, scalar and SIMD, on the same pile.
+static int benchSolver(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "10000"));
+    int steps = atoi(option(argc, argv, "--steps", "300"));
+    const char *names[] = {"serial", "colored", "colored simd"};
+    unsigned long long hashes[3];
+    int result = 0;
+
+    printf("solver: %d body pile, %d steps\n", count, steps);
+    for (int mode = SOLVER_SERIAL; mode <= SOLVER_COLORED_SIMD; mode++) {
+        PhysicsConfig config = configFromArgs(argc, argv);
+        config.solverMode = mode;
+        config.deterministic = 1;
+        spawnPile(&config, count);
+
+        double solverTime = 0.0;
+        int colors = 0;
+        for (int s = 0; s < steps; s++) {
+            physics_step(BENCH_DT);
+            solverTime += physicsStats.solverTime;
+            if (physicsStats.solverColors > colors)
+                colors = physicsStats.solverColors;
+        }
+        printf("  %-12s %8.3f ms/step solving, %d threads, %2d colors, %d contacts, residual %.5f\n",
+               names[mode], solverTime * 1000.0 / steps, jobs_thread_count(), colors,
+               physicsStats.contacts, physicsStats.solverResidual);
+        hashes[mode] = physicsStats.stateHash;
+        physics_shutdown();
+    }
+    printf("  simd path %s the scalar colored path\n",
+           hashes[SOLVER_COLORED_SIMD] == hashes[SOLVER_COLORED] ? "matches" : "DIFFERS from");
+    result |= hashes[SOLVER_COLORED_SIMD] != hashes[SOLVER_COLORED];
+
+    int hubCount = 4 * SOLVER_MAX_COLORS;
+    printf("solver: %d spheres against one body, %d steps\n", hubCount, steps);
+    for (int mode = SOLVER_SERIAL; mode <= SOLVER_COLORED_SIMD; mode++) {
+        PhysicsConfig config = configFromArgs(argc, argv);
+        config.solverMode = mode;
+        int colors;
+        hashes[mode] = solveHub(config, hubCount, steps, &colors);
+        if (mode == SOLVER_SERIAL)
+            continue;
+        printf("  %-12s %2d colors and an overflow batch, %s the serial solver\n", names[mode], colors,
+               hashes[mode] == hashes[SOLVER_SERIAL] ? "matches" : "DIFFERS from");
+        result |= hashes[mode] != hashes[SOLVER_SERIAL];
+    }
+    return result;
+}
+
+// Fires small fast spheres or boxes at a thin wall of static spheres, or at a mesh quad, with
+// and without CCD.
+static int benchCcd(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bullets", "200"));
+    float speed = atof(option(argc, argv, "--speed", "200"));
+    int shape = flag(argc, argv, "--box") ? SHAPE_BOX : SHAPE_SPHERE;
+    int mesh = flag(argc, argv, "--mesh");
+    int steps = 60;
+
+    printf("ccd: %d %s bullets at %.0f m/s against %s\n", count, shape == SHAPE_BOX ? "box" : "sphere", speed,
+           mesh ? "a mesh quad" : "a 0.2 thick wall");
+    float wallHalf = 9.5f * 0.18f + 0.1f;
+    if (mesh) {
+        float vertices[12] = {
+            0.0f, -wallHalf, -wallHalf, 0.0f, wallHalf, -wallHalf,
+            0.0f, wallHalf, wallHalf, 0.0f, -wallHalf, wallHalf
+        };
+        int indices[6] = {0, 1, 2, 0, 2, 3};
+        mesh_add(vertices, 4, indices, 2);
+    }
+    for (int ccd = 0; ccd <= 1; ccd++) {
+        PhysicsConfig config = configFromArgs(argc, argv);
+        for (int k = 0; k < 3; k++) {
+            config.gravity[k] = 0.0f;
+            config.boundsMin[k] = -50.0f;
+            config.boundsMax[k] = 50.0f;
+        }
+        physics_init(config);
+
+        float zero[3] = {0.0f, 0.0f, 0.0f};
+        for (int y = 0; y < 20 * !mesh; y++) {
+            for (int z = 0; z < 20; z++) {
+                float position[3] = {0.0f, (y - 9.5f) * 0.18f, (z - 9.5f) * 0.18f};
+                physics_add_body(position, zero, 0.1f, 0.0f, SHAPE_SPHERE);
+            }
+        }
+        unsigned int *ids = malloc(count * sizeof(unsigned int));
+        float *previous = malloc(count * 3 * sizeof(float));
+        unsigned char *through = calloc(count, 1);
+        for (int i = 0; i < count; i++) {
+            float position[3] = {-5.0f, (2.0f * physics_random() - 1.0f) * 1.5f, (2.0f * physics_random() - 1.0f) * 1.5f};
+            float velocity[3] = {speed, 0.0f, 0.0f};
+            int body = physics_add_body(position, velocity, 0.05f, 0.01f, shape);
+            physics_set_bullet(body, ccd);
+            ids[i] = bodies.id[body];
+            memcpy(&previous[i * 3], position, sizeof(position));
+        }
+
+        // a bullet tunneled if it crossed x = 0 within the wall; one glancing off a wall sphere
+        // can also end up behind the wall, but only by going around its edge
+        int handled = 0, clamped = 0;
+        double total = 0.0;
+        for (int s = 0; s < steps; s++) {
+            physics_step(BENCH_DT);
+            total += physicsStats.stepTime;
+            handled += physicsStats.ccdBodies;
+            clamped += physicsStats.ccdClamped;
+            for (int i = 0; i < count; i++) {
+                int b = physics_body_index(ids[i]);
+                float p[3] = {bodies.px[b], bodies.py[b], bodies.pz[b]};
+                float *q = &previous[i * 3];
+                if ((q[0] < 0.0f) != (p[0] < 0.0f)) {
+                    float f = q[0] / (q[0] - p[0]);
+                    float y = q[1] + (p[1] - q[1]) * f;
+                    float z = q[2] + (p[2] - q[2]) * f;
+                    if (fabsf(y) < wallHalf && fabsf(z) < wallHalf)
+                        through[i] = 1;
+                }
+                memcpy(q, p, sizeof(p));
+            }
+        }
+        int tunneled = 0, around = 0;
+        for (int i = 0; i < count; i++) {
+            tunneled += through[i];
+            around += !through[i] && bodies.px[physics_body_index(ids[i])] > 0.0f;
+        }
+        free(ids);
+        free(previous);
+        free(through);
+        printf("  ccd %-3s: %3d of %d tunneled, %d went around the wall, %.1f ccd bodies/step, %d clamped, %.3f ms/step\n",
+               ccd ? "on" : "off", tunneled, count, around, (double)handled / steps, clamped, total * 1000.0 / steps);
+        physics_shutdown();
+    }
+    meshes_clear();
+    return 0;
+}
+
+#define HULL_VERTICES 32
+
+typedef struct {
+    const char *name;
+    int typeA, typeB;
+    // 0 for the box SAT path, otherwise GJK/EPA with or without the simplex cache
+    int gjk, warm;
+} NarrowCase;
+
+static float randomRange(float min, float max) {
+    return min + (max - min) * physics_random();
+}
+
+// Rotation matrix of a random unit quaternion.
+static void randomRotation(float m[9]) {
+    float q[4], len2;
+    do {
+        for (int k = 0; k < 4; k++) {
+            q[k] = randomRange(-1.0f, 1.0f);
+        }
+        len2 = q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3];
+    } while (len2 > 1.0f || len2 < 1e-4f);
+    float s = 1.0f / sqrtf(len2);
+    float x = q[0] * s, y = q[1] * s, z = q[2] * s, w = q[3] * s;
+    float r[9] = {
+        1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w),
+        2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w),
+        2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)
+    };
+    memcpy(m, r, sizeof(r));
+}
+
+static void randomShape(int type, const float *hull, ConvexShape *s) {
+    memset(s, 0, sizeof(*s));
+    s->type = type;
+    for (int k = 0; k < 3; k++) {
+        s->position[k] = randomRange(-1.0f, 1.0f);
+        s->halfExtents[k] = randomRange(0.3f, 0.7f);
+    }
+    randomRotation(s->rotation);
+    s->radius = randomRange(0.3f, 0.7f);
+    s->vertices = hull;
+    s->vertexCount = HULL_VERTICES;
+}
+
+// Queries per second of every narrowphase path over random placements, about half of them
+// touching. The warm runs move the shapes a little and start from last query's simplex,
+// as a pair does from one step to the next.
+static int benchNarrowphase(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--pairs", "100000"));
+    int rounds = atoi(option(argc, argv, "--rounds", "5"));
+    static const NarrowCase cases[] = {
+        {"sphere-sphere gjk", SHAPE_SPHERE, SHAPE_SPHERE, 1, 0},
+        {"sphere-box gjk", SHAPE_SPHERE, SHAPE_BOX, 1, 0},
+        {"sphere-box gjk warm", SHAPE_SPHERE, SHAPE_BOX, 1, 1},
+        {"box-box sat", SHAPE_BOX, SHAPE_BOX, 0, 0},
+        {"box-box gjk/epa", SHAPE_BOX, SHAPE_BOX, 1, 0},
+        {"box-box gjk/epa warm", SHAPE_BOX, SHAPE_BOX, 1, 1},
+        {"hull-box gjk/epa", SHAPE_HULL, SHAPE_BOX, 1, 0},
+        {"hull-hull gjk/epa", SHAPE_HULL, SHAPE_HULL, 1, 0},
+        {"hull-hull gjk/epa warm", SHAPE_HULL, SHAPE_HULL, 1, 1}
+    };
+
+    PhysicsConfig config = configFromArgs(argc, argv);
+    config.threads = 1;
+    physics_init(config);
+    float hull[HULL_VERTICES * 3];
+    for (int i = 0; i < HULL_VERTICES; i++) {
+        float p[3], len;
+        do {
+            for (int k = 0; k < 3; k++) {
+                p[k] = randomRange(-1.0f, 1.0f);
+            }
+            len = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        } while (len > 1.0f || len < 0.1f);
+        for (int k = 0; k < 3; k++) {
+            hull[i * 3 + k] = 0.6f * p[k] / len;
+        }
+    }
+
+    ConvexShape *a = malloc(count * sizeof(ConvexShape));
+    ConvexShape *b = malloc(count * sizeof(ConvexShape));
+    SimplexCache *caches = malloc(count * sizeof(SimplexCache));
+    printf("narrowphase: %d random pairs, %d rounds\n", count, rounds);
+    for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+        const NarrowCase *nc = &cases[c];
+        for (int i = 0; i < count; i++) {
+            randomShape(nc->typeA, hull, &a[i]);
+            randomShape(nc->typeB, hull, &b[i]);
+            caches[i].count = 0;
+        }
+
+        double elapsed = 0.0;
+        long long touching = 0, points = 0;
+        for (int round = 0; round < rounds; round++) {
+            if (round > 0) {
+                for (int i = 0; i < count; i++) {
+                    a[i].position[1] += 0.002f;
+                    b[i].position[1] -= 0.002f;
+                }
+            }
+            double start = now();
+            for (int i = 0; i < count; i++) {
+                Manifold m;
+                int hit;
+                if (!nc->gjk)
+                    hit = narrow_collide_boxes(&a[i], &b[i], &m);
+                else if (nc->warm)
+                    hit = narrow_collide_convex(&a[i], &b[i], &caches[i], &m);
+                else
+                    hit = narrow_collide_convex(&a[i], &b[i], NULL, &m);
+                touching += hit;
+                points += hit ? m.count : 0;
+            }
+            elapsed += now() - start;
+        }
+        long long queries = (long long)count * rounds;
+        printf("  %-24s %8.2f M queries/s, %4.1f%% touching, %.2f points per contact\n",
+               nc->name, queries / elapsed * 1e-6, 100.0 * touching / queries, touching ? (double)points / touching : 0.0);
+    }
+
+    free(a);
+    free(b);
+    free(caches);
+    physics_shutdown();
+    return 0;
+}
+
+// Packing and copying per-frame instance data for a million bodies, compact records against
+// the mat4 per body the renderer used to upload. The copy into a separate buffer stands in
+// for the write into GL buffer storage, which needs a context this harness doesn't have.
+static int benchInstances(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--count", "1000000"));
+    int frames = atoi(option(argc, argv, "--frames", "20"));
+    PhysicsConfig config = configFromArgs(argc, argv);
+    config.threads = 1;
+    physics_init(config);
+    physics_reserve_bodies(count);
+    for (int i = 0; i < count; i++) {
+        float position[3] = {randomRange(-50.0f, 50.0f), randomRange(-50.0f, 50.0f), randomRange(-50.0f, 50.0f)};
+        float velocity[3] = {0.0f, 0.0f, 0.0f};
+        float q[4] = {randomRange(-1.0f, 1.0f), randomRange(-1.0f, 1.0f), randomRange(-1.0f, 1.0f), randomRange(0.1f, 1.0f)};
+        int body = physics_add_body(position, velocity, 0.5f, 1.0f, SHAPE_BOX);
+        physics_set_orientation(body, q);
+    }
+
+    size_t compactBytes = (size_t)count * sizeof(Instance);
+    size_t matrixBytes = (size_t)count * 16 * sizeof(float);
+    Instance *compact = malloc(compactBytes);
+    float *matrices = malloc(matrixBytes);
+    unsigned char *upload = malloc(matrixBytes);
+
+    printf("instances: %d bodies, %d frames\n", count, frames);
+    for (int format = 0; format < 2; format++) {
+        double packTime = 0.0, copyTime = 0.0;
+        size_t bytes = format ? compactBytes : matrixBytes;
+        for (int frame = 0; frame < frames; frame++) {
+            double start = now();
+            for (int i = 0; i < count; i++) {
+                if (format)
+                    instance_pack(i, &compact[i]);
+                else
+                    instance_model_matrix(i, matrices + i * 16);
+            }
+            double packed = now();
+            memcpy(upload, format ? (void*)compact : (void*)matrices, bytes);
+            copyTime += now() - packed;
+            packTime += packed - start;
+        }
+        printf("  %-8s %3zu bytes/instance, %6.1f MB/frame, pack %.2f ms, copy %.2f ms (%.2f GB/s)\n",
+               format ? "compact" : "mat4", bytes / count, bytes / 1e6, packTime * 1000.0 / frames,
+               copyTime * 1000.0 / frames, bytes * frames / copyTime * 1e-9);
+        if (format)
+            printf("  compact records move %.0f%% less data per frame\n", 100.0 * (1.0 - (double)compactBytes / matrixBytes));
+    }
+
+    free(compact);
+    free(matrices);
+    free(upload);
+    physics_shutdown();
+    return 0;
+}
+
+static float bowlHeight(float x, float z) {
+    return 0.02f * (x * x + z * z) + 0.3f * sinf(x) * cosf(z);
+}
+
+// A bumpy bowl heightfield, written as OBJ so loading goes through the parser.
+static int writeBowl(const char *path, int grid, float half) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return 0;
+    for (int z = 0; z <= grid; z++) {
+        for (int x = 0; x <= grid; x++) {
+            float px = -half + 2.0f * half * x / grid;
+            float pz = -half + 2.0f * half * z / grid;
+            fprintf(f, "v %f %f %f\n", px, bowlHeight(px, pz), pz);
+        }
+    }
+    for (int z = 0; z < grid; z++) {
+        for (int x = 0; x < grid; x++) {
+            int v = z * (grid + 1) + x + 1;
+            fprintf(f, "f %d %d %d %d\n", v, v + grid + 1, v + grid + 2, v + 1);
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+// Spheres at random points near the surface, through the triangles and through the SDF.
+static void sdfQueries(const TriangleMesh *mesh, int count) {
+    float *points = malloc(count * 3 * sizeof(float));
+    for (int i = 0; i < count; i++) {
+        float triangle[9], w[3] = {physics_random(), physics_random(), physics_random()};
+        mesh_triangle(mesh, (int)(physics_random() * mesh->triangleCount) % mesh->triangleCount, triangle);
+        float sum = w[0] + w[1] + w[2];
+        for (int k = 0; k < 3; k++) {
+            points[i * 3 + k] = (w[0] * triangle[k] + w[1] * triangle[3 + k] + w[2] * triangle[6 + k]) / sum
+                              + (2.0f * physics_random() - 1.0f) * 0.6f;
+        }
+    }
+
+    float radius = 0.5f;
+    int capacity = 1024;
+    int *triangles = malloc(capacity * sizeof(int));
+    for (int path = 0; path < 2; path++) {
+        int touching = 0;
+        double start = now();
+        for (int i = 0; i < count; i++) {
+            const float *p = &points[i * 3];
+            if (path) {
+                float gradient[3];
+                touching += sdf_sample(mesh->sdf, p, gradient) < radius;
+                continue;
+            }
+            float min[3] = {p[0] - radius, p[1] - radius, p[2] - radius};
+            float max[3] = {p[0] + radius, p[1] + radius, p[2] + radius};
+            int found = mesh_query(mesh, min, max, triangles, capacity);
+            int touched = 0;
+            for (int t = 0; t < found && t < capacity; t++) {
+                float triangle[9];
+                Manifold m;
+                mesh_triangle(mesh, triangles[t], triangle);
+                touched |= narrow_collide_sphere_triangle(p, radius, triangle, &m);
+            }
+            touching += touched;
+        }
+        double elapsed = now() - start;
+        printf("  %-14s %8.2f M sphere queries/s, %4.1f%% touching\n", path ? "sdf" : "bvh triangles",
+               count / elapsed * 1e-6, 100.0 * touching / count);
+    }
+    free(triangles);
+    free(points);
+}
+
+static int benchMesh(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "2000"));
+    int steps = atoi(option(argc, argv, "--steps", "600"));
+    int grid = atoi(option(argc, argv, "--grid", "256"));
+    const char *file = option(argc, argv, "--file", NULL);
+    const char *path = file ? file : "/tmp/benchmark_bowl.obj";
+    float half = 20.0f;
+    if (!file && !writeBowl(path, grid, half)) {
+        printf("Failed to write %s\n", path);
+        return 1;
+    }
+
+    // the first load builds the BVH and writes the cache, the second one reads it back
+    char cachePath[1024];
+    snprintf(cachePath, sizeof(cachePath), "%s.bvh", path);
+    remove(cachePath);
+    double start = now();
+    if (mesh_load(path) < 0)
+        return 1;
+    double built = now() - start;
+    meshes_clear();
+    start = now();
+    mesh_load(path);
+    double loaded = now() - start;
+    const TriangleMesh *mesh = &meshes.items[0];
+    const BvhNode *root = &mesh->nodes[0];
+    printf("mesh: %d triangles, %d BVH nodes (%.1f KB)\n", mesh->triangleCount, mesh->nodeCount, mesh->nodeCount * sizeof(BvhNode) / 1024.0);
+    printf("  parse and build %.2f ms, load from cache %.2f ms%s\n", built * 1000.0, loaded * 1000.0,
+           mesh->cached ? "" : " (cache missed)");
+
+    if (flag(argc, argv, "--sdf")) {
+        float cell = atof(option(argc, argv, "--cell", "0.125"));
+        if (!sdf_bake(0, cell, 0.75f)) {
+            printf("Can't bake an SDF with cell size %g\n", cell);
+            return 1;
+        }
+        const SdfField *sdf = mesh->sdf;
+        int bricks = sdf->bricks[0] * sdf->bricks[1] * sdf->bricks[2];
+        double dense = (double)bricks * SDF_BRICK * SDF_BRICK * SDF_BRICK * sizeof(float);
+        printf("  sdf: %.3f cells, %d of %d bricks, %.1f MB (dense float grid %.1f MB), bake %.2f ms\n",
+               cell, sdf->brickCount, bricks, sdf_memory(sdf) / 1e6, dense / 1e6, sdf->bakeTime * 1000.0);
+        sdfQueries(mesh, 1000000);
+    }
+
+    PhysicsConfig config = configFromArgs(argc, argv);
+    float width = fminf(root->max[0] - root->min[0], root->max[2] - root->min[2]);
+    int side = (int)(0.6f * width / 1.2f);
+    int layers = (count + side * side - 1) / (side * side);
+    for (int k = 0; k < 3; k++) {
+        config.boundsMin[k] = root->min[k];
+        config.boundsMax[k] = root->max[k];
+    }
+    config.boundsMin[1] = root->min[1] - 2.0f;
+    config.boundsMax[1] = root->max[1] + layers * 1.2f + 2.0f;
+    physics_init(config);
+    float centerX = 0.5f * (root->min[0] + root->max[0]);
+    float centerZ = 0.5f * (root->min[2] + root->max[2]);
+    for (int i = 0; i < count; i++) {
+        int x = i % side;
+        int z = (i / side) % side;
+        int y = i / (side * side);
+        float position[3] = {
+            centerX + (x - 0.5f * side) * 1.2f + 0.05f * physics_random(),
+            root->max[1] + (y + 0.5f) * 1.2f,
+            centerZ + (z - 0.5f * side) * 1.2f + 0.05f * physics_random()
+        };
+        float velocity[3] = {0.0f, 0.0f, 0.0f};
+        int shape = i % 2 ? SHAPE_BOX : SHAPE_SPHERE;
+        physics_add_body(position, velocity, shape == SHAPE_BOX ? 0.4f : 0.5f, 1.0f, shape);
+    }
+
+    printf("  %d bodies, half spheres and half boxes, %d threads\n", count, jobs_thread_count());
+    double total = 0.0;
+    for (int s = 1; s <= steps; s++) {
+        physics_step(BENCH_DT);
+        total += physicsStats.stepTime;
+        if (s % 100 == 0 || s == steps)
+            printf("  step %4d: %.3f ms/step, %d contacts, kinetic energy %.3f, %d awake\n",
+                   s, total * 1000.0 / s, physicsStats.contacts, physicsStats.kineticEnergy, physicsStats.awakeBodies);
+    }
+
+    // anything under the lowest point of the mesh went through it
+    int fell = 0;
+    for (int i = 0; i < bodies.count; i++) {
+        if (bodies.py[i] < root->min[1])
+            fell++;
+    }
+    printf("  %d of %d bodies fell through the mesh\n", fell, count);
+    physics_shutdown();
+    meshes_clear();
+    return 0;
+}
+
+typedef struct {
+    unsigned long long key;
+    int value;
+} KeyValue;
+
+// Ties by value, which is the input position, so qsort gives the order of a stable sort.
+static int compareKeyValues(const void *a, const void *b) {
+    const KeyValue *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->value - y->value;
+}
+
+// Random key-value pairs through the radix sort against qsort, 32 and 64 bit keys.
+static int benchSort(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--keys", "4000000"));
+    int rounds = atoi(option(argc, argv, "--rounds", "5"));
+    // below 64, keys only use this many low bits, like Morton codes or cell indices
+    int bits = atoi(option(argc, argv, "--bits", "64"));
+    jobs_init(atoi(option(argc, argv, "--threads", "0")));
+    physicsPersistent.rngState = strtoull(option(argc, argv, "--seed", "1"), NULL, 10);
+
+    unsigned long long *source = malloc(count * sizeof(unsigned long long));
+    unsigned long long *keys64 = malloc(count * sizeof(unsigned long long));
+    unsigned int *keys32 = malloc(count * sizeof(unsigned int));
+    int *values = malloc(count * sizeof(int));
+    KeyValue *reference = malloc(count * sizeof(KeyValue));
+    unsigned long long mask = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+    for (int i = 0; i < count; i++) {
+        unsigned long long high = (unsigned long long)(physics_random() * 16777216.0f);
+        unsigned long long mid = (unsigned long long)(physics_random() * 16777216.0f);
+        unsigned long long low = (unsigned long long)(physics_random() * 65536.0f);
+        source[i] = (high << 40 | mid << 16 | low) & mask;
+    }
+
+    printf("sort: %d keys of %d bits, %d threads, best of %d\n", count, bits < 64 ? bits : 64, jobs_thread_count(), rounds);
+    int ok = 1;
+    for (int wide = 0; wide < 2; wide++) {
+        double radixTime = 1e30, qsortTime = 1e30;
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < count; i++) {
+                keys64[i] = wide ? source[i] : (unsigned int)source[i];
+                keys32[i] = (unsigned int)source[i];
+                values[i] = i;
+                reference[i] = (KeyValue){keys64[i], i};
+            }
+            double start = now();
+            if (wide)
+                sort_pairs64(keys64, values, count);
+            else
+                sort_pairs32(keys32, values, count);
+            radixTime = fmin(radixTime, now() - start);
+
+            start = now();
+            qsort(reference, count, sizeof(KeyValue), compareKeyValues);
+            qsortTime = fmin(qsortTime, now() - start);
+        }
+
+        int same = 1;
+        for (int i = 0; i < count && same; i++) {
+            unsigned long long key = wide ? keys64[i] : keys32[i];
+            same = key == reference[i].key && values[i] == reference[i].value;
+        }
+        ok &= same;
+        printf("  %d bit keys: radix %.2f ms (%.1f M keys/s), qsort %.2f ms (%.1f M keys/s), %.1fx, %s\n",
+               wide ? 64 : 32, radixTime * 1000.0, count / radixTime * 1e-6, qsortTime * 1000.0, count / qsortTime * 1e-6,
+               qsortTime / radixTime, same ? "same order" : "DIFFERENT ORDER");
+    }
+
+    free(source);
+    free(keys64);
+    free(keys32);
+    free(values);
+    free(reference);
+    sort_shutdown();
+    jobs_shutdown();
+    return ok ? 0 : 1;
+}
+
+// Hardware cache counters of this process and the threads it starts afterwards; -1 where
+// the kernel or the machine doesn't offer them.
+enum {
+    COUNTER_L1_READS,
+    COUNTER_L1_MISSES,
+    COUNTER_LLC_REFERENCES,
+    COUNTER_LLC_MISSES,
+    COUNTER_COUNT
+};
+
+static int openCounter(unsigned int type, unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void openCacheCounters(int fd[COUNTER_COUNT]) {
+    unsigned long long l1 = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8;
+    fd[COUNTER_L1_READS] = openCounter(PERF_TYPE_HW_CACHE, l1 | PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+    fd[COUNTER_L1_MISSES] = openCounter(PERF_TYPE_HW_CACHE, l1 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    fd[COUNTER_LLC_REFERENCES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+    fd[COUNTER_LLC_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+}
+
+static void readCacheCounters(const int fd[COUNTER_COUNT], unsigned long long value[COUNTER_COUNT]) {
+    for (int k = 0; k < COUNTER_COUNT; k++) {
+        if (fd[k] < 0 || read(fd[k], &value[k], sizeof(value[k])) != sizeof(value[k]))
+            value[k] = 0;
+    }
+}
+
+static void closeCacheCounters(const int fd[COUNTER_COUNT]) {
+    for (int k = 0; k < COUNTER_COUNT; k++) {
+        if (fd[k] >= 0)
+            close(fd[k]);
+    }
+}
+
+// Spheres sprayed into a container at a fixed rate and removed after a fixed number of steps,
+// timing the adds and removes and checking that handles of removed bodies come back stale.
+static int benchEmitter(int argc, char **argv) {
+    int rate = atoi(option(argc, argv, "--rate", "20"));
+    int lifetime = atoi(option(argc, argv, "--lifetime", "300"));
+    int steps = atoi(option(argc, argv, "--steps", "900"));
+    PhysicsConfig config = configFromArgs(argc, argv);
+    for (int k = 0; k < 3; k++) {
+        config.boundsMin[k] = -8.0f;
+        config.boundsMax[k] = 8.0f;
+    }
+    config.boundsMin[1] = 0.0f;
+    config.boundsMax[1] = 24.0f;
+    physics_init(config);
+
+    // handles in spawn order, so the oldest is removed first
+    int ringSize = rate * lifetime;
+    PoolHandle *ring = malloc(ringSize * sizeof(PoolHandle));
+    int head = 0, live = 0;
+    PoolHandle stale = POOL_NULL;
+    int staleChecks = 0, staleMisses = 0, added = 0, removed = 0;
+    double addTime = 0.0, removeTime = 0.0, stepTime = 0.0;
+    int allocations = 0;
+
+    printf("emitter: %d bodies per step, removed after %d steps, %d threads%s\n", rate, lifetime,
+           jobs_thread_count(), config.deterministic ? ", deterministic" : "");
+    for (int s = 1; s <= steps; s++) {
+        double start = now();
+        while (live > 0 && live + rate > ringSize) {
+            PoolHandle handle = ring[head];
+            head = (head + 1) % ringSize;
+            live--;
+            removed += physics_remove_body(handle);
+            stale = handle;
+        }
+        double mid = now();
+        for (int k = 0; k < rate; k++) {
+            float position[3] = {
+                (2.0f * physics_random() - 1.0f) * 2.0f,
+                22.0f + physics_random(),
+                (2.0f * physics_random() - 1.0f) * 2.0f
+            };
+            float velocity[3] = {(2.0f * physics_random() - 1.0f) * 3.0f, -5.0f, (2.0f * physics_random() - 1.0f) * 3.0f};
+            int body = physics_add_body(position, velocity, 0.2f + 0.1f * physics_random(), 1.0f, SHAPE_SPHERE);
+            ring[(head + live) % ringSize] = physics_body_handle(body);
+            live++;
+            added++;
+        }
+        double end = now();
+        removeTime += mid - start;
+        addTime += end - mid;
+
+        if (stale != POOL_NULL) {
+            staleChecks++;
+            if (physics_handle_index(stale) != -1 || physics_remove_body(stale))
+                staleMisses++;
+        }
+        physics_step(BENCH_DT);
+        stepTime += physicsStats.stepTime;
+        if (s == steps / 2)
+            allocations = physicsStats.arenaAllocations;
+
+        if (s % 150 == 0 || s == steps) {
+            printf("  step %4d: %d bodies in %d slots (%d free), %.3f ms/step, add %.3f us, remove %.3f us per body\n",
+                   s, bodies.count, physicsStats.bodySlots, physicsStats.freeBodySlots, stepTime * 1000.0 / s,
+                   added ? addTime * 1e6 / added : 0.0, removed ? removeTime * 1e6 / removed : 0.0);
+        }
+    }
+
+    // every live handle leads to a body whose handle it is
+    int mismatches = 0;
+    for (int k = 0; k < live; k++) {
+        PoolHandle handle = ring[(head + k) % ringSize];
+        int body = physics_handle_index(handle);
+        if (body < 0 || physics_body_handle(body) != handle)
+            mismatches++;
+    }
+    printf("  %d added, %d removed, %d of %d stale handles detected, %d live handles wrong\n", added, removed,
+           staleChecks - staleMisses, staleChecks, mismatches);
+    printf("  step arenas went to the heap %d times in the second half\n", physicsStats.arenaAllocations - allocations);
+    if (config.deterministic)
+        printf("  final state hash %016llx\n", physicsStats.stateHash);
+    free(ring);
+    physics_shutdown();
+    return staleMisses || mismatches;
+}
+
+// The renderer's streaming loop without GL: textures are requested at startup, frames of
+// --frame ms copy the levels of ready ones into a staging buffer up to --budget KB each, as
+// into the upload buffer. Reports how long the main thread is held up against loading in place.
+static int benchAssets(int argc, char **argv) {
+    const char *file = option(argc, argv, "--file", "textures/test.png");
+    int count = atoi(option(argc, argv, "--count", "8"));
+    size_t budget = atoi(option(argc, argv, "--budget", "256")) * 1024;
+    double frameTime = atof(option(argc, argv, "--frame", "16.7")) * 1e-3;
+    int format = flag(argc, argv, "--bc1") ? TEXTURE_BC1 : TEXTURE_BC7;
+    count = count < ASSETS_MAX ? count : ASSETS_MAX;
+    int cold = flag(argc, argv, "--cold");
+    char *cache = texture_cache_path(file, format);
+    if (cold)
+        remove(cache);
+
+    double start = now();
+    assets_init();
+    int assetIds[ASSETS_MAX], nextLevel[ASSETS_MAX];
+    for (int i = 0; i < count; i++) {
+        assetIds[i] = assets_request_texture(file, format);
+        nextLevel[i] = -2;
+    }
+    double requestTime = now() - start;
+
+    unsigned char *staging = malloc(budget > 0 ? budget : 1);
+    size_t stagingSize = budget;
+    int frames = 0, streamed = 0, failed = 0;
+    double firstShown = 0.0, busiest = 0.0, busy = 0.0;
+    while (streamed + failed < count) {
+        double frameStart = now();
+        size_t bytes = 0;
+        for (int i = 0; i < count; i++) {
+            int state = assets_state(assetIds[i]);
+            if (nextLevel[i] == -1 || (state != ASSET_READY && state != ASSET_FAILED))
+                continue;
+            if (state == ASSET_FAILED) {
+                nextLevel[i] = -1;
+                failed++;
+                continue;
+            }
+            const TextureImage *image = assets_image(assetIds[i]);
+            if (nextLevel[i] == -2)
+                nextLevel[i] = image->levels - 1;
+            // the coarsest levels left that fit what is left of the budget, a frame's first one always
+            while (nextLevel[i] >= 0 && (bytes == 0 || bytes + image->size[nextLevel[i]] <= budget)) {
+                size_t size = image->size[nextLevel[i]];
+                if (size > stagingSize) {
+                    stagingSize = size;
+                    staging = realloc(staging, stagingSize);
+                }
+                memcpy(staging + (bytes + size <= stagingSize ? bytes : 0), image->data[nextLevel[i]], size);
+                bytes += size;
+                nextLevel[i]--;
+                if (!firstShown)
+                    firstShown = now() - start;
+            }
+            if (nextLevel[i] < 0) {
+                assets_release(assetIds[i]);
+                streamed++;
+            }
+        }
+        double spent = now() - frameStart;
+        busy += spent;
+        busiest = spent > busiest ? spent : busiest;
+        frames++;
+        if (spent < frameTime) {
+            struct timespec rest = {0, (long)((frameTime - spent) * 1e9)};
+            nanosleep(&rest, NULL);
+        }
+    }
+    double total = now() - start;
+    double loaderTime = assetStats.loaderTime;
+    assets_shutdown();
+
+    // what startup used to do: every texture loaded in place before the first frame
+    if (cold)
+        remove(cache);
+    double syncStart = now();
+    for (int i = 0; i < count; i++) {
+        TextureImage image;
+        if (texture_load(file, format, &image))
+            texture_release(&image);
+    }
+    double syncTime = now() - syncStart;
+
+    printf("assets: %d x %s, %zu KB per frame, %.1f ms frames\n", count, file, budget / 1024, frameTime * 1000.0);
+    printf("  requests took %.3f ms, first level up after %.2f ms, all streamed after %.2f ms over %d frames\n",
+           requestTime * 1000.0, firstShown * 1000.0, total * 1000.0, frames);
+    printf("  main thread busy %.3f ms per frame on average, %.3f ms at most; loader thread %.2f ms\n",
+           busy * 1000.0 / frames, busiest * 1000.0, loaderTime * 1000.0);
+    printf("  loading in place before the first frame: %.2f ms%s\n", syncTime * 1000.0, cold ? ", building the cache on the job pool" : "");
+    free(staging);
+    free(cache);
+    return failed != 0;
+}
+
+// Startup cost of a texture: decoding the source alone against building the mipmapped cache
+// once and mapping it on every later run, with the error the encoder leaves in level 0.
+static int benchTexture(int argc, char **argv) {
+    const char *file = option(argc, argv, "--file", "textures/test.png");
+    const char *formatName = option(argc, argv, "--format", "bc7");
+    int rounds = atoi(option(argc, argv, "--rounds", "20"));
+    jobs_init(atoi(option(argc, argv, "--threads", "0")));
+    const char *formatNames[] = {"rgba8", "bc1", "bc7"};
+    int format = -1;
+    for (int f = 0; f < 3; f++) {
+        if (strcmp(formatName, formatNames[f]) == 0)
+            format = f;
+    }
+    if (format < 0) {
+        printf("Unknown format %s\n", formatName);
+        return 1;
+    }
+
+    int width, height, channels;
+    double decodeTime = 1e30;
+    unsigned char *source = NULL;
+    for (int r = 0; r < rounds; r++) {
+        double start = now();
+        unsigned char *pixels = stbi_load(file, &width, &height, &channels, 4);
+        double elapsed = now() - start;
+        if (!pixels) {
+            printf("Failed to load %s\n", file);
+            return 1;
+        }
+        decodeTime = elapsed < decodeTime ? elapsed : decodeTime;
+        if (source)
+            stbi_image_free(pixels);
+        else
+            source = pixels;
+    }
+
+    char *cache = texture_cache_path(file, format);
+    remove(cache);
+    free(cache);
+    TextureImage image;
+    double start = now();
+    if (!texture_load(file, format, &image)) {
+        stbi_image_free(source);
+        return 1;
+    }
+    double buildTime = now() - start;
+    int built = image.built;
+    texture_release(&image);
+
+    double loadTime = 1e30;
+    int cached = 1;
+    for (int r = 0; r < rounds; r++) {
+        start = now();
+        texture_load(file, format, &image);
+        // fault in every page, as the upload would
+        volatile unsigned char touched;
+        for (int l = 0; l < image.levels; l++) {
+            for (size_t i = 0; i < image.size[l]; i += 4096) {
+                touched = image.data[l][i];
+            }
+        }
+        (void)touched;
+        double elapsed = now() - start;
+        loadTime = elapsed < loadTime ? elapsed : loadTime;
+        cached = cached && !image.built;
+        if (r < rounds - 1)
+            texture_release(&image);
+    }
+
+    size_t bytes = 0;
+    for (int l = 0; l < image.levels; l++) {
+        bytes += image.size[l];
+    }
+    unsigned char *decoded = malloc((size_t)width * height * 4);
+    double error = 0.0;
+    int decodedOk = texture_decode_level(&image, 0, decoded);
+    for (size_t i = 0; decodedOk && i < (size_t)width * height * 4; i++) {
+        double d = (double)decoded[i] - source[i];
+        error += d * d;
+    }
+    error /= (double)width * height * 4;
+
+    printf("texture: %s, %dx%d with %d channels, %s (%s), %d levels, %d threads, best of %d\n", file, width, height,
+           channels, formatNames[image.format], formatName, image.levels, jobs_thread_count(), rounds);
+    printf("  decode only %.3f ms, build cache %.3f ms, load cache %.3f ms (%.1fx faster than decoding)\n",
+           decodeTime * 1000.0, buildTime * 1000.0, loadTime * 1000.0, decodeTime / loadTime);
+    printf("  %zu KB with mips against %zu KB RGBA level 0, level 0 PSNR %.2f dB\n", bytes / 1024,
+           (size_t)width * height * 4 / 1024, error > 0.0 ? 10.0 * log10(255.0 * 255.0 / error) : INFINITY);
+    int ok = built && cached && decodedOk;
+    if (!ok)
+        printf("  cache was %s\n", !built ? "not built" : !cached ? "rebuilt on a later load" : "not decodable");
+    texture_release(&image);
+    free(decoded);
+    stbi_image_free(source);
+    jobs_shutdown();
+    return !ok;
+}
+
+// The same random spheres stepped in spawn order and reordered every --reorder steps,
+// with cache miss rates over each window of steps.
+static int benchReorder(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--bodies", "50000"));
+    int steps = atoi(option(argc, argv, "--steps", "500"));
+    int interval = atoi(option(argc, argv, "--reorder", "100"));
+    int window = 100;
+
+    printf("reorder: %d bodies, %d steps\n", count, steps);
+    for (int run = 0; run < 2; run++) {
+        PhysicsConfig config = configFromArgs(argc, argv);
+        config.reorderInterval = run ? interval : 0;
+        int fd[COUNTER_COUNT];
+        openCacheCounters(fd);
+        if (fd[COUNTER_L1_MISSES] < 0 && fd[COUNTER_LLC_MISSES] < 0 && run == 0)
+            printf("  no cache counters available (perf_event_paranoid, or no PMU in a VM), timing only\n");
+        spawnSpheres(&config, count);
+        if (run)
+            printf("  Morton order every %d steps, %d threads\n", interval, jobs_thread_count());
+        else
+            printf("  spawn order, %d threads\n", jobs_thread_count());
+
+        unsigned long long before[COUNTER_COUNT], after[COUNTER_COUNT];
+        readCacheCounters(fd, before);
+        double total = 0.0;
+        for (int s = 1; s <= steps; s++) {
+            physics_step(BENCH_DT);
+            total += physicsStats.stepTime;
+            if (s % window != 0 && s != steps)
+                continue;
+            readCacheCounters(fd, after);
+            unsigned long long d[COUNTER_COUNT];
+            for (int k = 0; k < COUNTER_COUNT; k++) {
+                d[k] = after[k] - before[k];
+            }
+            int done = s % window ? s % window : window;
+            printf("    steps %4d-%4d: %.3f ms/step", s - done + 1, s, total * 1000.0 / done);
+            if (d[COUNTER_L1_READS])
+                printf(", L1 read miss rate %.2f%%", 100.0 * d[COUNTER_L1_MISSES] / d[COUNTER_L1_READS]);
+            if (d[COUNTER_LLC_REFERENCES])
+                printf(", LLC miss rate %.2f%%, %.0f LLC misses/step", 100.0 * d[COUNTER_LLC_MISSES] / d[COUNTER_LLC_REFERENCES],
+                       (double)d[COUNTER_LLC_MISSES] / done);
+            printf("\n");
+            memcpy(before, after, sizeof(before));
+            total = 0.0;
+        }
+
+        int consistent = 1;
+        for (unsigned int id = 0; id < (unsigned int)count; id++) {
+            int i = physics_body_index(id);
+            consistent &= i >= 0 && bodies.id[i] == id;
+        }
+        if (run)
+            printf("  %d reorders, id to index table %s\n", physicsStats.reorders, consistent ? "consistent" : "INCONSISTENT");
+        physics_shutdown();
+        closeCacheCounters(fd);
+        if (!consistent)
+            return 1;
+    }
+    return 0;
+}
+
+// Spheres dropped on a jittered grid into a container with a square floor, about four times as
+// tall as wide, where they settle into a dense granular bed.
+static void spawnGranular(GranularConfig *config, int count, int polydisperse) {
+    int side = (int)ceilf(cbrtf(count / 4.0f));
+    float width = side * 1.05f;
+    config->boundsMin[0] = config->boundsMin[2] = -0.5f * width;
+    config->boundsMax[0] = config->boundsMax[2] = 0.5f * width;
+    config->boundsMin[1] = 0.0f;
+    config->boundsMax[1] = 1.05f * (count / (side * side) + 2);
+    granular_init(*config);
+    granular_reserve(count);
+    for (int i = 0; i < count; i++) {
+        int x = i % side;
+        int z = (i / side) % side;
+        int y = i / (side * side);
+        float position[3] = {
+            (x + 0.5f) * 1.05f - 0.5f * width + 0.02f * physics_random(),
+            (y + 0.5f) * 1.05f,
+            (z + 0.5f) * 1.05f - 0.5f * width + 0.02f * physics_random()
+        };
+        float velocity[3] = {0.0f, 0.0f, 0.0f};
+        granular_add(position, velocity, polydisperse ? 0.3f + 0.2f * physics_random() : 0.5f);
+    }
+}
+
+static int benchGranular(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--particles", "100000"));
+    int steps = atoi(option(argc, argv, "--steps", "500"));
+    float dt = atof(option(argc, argv, "--dt", "0.001"));
+    int polydisperse = flag(argc, argv, "--polydisperse");
+    GranularConfig config = granular_default_config();
+    config.threads = atoi(option(argc, argv, "--threads", "0"));
+    config.sortInterval = atoi(option(argc, argv, "--sort", "100"));
+    config.skin = atof(option(argc, argv, "--skin", "0.1"));
+    spawnGranular(&config, count, polydisperse);
+
+    printf("granular: %d %s particles, dt %g, skin %g, Morton sort every %d steps, %d threads\n", count,
+           polydisperse ? "polydisperse" : "uniform", dt, config.skin, config.sortInterval, jobs_thread_count());
+    double total = 0.0;
+    int rebuilds = 0;
+    for (int s = 1; s <= steps; s++) {
+        granular_step(dt);
+        total += granularStats.stepTime;
+        if (s % 100 == 0 || s == steps) {
+            printf("  step %4d: %.3f ms/step (%.1f steps/s, %.1f M particle steps/s), rebuilt %d of last %d steps, "
+                   "%.1f neighbors and %.1f contacts per particle, kinetic energy %.1f\n",
+                   s, total * 1000.0 / s, s / total, count * s / total * 1e-6, granularStats.rebuilds - rebuilds,
+                   s % 100 ? s % 100 : 100, (double)granularStats.neighbors / count, (double)granularStats.contacts / count,
+                   granularStats.kineticEnergy);
+            rebuilds = granularStats.rebuilds;
+        }
+    }
+    printf("  %d rebuilds and %d sorts in %d steps, state hash %016llx\n", granularStats.rebuilds, granularStats.sorts,
+           steps, granular_state_hash());
+    granular_shutdown();
+    return 0;
+}
+
+#ifdef BENCH_GPU
+// A context without a window; on machines without a GPU Mesa's llvmpipe runs the shaders.
+static int createHeadlessContext() {
+    EGLDisplay display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API))
+        return 0;
+    EGLint attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+        return 0;
+    return gladLoadGLLoader((GLADloadproc)eglGetProcAddress);
+}
+
+static double particleEnergy() {
+    double energy = 0.0;
+    for (int i = 0; i < particles.count; i++) {
+        double v2 = (double)particles.vx[i] * particles.vx[i] + (double)particles.vy[i] * particles.vy[i]
+                  + (double)particles.vz[i] * particles.vz[i];
+        energy += 0.5 * v2 / particles.invMass[i];
+    }
+    return energy;
+}
+
+// Steps the granular bed on the CPU and from the same start on the compute backend, then compares
+// every particle by id. Sums run in a different order on the GPU, so the two drift apart slowly.
+static int benchGpu(int argc, char **argv) {
+    int count = atoi(option(argc, argv, "--particles", "20000"));
+    int steps = atoi(option(argc, argv, "--steps", "200"));
+    float dt = atof(option(argc, argv, "--dt", "0.001"));
+    float tolerance = atof(option(argc, argv, "--tolerance", "0.001"));
+    GranularConfig config = granular_default_config();
+    config.threads = atoi(option(argc, argv, "--threads", "0"));
+    spawnGranular(&config, count, flag(argc, argv, "--polydisperse"));
+    if (!createHeadlessContext()) {
+        printf("gpu: no OpenGL context\n");
+        granular_shutdown();
+        return 1;
+    }
+    if (!gpuphysics_init(4)) {
+        granular_shutdown();
+        return 1;
+    }
+    printf("gpu: %d particles, %d steps of %g s on %s, %d threads for the CPU backend\n", count, steps, dt,
+           (const char*)glGetString(GL_RENDERER), jobs_thread_count());
+
+    // the CPU backend sorts particles, so everything is kept by id
+    size_t size = count * sizeof(float);
+    float *start[8], *cpu[6];
+    float **arrays[8] = {&particles.px, &particles.py, &particles.pz, &particles.vx, &particles.vy, &particles.vz,
+                         &particles.radius, &particles.invMass};
+    for (int a = 0; a < 8; a++) {
+        start[a] = malloc(size);
+        memcpy(start[a], *arrays[a], size);
+    }
+
+    double cpuStart = now();
+    for (int s = 0; s < steps; s++) {
+        granular_step(dt);
+    }
+    double cpuTime = now() - cpuStart;
+    double cpuEnergy = particleEnergy();
+    int cpuContacts = granularStats.contacts;
+    for (int a = 0; a < 6; a++) {
+        cpu[a] = malloc(size);
+        for (int i = 0; i < count; i++) {
+            cpu[a][particles.id[i]] = (*arrays[a])[i];
+        }
+    }
+
+    for (int a = 0; a < 8; a++) {
+        memcpy(*arrays[a], start[a], size);
+    }
+    for (int i = 0; i < count; i++) {
+        particles.id[i] = i;
+    }
+    double uploadStart = now();
+    gpuphysics_upload();
+    glFinish();
+    double uploadTime = now() - uploadStart;
+    double gpuStart = now();
+    for (int s = 0; s < steps; s++) {
+        gpuphysics_step(dt);
+    }
+    glFinish();
+    double gpuTime = now() - gpuStart;
+    gpuphysics_download();
+    double gpuEnergy = particleEnergy();
+
+    double worst = 0.0, sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        double dx = particles.px[i] - cpu[0][i], dy = particles.py[i] - cpu[1][i], dz = particles.pz[i] - cpu[2][i];
+        double error = sqrt(dx * dx + dy * dy + dz * dz);
+        worst = fmax(worst, error);
+        sum += error;
+    }
+    printf("  cpu: %.3f ms/step, %d contacts, kinetic energy %.3f\n", cpuTime * 1000.0 / steps, cpuContacts, cpuEnergy);
+    printf("  gpu: %.3f ms/step (upload %.2f ms, %d buckets of %.2f), %d contacts, kinetic energy %.3f\n",
+           gpuTime * 1000.0 / steps, uploadTime * 1000.0, gpuPhysicsStats.tableSize, gpuPhysicsStats.cellSize,
+           gpuPhysicsStats.contacts, gpuEnergy);
+    int match = worst <= tolerance;
+    printf("  positions differ by %.2e on average, %.2e at most: %s\n", sum / count, worst,
+           match ? "matches the CPU backend" : "MISMATCH");
+
+    for (int a = 0; a < 8; a++) {
+        free(start[a]);
+        if (a < 6)
+            free(cpu[a]);
+    }
+    gpuphysics_shutdown();
+    granular_shutdown();
+    return !match;
+}
+#endif
+
+static const Bench benches[] = {
+    {"step", "[--bodies N] [--steps N] [--threads N] [--seed N] [--skin D] [--reorder N] [--deterministic] [--record FILE] [--check FILE]", benchStep},
+    {"determinism", "[--bodies N] [--steps N] [--threads N] [--seed N] [--skin D] [--reorder N]", benchDeterminism},
+    {"checkpoint", "[--bodies N] [--steps N] [--threads N] [--seed N] [--skin D] [--reorder N] [--file PATH]", benchCheckpoint},
+    {"pile", "[--bodies N] [--steps N] [--threads N] [--iterations N] [--skin D] [--reorder N]", benchPile},
+    {"solver", "[--bodies N] [--steps N] [--threads N] [--iterations N]", benchSolver},
+    {"ccd", "[--bullets N] [--speed M/S] [--box] [--mesh] [--threads N]", benchCcd},
+    {"narrowphase", "[--pairs N] [--rounds N] [--seed N]", benchNarrowphase},
+    {"instances", "[--count N] [--frames N]", benchInstances},
+    {"mesh", "[--bodies N] [--steps N] [--threads N] [--grid N] [--file OBJ|PLY] [--sdf] [--cell SIZE]", benchMesh},
+    {"sort", "[--keys N] [--rounds N] [--bits N] [--threads N] [--seed N]", benchSort},
+    {"reorder", "[--bodies N] [--steps N] [--threads N] [--reorder N] [--skin D]", benchReorder},
+    {"emitter", "[--rate N] [--lifetime N] [--steps N] [--threads N] [--seed N] [--skin D] [--reorder N] [--deterministic]", benchEmitter},
+    {"texture", "[--file IMAGE] [--format rgba8|bc1|bc7] [--rounds N] [--threads N]", benchTexture},
+    {"assets", "[--file IMAGE] [--count N] [--budget KB] [--frame MS] [--bc1] [--cold]", benchAssets},
+    {"granular", "[--particles N] [--steps N] [--threads N] [--dt S] [--skin D] [--sort N] [--polydisperse]", benchGranular},
+#ifdef BENCH_GPU
+    {"gpu", "[--particles N] [--steps N] [--threads N] [--dt S] [--tolerance D] [--polydisperse]", benchGpu},
+#endif
+};
+
+int main(int argc, char **argv) {
+    int benchCount = sizeof(benches) / sizeof(benches[0]);
+    if (argc >= 2) {
+        for (int i = 0; i < benchCount; i++) {
+            if (strcmp(argv[1], benches[i].name) == 0)
+                return benches[i].run(argc - 2, argv + 2);
+        }
+    }
+
+    printf("usage: benchmark <bench> [options]\n");
+    for (int i = 0; i < benchCount; i++) {
+        printf("  %s %s\n", benches[i].name, benches[i].usage);
+    }
+    return 1;
+}
@@ -0,0 +1,51 @@
+#version 430 core
+out vec4 fragColor;
+in vec2 coord;
+in vec3 worldPosition;
+in float viewDepth;
+flat in uint material;
+uniform sampler2DArray text;
+// tint in rgb, texture array layer in w, MAX_MATERIALS of them
+uniform vec4 materials[16];
+uniform uint materialCount;
+
+// one depth layer per cascade, SHADOW_CASCADES of them
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 lightMatrices[4];
+// the view depth each cascade reaches to; past the last nothing is shadowed
+uniform float cascadeEnds[4];
+// direction the light travels in
+uniform vec3 lightDirection;
+
+// 3x3 taps of the hardware 2x2 comparison, so shadow edges blur over about four texels
+float shadowed(int cascade, float facing) {
+    vec4 light = lightMatrices[cascade] * vec4(worldPosition, 1.0);
+    vec3 c = light.xyz / light.w * 0.5 + 0.5;
+    if (c.z >= 1.0)
+        return 0.0;
+    // surfaces at a grazing angle to the light need more bias, and so do the coarser cascades
+    float bias = (0.0005 + 0.002 * (1.0 - facing)) * float(cascade + 1);
+    vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            lit += texture(shadowMap, vec4(c.xy + vec2(x, y) * texel, float(cascade), c.z - bias));
+        }
+    }
+    return 1.0 - lit / 9.0;
+}
+
+void main() {
+    vec4 m = materials[min(material, materialCount - 1u)];
+    vec4 color = texture(text, vec3(coord, m.w)) * vec4(m.rgb, 1.0);
+
+    // the mesh has no normals, the face's comes from the screen-space derivatives
+    vec3 n = normalize(cross(dFdx(worldPosition), dFdy(worldPosition)));
+    float facing = max(dot(n, -lightDirection), 0.0);
+    int cascade = 0;
+    while (cascade < 3 && viewDepth > cascadeEnds[cascade])
+        cascade++;
+    float shadow = viewDepth <= cascadeEnds[3] && facing > 0.0 ? shadowed(cascade, facing) : 0.0;
+    float light = 0.35 + 0.65 * facing * (1.0 - shadow);
+    fragColor = vec4(color.rgb * light, color.a);
+}
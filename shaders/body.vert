@@ -0,0 +1,29 @@
+#version 430 core
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec2 textCoord;
+layout(location = 2) in vec4 instancePositionScale;
+layout(location = 3) in vec4 instanceRotation;
+layout(location = 4) in uint instanceMaterial;
+out vec2 coord;
+out vec3 worldPosition;
+// distance in front of the camera, which picks the shadow cascade
+out float viewDepth;
+flat out uint material;
+uniform mat4 view;
+uniform mat4 projection;
+
+vec3 rotate(vec4 q, vec3 v) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+// the model matrix comes from the instance record: rotate by the quaternion, scale, translate
+void main() {
+    vec4 q = normalize(instanceRotation);
+    vec3 world = instancePositionScale.xyz + rotate(q, pos * instancePositionScale.w);
+    vec4 eye = view * vec4(world, 1.0);
+    gl_Position = projection * eye;
+    coord = textCoord;
+    worldPosition = world;
+    viewDepth = -eye.z;
+    material = instanceMaterial;
+}
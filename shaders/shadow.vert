@@ -0,0 +1,16 @@
+#version 430 core
+// Depth only: the shadow pass has no fragment shader.
+layout(location = 0) in vec3 pos;
+layout(location = 2) in vec4 instancePositionScale;
+layout(location = 3) in vec4 instanceRotation;
+uniform mat4 lightViewProjection;
+
+vec3 rotate(vec4 q, vec3 v) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main() {
+    vec4 q = normalize(instanceRotation);
+    vec3 world = instancePositionScale.xyz + rotate(q, pos * instancePositionScale.w);
+    gl_Position = lightViewProjection * vec4(world, 1.0);
+}
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK (64 * 1024)
+
+// the header is padded to the alignment, so data after it stays aligned
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t capacity;
+    size_t used;
+    size_t padding;
+};
+
+static size_t alignUp(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static unsigned char *blockData(ArenaBlock *block) {
+    return (unsigned char*)(block + 1);
+}
+
+static ArenaBlock *newBlock(Arena *arena, size_t capacity) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+    if (!block)
+        return NULL;
+    block->next = arena->blocks;
+    block->capacity = capacity;
+    block->used = 0;
+    arena->blocks = block;
+    arena->heapAllocations++;
+    return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = alignUp(size ? size : 1);
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->capacity - block->used < size) {
+        size_t capacity = block ? 2 * block->capacity : ARENA_MIN_BLOCK;
+        while (capacity < size)
+            capacity *= 2;
+        block = newBlock(arena, capacity);
+        if (!block)
+            return NULL;
+    }
+    void *p = blockData(block) + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->highWater)
+        arena->highWater = arena->used;
+    arena->last = p;
+    return p;
+}
+
+void *arena_grow(Arena *arena, void *pointer, size_t oldSize, size_t size) {
+    if (!pointer)
+        return arena_alloc(arena, size);
+    ArenaBlock *block = arena->blocks;
+    if (pointer == arena->last) {
+        size_t start = (unsigned char*)pointer - blockData(block);
+        size_t old = alignUp(oldSize ? oldSize : 1);
+        size_t grown = alignUp(size ? size : 1);
+        if (grown <= block->capacity - start) {
+            block->used = start + grown;
+            arena->used += grown - old;
+            if (arena->used > arena->highWater)
+                arena->highWater = arena->used;
+            return pointer;
+        }
+    }
+    void *p = arena_alloc(arena, size);
+    if (p)
+        memcpy(p, pointer, oldSize < size ? oldSize : size);
+    return p;
+}
+
+static void freeBlocks(Arena *arena) {
+    while (arena->blocks) {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    if (block && block->next) {
+        // chained blocks become one that holds the high water mark
+        size_t capacity = ARENA_MIN_BLOCK;
+        while (capacity < arena->highWater)
+            capacity *= 2;
+        freeBlocks(arena);
+        block = newBlock(arena, capacity);
+    }
+    if (block)
+        block->used = 0;
+    arena->used = 0;
+    arena->last = NULL;
+}
+
+void arena_free(Arena *arena) {
+    freeBlocks(arena);
+    memset(arena, 0, sizeof(Arena));
+}
+
+size_t arena_capacity(const Arena *arena) {
+    size_t capacity = 0;
+    for (const ArenaBlock *block = arena->blocks; block; block = block->next) {
+        capacity += block->capacity;
+    }
+    return capacity;
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Bump allocator for data that lives until the next reset. When a block runs out another one
+// is chained on; the next reset folds them into a single block as large as the most ever in
+// use, so an arena that has seen its worst case never touches the heap again.
+typedef struct {
+    ArenaBlock *blocks;
+    // the last allocation, which arena_grow can extend in place
+    void *last;
+    size_t used;
+    size_t highWater;
+    // malloc calls since the arena was created, for checking steady state stays at zero
+    int heapAllocations;
+} Arena;
+
+// 16 byte aligned, never NULL unless malloc fails.
+void *arena_alloc(Arena *arena, size_t size);
+// Resizes an allocation to size, in place when it was the last one and the block has room,
+// else by copying into a new one. A NULL pointer allocates.
+void *arena_grow(Arena *arena, void *pointer, size_t oldSize, size_t size);
+void arena_reset(Arena *arena);
+// Frees the blocks and clears the statistics.
+void arena_free(Arena *arena);
+// Bytes reserved in blocks, which can be more than the high water mark.
+size_t arena_capacity(const Arena *arena);
+
+#endif
@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "assets.h"
+
+AssetStats assetStats;
+
+static Asset assets[ASSETS_MAX];
+static int assetCount;
+// assets before this one have been taken by the loader, which works through them in order
+static int nextLoad;
+
+static pthread_t loader;
+static pthread_mutex_t assetsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t assetsQueued = PTHREAD_COND_INITIALIZER;
+static int running;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void *loaderMain(void *arg) {
+    pthread_mutex_lock(&assetsMutex);
+    while (1) {
+        while (running && nextLoad == assetCount) {
+            pthread_cond_wait(&assetsQueued, &assetsMutex);
+        }
+        if (!running)
+            break;
+        Asset *asset = &assets[nextLoad++];
+        asset->state = ASSET_LOADING;
+        pthread_mutex_unlock(&assetsMutex);
+
+        double start = now();
+        TextureImage image;
+        int ok = texture_load_serial(asset->path, asset->format, &image);
+        double finish = now();
+
+        pthread_mutex_lock(&assetsMutex);
+        if (ok)
+            asset->image = image;
+        else
+            printf("Failed to load asset %s\n", asset->path);
+        asset->state = ok ? ASSET_READY : ASSET_FAILED;
+        asset->loadTime = finish - asset->requestTime;
+        assetStats.loaded += ok;
+        assetStats.failed += !ok;
+        assetStats.loaderTime += finish - start;
+    }
+    pthread_mutex_unlock(&assetsMutex);
+    return NULL;
+}
+
+void assets_init() {
+    if (running)
+        return;
+    memset(&assetStats, 0, sizeof(assetStats));
+    assetCount = nextLoad = 0;
+    running = 1;
+    if (pthread_create(&loader, NULL, loaderMain, NULL) != 0) {
+        printf("Failed to start asset loader\n");
+        running = 0;
+    }
+}
+
+void assets_shutdown() {
+    if (!running)
+        return;
+    pthread_mutex_lock(&assetsMutex);
+    running = 0;
+    pthread_cond_signal(&assetsQueued);
+    pthread_mutex_unlock(&assetsMutex);
+    pthread_join(loader, NULL);
+    for (int a = 0; a < assetCount; a++) {
+        if (assets[a].state == ASSET_READY)
+            texture_release(&assets[a].image);
+    }
+    assetCount = nextLoad = 0;
+}
+
+int assets_request_texture(const char *path, int format) {
+    if (!running || strlen(path) >= ASSET_PATH_MAX)
+        return -1;
+    pthread_mutex_lock(&assetsMutex);
+    int a = assetCount < ASSETS_MAX ? assetCount++ : -1;
+    if (a >= 0) {
+        Asset *asset = &assets[a];
+        memset(asset, 0, sizeof(Asset));
+        strcpy(asset->path, path);
+        asset->format = format;
+        asset->state = ASSET_QUEUED;
+        asset->requestTime = now();
+        assetStats.requested++;
+        pthread_cond_signal(&assetsQueued);
+    }
+    pthread_mutex_unlock(&assetsMutex);
+    return a;
+}
+
+int assets_state(int asset) {
+    pthread_mutex_lock(&assetsMutex);
+    int state = assets[asset].state;
+    pthread_mutex_unlock(&assetsMutex);
+    return state;
+}
+
+const TextureImage *assets_image(int asset) {
+    return assets_state(asset) == ASSET_READY ? &assets[asset].image : NULL;
+}
+
+double assets_load_time(int asset) {
+    pthread_mutex_lock(&assetsMutex);
+    double time = assets[asset].loadTime;
+    pthread_mutex_unlock(&assetsMutex);
+    return time;
+}
+
+void assets_release(int asset) {
+    pthread_mutex_lock(&assetsMutex);
+    if (assets[asset].state == ASSET_READY) {
+        texture_release(&assets[asset].image);
+        assets[asset].state = ASSET_DONE;
+    }
+    pthread_mutex_unlock(&assetsMutex);
+}
+
+int assets_pending() {
+    pthread_mutex_lock(&assetsMutex);
+    int pending = 0;
+    for (int a = 0; a < assetCount; a++) {
+        pending += assets[a].state == ASSET_QUEUED || assets[a].state == ASSET_LOADING;
+    }
+    pthread_mutex_unlock(&assetsMutex);
+    return pending;
+}
@@ -0,0 +1,54 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include "texture.h"
+
+#define ASSETS_MAX 64
+#define ASSET_PATH_MAX 256
+
+enum {
+    ASSET_QUEUED,
+    ASSET_LOADING,
+    // the image can be uploaded
+    ASSET_READY,
+    ASSET_FAILED,
+    // uploaded and released
+    ASSET_DONE
+};
+
+typedef struct {
+    char path[ASSET_PATH_MAX];
+    int format;
+    int state;
+    TextureImage image;
+    // seconds from the request until the loader finished it
+    double loadTime;
+    double requestTime;
+} Asset;
+
+typedef struct {
+    int requested;
+    int loaded;
+    int failed;
+    // time the loader thread spent mapping caches, or decoding and encoding where they were stale
+    double loaderTime;
+} AssetStats;
+
+extern AssetStats assetStats;
+
+// Starts the loader thread, which maps texture caches or builds them without the job pool.
+void assets_init();
+// Stops the loader thread once it is idle and releases every image.
+void assets_shutdown();
+// Queues a texture and returns its asset, -1 if there are too many. Never blocks on loading.
+int assets_request_texture(const char *path, int format);
+int assets_state(int asset);
+// The image of an asset that is ASSET_READY; it stays mapped until assets_release.
+const TextureImage *assets_image(int asset);
+double assets_load_time(int asset);
+// Unmaps the image once it has been uploaded and marks the asset ASSET_DONE.
+void assets_release(int asset);
+// Requested assets that aren't ready or failed yet.
+int assets_pending();
+
+#endif
@@ -0,0 +1,545 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ccd.h"
+#include "physics.h"
+#include "island.h"
+#include "narrow.h"
+#include "mesh.h"
+#include "jobs.h"
+#include "sort.h"
+
+#define CCD_GRAIN 1024
+#define CCD_MAX_ITERATIONS 32
+// gap left at the time of impact, as a fraction of the bullet radius
+#define CCD_TOLERANCE 0.01f
+// part of the smallest extent swept shapes keep as skin around their cores
+#define CCD_CORE 0.5f
+// radians a bounce may turn a bullet per step; the orientation update falls apart for much more
+#define CCD_MAX_TURN 1.0f
+#define NO_HIT -2
+#define WALL_HIT -1
+#define MESH_HIT -3
+
+typedef struct {
+    int *bodies;
+    int count;
+    int capacity;
+    float maxRadius;
+    float maxMotion;
+} WorkerBullets;
+
+typedef struct {
+    float time;
+    int body;
+    // from the bullet to what it hits
+    float normal[3];
+    // where the impulse acts, at the time of impact
+    float point[3];
+} Hit;
+
+static WorkerBullets workerBullets[JOBS_MAX_THREADS];
+static int *bullets;
+static int bulletCount;
+static int bulletCapacity;
+static float maxRadius;
+static float maxMotion;
+static float stepDt;
+// mesh triangles near the current sweep
+static int *triangles;
+static int triangleCapacity;
+
+void ccd_shutdown() {
+    for (int w = 0; w < JOBS_MAX_THREADS; w++) {
+        free(workerBullets[w].bodies);
+        workerBullets[w] = (WorkerBullets){0};
+    }
+    free(bullets);
+    bullets = NULL;
+    bulletCount = bulletCapacity = 0;
+    free(triangles);
+    triangles = NULL;
+    triangleCapacity = 0;
+}
+
+static void findBulletsRange(void *ctx, int begin, int end, int worker) {
+    WorkerBullets *w = &workerBullets[worker];
+    float threshold = physicsConfig.ccdThreshold;
+
+    for (int i = begin; i < end; i++) {
+        float r = bodies.radius[i];
+        w->maxRadius = fmaxf(w->maxRadius, r);
+        if (!bodies.awake[i])
+            continue;
+        float speed = sqrtf(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i] + bodies.vz[i] * bodies.vz[i]);
+        w->maxMotion = fmaxf(w->maxMotion, speed * stepDt);
+        if (!(bodies.flags[i] & BODY_BULLET) || speed * stepDt <= threshold * r)
+            continue;
+        if (w->count == w->capacity) {
+            w->capacity = w->capacity ? w->capacity * 2 : 16;
+            w->bodies = realloc(w->bodies, w->capacity * sizeof(int));
+        }
+        w->bodies[w->count++] = i;
+    }
+}
+
+// Bullets are handled in body order whatever worker found them, to stay deterministic.
+static void findBullets() {
+    int workers = jobs_thread_count();
+    for (int w = 0; w < workers; w++) {
+        workerBullets[w].count = 0;
+        workerBullets[w].maxRadius = 0.0f;
+        workerBullets[w].maxMotion = 0.0f;
+    }
+    jobs_parallel_for(bodies.count, CCD_GRAIN, findBulletsRange, NULL);
+
+    bulletCount = 0;
+    maxRadius = maxMotion = 0.0f;
+    for (int w = 0; w < workers; w++) {
+        WorkerBullets *wb = &workerBullets[w];
+        maxRadius = fmaxf(maxRadius, wb->maxRadius);
+        maxMotion = fmaxf(maxMotion, wb->maxMotion);
+        if (bulletCount + wb->count > bulletCapacity) {
+            bulletCapacity = (bulletCount + wb->count) * 2;
+            bullets = realloc(bullets, bulletCapacity * sizeof(int));
+        }
+        for (int k = 0; k < wb->count; k++) {
+            bullets[bulletCount++] = wb->bodies[k];
+        }
+    }
+    // indices are never negative, so they sort as unsigned keys
+    sort_pairs32((unsigned int*)bullets, NULL, bulletCount);
+}
+
+// Bodies not moved yet are still at the start of the step; CCD-moved ones are at its end.
+static void positionAt(int j, float time, float out[3]) {
+    float t = bodies.flags[j] & BODY_CCD_STEPPED ? time - stepDt : time;
+    out[0] = bodies.px[j] + bodies.vx[j] * t;
+    out[1] = bodies.py[j] + bodies.vy[j] * t;
+    out[2] = bodies.pz[j] + bodies.vz[j] * t;
+}
+
+static float dot(const float a[3], const float b[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross(const float a[3], const float b[3], float out[3]) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// R diag(invI) R^T applied to v
+static void applyInvInertia(int i, const float v[3], float out[3]) {
+    float r[9];
+    physics_body_rotation(i, r);
+    float invI[3] = {bodies.invIx[i], bodies.invIy[i], bodies.invIz[i]};
+    float local[3];
+    for (int k = 0; k < 3; k++) {
+        local[k] = (r[k] * v[0] + r[3 + k] * v[1] + r[6 + k] * v[2]) * invI[k];
+    }
+    for (int k = 0; k < 3; k++) {
+        out[k] = r[k * 3] * local[0] + r[k * 3 + 1] * local[1] + r[k * 3 + 2] * local[2];
+    }
+}
+
+// The shape's furthest point along axis in direction sign. Boxes touch a wall with a face
+// center, an edge middle or a corner, depending on how many of their axes lie in its plane.
+static void wallSupport(const ConvexShape *s, int axis, float sign, float out[3]) {
+    for (int k = 0; k < 3; k++) {
+        out[k] = s->position[k];
+    }
+    if (s->type != SHAPE_BOX) {
+        out[axis] += sign * s->radius;
+        return;
+    }
+    for (int local = 0; local < 3; local++) {
+        float c = s->rotation[axis * 3 + local];
+        float side = c > 1e-4f ? sign : c < -1e-4f ? -sign : 0.0f;
+        for (int k = 0; k < 3; k++) {
+            out[k] += side * s->halfExtents[local] * s->rotation[k * 3 + local];
+        }
+    }
+}
+
+static void wallHit(const ConvexShape *s, const float v[3], Hit *hit) {
+    for (int axis = 0; axis < 3; axis++) {
+        float gap, sign;
+        float reach[3];
+        if (v[axis] < 0.0f) {
+            sign = -1.0f;
+            wallSupport(s, axis, sign, reach);
+            gap = reach[axis] - physicsConfig.boundsMin[axis];
+        }
+        else if (v[axis] > 0.0f) {
+            sign = 1.0f;
+            wallSupport(s, axis, sign, reach);
+            gap = physicsConfig.boundsMax[axis] - reach[axis];
+        }
+        else {
+            continue;
+        }
+        // already touching walls are left to the contact solver
+        if (gap <= 0.0f)
+            continue;
+        float t = gap / fabsf(v[axis]);
+        if (t < hit->time) {
+            hit->time = t;
+            hit->body = WALL_HIT;
+            hit->normal[0] = hit->normal[1] = hit->normal[2] = 0.0f;
+            hit->normal[axis] = sign;
+            for (int k = 0; k < 3; k++) {
+                hit->point[k] = reach[k] + v[k] * t;
+            }
+        }
+    }
+}
+
+// Conservative advancement: the gap can't close faster than the relative speed, so stepping
+// by gap / speed never passes the time of impact.
+static float timeOfImpact(const float offset[3], const float velocity[3], float radius, float tolerance, float maxTime) {
+    // with linear motion, bodies moving apart now never meet
+    float closing = offset[0] * velocity[0] + offset[1] * velocity[1] + offset[2] * velocity[2];
+    float speed = sqrtf(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+    if (closing >= 0.0f || speed == 0.0f)
+        return -1.0f;
+
+    float t = 0.0f;
+    for (int iteration = 0; iteration < CCD_MAX_ITERATIONS; iteration++) {
+        float d[3] = {
+            offset[0] + velocity[0] * t,
+            offset[1] + velocity[1] * t,
+            offset[2] + velocity[2] * t
+        };
+        float gap = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) - radius;
+        if (gap < tolerance)
+            return t;
+        t += gap / speed;
+        if (t >= maxTime)
+            return -1.0f;
+    }
+    return -1.0f;
+}
+
+// Shrinks the shape to its core and returns how much was taken off all around. Rounding the
+// core out by that again stays within the shape, and only gives up box corners.
+static float shapeCore(ConvexShape *s) {
+    float skin;
+    switch (s->type) {
+    case SHAPE_SPHERE:
+        skin = CCD_CORE * s->radius;
+        s->radius -= skin;
+        return skin;
+    case SHAPE_BOX:
+        skin = CCD_CORE * fminf(s->halfExtents[0], fminf(s->halfExtents[1], s->halfExtents[2]));
+        for (int k = 0; k < 3; k++) {
+            s->halfExtents[k] -= skin;
+        }
+        return skin;
+    default:
+        return 0.0f;
+    }
+}
+
+// Conservative advancement on the GJK distance of the shapes, which keep their orientation:
+// bodies only rotate after CCD. Under linear motion the distance is convex in time, so it
+// never closes faster than along the current closest points, and once those stop closing
+// the shapes don't meet. The cores are swept, until they are as far apart as their skins:
+// shapes that turned or were pushed slightly into each other since the last step still have
+// separate cores, and hit at once if those close. Deeper overlaps are left to the contact
+// solver. Fills the normal from a to b and the point midway between the surfaces at the impact.
+static float shapeTimeOfImpact(const ConvexShape *a, const ConvexShape *b, const float va[3], const float vb[3],
+                               float tolerance, float maxTime, float normal[3], float point[3]) {
+    ConvexShape ca = *a, cb = *b;
+    float skinA = shapeCore(&ca), skinB = shapeCore(&cb);
+    SimplexCache cache = {0};
+    float relative[3] = {va[0] - vb[0], va[1] - vb[1], va[2] - vb[2]};
+    float t = 0.0f;
+    for (int iteration = 0; iteration < CCD_MAX_ITERATIONS; iteration++) {
+        for (int k = 0; k < 3; k++) {
+            ca.position[k] = a->position[k] + va[k] * t;
+            cb.position[k] = b->position[k] + vb[k] * t;
+        }
+        float distance, pa[3], pb[3];
+        // only rounding can make the cores overlap after the start; the last step was close enough
+        if (!narrow_distance(&ca, &cb, &cache, &distance, pa, pb))
+            return iteration ? t : -1.0f;
+        float n[3] = {(pb[0] - pa[0]) / distance, (pb[1] - pa[1]) / distance, (pb[2] - pa[2]) / distance};
+        float closing = dot(relative, n);
+        if (closing <= 0.0f)
+            return -1.0f;
+        float gap = distance - skinA - skinB;
+        if (gap < tolerance) {
+            for (int k = 0; k < 3; k++) {
+                normal[k] = n[k];
+                point[k] = 0.5f * (pa[k] + n[k] * skinA + pb[k] - n[k] * skinB);
+            }
+            return t;
+        }
+        // aim for half the tolerance, so the shapes stop apart
+        t += (gap - 0.5f * tolerance) / closing;
+        if (t >= maxTime)
+            return -1.0f;
+    }
+    return -1.0f;
+}
+
+// Relative motion in y and z has to bring the bounds together before maxTime.
+static int sweptBoundsOverlap(const float offset[3], const float velocity[3], float radius, float maxTime) {
+    for (int axis = 1; axis < 3; axis++) {
+        float end = offset[axis] + velocity[axis] * maxTime;
+        if (fminf(offset[axis], end) > radius || fmaxf(offset[axis], end) < -radius)
+            return 0;
+    }
+    return 1;
+}
+
+static int lowerBound(const float *keys, int count, float key) {
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (keys[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Triangles of the static meshes in the swept bounds, skipping those the bullet stays clear
+// of on one side of. Meshes with an SDF are swept against their triangles too.
+static void meshHit(const ConvexShape *shape, const float v[3], float r, Hit *hit) {
+    const float *p = shape->position;
+    float min[3], max[3];
+    for (int k = 0; k < 3; k++) {
+        float end = p[k] + v[k] * hit->time;
+        min[k] = fminf(p[k], end) - r;
+        max[k] = fmaxf(p[k], end) + r;
+    }
+    float zero[3] = {0.0f, 0.0f, 0.0f};
+    ConvexShape triangle = {.type = SHAPE_HULL, .rotation = {1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f}, .vertexCount = 3};
+
+    for (int m = 0; m < meshes.count; m++) {
+        const TriangleMesh *mesh = &meshes.items[m];
+        int found = mesh_query(mesh, min, max, triangles, triangleCapacity);
+        if (found > triangleCapacity) {
+            triangleCapacity = found * 2;
+            triangles = realloc(triangles, triangleCapacity * sizeof(int));
+            mesh_query(mesh, min, max, triangles, triangleCapacity);
+        }
+        for (int t = 0; t < found; t++) {
+            float vertices[9];
+            mesh_triangle(mesh, triangles[t], vertices);
+            float e1[3] = {vertices[3] - vertices[0], vertices[4] - vertices[1], vertices[5] - vertices[2]};
+            float e2[3] = {vertices[6] - vertices[0], vertices[7] - vertices[1], vertices[8] - vertices[2]};
+            float normal[3];
+            cross(e1, e2, normal);
+            float length = sqrtf(dot(normal, normal));
+            if (length == 0.0f)
+                continue;
+            float rel[3] = {p[0] - vertices[0], p[1] - vertices[1], p[2] - vertices[2]};
+            float from = dot(rel, normal) / length;
+            float to = from + dot(v, normal) / length * hit->time;
+            if ((from > r && to > r) || (from < -r && to < -r))
+                continue;
+
+            triangle.vertices = vertices;
+            float n[3], point[3];
+            float time = shapeTimeOfImpact(shape, &triangle, v, zero, CCD_TOLERANCE * r, hit->time, n, point);
+            if (time < 0.0f || time >= hit->time)
+                continue;
+            hit->time = time;
+            hit->body = MESH_HIT;
+            memcpy(hit->normal, n, sizeof(n));
+            memcpy(hit->point, point, sizeof(point));
+        }
+    }
+}
+
+// Bodies are culled by their bounding spheres; sphere pairs are swept analytically, pairs with
+// a box through GJK on the real shapes.
+static Hit earliestHit(int i, float start, float duration) {
+    Hit hit = {duration, NO_HIT, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+    float p[3] = {bodies.px[i], bodies.py[i], bodies.pz[i]};
+    float v[3] = {bodies.vx[i], bodies.vy[i], bodies.vz[i]};
+    float r = bodies.radius[i];
+    ConvexShape shape;
+    narrow_body_shape(i, &shape);
+    wallHit(&shape, v, &hit);
+    meshHit(&shape, v, r, &hit);
+
+    // anything that can reach the swept bounds has its min x within this range
+    float end = p[0] + v[0] * duration;
+    float sweepMin = fminf(p[0], end) - r - maxMotion - 2.0f * maxRadius;
+    float sweepMax = fmaxf(p[0], end) + r + maxMotion;
+    SortedBounds sorted = physics_sorted_bounds();
+
+    for (int s = lowerBound(sorted.minX, sorted.count, sweepMin); s < sorted.count && sorted.minX[s] <= sweepMax; s++) {
+        int j = sorted.bodies[s];
+        if (j == i)
+            continue;
+        float q[3];
+        positionAt(j, start, q);
+        float offset[3] = {p[0] - q[0], p[1] - q[1], p[2] - q[2]};
+        float vj[3] = {bodies.vx[j], bodies.vy[j], bodies.vz[j]};
+        float velocity[3] = {v[0] - vj[0], v[1] - vj[1], v[2] - vj[2]};
+        float radius = r + bodies.radius[j];
+        if (!sweptBoundsOverlap(offset, velocity, radius, hit.time))
+            continue;
+
+        float t, n[3], point[3];
+        if (shape.type == SHAPE_SPHERE && bodies.shape[j] == SHAPE_SPHERE) {
+            // already overlapping bodies are left to the contact solver
+            if (dot(offset, offset) < radius * radius)
+                continue;
+            t = timeOfImpact(offset, velocity, radius, CCD_TOLERANCE * r, hit.time);
+            if (t < 0.0f || t >= hit.time)
+                continue;
+            float d[3] = {offset[0] + velocity[0] * t, offset[1] + velocity[1] * t, offset[2] + velocity[2] * t};
+            float len = sqrtf(dot(d, d));
+            for (int k = 0; k < 3; k++) {
+                n[k] = -d[k] / len;
+                point[k] = p[k] + v[k] * t + n[k] * r;
+            }
+        }
+        else {
+            ConvexShape other;
+            narrow_body_shape(j, &other);
+            memcpy(other.position, q, sizeof(q));
+            t = shapeTimeOfImpact(&shape, &other, v, vj, CCD_TOLERANCE * r, hit.time, n, point);
+            if (t < 0.0f || t >= hit.time)
+                continue;
+        }
+        hit.time = t;
+        hit.body = j;
+        memcpy(hit.normal, n, sizeof(n));
+        memcpy(hit.point, point, sizeof(point));
+    }
+    return hit;
+}
+
+// Bullets knocked fast by another one after findBullets get their own sweep, or the kick
+// would carry them through what's behind them.
+static void queueBullet(int j) {
+    float speed = sqrtf(bodies.vx[j] * bodies.vx[j] + bodies.vy[j] * bodies.vy[j] + bodies.vz[j] * bodies.vz[j]);
+    if (!(bodies.flags[j] & BODY_BULLET) || (bodies.flags[j] & BODY_CCD_STEPPED) ||
+        speed * stepDt <= physicsConfig.ccdThreshold * bodies.radius[j])
+        return;
+    maxMotion = fmaxf(maxMotion, speed * stepDt);
+    if (bulletCount == bulletCapacity) {
+        bulletCapacity = bulletCapacity ? bulletCapacity * 2 : 16;
+        bullets = realloc(bullets, bulletCapacity * sizeof(int));
+    }
+    bullets[bulletCount++] = j;
+}
+
+static void limitSpin(int i) {
+    float w2 = bodies.wx[i] * bodies.wx[i] + bodies.wy[i] * bodies.wy[i] + bodies.wz[i] * bodies.wz[i];
+    if (w2 * stepDt * stepDt > CCD_MAX_TURN * CCD_MAX_TURN) {
+        float scale = CCD_MAX_TURN / (sqrtf(w2) * stepDt);
+        bodies.wx[i] *= scale;
+        bodies.wy[i] *= scale;
+        bodies.wz[i] *= scale;
+    }
+}
+
+// The impulse acts at the point of impact, so boxes hit off their center also start to spin,
+// as the solver's contact rows would make them.
+static void bounce(int i, const Hit *hit, float time) {
+    int j = hit->body >= 0 ? hit->body : -1;
+    const float *n = hit->normal;
+    float p[3] = {bodies.px[i], bodies.py[i], bodies.pz[i]};
+    float ri[3] = {hit->point[0] - p[0], hit->point[1] - p[1], hit->point[2] - p[2]};
+    float ji[3], ki[3];
+    cross(ri, n, ji);
+    applyInvInertia(i, ji, ki);
+    float wi = bodies.invMass[i];
+    float k = wi + dot(ji, ki);
+    float vn = -(bodies.vx[i] * n[0] + bodies.vy[i] * n[1] + bodies.vz[i] * n[2]);
+    vn -= bodies.wx[i] * ji[0] + bodies.wy[i] * ji[1] + bodies.wz[i] * ji[2];
+
+    float jj[3] = {0.0f, 0.0f, 0.0f}, kj[3] = {0.0f, 0.0f, 0.0f};
+    float wj = 0.0f;
+    if (j >= 0) {
+        if (bodies.invMass[j] != 0.0f && !bodies.awake[j]) {
+            Contact touch = {.a = i, .b = j};
+            islands_wake_touched(&touch, 1);
+        }
+        float q[3];
+        positionAt(j, time, q);
+        float rj[3] = {hit->point[0] - q[0], hit->point[1] - q[1], hit->point[2] - q[2]};
+        cross(rj, n, jj);
+        applyInvInertia(j, jj, kj);
+        wj = bodies.invMass[j];
+        k += wj + dot(jj, kj);
+        vn += bodies.vx[j] * n[0] + bodies.vy[j] * n[1] + bodies.vz[j] * n[2];
+        vn += bodies.wx[j] * jj[0] + bodies.wy[j] * jj[1] + bodies.wz[j] * jj[2];
+    }
+    float impulse = vn < 0.0f ? -(1.0f + physicsConfig.restitution) * vn / k : 0.0f;
+    bodies.vx[i] -= n[0] * impulse * wi;
+    bodies.vy[i] -= n[1] * impulse * wi;
+    bodies.vz[i] -= n[2] * impulse * wi;
+    bodies.wx[i] -= ki[0] * impulse;
+    bodies.wy[i] -= ki[1] * impulse;
+    bodies.wz[i] -= ki[2] * impulse;
+    limitSpin(i);
+    if (j >= 0) {
+        bodies.vx[j] += n[0] * impulse * wj;
+        bodies.vy[j] += n[1] * impulse * wj;
+        bodies.vz[j] += n[2] * impulse * wj;
+        bodies.wx[j] += kj[0] * impulse;
+        bodies.wy[j] += kj[1] * impulse;
+        bodies.wz[j] += kj[2] * impulse;
+        limitSpin(j);
+    }
+
+    // the sweeps move bullets without turning them, so the centers have to stop closing too,
+    // or the next sweep finds the same contact at once
+    float closing = bodies.vx[i] * n[0] + bodies.vy[i] * n[1] + bodies.vz[i] * n[2];
+    if (j >= 0)
+        closing -= bodies.vx[j] * n[0] + bodies.vy[j] * n[1] + bodies.vz[j] * n[2];
+    if (closing > 0.0f) {
+        float linear = closing / (wi + wj);
+        bodies.vx[i] -= n[0] * linear * wi;
+        bodies.vy[i] -= n[1] * linear * wi;
+        bodies.vz[i] -= n[2] * linear * wi;
+        if (j >= 0) {
+            bodies.vx[j] += n[0] * linear * wj;
+            bodies.vy[j] += n[1] * linear * wj;
+            bodies.vz[j] += n[2] * linear * wj;
+        }
+    }
+    if (j >= 0)
+        queueBullet(j);
+}
+
+void ccd_advance(float dt) {
+    stepDt = dt;
+    findBullets();
+
+    int swept = 0, clamped = 0;
+    // bounces may queue more bullets, and one already in the list again
+    for (int k = 0; k < bulletCount; k++) {
+        int i = bullets[k];
+        if (bodies.flags[i] & BODY_CCD_STEPPED)
+            continue;
+        float time = 0.0f;
+        // one sweep more than there are bounces moves the bullet on after the last one
+        for (int substep = 0; substep <= CCD_MAX_SUBSTEPS && time < dt; substep++) {
+            Hit hit = earliestHit(i, time, dt - time);
+            bodies.px[i] += bodies.vx[i] * hit.time;
+            bodies.py[i] += bodies.vy[i] * hit.time;
+            bodies.pz[i] += bodies.vz[i] * hit.time;
+            time += hit.time;
+            if (hit.body == NO_HIT)
+                break;
+            bounce(i, &hit, time);
+            clamped += substep == CCD_MAX_SUBSTEPS;
+        }
+        bodies.flags[i] |= BODY_CCD_STEPPED;
+        swept++;
+    }
+
+    physicsStats.ccdBodies = swept;
+    physicsStats.ccdClamped = clamped;
+}
@@ -0,0 +1,14 @@
+#ifndef CCD_H
+#define CCD_H
+
+// Moves fast bullets through the step with conservative advancement of their shapes against
+// every body and mesh triangle they can reach and the walls, bouncing at each time of impact,
+// up to CCD_MAX_SUBSTEPS times; a bullet still hitting something after that stops there for
+// the step.
+// Only those bodies are sub-stepped; the others are integrated normally afterwards.
+#define CCD_MAX_SUBSTEPS 4
+
+void ccd_advance(float dt);
+void ccd_shutdown();
+
+#endif
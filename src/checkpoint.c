@@ -0,0 +1,358 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "checkpoint.h"
+#include "physics.h"
+#include "solver.h"
+#include "narrow.h"
+#include "jobs.h"
+
+#define MAX_SECTIONS 16
+#define COPY_CHUNK (1 << 20)
+
+enum {
+    SECTION_CONFIG = 1,
+    SECTION_COUNTERS,
+    SECTION_BODIES,
+    SECTION_BROADPHASE,
+    SECTION_CONTACT_CACHE,
+    SECTION_SIMPLEX_CACHE,
+    SECTION_BODY_POOL
+};
+
+typedef struct {
+    unsigned long long step;
+    unsigned long long rngState;
+    unsigned int nextId;
+    int bodyCount;
+} Counters;
+
+// followed by the generations, free list links and items of every slot
+typedef struct {
+    int capacity;
+    int freeHead;
+    int count;
+    int reserved;
+} PoolHeader;
+
+static size_t poolSlotBytes(const Pool *pool) {
+    return sizeof(unsigned int) + sizeof(int) + pool->itemSize;
+}
+
+typedef struct {
+    unsigned int tag;
+    unsigned int reserved;
+    unsigned long long size;
+} SectionHeader;
+
+typedef struct {
+    SectionHeader header;
+    unsigned char *data;
+} Section;
+
+typedef struct {
+    unsigned char *dst;
+    const unsigned char *src;
+    size_t size;
+} Copy;
+
+CheckpointStats checkpointStats;
+
+static Section sections[MAX_SECTIONS];
+static int sectionCount;
+
+static Copy *copies;
+static int copyCount;
+static int copyCapacity;
+
+static pthread_t writer;
+static int writing;
+static int writeResult;
+static char *writePath;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned long long checksum(unsigned long long h, const unsigned char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static unsigned char *addSection(unsigned int tag, size_t size) {
+    Section *s = &sections[sectionCount++];
+    s->header.tag = tag;
+    s->header.reserved = 0;
+    s->header.size = size;
+    s->data = malloc(size ? size : 1);
+    return s->data;
+}
+
+// Large arrays are split into chunks so the copy itself runs on all workers.
+static void queueCopy(unsigned char *dst, const void *src, size_t size) {
+    const unsigned char *from = src;
+    for (size_t offset = 0; offset < size; offset += COPY_CHUNK) {
+        if (copyCount == copyCapacity) {
+            copyCapacity = copyCapacity ? copyCapacity * 2 : 64;
+            copies = realloc(copies, copyCapacity * sizeof(Copy));
+        }
+        size_t n = size - offset < COPY_CHUNK ? size - offset : COPY_CHUNK;
+        copies[copyCount++] = (Copy){dst + offset, from + offset, n};
+    }
+}
+
+static void copyRange(void *ctx, int begin, int end, int worker) {
+    for (int i = begin; i < end; i++) {
+        memcpy(copies[i].dst, copies[i].src, copies[i].size);
+    }
+}
+
+static void freeSections() {
+    for (int i = 0; i < sectionCount; i++) {
+        free(sections[i].data);
+    }
+    sectionCount = 0;
+}
+
+static void *writerMain(void *arg) {
+    double start = now();
+    writeResult = 0;
+
+    FILE *f = fopen(writePath, "wb");
+    if (!f) {
+        printf("Failed to open checkpoint %s\n", writePath);
+        freeSections();
+        return NULL;
+    }
+
+    unsigned int version = CHECKPOINT_VERSION;
+    unsigned int count = sectionCount;
+    unsigned long long sum = 0xCBF29CE484222325ULL;
+    int ok = fwrite(CHECKPOINT_MAGIC, 8, 1, f) == 1
+          && fwrite(&version, sizeof(version), 1, f) == 1
+          && fwrite(&count, sizeof(count), 1, f) == 1;
+    for (int i = 0; ok && i < sectionCount; i++) {
+        Section *s = &sections[i];
+        ok = fwrite(&s->header, sizeof(s->header), 1, f) == 1
+          && (s->header.size == 0 || fwrite(s->data, s->header.size, 1, f) == 1);
+        sum = checksum(sum, s->data, s->header.size);
+    }
+    ok = ok && fwrite(&sum, sizeof(sum), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok)
+        printf("Failed to write checkpoint %s\n", writePath);
+    freeSections();
+    checkpointStats.writeTime = now() - start;
+    writeResult = ok;
+    return NULL;
+}
+
+int checkpoint_wait() {
+    if (!writing)
+        return 1;
+    pthread_join(writer, NULL);
+    writing = 0;
+    return writeResult;
+}
+
+int checkpoint_save(const char *path) {
+    checkpoint_wait();
+    double start = now();
+
+    Counters counters = {
+        .step = physicsStats.step,
+        .rngState = physicsPersistent.rngState,
+        .nextId = physicsPersistent.nextId,
+        .bodyCount = bodies.count
+    };
+    memcpy(addSection(SECTION_CONFIG, sizeof(PhysicsConfig)), &physicsConfig, sizeof(PhysicsConfig));
+    memcpy(addSection(SECTION_COUNTERS, sizeof(Counters)), &counters, sizeof(Counters));
+
+    copyCount = 0;
+    size_t bodyBytes = 0;
+#define BODY_ARRAY_SIZE(name) bodyBytes += bodies.count * sizeof(*bodies.name);
+    BODY_ARRAYS(BODY_ARRAY_SIZE)
+#undef BODY_ARRAY_SIZE
+    unsigned char *dst = addSection(SECTION_BODIES, bodyBytes);
+#define BODY_ARRAY_COPY(name) \
+    queueCopy(dst, bodies.name, bodies.count * sizeof(*bodies.name)); \
+    dst += bodies.count * sizeof(*bodies.name);
+    BODY_ARRAYS(BODY_ARRAY_COPY)
+#undef BODY_ARRAY_COPY
+
+    size_t sortedBytes = physicsPersistent.sortedCount * sizeof(int);
+    queueCopy(addSection(SECTION_BROADPHASE, sortedBytes), physicsPersistent.sortedBodies, sortedBytes);
+
+    size_t cacheBytes = contactCache.count * sizeof(CachedImpulse);
+    queueCopy(addSection(SECTION_CONTACT_CACHE, cacheBytes), contactCache.entries, cacheBytes);
+
+    size_t simplexBytes = pairSimplexCache.count * sizeof(PairSimplex);
+    queueCopy(addSection(SECTION_SIMPLEX_CACHE, simplexBytes), pairSimplexCache.entries, simplexBytes);
+
+    const Pool *pool = &physicsPersistent.bodyPool;
+    PoolHeader poolHeader = {pool->capacity, pool->freeHead, pool->count, 0};
+    dst = addSection(SECTION_BODY_POOL, sizeof(PoolHeader) + pool->capacity * poolSlotBytes(pool));
+    memcpy(dst, &poolHeader, sizeof(PoolHeader));
+    dst += sizeof(PoolHeader);
+    queueCopy(dst, pool->generations, pool->capacity * sizeof(unsigned int));
+    dst += pool->capacity * sizeof(unsigned int);
+    queueCopy(dst, pool->nextFree, pool->capacity * sizeof(int));
+    dst += pool->capacity * sizeof(int);
+    queueCopy(dst, pool->items, pool->capacity * pool->itemSize);
+
+    jobs_parallel_for(copyCount, 1, copyRange, NULL);
+
+    checkpointStats.bytes = 0;
+    for (int i = 0; i < sectionCount; i++) {
+        checkpointStats.bytes += sizeof(SectionHeader) + sections[i].header.size;
+    }
+    checkpointStats.snapshotTime = now() - start;
+
+    free(writePath);
+    writePath = strdup(path);
+    if (pthread_create(&writer, NULL, writerMain, NULL) != 0) {
+        printf("Failed to start checkpoint writer\n");
+        freeSections();
+        return 0;
+    }
+    writing = 1;
+    return 1;
+}
+
+static Section *findSection(Section *loaded, int count, unsigned int tag, size_t size) {
+    for (int i = 0; i < count; i++) {
+        if (loaded[i].header.tag == tag && (size == 0 || loaded[i].header.size == size))
+            return &loaded[i];
+    }
+    return NULL;
+}
+
+static int restore(Section *loaded, int count) {
+    Section *configSection = findSection(loaded, count, SECTION_CONFIG, sizeof(PhysicsConfig));
+    Section *countersSection = findSection(loaded, count, SECTION_COUNTERS, sizeof(Counters));
+    Section *bodiesSection = findSection(loaded, count, SECTION_BODIES, 0);
+    Section *broadphaseSection = findSection(loaded, count, SECTION_BROADPHASE, 0);
+    Section *cacheSection = findSection(loaded, count, SECTION_CONTACT_CACHE, 0);
+    Section *simplexSection = findSection(loaded, count, SECTION_SIMPLEX_CACHE, 0);
+    Section *poolSection = findSection(loaded, count, SECTION_BODY_POOL, 0);
+    if (!configSection || !countersSection || !bodiesSection || !broadphaseSection || !cacheSection || !simplexSection
+        || !poolSection || poolSection->header.size < sizeof(PoolHeader))
+        return 0;
+
+    Counters counters;
+    memcpy(&counters, countersSection->data, sizeof(Counters));
+    size_t bodyBytes = 0;
+#define BODY_ARRAY_SIZE(name) bodyBytes += counters.bodyCount * sizeof(*bodies.name);
+    BODY_ARRAYS(BODY_ARRAY_SIZE)
+#undef BODY_ARRAY_SIZE
+    if (bodiesSection->header.size != bodyBytes || broadphaseSection->header.size % sizeof(int) != 0
+        || cacheSection->header.size % sizeof(CachedImpulse) != 0 || simplexSection->header.size % sizeof(PairSimplex) != 0)
+        return 0;
+    PoolHeader poolHeader;
+    memcpy(&poolHeader, poolSection->data, sizeof(PoolHeader));
+    if (poolHeader.count != counters.bodyCount || poolHeader.capacity < poolHeader.count
+        || poolSection->header.size != sizeof(PoolHeader) + poolHeader.capacity * poolSlotBytes(&physicsPersistent.bodyPool))
+        return 0;
+
+    PhysicsConfig config;
+    memcpy(&config, configSection->data, sizeof(PhysicsConfig));
+    config.threads = physicsConfig.threads;
+    physics_shutdown();
+    physics_init(config);
+
+    physics_reserve_bodies(counters.bodyCount);
+    bodies.count = counters.bodyCount;
+    const unsigned char *src = bodiesSection->data;
+#define BODY_ARRAY_RESTORE(name) \
+    memcpy(bodies.name, src, bodies.count * sizeof(*bodies.name)); \
+    src += bodies.count * sizeof(*bodies.name);
+    BODY_ARRAYS(BODY_ARRAY_RESTORE)
+#undef BODY_ARRAY_RESTORE
+
+    int sortedCount = broadphaseSection->header.size / sizeof(int);
+    physicsPersistent.sortedBodies = malloc((sortedCount ? sortedCount : 1) * sizeof(int));
+    memcpy(physicsPersistent.sortedBodies, broadphaseSection->data, broadphaseSection->header.size);
+    physicsPersistent.sortedCount = sortedCount;
+    physicsPersistent.sortedCapacity = sortedCount;
+    physicsPersistent.rngState = counters.rngState;
+    physicsPersistent.nextId = counters.nextId;
+
+    Pool *pool = &physicsPersistent.bodyPool;
+    size_t slots = poolHeader.capacity ? poolHeader.capacity : 1;
+    pool->generations = malloc(slots * sizeof(unsigned int));
+    pool->nextFree = malloc(slots * sizeof(int));
+    pool->items = malloc(slots * pool->itemSize);
+    src = poolSection->data + sizeof(PoolHeader);
+    memcpy(pool->generations, src, poolHeader.capacity * sizeof(unsigned int));
+    src += poolHeader.capacity * sizeof(unsigned int);
+    memcpy(pool->nextFree, src, poolHeader.capacity * sizeof(int));
+    src += poolHeader.capacity * sizeof(int);
+    memcpy(pool->items, src, poolHeader.capacity * pool->itemSize);
+    pool->capacity = poolHeader.capacity;
+    pool->freeHead = poolHeader.freeHead;
+    pool->count = poolHeader.count;
+    physicsStats.step = counters.step;
+    solver_restore_cache((CachedImpulse*)cacheSection->data, cacheSection->header.size / sizeof(CachedImpulse));
+    narrow_store_simplices((PairSimplex*)simplexSection->data, simplexSection->header.size / sizeof(PairSimplex));
+    return 1;
+}
+
+int checkpoint_load(const char *path) {
+    checkpoint_wait();
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Failed to open checkpoint %s\n", path);
+        return 0;
+    }
+
+    char magic[8];
+    unsigned int version, count;
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0
+        || fread(&version, sizeof(version), 1, f) != 1 || fread(&count, sizeof(count), 1, f) != 1) {
+        printf("%s is not a checkpoint\n", path);
+        fclose(f);
+        return 0;
+    }
+    if (version != CHECKPOINT_VERSION || count > MAX_SECTIONS) {
+        printf("Unsupported checkpoint version %u in %s\n", version, path);
+        fclose(f);
+        return 0;
+    }
+
+    Section loaded[MAX_SECTIONS];
+    int loadedCount = 0;
+    unsigned long long sum = 0xCBF29CE484222325ULL, storedSum;
+    int ok = 1;
+    for (unsigned int i = 0; ok && i < count; i++) {
+        Section *s = &loaded[loadedCount];
+        ok = fread(&s->header, sizeof(s->header), 1, f) == 1;
+        if (!ok)
+            break;
+        s->data = malloc(s->header.size ? s->header.size : 1);
+        loadedCount++;
+        ok = s->data && (s->header.size == 0 || fread(s->data, s->header.size, 1, f) == 1);
+        if (ok)
+            sum = checksum(sum, s->data, s->header.size);
+    }
+    ok = ok && fread(&storedSum, sizeof(storedSum), 1, f) == 1 && storedSum == sum;
+    fclose(f);
+
+    if (!ok)
+        printf("Checkpoint %s is truncated or corrupted\n", path);
+    else if (!(ok = restore(loaded, loadedCount)))
+        printf("Checkpoint %s is missing world data\n", path);
+
+    for (int i = 0; i < loadedCount; i++) {
+        free(loaded[i].data);
+    }
+    return ok;
+}
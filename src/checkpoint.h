@@ -0,0 +1,24 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#define CHECKPOINT_MAGIC "CSIMCKPT"
+#define CHECKPOINT_VERSION 11
+
+typedef struct {
+    double snapshotTime;
+    double writeTime;
+    unsigned long long bytes;
+} CheckpointStats;
+
+extern CheckpointStats checkpointStats;
+
+// Copies the world into memory between steps and writes it on a background thread,
+// so the simulation only waits for the copy. Returns 0 if the snapshot failed.
+int checkpoint_save(const char *path);
+// Waits for the background write. Returns 0 if it failed.
+int checkpoint_wait();
+// Replaces the world with the checkpoint. The thread count stays the one of the
+// current config, in deterministic mode the continuation is bit-identical anyway.
+int checkpoint_load(const char *path);
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gpuphysics.h"
+#include "granular.h"
+#include "instance.h"
+#include "program.h"
+#include "shaders.h"
+
+#define LOCAL_SIZE 128
+// local size of the scan, which takes the bucket table 256 buckets at a time
+#define SCAN_SIZE 256
+
+enum {
+    PASS_HASH,
+    PASS_SCAN,
+    PASS_SCATTER,
+    PASS_FORCE,
+    PASS_INTEGRATE,
+    PASS_COUNT
+};
+
+static const char *passFiles[PASS_COUNT] = {
+    "granular_hash.comp",
+    "granular_scan.comp",
+    "granular_scatter.comp",
+    "granular_force.comp",
+    "granular_integrate.comp"
+};
+
+// by binding point in the shaders
+enum {
+    BUFFER_POSITIONS,
+    BUFFER_VELOCITIES,
+    BUFFER_CELLS,
+    BUFFER_CELL_OF,
+    BUFFER_CELL_RANK,
+    BUFFER_BLOCK_SUMS,
+    BUFFER_CELL_PARTICLES,
+    BUFFER_FORCES,
+    BUFFER_INSTANCES,
+    BUFFER_COUNTERS,
+    BUFFER_COUNT
+};
+
+GpuPhysicsStats gpuPhysicsStats;
+
+static GLuint programs[PASS_COUNT];
+static GLuint buffers[BUFFER_COUNT];
+static int uploadedCount;
+static int materials;
+
+int gpuphysics_init(int materialCount) {
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major * 10 + minor < 43) {
+        printf("The compute backend needs OpenGL 4.3, this context is %d.%d\n", major, minor);
+        return 0;
+    }
+    for (int p = 0; p < PASS_COUNT; p++) {
+        char *source = shaders_read(passFiles[p]);
+        GLenum stage = GL_COMPUTE_SHADER;
+        programs[p] = source ? program_build(&stage, (const char**)&source, 1) : 0;
+        free(source);
+        if (!programs[p]) {
+            printf("Failed to build %s\n", passFiles[p]);
+            gpuphysics_shutdown();
+            return 0;
+        }
+    }
+    glGenBuffers(BUFFER_COUNT, buffers);
+    memset(&gpuPhysicsStats, 0, sizeof(gpuPhysicsStats));
+    materials = materialCount > 0 ? materialCount : 1;
+    uploadedCount = 0;
+    return 1;
+}
+
+void gpuphysics_shutdown() {
+    for (int p = 0; p < PASS_COUNT; p++) {
+        if (programs[p])
+            glDeleteProgram(programs[p]);
+        programs[p] = 0;
+    }
+    if (buffers[0])
+        glDeleteBuffers(BUFFER_COUNT, buffers);
+    memset(buffers, 0, sizeof(buffers));
+    uploadedCount = 0;
+}
+
+static void allocate(int buffer, size_t size, const void *data) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[buffer]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size ? size : 16, data, GL_DYNAMIC_COPY);
+}
+
+void gpuphysics_upload() {
+    int count = particles.count;
+    float *positions = malloc(count * 4 * sizeof(float));
+    float *velocities = malloc(count * 4 * sizeof(float));
+    float maxRadius = 0.0f;
+    for (int i = 0; i < count; i++) {
+        positions[4 * i] = particles.px[i];
+        positions[4 * i + 1] = particles.py[i];
+        positions[4 * i + 2] = particles.pz[i];
+        positions[4 * i + 3] = particles.radius[i];
+        velocities[4 * i] = particles.vx[i];
+        velocities[4 * i + 1] = particles.vy[i];
+        velocities[4 * i + 2] = particles.vz[i];
+        velocities[4 * i + 3] = particles.invMass[i];
+        if (particles.radius[i] > maxRadius)
+            maxRadius = particles.radius[i];
+    }
+
+    // the grid is rebuilt every step, so cells only have to fit the largest pair
+    int size = 1024;
+    while (size < count)
+        size *= 2;
+    gpuPhysicsStats.tableSize = size;
+    gpuPhysicsStats.cellSize = 2.0f * maxRadius;
+
+    allocate(BUFFER_POSITIONS, count * 4 * sizeof(float), positions);
+    allocate(BUFFER_VELOCITIES, count * 4 * sizeof(float), velocities);
+    allocate(BUFFER_CELLS, (size + 1) * sizeof(unsigned int), NULL);
+    allocate(BUFFER_CELL_OF, count * sizeof(unsigned int), NULL);
+    allocate(BUFFER_CELL_RANK, count * sizeof(unsigned int), NULL);
+    allocate(BUFFER_BLOCK_SUMS, size / SCAN_SIZE * sizeof(unsigned int), NULL);
+    allocate(BUFFER_CELL_PARTICLES, count * sizeof(unsigned int), NULL);
+    allocate(BUFFER_FORCES, count * 4 * sizeof(float), NULL);
+    allocate(BUFFER_INSTANCES, count * sizeof(Instance), NULL);
+    allocate(BUFFER_COUNTERS, sizeof(unsigned int), NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    free(positions);
+    free(velocities);
+    uploadedCount = count;
+}
+
+// Every pass gets all of them; names a pass doesn't use have no location and are skipped.
+static void setUniforms(GLuint program, float dt) {
+    glProgramUniform1ui(program, glGetUniformLocation(program, "count"), uploadedCount);
+    glProgramUniform1ui(program, glGetUniformLocation(program, "tableSize"), gpuPhysicsStats.tableSize);
+    glProgramUniform1f(program, glGetUniformLocation(program, "cellSize"), gpuPhysicsStats.cellSize);
+    glProgramUniform3fv(program, glGetUniformLocation(program, "boundsMin"), 1, granularConfig.boundsMin);
+    glProgramUniform3fv(program, glGetUniformLocation(program, "boundsMax"), 1, granularConfig.boundsMax);
+    glProgramUniform3fv(program, glGetUniformLocation(program, "gravity"), 1, granularConfig.gravity);
+    glProgramUniform1f(program, glGetUniformLocation(program, "stiffness"), granularConfig.stiffness);
+    glProgramUniform1f(program, glGetUniformLocation(program, "dampingRatio"), granularConfig.dampingRatio);
+    glProgramUniform1f(program, glGetUniformLocation(program, "friction"), granularConfig.friction);
+    glProgramUniform1f(program, glGetUniformLocation(program, "dt"), dt);
+    glProgramUniform1ui(program, glGetUniformLocation(program, "materialCount"), materials);
+}
+
+static void dispatch(int pass, int groups) {
+    glUseProgram(programs[pass]);
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void gpuphysics_step(float dt) {
+    if (!uploadedCount)
+        return;
+    for (int b = 0; b < BUFFER_COUNT; b++) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, b, buffers[b]);
+    }
+    for (int p = 0; p < PASS_COUNT; p++) {
+        setUniforms(programs[p], dt);
+    }
+    unsigned int zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[BUFFER_CELLS]);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[BUFFER_COUNTERS]);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    int groups = (uploadedCount + LOCAL_SIZE - 1) / LOCAL_SIZE;
+    int blocks = gpuPhysicsStats.tableSize / SCAN_SIZE;
+    dispatch(PASS_HASH, groups);
+    GLint pass = glGetUniformLocation(programs[PASS_SCAN], "pass");
+    for (int p = 0; p < 3; p++) {
+        glProgramUniform1ui(programs[PASS_SCAN], pass, p);
+        dispatch(PASS_SCAN, p == 1 ? 1 : blocks);
+    }
+    dispatch(PASS_SCATTER, groups);
+    dispatch(PASS_FORCE, groups);
+    glUseProgram(programs[PASS_INTEGRATE]);
+    glDispatchCompute(groups, 1, 1);
+    // positions feed the next step, the instances the draw
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    gpuPhysicsStats.step++;
+}
+
+void gpuphysics_download() {
+    int count = uploadedCount;
+    if (count != particles.count)
+        return;
+    float *positions = malloc(count * 4 * sizeof(float));
+    float *velocities = malloc(count * 4 * sizeof(float));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[BUFFER_POSITIONS]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * 4 * sizeof(float), positions);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[BUFFER_VELOCITIES]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * 4 * sizeof(float), velocities);
+    unsigned int contacts;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[BUFFER_COUNTERS]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(contacts), &contacts);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    for (int i = 0; i < count; i++) {
+        particles.px[i] = positions[4 * i];
+        particles.py[i] = positions[4 * i + 1];
+        particles.pz[i] = positions[4 * i + 2];
+        particles.vx[i] = velocities[4 * i];
+        particles.vy[i] = velocities[4 * i + 1];
+        particles.vz[i] = velocities[4 * i + 2];
+    }
+    gpuPhysicsStats.contacts = contacts;
+    free(positions);
+    free(velocities);
+}
+
+GLuint gpuphysics_instance_buffer() {
+    return buffers[BUFFER_INSTANCES];
+}
@@ -0,0 +1,32 @@
+#ifndef GPUPHYSICS_H
+#define GPUPHYSICS_H
+
+#include <glad/glad.h>
+
+// The granular model (granular.h) on OpenGL 4.3 compute shaders: integration, a grid rebuilt
+// every step by counting sort and the sphere contacts, all in shader storage buffers that
+// never leave the GPU. The last pass writes the renderer's Instance records for the particles.
+typedef struct {
+    unsigned long long step;
+    int tableSize;
+    float cellSize;
+    // contacts between particles in the last step, read back by gpuphysics_download
+    int contacts;
+} GpuPhysicsStats;
+
+extern GpuPhysicsStats gpuPhysicsStats;
+
+// Builds the passes from shaders/ on the current context. Particles get material
+// index % materialCount. Returns 0 if the context is older than 4.3 or a pass doesn't compile.
+int gpuphysics_init(int materialCount);
+void gpuphysics_shutdown();
+// Copies particles and granularConfig to the GPU, replacing what was there.
+void gpuphysics_upload();
+// Queues one step; nothing waits for the GPU.
+void gpuphysics_step(float dt);
+// Reads positions and velocities back into particles, in the order they were uploaded.
+void gpuphysics_download();
+// particles.count Instance records, ready for the vertex stage after each step.
+GLuint gpuphysics_instance_buffer();
+
+#endif
@@ -0,0 +1,498 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "granular.h"
+#include "jobs.h"
+#include "sort.h"
+
+#define GRANULAR_GRAIN 1024
+#define MORTON_BITS 10
+
+Particles particles;
+GranularConfig granularConfig;
+GranularStats granularStats;
+
+// positions at the last rebuild
+static float *lastX, *lastY, *lastZ;
+static float *forceX, *forceY, *forceZ;
+static int arrayCapacity;
+
+// neighbor lists in compressed rows: the neighbors of i are neighbors[neighborStart[i]..neighborStart[i + 1]]
+static int *neighborStart;
+static int *neighbors;
+static int neighborCapacity;
+
+// particles bucketed by a hash of their grid cell
+static unsigned int *cellOf;
+static int *cellStart;
+static int *cellParticles;
+static int cellTableSize;
+static float cellSize;
+
+static unsigned int *sortCodes;
+static int *sortOrder;
+static void *scratch;
+static int stepsSinceSort;
+static int rebuildNeeded;
+
+static float maxDisplacement[JOBS_MAX_THREADS];
+static int workerContacts[JOBS_MAX_THREADS];
+static double *chunkEnergy;
+static int chunkCapacity;
+static float stepDt;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+GranularConfig granular_default_config() {
+    GranularConfig config = {
+        .threads = 0,
+        .gravity = {0.0f, -9.81f, 0.0f},
+        .boundsMin = {-10.0f, 0.0f, -10.0f},
+        .boundsMax = {10.0f, 20.0f, 10.0f},
+        .density = 1.0f,
+        .stiffness = 20000.0f,
+        .dampingRatio = 0.3f,
+        .friction = 0.5f,
+        .skin = 0.1f,
+        .sortInterval = 100
+    };
+    return config;
+}
+
+static void freeArrays() {
+    free(particles.id);
+    free(particles.px);
+    free(particles.py);
+    free(particles.pz);
+    free(particles.vx);
+    free(particles.vy);
+    free(particles.vz);
+    free(particles.radius);
+    free(particles.invMass);
+    memset(&particles, 0, sizeof(particles));
+    free(lastX);
+    free(lastY);
+    free(lastZ);
+    free(forceX);
+    free(forceY);
+    free(forceZ);
+    free(neighborStart);
+    free(cellOf);
+    free(cellParticles);
+    free(sortCodes);
+    free(sortOrder);
+    free(scratch);
+    lastX = lastY = lastZ = NULL;
+    forceX = forceY = forceZ = NULL;
+    neighborStart = NULL;
+    cellOf = NULL;
+    cellParticles = NULL;
+    sortCodes = NULL;
+    sortOrder = NULL;
+    scratch = NULL;
+    arrayCapacity = 0;
+
+    free(neighbors);
+    neighbors = NULL;
+    neighborCapacity = 0;
+    free(cellStart);
+    cellStart = NULL;
+    cellTableSize = 0;
+    free(chunkEnergy);
+    chunkEnergy = NULL;
+    chunkCapacity = 0;
+}
+
+void granular_init(GranularConfig config) {
+    granularConfig = config;
+    jobs_init(config.threads);
+    freeArrays();
+    memset(&granularStats, 0, sizeof(granularStats));
+    // sorted before the first step
+    stepsSinceSort = config.sortInterval;
+    rebuildNeeded = 1;
+}
+
+void granular_shutdown() {
+    jobs_shutdown();
+    sort_shutdown();
+    freeArrays();
+}
+
+void granular_reserve(int needed) {
+    if (needed <= particles.capacity)
+        return;
+    int capacity = particles.capacity ? particles.capacity : 1024;
+    while (capacity < needed)
+        capacity *= 2;
+    particles.id = realloc(particles.id, capacity * sizeof(unsigned int));
+    particles.px = realloc(particles.px, capacity * sizeof(float));
+    particles.py = realloc(particles.py, capacity * sizeof(float));
+    particles.pz = realloc(particles.pz, capacity * sizeof(float));
+    particles.vx = realloc(particles.vx, capacity * sizeof(float));
+    particles.vy = realloc(particles.vy, capacity * sizeof(float));
+    particles.vz = realloc(particles.vz, capacity * sizeof(float));
+    particles.radius = realloc(particles.radius, capacity * sizeof(float));
+    particles.invMass = realloc(particles.invMass, capacity * sizeof(float));
+    particles.capacity = capacity;
+}
+
+int granular_add(const float position[3], const float velocity[3], float radius) {
+    granular_reserve(particles.count + 1);
+    int i = particles.count++;
+    particles.id[i] = i;
+    particles.px[i] = position[0];
+    particles.py[i] = position[1];
+    particles.pz[i] = position[2];
+    particles.vx[i] = velocity[0];
+    particles.vy[i] = velocity[1];
+    particles.vz[i] = velocity[2];
+    particles.radius[i] = radius;
+    particles.invMass[i] = 1.0f / (granularConfig.density * 4.18879f * radius * radius * radius);
+    rebuildNeeded = 1;
+    return i;
+}
+
+static void reserveArrays() {
+    if (particles.count <= arrayCapacity)
+        return;
+    arrayCapacity = particles.capacity;
+    lastX = realloc(lastX, arrayCapacity * sizeof(float));
+    lastY = realloc(lastY, arrayCapacity * sizeof(float));
+    lastZ = realloc(lastZ, arrayCapacity * sizeof(float));
+    forceX = realloc(forceX, arrayCapacity * sizeof(float));
+    forceY = realloc(forceY, arrayCapacity * sizeof(float));
+    forceZ = realloc(forceZ, arrayCapacity * sizeof(float));
+    neighborStart = realloc(neighborStart, (arrayCapacity + 1) * sizeof(int));
+    cellOf = realloc(cellOf, arrayCapacity * sizeof(unsigned int));
+    cellParticles = realloc(cellParticles, arrayCapacity * sizeof(int));
+    sortCodes = realloc(sortCodes, arrayCapacity * sizeof(unsigned int));
+    sortOrder = realloc(sortOrder, arrayCapacity * sizeof(int));
+    scratch = realloc(scratch, arrayCapacity * sizeof(unsigned int));
+}
+
+static unsigned int spreadBits(unsigned int x) {
+    x &= 0x3FF;
+    x = (x | x << 16) & 0x030000FF;
+    x = (x | x << 8) & 0x0300F00F;
+    x = (x | x << 4) & 0x030C30C3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
+
+static void permute(void *array, size_t size) {
+    unsigned char *src = array, *dst = scratch;
+    for (int k = 0; k < particles.count; k++) {
+        memcpy(dst + k * size, src + sortOrder[k] * size, size);
+    }
+    memcpy(array, scratch, particles.count * size);
+}
+
+// Particles close in space end up close in memory, so a particle's neighbors share its cache lines.
+static void mortonSort() {
+    const float *min = granularConfig.boundsMin, *max = granularConfig.boundsMax;
+    float scale[3];
+    for (int k = 0; k < 3; k++) {
+        scale[k] = ((1 << MORTON_BITS) - 1) / fmaxf(max[k] - min[k], 1e-6f);
+    }
+    for (int i = 0; i < particles.count; i++) {
+        float p[3] = {particles.px[i], particles.py[i], particles.pz[i]};
+        unsigned int q[3];
+        for (int k = 0; k < 3; k++) {
+            float v = (p[k] - min[k]) * scale[k];
+            q[k] = v <= 0.0f ? 0 : v >= (1 << MORTON_BITS) - 1 ? (1 << MORTON_BITS) - 1 : (unsigned int)v;
+        }
+        sortCodes[i] = spreadBits(q[0]) | spreadBits(q[1]) << 1 | spreadBits(q[2]) << 2;
+        sortOrder[i] = i;
+    }
+    sort_pairs32(sortCodes, sortOrder, particles.count);
+
+    permute(particles.id, sizeof(unsigned int));
+    permute(particles.px, sizeof(float));
+    permute(particles.py, sizeof(float));
+    permute(particles.pz, sizeof(float));
+    permute(particles.vx, sizeof(float));
+    permute(particles.vy, sizeof(float));
+    permute(particles.vz, sizeof(float));
+    permute(particles.radius, sizeof(float));
+    permute(particles.invMass, sizeof(float));
+    granularStats.sorts++;
+}
+
+static unsigned int cellHash(int x, int y, int z) {
+    return ((unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u) & (cellTableSize - 1);
+}
+
+static void cellCoordinates(int i, int c[3]) {
+    c[0] = (int)floorf((particles.px[i] - granularConfig.boundsMin[0]) / cellSize);
+    c[1] = (int)floorf((particles.py[i] - granularConfig.boundsMin[1]) / cellSize);
+    c[2] = (int)floorf((particles.pz[i] - granularConfig.boundsMin[2]) / cellSize);
+}
+
+static void hashRange(void *ctx, int begin, int end, int worker) {
+    for (int i = begin; i < end; i++) {
+        int c[3];
+        cellCoordinates(i, c);
+        cellOf[i] = cellHash(c[0], c[1], c[2]);
+    }
+}
+
+// The 27 cells around i, without repeats where different cells hash to the same bucket.
+static int nearbyBuckets(int i, unsigned int buckets[27]) {
+    int c[3], n = 0;
+    cellCoordinates(i, c);
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                unsigned int h = cellHash(c[0] + dx, c[1] + dy, c[2] + dz);
+                int seen = 0;
+                for (int k = 0; k < n && !seen; k++) {
+                    seen = buckets[k] == h;
+                }
+                if (!seen)
+                    buckets[n++] = h;
+            }
+        }
+    }
+    return n;
+}
+
+// Lists are full, holding every pair in both directions, so each particle sums its own force
+// without writing to its neighbors.
+static void neighborRange(void *ctx, int begin, int end, int worker) {
+    int fill = ctx != NULL;
+    float skin = granularConfig.skin;
+    for (int i = begin; i < end; i++) {
+        unsigned int buckets[27];
+        int bucketCount = nearbyBuckets(i, buckets);
+        float px = particles.px[i], py = particles.py[i], pz = particles.pz[i], r = particles.radius[i];
+        int n = 0;
+        int *out = fill ? &neighbors[neighborStart[i]] : NULL;
+        for (int b = 0; b < bucketCount; b++) {
+            for (int k = cellStart[buckets[b]]; k < cellStart[buckets[b] + 1]; k++) {
+                int j = cellParticles[k];
+                if (j == i)
+                    continue;
+                float dx = particles.px[j] - px, dy = particles.py[j] - py, dz = particles.pz[j] - pz;
+                float reach = r + particles.radius[j] + skin;
+                if (dx * dx + dy * dy + dz * dz >= reach * reach)
+                    continue;
+                if (fill)
+                    out[n] = j;
+                n++;
+            }
+        }
+        if (!fill)
+            neighborStart[i + 1] = n;
+    }
+}
+
+static void rebuild() {
+    int count = particles.count;
+    float maxRadius = 0.0f;
+    for (int i = 0; i < count; i++) {
+        maxRadius = fmaxf(maxRadius, particles.radius[i]);
+    }
+    cellSize = 2.0f * maxRadius + granularConfig.skin;
+
+    int size = 1024;
+    while (size < count)
+        size *= 2;
+    if (size != cellTableSize) {
+        cellTableSize = size;
+        cellStart = realloc(cellStart, (size + 1) * sizeof(int));
+    }
+    jobs_parallel_for(count, GRANULAR_GRAIN, hashRange, NULL);
+
+    // counting sort by bucket, keeping particle order within a bucket
+    memset(cellStart, 0, (cellTableSize + 1) * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        cellStart[cellOf[i] + 1]++;
+    }
+    for (int h = 0; h < cellTableSize; h++) {
+        cellStart[h + 1] += cellStart[h];
+    }
+    for (int i = 0; i < count; i++) {
+        cellParticles[cellStart[cellOf[i]]++] = i;
+    }
+    for (int h = cellTableSize; h > 0; h--) {
+        cellStart[h] = cellStart[h - 1];
+    }
+    cellStart[0] = 0;
+
+    // count, then fill, so the lists come out the same for any thread count
+    neighborStart[0] = 0;
+    jobs_parallel_for(count, GRANULAR_GRAIN, neighborRange, NULL);
+    for (int i = 0; i < count; i++) {
+        neighborStart[i + 1] += neighborStart[i];
+    }
+    if (neighborStart[count] > neighborCapacity) {
+        neighborCapacity = neighborStart[count] + neighborStart[count] / 4;
+        neighbors = realloc(neighbors, neighborCapacity * sizeof(int));
+    }
+    jobs_parallel_for(count, GRANULAR_GRAIN, neighborRange, neighbors);
+
+    memcpy(lastX, particles.px, count * sizeof(float));
+    memcpy(lastY, particles.py, count * sizeof(float));
+    memcpy(lastZ, particles.pz, count * sizeof(float));
+    granularStats.neighbors = neighborStart[count];
+    granularStats.rebuilds++;
+}
+
+// Spring-dashpot along the normal, then friction opposing the tangential sliding velocity,
+// viscous up to the Coulomb limit. n points from the particle to whatever it touches,
+// relative is the velocity of that relative to the particle.
+static void contactForce(float overlap, const float n[3], const float relative[3], float invMass, float out[3]) {
+    float mass = 1.0f / invMass;
+    float damping = 2.0f * granularConfig.dampingRatio * sqrtf(granularConfig.stiffness * mass);
+    float vn = relative[0] * n[0] + relative[1] * n[1] + relative[2] * n[2];
+    float fn = granularConfig.stiffness * overlap - damping * vn;
+    if (fn <= 0.0f)
+        return;
+    float vt[3] = {relative[0] - vn * n[0], relative[1] - vn * n[1], relative[2] - vn * n[2]};
+    float speed = sqrtf(vt[0] * vt[0] + vt[1] * vt[1] + vt[2] * vt[2]);
+    float ft = speed > 1e-9f ? fminf(granularConfig.friction * fn, damping * speed) / speed : 0.0f;
+    for (int k = 0; k < 3; k++) {
+        out[k] += -fn * n[k] + ft * vt[k];
+    }
+}
+
+static void forceRange(void *ctx, int begin, int end, int worker) {
+    const float *min = granularConfig.boundsMin, *max = granularConfig.boundsMax;
+    int contacts = 0;
+    for (int i = begin; i < end; i++) {
+        float p[3] = {particles.px[i], particles.py[i], particles.pz[i]};
+        float v[3] = {particles.vx[i], particles.vy[i], particles.vz[i]};
+        float r = particles.radius[i];
+        float f[3] = {0.0f, 0.0f, 0.0f};
+
+        for (int k = neighborStart[i]; k < neighborStart[i + 1]; k++) {
+            int j = neighbors[k];
+            float d[3] = {particles.px[j] - p[0], particles.py[j] - p[1], particles.pz[j] - p[2]};
+            float reach = r + particles.radius[j];
+            float d2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+            if (d2 >= reach * reach || d2 == 0.0f)
+                continue;
+            float distance = sqrtf(d2);
+            float n[3] = {d[0] / distance, d[1] / distance, d[2] / distance};
+            float relative[3] = {particles.vx[j] - v[0], particles.vy[j] - v[1], particles.vz[j] - v[2]};
+            // the effective mass of the pair keeps the damping symmetric
+            contactForce(reach - distance, n, relative, particles.invMass[i] + particles.invMass[j], f);
+            contacts++;
+        }
+
+        for (int axis = 0; axis < 3; axis++) {
+            float depthMin = min[axis] - (p[axis] - r);
+            float depthMax = p[axis] + r - max[axis];
+            if (depthMin <= 0.0f && depthMax <= 0.0f)
+                continue;
+            float n[3] = {0.0f, 0.0f, 0.0f};
+            float relative[3] = {-v[0], -v[1], -v[2]};
+            n[axis] = depthMin > depthMax ? -1.0f : 1.0f;
+            contactForce(fmaxf(depthMin, depthMax), n, relative, particles.invMass[i], f);
+        }
+        forceX[i] = f[0];
+        forceY[i] = f[1];
+        forceZ[i] = f[2];
+    }
+    workerContacts[worker] += contacts;
+}
+
+// Semi-implicit Euler, tracking how far particles got from where the lists were built.
+static void integrateRange(void *ctx, int begin, int end, int worker) {
+    const float *g = granularConfig.gravity;
+    float h = stepDt;
+    float moved = maxDisplacement[worker];
+    double energy = 0.0;
+    for (int i = begin; i < end; i++) {
+        float w = particles.invMass[i];
+        particles.vx[i] += (forceX[i] * w + g[0]) * h;
+        particles.vy[i] += (forceY[i] * w + g[1]) * h;
+        particles.vz[i] += (forceZ[i] * w + g[2]) * h;
+        particles.px[i] += particles.vx[i] * h;
+        particles.py[i] += particles.vy[i] * h;
+        particles.pz[i] += particles.vz[i] * h;
+
+        float dx = particles.px[i] - lastX[i], dy = particles.py[i] - lastY[i], dz = particles.pz[i] - lastZ[i];
+        moved = fmaxf(moved, dx * dx + dy * dy + dz * dz);
+        double v2 = (double)particles.vx[i] * particles.vx[i]
+                  + (double)particles.vy[i] * particles.vy[i]
+                  + (double)particles.vz[i] * particles.vz[i];
+        energy += 0.5 * v2 / w;
+    }
+    maxDisplacement[worker] = moved;
+    chunkEnergy[begin / GRANULAR_GRAIN] = energy;
+}
+
+void granular_step(float dt) {
+    double start = now();
+    stepDt = dt;
+    reserveArrays();
+    int count = particles.count;
+    int chunks = (count + GRANULAR_GRAIN - 1) / GRANULAR_GRAIN;
+    if (chunks > chunkCapacity) {
+        chunkCapacity = chunks;
+        chunkEnergy = realloc(chunkEnergy, chunkCapacity * sizeof(double));
+    }
+
+    if (granularConfig.sortInterval && stepsSinceSort >= granularConfig.sortInterval) {
+        mortonSort();
+        stepsSinceSort = 0;
+        rebuildNeeded = 1;
+    }
+    stepsSinceSort++;
+    if (rebuildNeeded)
+        rebuild();
+
+    int workers = jobs_thread_count();
+    memset(workerContacts, 0, sizeof(workerContacts));
+    jobs_parallel_for(count, GRANULAR_GRAIN, forceRange, NULL);
+    for (int w = 0; w < workers; w++) {
+        maxDisplacement[w] = 0.0f;
+    }
+    jobs_parallel_for(count, GRANULAR_GRAIN, integrateRange, NULL);
+
+    // a pair can close by twice the largest displacement, so the lists hold while that's under the skin
+    float moved = 0.0f;
+    granularStats.contacts = 0;
+    for (int w = 0; w < workers; w++) {
+        moved = fmaxf(moved, maxDisplacement[w]);
+        granularStats.contacts += workerContacts[w];
+    }
+    float half = 0.5f * granularConfig.skin;
+    rebuildNeeded = moved > half * half;
+
+    granularStats.kineticEnergy = 0.0;
+    for (int c = 0; c < chunks; c++) {
+        granularStats.kineticEnergy += chunkEnergy[c];
+    }
+    granularStats.step++;
+    granularStats.stepTime = now() - start;
+}
+
+static unsigned long long hashBytes(unsigned long long h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+unsigned long long granular_state_hash() {
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    size_t size = particles.count * sizeof(float);
+    h = hashBytes(h, particles.id, particles.count * sizeof(unsigned int));
+    h = hashBytes(h, particles.px, size);
+    h = hashBytes(h, particles.py, size);
+    h = hashBytes(h, particles.pz, size);
+    h = hashBytes(h, particles.vx, size);
+    h = hashBytes(h, particles.vy, size);
+    h = hashBytes(h, particles.vz, size);
+    return h;
+}
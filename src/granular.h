@@ -0,0 +1,59 @@
+#ifndef GRANULAR_H
+#define GRANULAR_H
+
+// Discrete element method for granular material: spheres without rotation, pushed apart by a
+// linear spring-dashpot with Coulomb-limited viscous friction. Independent of the rigid bodies.
+typedef struct {
+    unsigned int *id;
+    float *px, *py, *pz;
+    float *vx, *vy, *vz;
+    float *radius;
+    float *invMass;
+    int count;
+    int capacity;
+} Particles;
+
+typedef struct {
+    int threads;
+    float gravity[3];
+    float boundsMin[3];
+    float boundsMax[3];
+    float density;
+    // spring constant of the normal force
+    float stiffness;
+    // fraction of critical damping of the normal spring
+    float dampingRatio;
+    float friction;
+    // neighbor lists hold everything within the sum of radii plus skin, and are rebuilt once
+    // some particle moved more than half of it
+    float skin;
+    // particles are put in Morton order every this many steps, 0 never
+    int sortInterval;
+} GranularConfig;
+
+typedef struct {
+    unsigned long long step;
+    int rebuilds;
+    int sorts;
+    // entries in the neighbor lists, twice the number of pairs
+    int neighbors;
+    int contacts;
+    double kineticEnergy;
+    double stepTime;
+} GranularStats;
+
+extern Particles particles;
+extern GranularConfig granularConfig;
+extern GranularStats granularStats;
+
+GranularConfig granular_default_config();
+// Starts the job pool with config.threads, like physics_init.
+void granular_init(GranularConfig config);
+void granular_shutdown();
+void granular_reserve(int count);
+int granular_add(const float position[3], const float velocity[3], float radius);
+void granular_step(float dt);
+// The same for any thread count: forces are summed per particle in neighbor list order.
+unsigned long long granular_state_hash();
+
+#endif
@@ -0,0 +1,41 @@
+#include "instance.h"
+#include "physics.h"
+
+// quaternion components are already within [-1, 1]
+static short packSnorm(float value) {
+    return (short)(value * INSTANCE_SNORM16 + (value < 0.0f ? -0.5f : 0.5f));
+}
+
+// The cube mesh spans -0.5 to 0.5, so the scale is the full size of the shape.
+static float bodyScale(int body) {
+    return bodies.shape[body] == SHAPE_BOX ? 2.0f * bodies.halfExtent[body] : 2.0f * bodies.radius[body];
+}
+
+void instance_pack(int body, Instance *out) {
+    out->position[0] = bodies.px[body];
+    out->position[1] = bodies.py[body];
+    out->position[2] = bodies.pz[body];
+    out->scale = bodyScale(body);
+    out->rotation[0] = packSnorm(bodies.qx[body]);
+    out->rotation[1] = packSnorm(bodies.qy[body]);
+    out->rotation[2] = packSnorm(bodies.qz[body]);
+    out->rotation[3] = packSnorm(bodies.qw[body]);
+    out->material = bodies.material[body];
+    out->pad = 0;
+}
+
+void instance_model_matrix(int body, float out[16]) {
+    float r[9];
+    float s = bodyScale(body);
+    physics_body_rotation(body, r);
+    for (int col = 0; col < 3; col++) {
+        for (int row = 0; row < 3; row++) {
+            out[col * 4 + row] = r[row * 3 + col] * s;
+        }
+        out[col * 4 + 3] = 0.0f;
+    }
+    out[12] = bodies.px[body];
+    out[13] = bodies.py[body];
+    out[14] = bodies.pz[body];
+    out[15] = 1.0f;
+}
@@ -0,0 +1,25 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#define INSTANCE_SNORM16 32767.0f
+
+// What the vertex shader needs to place one body, half the size of a mat4. The model matrix
+// is rebuilt on the GPU from the position, the orientation (x y z w as normalized shorts)
+// and the scale of the unit cube mesh.
+typedef struct {
+    float position[3];
+    float scale;
+    short rotation[4];
+    // row of the renderer's material table
+    unsigned int material;
+    // keeps the record at two 16 byte halves
+    unsigned int pad;
+} Instance;
+
+_Static_assert(sizeof(Instance) == 32, "Instance has to stay 32 bytes");
+
+void instance_pack(int body, Instance *out);
+// The model matrix the shader rebuilds from the instance, column-major like GL.
+void instance_model_matrix(int body, float out[16]);
+
+#endif
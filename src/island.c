@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include "island.h"
+
+#define MAX_SLEEP_TIMER 65535
+
+static int *parent;
+static unsigned short *islandTimer;
+static unsigned char *wakeIsland;
+static int capacity;
+
+static void reserve() {
+    if (bodies.count <= capacity)
+        return;
+    capacity = bodies.capacity;
+    parent = realloc(parent, capacity * sizeof(int));
+    islandTimer = realloc(islandTimer, capacity * sizeof(unsigned short));
+    wakeIsland = realloc(wakeIsland, capacity);
+}
+
+void islands_shutdown() {
+    free(parent);
+    free(islandTimer);
+    free(wakeIsland);
+    parent = NULL;
+    islandTimer = NULL;
+    wakeIsland = NULL;
+    capacity = 0;
+}
+
+static int find(int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static void unite(int i, int j) {
+    i = find(i);
+    j = find(j);
+    // the lower index becomes the root, so islands come out the same on every run
+    if (i < j)
+        parent[j] = i;
+    else if (j < i)
+        parent[i] = j;
+}
+
+static int isDynamic(int i) {
+    return i >= 0 && bodies.invMass[i] != 0.0f;
+}
+
+void islands_wake_touched(const Contact *contacts, int count) {
+    if (!physicsConfig.sleepSteps)
+        return;
+    reserve();
+
+    // sleeping islands are labelled with the index of their root body
+    int woken = 0;
+    memset(wakeIsland, 0, bodies.count);
+    for (int k = 0; k < count; k++) {
+        int a = contacts[k].a;
+        int b = contacts[k].b;
+        if (!isDynamic(a) || !isDynamic(b) || bodies.awake[a] == bodies.awake[b])
+            continue;
+        int sleeping = bodies.awake[a] ? b : a;
+        wakeIsland[bodies.island[sleeping]] = 1;
+        woken = 1;
+    }
+    if (!woken)
+        return;
+
+    for (int i = 0; i < bodies.count; i++) {
+        if (!bodies.awake[i] && isDynamic(i) && wakeIsland[bodies.island[i]]) {
+            bodies.awake[i] = 1;
+            bodies.sleepTimer[i] = 0;
+        }
+    }
+}
+
+void islands_update(const Contact *contacts, int count) {
+    reserve();
+
+    for (int i = 0; i < bodies.count; i++) {
+        parent[i] = i;
+    }
+    for (int k = 0; k < count; k++) {
+        if (isDynamic(contacts[k].a) && isDynamic(contacts[k].b))
+            unite(contacts[k].a, contacts[k].b);
+    }
+
+    int islands = 0;
+    int awake = 0;
+    float threshold = physicsConfig.sleepEnergy;
+    for (int i = 0; i < bodies.count; i++) {
+        islandTimer[i] = MAX_SLEEP_TIMER;
+    }
+    for (int i = 0; i < bodies.count; i++) {
+        if (!isDynamic(i) || !bodies.awake[i])
+            continue;
+        float v2 = bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i] + bodies.vz[i] * bodies.vz[i];
+        // spinning counts with the speed of the bounding sphere's surface
+        float w2 = bodies.wx[i] * bodies.wx[i] + bodies.wy[i] * bodies.wy[i] + bodies.wz[i] * bodies.wz[i];
+        v2 += w2 * bodies.radius[i] * bodies.radius[i];
+        if (0.5f * v2 < threshold) {
+            if (bodies.sleepTimer[i] < MAX_SLEEP_TIMER)
+                bodies.sleepTimer[i]++;
+        }
+        else {
+            bodies.sleepTimer[i] = 0;
+        }
+
+        int root = find(i);
+        bodies.island[i] = root;
+        if (root == i)
+            islands++;
+        if (bodies.sleepTimer[i] < islandTimer[root])
+            islandTimer[root] = bodies.sleepTimer[i];
+    }
+
+    int sleepSteps = physicsConfig.sleepSteps;
+    for (int i = 0; i < bodies.count; i++) {
+        if (!isDynamic(i) || !bodies.awake[i])
+            continue;
+        if (sleepSteps && islandTimer[bodies.island[i]] >= sleepSteps) {
+            bodies.awake[i] = 0;
+            bodies.vx[i] = bodies.vy[i] = bodies.vz[i] = 0.0f;
+            bodies.wx[i] = bodies.wy[i] = bodies.wz[i] = 0.0f;
+        }
+        else {
+            awake++;
+        }
+    }
+
+    physicsStats.islands = islands;
+    physicsStats.awakeBodies = awake;
+}
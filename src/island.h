@@ -0,0 +1,14 @@
+#ifndef ISLAND_H
+#define ISLAND_H
+
+#include "physics.h"
+
+// Wakes the islands of sleeping bodies that an awake body touches. Call it before solving,
+// so the woken bodies take part in this step.
+void islands_wake_touched(const Contact *contacts, int count);
+// Builds islands of dynamic bodies connected by contacts with union-find and puts an island
+// to sleep once all its bodies have stayed under physicsConfig.sleepEnergy for sleepSteps steps.
+void islands_update(const Contact *contacts, int count);
+void islands_shutdown();
+
+#endif
@@ -0,0 +1,133 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "jobs.h"
+
+typedef struct {
+    JobFn fn;
+    void *ctx;
+    int count;
+    int grain;
+    atomic_int next;
+} JobBatch;
+
+static pthread_t workers[JOBS_MAX_THREADS];
+static pthread_mutex_t jobsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobsStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobsDone = PTHREAD_COND_INITIALIZER;
+
+static int threadCount = 1;
+static int running = 0;
+static unsigned long generation = 0;
+static int busyWorkers = 0;
+static JobBatch batch;
+
+static void runBatch(int worker) {
+    for (;;) {
+        int begin = atomic_fetch_add(&batch.next, batch.grain);
+        if (begin >= batch.count)
+            break;
+        int end = begin + batch.grain;
+        if (end > batch.count)
+            end = batch.count;
+        batch.fn(batch.ctx, begin, end, worker);
+    }
+}
+
+static void *workerMain(void *arg) {
+    int worker = (int)(long)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&jobsMutex);
+    for (;;) {
+        while (running && generation == seen)
+            pthread_cond_wait(&jobsStart, &jobsMutex);
+        if (!running)
+            break;
+        seen = generation;
+        pthread_mutex_unlock(&jobsMutex);
+
+        runBatch(worker);
+
+        pthread_mutex_lock(&jobsMutex);
+        if (--busyWorkers == 0)
+            pthread_cond_signal(&jobsDone);
+    }
+    pthread_mutex_unlock(&jobsMutex);
+    return NULL;
+}
+
+int jobs_hardware_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        return 1;
+    if (n > JOBS_MAX_THREADS)
+        return JOBS_MAX_THREADS;
+    return (int)n;
+}
+
+void jobs_init(int threads) {
+    if (running)
+        jobs_shutdown();
+    if (threads < 1)
+        threads = jobs_hardware_threads();
+    if (threads > JOBS_MAX_THREADS)
+        threads = JOBS_MAX_THREADS;
+
+    threadCount = threads;
+    running = 1;
+    generation = 0;
+    // worker 0 is the calling thread
+    for (int i = 1; i < threadCount; i++) {
+        pthread_create(&workers[i], NULL, workerMain, (void*)(long)i);
+    }
+}
+
+void jobs_shutdown() {
+    pthread_mutex_lock(&jobsMutex);
+    running = 0;
+    pthread_cond_broadcast(&jobsStart);
+    pthread_mutex_unlock(&jobsMutex);
+
+    for (int i = 1; i < threadCount; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    threadCount = 1;
+}
+
+int jobs_thread_count() {
+    return threadCount;
+}
+
+void jobs_parallel_for(int count, int grain, JobFn fn, void *ctx) {
+    if (count <= 0)
+        return;
+    if (grain < 1)
+        grain = 1;
+
+    if (threadCount == 1 || count <= grain) {
+        for (int begin = 0; begin < count; begin += grain) {
+            int end = begin + grain < count ? begin + grain : count;
+            fn(ctx, begin, end, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&jobsMutex);
+    batch.fn = fn;
+    batch.ctx = ctx;
+    batch.count = count;
+    batch.grain = grain;
+    atomic_store(&batch.next, 0);
+    busyWorkers = threadCount - 1;
+    generation++;
+    pthread_cond_broadcast(&jobsStart);
+    pthread_mutex_unlock(&jobsMutex);
+
+    runBatch(0);
+
+    pthread_mutex_lock(&jobsMutex);
+    while (busyWorkers > 0)
+        pthread_cond_wait(&jobsDone, &jobsMutex);
+    pthread_mutex_unlock(&jobsMutex);
+}
@@ -0,0 +1,17 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#define JOBS_MAX_THREADS 64
+
+// fn is called with a [begin, end) range and the index of the worker running it.
+// Ranges are always multiples of the grain (except the last one), so begin / grain
+// identifies a chunk independently of how many workers there are.
+typedef void (*JobFn)(void *ctx, int begin, int end, int worker);
+
+void jobs_init(int threads);
+void jobs_shutdown();
+int jobs_thread_count();
+int jobs_hardware_threads();
+void jobs_parallel_for(int count, int grain, JobFn fn, void *ctx);
+
+#endif
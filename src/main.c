@@ -1,12 +1,25 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <cglm/cglm.h>
 
 #include "renderer.h"
+#include "physics.h"
+#include "checkpoint.h"
+#include "assets.h"
+#include "shaders.h"
+#include "granular.h"
+#include "gpuphysics.h"
 
 #define CAMERA_SPEED 2.5
 #define CAMERA_SENSITIVITY 0.1f
+#define PHYSICS_DT (1.0 / 120.0)
+#define MAX_STEPS_PER_FRAME 8
+#define CHECKPOINT_PATH "checkpoint.bin"
+// the spring-dashpot contacts of the compute backend need smaller steps than the rigid bodies
+#define GPU_SUBSTEPS 8
 
 vec3 cameraPos = (vec3){0.0f, 0.0f, 3.0f};
 vec3 cameraFront = (vec3){0.0f, 0.0f, -1.0f};
@@ -19,6 +32,19 @@ float lastX = 0.0f;
 float lastY = 0.0f;
 float fov = 45.0f;
 
+float positions[][3] = {
+    {0.0f, 0.0f, 0.0f},
+    {2.0f, 5.0f, -15.0f},
+    {-1.5f, -2.2f, -2.5f},
+    {-3.8f, -2.0f, -12.3f},
+    {2.4f, -0.4f, -3.5f},
+    {-1.7f, 3.0f, -7.5f},
+    {1.3f, -2.0f, -2.5f},
+    {1.5f, 2.0f, -2.5},
+    {1.5f, 0.2f, -1.5f},
+    {-1.3f, 1.0f, -1.5f}
+};
+
 void sizeCallback(GLFWwindow* window, int width, int height) {
     glViewport(0, 0, width, height);
 }
@@ -49,6 +75,20 @@ void processInput(GLFWwindow *window, double deltaTime) {
     }
 }
 
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action != GLFW_PRESS)
+        return;
+    if (key == GLFW_KEY_F5 && checkpoint_save(CHECKPOINT_PATH)) {
+        printf("Saved step %llu to %s (%.3f ms)\n", physicsStats.step, CHECKPOINT_PATH, checkpointStats.snapshotTime * 1000.0);
+    }
+    if (key == GLFW_KEY_F9 && checkpoint_load(CHECKPOINT_PATH)) {
+        renderer_invalidate_bodies();
+        printf("Restored step %llu from %s\n", physicsStats.step, CHECKPOINT_PATH);
+    }
+    if (key == GLFW_KEY_F3)
+        printf("Occlusion culling %s\n", renderer_toggle_occlusion() ? "on" : "off");
+}
+
 void mouseCallback(GLFWwindow* window, double x, double y) {
     if (firstMouse) {
         lastX = x;
@@ -81,8 +121,43 @@ void mouseCallback(GLFWwindow* window, double x, double y) {
     glm_vec3_normalize_to(direction, cameraFront);
 }
 
-int main()
+// Fills a box in front of the camera with spheres for the compute backend and draws them in
+// place of the bodies. Returns 0 if the context can't run it.
+int spawnGpuParticles(int count) {
+    GranularConfig config = granular_default_config();
+    float min[3] = {-4.0f, -3.0f, -14.0f}, max[3] = {4.0f, 13.0f, -6.0f};
+    memcpy(config.boundsMin, min, sizeof(min));
+    memcpy(config.boundsMax, max, sizeof(max));
+    granular_init(config);
+    granular_reserve(count);
+    int side = 15;
+    for (int i = 0; i < count; i++) {
+        float position[3] = {
+            min[0] + 0.3f + 0.5f * (i % side) + 0.02f * physics_random(),
+            min[1] + 0.3f + 0.5f * (i / (side * side)),
+            min[2] + 0.3f + 0.5f * (i / side % side) + 0.02f * physics_random()
+        };
+        float velocity[3] = {0.0f, 0.0f, 0.0f};
+        granular_add(position, velocity, 0.2f);
+    }
+    if (!gpuphysics_init(renderer_material_count())) {
+        granular_shutdown();
+        return 0;
+    }
+    gpuphysics_upload();
+    renderer_use_instances(gpuphysics_instance_buffer(), count);
+    return 1;
+}
+
+int main(int argc, char **argv)
 {
+    // --gpu N simulates N spheres with the compute backend instead of the bodies
+    int gpuParticles = 0;
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--gpu") == 0)
+            gpuParticles = atoi(argv[i + 1]);
+    }
+
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4.6);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4.6);
@@ -98,6 +173,7 @@ int main()
     
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     glfwSetCursorPosCallback(window, mouseCallback);
+    glfwSetKeyCallback(window, keyCallback);
     glfwMakeContextCurrent(window);
 
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
@@ -110,11 +186,31 @@ int main()
 
     glfwSetFramebufferSizeCallback(window, sizeCallback);
 
+    // PHYSICS INIT
+    physics_init(physics_default_config());
+    for (int i = 0; i < 10; i++) {
+        float velocity[3] = {0.0f, 0.0f, 0.0f};
+        int body = physics_add_body(positions[i], velocity, 0.5f, 1.0f, SHAPE_BOX);
+        // each cube starts tilted 20 degrees more than the last
+        vec3 axis = {1.0f, 0.3f, 0.5f};
+        versor q;
+        glm_vec3_normalize(axis);
+        glm_quatv(q, glm_rad(20.0f * i), axis);
+        physics_set_orientation(body, q);
+        physics_set_material(body, i % renderer_material_count());
+    }
+
     // RENDERER INIT
+    assets_init();
+    shaders_watch(SHADERS_DIR);
     renderer_init(window);
+    if (gpuParticles > 0 && !spawnGpuParticles(gpuParticles))
+        gpuParticles = 0;
 
     double deltaTime = 0;
     double lastFrame = glfwGetTime();
+    double accumulator = 0;
+    int frames = 0;
     while(!glfwWindowShouldClose(window))
     {
         double current = glfwGetTime();
@@ -125,12 +221,56 @@ int main()
         glfwPollEvents();
         processInput(window, deltaTime);
 
+        // PHYSICS STEP
+        accumulator += deltaTime;
+        int steps = 0;
+        while (accumulator >= PHYSICS_DT && steps < MAX_STEPS_PER_FRAME) {
+            if (gpuParticles) {
+                for (int s = 0; s < GPU_SUBSTEPS; s++) {
+                    gpuphysics_step(PHYSICS_DT / GPU_SUBSTEPS);
+                }
+            }
+            else {
+                physics_step(PHYSICS_DT);
+            }
+            accumulator -= PHYSICS_DT;
+            steps++;
+        }
+        if (steps == MAX_STEPS_PER_FRAME)
+            accumulator = 0;
+
         // RENDERER RENDER
         renderer_render(deltaTime, cameraPos, cameraFront, cameraUp);
 
         glfwSwapBuffers(window);
+        // glfw's clock starts at glfwInit
+        if (frames++ == 0)
+            printf("First frame %.2f ms after startup, %d assets still loading\n", glfwGetTime() * 1000.0, assets_pending());
     }
   
+    checkpoint_wait();
+    assets_shutdown();
+    shaders_unwatch();
+    printf("step arenas peaked at %llu KB with %d heap allocations, frame arena at %zu KB with %d\n",
+           physicsStats.arenaHighWater / 1024, physicsStats.arenaAllocations, frameArena.highWater / 1024, frameArena.heapAllocations);
+    if (gpuParticles) {
+        gpuphysics_shutdown();
+        granular_shutdown();
+    }
+    if (rendererStats.timedFrames)
+        printf("GPU per frame: shadow depth pass %.3f ms, main pass %.3f ms over %d frames\n",
+               rendererStats.shadowTime * 1000.0 / rendererStats.timedFrames,
+               rendererStats.mainTime * 1000.0 / rendererStats.timedFrames, rendererStats.timedFrames);
+    if (rendererStats.culledFrames)
+        printf("Culled %.1f%% of instances per frame on average, culling and depth pyramid %.3f ms\n",
+               rendererStats.culledSum / rendererStats.culledFrames,
+               rendererStats.timedFrames ? rendererStats.cullTime * 1000.0 / rendererStats.timedFrames : 0.0);
+    if (rendererStats.uploadedFrames)
+        printf("Uploaded %.1f KB of instances per frame on average in %.1f ranges\n",
+               rendererStats.uploadedBytes / 1024.0 / rendererStats.uploadedFrames,
+               (double)rendererStats.uploadedRanges / rendererStats.uploadedFrames);
+    physics_shutdown();
+    arena_free(&frameArena);
     glfwTerminate();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,657 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mesh.h"
+#include "sdf.h"
+
+#define SAH_BINS 12
+// past this depth nodes split at the median, which bounds the depth of the tree
+#define SAH_MAX_DEPTH 32
+#define QUERY_STACK_SIZE 72
+#define PLY_MAX_ELEMENTS 8
+#define PLY_MAX_PROPERTIES 16
+
+enum {
+    PLY_CHAR,
+    PLY_UCHAR,
+    PLY_SHORT,
+    PLY_USHORT,
+    PLY_INT,
+    PLY_UINT,
+    PLY_FLOAT,
+    PLY_DOUBLE
+};
+
+typedef struct {
+    float *vertices;
+    int vertexCount;
+    int vertexCapacity;
+    int *indices;
+    int triangleCount;
+    int triangleCapacity;
+} MeshData;
+
+typedef struct {
+    char name[32];
+    int type;
+    // type of the item count for list properties, -1 otherwise
+    int countType;
+} PlyProperty;
+
+typedef struct {
+    char name[32];
+    int count;
+    PlyProperty properties[PLY_MAX_PROPERTIES];
+    int propertyCount;
+} PlyElement;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int ascii;
+} PlyReader;
+
+typedef struct {
+    float min[3];
+    float max[3];
+    int count;
+} Bin;
+
+typedef struct {
+    float (*bounds)[6];
+    float (*centroids)[3];
+    int *order;
+    BvhNode *nodes;
+    int nodeCount;
+} Builder;
+
+typedef struct {
+    unsigned int version;
+    unsigned long long sourceHash;
+    int vertexCount;
+    int triangleCount;
+    int nodeCount;
+} CacheHeader;
+
+Meshes meshes;
+
+static const char *plyTypeNames[][2] = {
+    {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+    {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}
+};
+static const int plyTypeSizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+static unsigned long long hashBytes(const unsigned char *data, size_t size) {
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static char *readFile(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = length >= 0 ? malloc(length + 1) : NULL;
+    if (data && fread(data, 1, length, f) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (!data)
+        return NULL;
+    data[length] = '\0';
+    *size = length;
+    return data;
+}
+
+static void addVertex(MeshData *d, float x, float y, float z) {
+    if (d->vertexCount == d->vertexCapacity) {
+        d->vertexCapacity = d->vertexCapacity ? d->vertexCapacity * 2 : 256;
+        d->vertices = realloc(d->vertices, d->vertexCapacity * 3 * sizeof(float));
+    }
+    float *v = &d->vertices[d->vertexCount++ * 3];
+    v[0] = x;
+    v[1] = y;
+    v[2] = z;
+}
+
+static void addTriangle(MeshData *d, int a, int b, int c) {
+    if (d->triangleCount == d->triangleCapacity) {
+        d->triangleCapacity = d->triangleCapacity ? d->triangleCapacity * 2 : 256;
+        d->indices = realloc(d->indices, d->triangleCapacity * 3 * sizeof(int));
+    }
+    int *t = &d->indices[d->triangleCount++ * 3];
+    t[0] = a;
+    t[1] = b;
+    t[2] = c;
+}
+
+// Polygons are split into fans; face indices may be negative, counting back from the last vertex.
+static int parseObj(const char *text, MeshData *d) {
+    const char *line = text;
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line);
+
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+            char *p;
+            float x = strtof(line + 2, &p);
+            float y = strtof(p, &p);
+            float z = strtof(p, &p);
+            addVertex(d, x, y, z);
+        }
+        else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+            const char *p = line + 1;
+            int first = -1, previous = -1, n = 0;
+            while (p < end) {
+                while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                    p++;
+                if (p == end)
+                    break;
+                char *next;
+                long index = strtol(p, &next, 10);
+                if (next == p)
+                    return 0;
+                // texture and normal indices after the slashes
+                while (next < end && !isspace((unsigned char)*next))
+                    next++;
+                p = next;
+
+                int v = index < 0 ? d->vertexCount + (int)index : (int)index - 1;
+                if (v < 0 || v >= d->vertexCount)
+                    return 0;
+                if (n == 0)
+                    first = v;
+                else if (n >= 2)
+                    addTriangle(d, first, previous, v);
+                previous = v;
+                n++;
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+static int plyType(const char *name) {
+    for (int t = 0; t <= PLY_DOUBLE; t++) {
+        if (strcmp(name, plyTypeNames[t][0]) == 0 || strcmp(name, plyTypeNames[t][1]) == 0)
+            return t;
+    }
+    return -1;
+}
+
+// Binary values are read as little endian, which is what the host is assumed to be.
+static int readPlyValue(PlyReader *r, int type, double *out) {
+    if (r->ascii) {
+        char *next;
+        *out = strtod(r->p, &next);
+        if (next == r->p)
+            return 0;
+        r->p = next;
+        return 1;
+    }
+    if (r->end - r->p < plyTypeSizes[type])
+        return 0;
+    union {
+        signed char c;
+        unsigned char uc;
+        short s;
+        unsigned short us;
+        int i;
+        unsigned int ui;
+        float f;
+        double d;
+    } value;
+    memcpy(&value, r->p, plyTypeSizes[type]);
+    r->p += plyTypeSizes[type];
+    switch (type) {
+        case PLY_CHAR: *out = value.c; break;
+        case PLY_UCHAR: *out = value.uc; break;
+        case PLY_SHORT: *out = value.s; break;
+        case PLY_USHORT: *out = value.us; break;
+        case PLY_INT: *out = value.i; break;
+        case PLY_UINT: *out = value.ui; break;
+        case PLY_FLOAT: *out = value.f; break;
+        default: *out = value.d; break;
+    }
+    return 1;
+}
+
+// ascii and binary_little_endian files. Vertices take their x, y and z properties and faces
+// their vertex_indices list; other elements and properties are skipped.
+static int parsePly(const char *text, size_t size, MeshData *d) {
+    if (strncmp(text, "ply", 3) != 0)
+        return 0;
+    PlyElement elements[PLY_MAX_ELEMENTS];
+    int elementCount = 0;
+    int ascii = -1;
+
+    const char *line = text;
+    const char *end = text + size;
+    for (;;) {
+        const char *lineEnd = memchr(line, '\n', end - line);
+        if (!lineEnd)
+            return 0;
+        char buffer[256];
+        int length = lineEnd - line < 255 ? lineEnd - line : 255;
+        memcpy(buffer, line, length);
+        buffer[length] = '\0';
+        line = lineEnd + 1;
+
+        char word[32], a[32], b[32], c[32];
+        int count;
+        if (strncmp(buffer, "end_header", 10) == 0)
+            break;
+        if (sscanf(buffer, "format %31s", word) == 1) {
+            if (strcmp(word, "ascii") == 0)
+                ascii = 1;
+            else if (strcmp(word, "binary_little_endian") == 0)
+                ascii = 0;
+            else
+                return 0;
+        }
+        else if (sscanf(buffer, "element %31s %d", word, &count) == 2) {
+            if (elementCount == PLY_MAX_ELEMENTS)
+                return 0;
+            PlyElement *e = &elements[elementCount++];
+            strcpy(e->name, word);
+            e->count = count;
+            e->propertyCount = 0;
+        }
+        else if (sscanf(buffer, "property list %31s %31s %31s", a, b, c) == 3) {
+            if (!elementCount || elements[elementCount - 1].propertyCount == PLY_MAX_PROPERTIES)
+                return 0;
+            PlyElement *e = &elements[elementCount - 1];
+            PlyProperty *p = &e->properties[e->propertyCount++];
+            strcpy(p->name, c);
+            p->countType = plyType(a);
+            p->type = plyType(b);
+            if (p->countType < 0 || p->type < 0)
+                return 0;
+        }
+        else if (sscanf(buffer, "property %31s %31s", a, b) == 2) {
+            if (!elementCount || elements[elementCount - 1].propertyCount == PLY_MAX_PROPERTIES)
+                return 0;
+            PlyElement *e = &elements[elementCount - 1];
+            PlyProperty *p = &e->properties[e->propertyCount++];
+            strcpy(p->name, b);
+            p->countType = -1;
+            p->type = plyType(a);
+            if (p->type < 0)
+                return 0;
+        }
+    }
+    if (ascii < 0)
+        return 0;
+
+    PlyReader r = {line, end, ascii};
+    for (int e = 0; e < elementCount; e++) {
+        PlyElement *element = &elements[e];
+        int isVertex = strcmp(element->name, "vertex") == 0;
+        int isFace = strcmp(element->name, "face") == 0;
+        for (int item = 0; item < element->count; item++) {
+            float position[3] = {0.0f, 0.0f, 0.0f};
+            for (int k = 0; k < element->propertyCount; k++) {
+                PlyProperty *p = &element->properties[k];
+                double value;
+                if (p->countType < 0) {
+                    if (!readPlyValue(&r, p->type, &value))
+                        return 0;
+                    if (isVertex && p->name[0] >= 'x' && p->name[0] <= 'z' && p->name[1] == '\0')
+                        position[p->name[0] - 'x'] = (float)value;
+                    continue;
+                }
+
+                double listCount;
+                if (!readPlyValue(&r, p->countType, &listCount))
+                    return 0;
+                int polygon = isFace && (strcmp(p->name, "vertex_indices") == 0 || strcmp(p->name, "vertex_index") == 0);
+                int first = -1, previous = -1;
+                for (int n = 0; n < (int)listCount; n++) {
+                    if (!readPlyValue(&r, p->type, &value))
+                        return 0;
+                    int v = (int)value;
+                    if (!polygon)
+                        continue;
+                    if (v < 0 || v >= d->vertexCount)
+                        return 0;
+                    if (n == 0)
+                        first = v;
+                    else if (n >= 2)
+                        addTriangle(d, first, previous, v);
+                    previous = v;
+                }
+            }
+            if (isVertex)
+                addVertex(d, position[0], position[1], position[2]);
+        }
+    }
+    return 1;
+}
+
+static float surfaceArea(const float min[3], const float max[3]) {
+    float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static void emptyBounds(float min[3], float max[3]) {
+    for (int k = 0; k < 3; k++) {
+        min[k] = INFINITY;
+        max[k] = -INFINITY;
+    }
+}
+
+static void growBounds(float min[3], float max[3], const float lo[3], const float hi[3]) {
+    for (int k = 0; k < 3; k++) {
+        min[k] = fminf(min[k], lo[k]);
+        max[k] = fmaxf(max[k], hi[k]);
+    }
+}
+
+static int binOf(float centroid, float low, float scale) {
+    int bin = (int)((centroid - low) * scale);
+    return bin < SAH_BINS - 1 ? bin : SAH_BINS - 1;
+}
+
+// Nodes are laid out depth first, so the left child always follows its parent.
+static int buildNode(Builder *b, int first, int count, int depth) {
+    int index = b->nodeCount++;
+    BvhNode *node = &b->nodes[index];
+    float centroidMin[3], centroidMax[3];
+    emptyBounds(node->min, node->max);
+    emptyBounds(centroidMin, centroidMax);
+    for (int k = first; k < first + count; k++) {
+        int t = b->order[k];
+        growBounds(node->min, node->max, b->bounds[t], b->bounds[t] + 3);
+        growBounds(centroidMin, centroidMax, b->centroids[t], b->centroids[t]);
+    }
+    node->offset = first;
+    node->count = count;
+    if (count == 1)
+        return index;
+
+    // binned surface area heuristic, with a node visit costing about as much as a triangle test
+    float nodeArea = surfaceArea(node->min, node->max);
+    float bestCost = INFINITY;
+    int bestAxis = -1, bestSplit = 0;
+    for (int axis = 0; axis < 3 && depth < SAH_MAX_DEPTH; axis++) {
+        float extent = centroidMax[axis] - centroidMin[axis];
+        if (extent <= 0.0f)
+            continue;
+        float scale = SAH_BINS / extent;
+        Bin bins[SAH_BINS];
+        for (int i = 0; i < SAH_BINS; i++) {
+            emptyBounds(bins[i].min, bins[i].max);
+            bins[i].count = 0;
+        }
+        for (int k = first; k < first + count; k++) {
+            int t = b->order[k];
+            Bin *bin = &bins[binOf(b->centroids[t][axis], centroidMin[axis], scale)];
+            growBounds(bin->min, bin->max, b->bounds[t], b->bounds[t] + 3);
+            bin->count++;
+        }
+
+        float rightArea[SAH_BINS];
+        int rightCount[SAH_BINS];
+        float min[3], max[3];
+        emptyBounds(min, max);
+        int n = 0;
+        for (int i = SAH_BINS - 1; i > 0; i--) {
+            growBounds(min, max, bins[i].min, bins[i].max);
+            n += bins[i].count;
+            rightArea[i] = n ? surfaceArea(min, max) : 0.0f;
+            rightCount[i] = n;
+        }
+        emptyBounds(min, max);
+        n = 0;
+        for (int i = 0; i < SAH_BINS - 1; i++) {
+            growBounds(min, max, bins[i].min, bins[i].max);
+            n += bins[i].count;
+            if (!n || !rightCount[i + 1])
+                continue;
+            float cost = surfaceArea(min, max) * n + rightArea[i + 1] * rightCount[i + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+    if (count <= MESH_LEAF_SIZE && (bestAxis < 0 || nodeArea + bestCost >= nodeArea * count))
+        return index;
+
+    int mid = first + count / 2;
+    if (bestAxis >= 0) {
+        float scale = SAH_BINS / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+        int left = first, right = first + count - 1;
+        while (left <= right) {
+            int t = b->order[left];
+            if (binOf(b->centroids[t][bestAxis], centroidMin[bestAxis], scale) <= bestSplit) {
+                left++;
+            }
+            else {
+                b->order[left] = b->order[right];
+                b->order[right--] = t;
+            }
+        }
+        if (left > first && left < first + count)
+            mid = left;
+    }
+
+    buildNode(b, first, mid - first, depth + 1);
+    int right = buildNode(b, mid, first + count - mid, depth + 1);
+    node = &b->nodes[index];
+    node->offset = right;
+    node->count = 0;
+    return index;
+}
+
+// Builds the BVH and puts the triangles in leaf order.
+static void buildBvh(TriangleMesh *mesh) {
+    int n = mesh->triangleCount;
+    Builder b = {
+        .bounds = malloc(n * sizeof(*b.bounds)),
+        .centroids = malloc(n * sizeof(*b.centroids)),
+        .order = malloc(n * sizeof(int)),
+        .nodes = malloc((2 * n - 1) * sizeof(BvhNode)),
+        .nodeCount = 0
+    };
+    for (int t = 0; t < n; t++) {
+        float *bounds = b.bounds[t];
+        emptyBounds(bounds, bounds + 3);
+        for (int k = 0; k < 3; k++) {
+            const float *v = &mesh->vertices[mesh->indices[t * 3 + k] * 3];
+            growBounds(bounds, bounds + 3, v, v);
+        }
+        for (int k = 0; k < 3; k++) {
+            b.centroids[t][k] = 0.5f * (bounds[k] + bounds[3 + k]);
+        }
+        b.order[t] = t;
+    }
+    buildNode(&b, 0, n, 0);
+
+    int *indices = malloc(n * 3 * sizeof(int));
+    for (int k = 0; k < n; k++) {
+        memcpy(&indices[k * 3], &mesh->indices[b.order[k] * 3], 3 * sizeof(int));
+    }
+    free(mesh->indices);
+    mesh->indices = indices;
+    mesh->nodes = realloc(b.nodes, b.nodeCount * sizeof(BvhNode));
+    mesh->nodeCount = b.nodeCount;
+    free(b.bounds);
+    free(b.centroids);
+    free(b.order);
+}
+
+static int readCache(const char *path, unsigned long long sourceHash, TriangleMesh *mesh) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    char magic[8];
+    CacheHeader header;
+    int ok = fread(magic, 8, 1, f) == 1 && memcmp(magic, MESH_CACHE_MAGIC, 8) == 0
+          && fread(&header, sizeof(header), 1, f) == 1
+          && header.version == MESH_CACHE_VERSION && header.sourceHash == sourceHash
+          && header.vertexCount > 0 && header.triangleCount > 0
+          && header.nodeCount > 0 && header.nodeCount < 2 * header.triangleCount;
+    if (ok) {
+        mesh->vertexCount = header.vertexCount;
+        mesh->triangleCount = header.triangleCount;
+        mesh->nodeCount = header.nodeCount;
+        mesh->vertices = malloc(header.vertexCount * 3 * sizeof(float));
+        mesh->indices = malloc(header.triangleCount * 3 * sizeof(int));
+        mesh->nodes = malloc(header.nodeCount * sizeof(BvhNode));
+        ok = fread(mesh->vertices, 3 * sizeof(float), header.vertexCount, f) == (size_t)header.vertexCount
+          && fread(mesh->indices, 3 * sizeof(int), header.triangleCount, f) == (size_t)header.triangleCount
+          && fread(mesh->nodes, sizeof(BvhNode), header.nodeCount, f) == (size_t)header.nodeCount;
+        if (!ok) {
+            free(mesh->vertices);
+            free(mesh->indices);
+            free(mesh->nodes);
+            memset(mesh, 0, sizeof(*mesh));
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+static void writeCache(const char *path, unsigned long long sourceHash, const TriangleMesh *mesh) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Failed to write BVH cache %s\n", path);
+        return;
+    }
+    CacheHeader header = {MESH_CACHE_VERSION, sourceHash, mesh->vertexCount, mesh->triangleCount, mesh->nodeCount};
+    int ok = fwrite(MESH_CACHE_MAGIC, 8, 1, f) == 1
+          && fwrite(&header, sizeof(header), 1, f) == 1
+          && fwrite(mesh->vertices, 3 * sizeof(float), mesh->vertexCount, f) == (size_t)mesh->vertexCount
+          && fwrite(mesh->indices, 3 * sizeof(int), mesh->triangleCount, f) == (size_t)mesh->triangleCount
+          && fwrite(mesh->nodes, sizeof(BvhNode), mesh->nodeCount, f) == (size_t)mesh->nodeCount;
+    fclose(f);
+    if (!ok) {
+        printf("Failed to write BVH cache %s\n", path);
+        remove(path);
+    }
+}
+
+static int addMesh(TriangleMesh *mesh) {
+    if (meshes.count == meshes.capacity) {
+        meshes.capacity = meshes.capacity ? meshes.capacity * 2 : 4;
+        meshes.items = realloc(meshes.items, meshes.capacity * sizeof(TriangleMesh));
+    }
+    mesh->firstTriangle = meshes.triangleCount;
+    meshes.triangleCount += mesh->triangleCount;
+    meshes.items[meshes.count] = *mesh;
+    return meshes.count++;
+}
+
+int mesh_add(const float *vertices, int vertexCount, const int *indices, int triangleCount) {
+    if (triangleCount <= 0)
+        return -1;
+    for (int k = 0; k < triangleCount * 3; k++) {
+        if (indices[k] < 0 || indices[k] >= vertexCount)
+            return -1;
+    }
+    TriangleMesh mesh = {0};
+    mesh.vertexCount = vertexCount;
+    mesh.triangleCount = triangleCount;
+    mesh.vertices = malloc(vertexCount * 3 * sizeof(float));
+    mesh.indices = malloc(triangleCount * 3 * sizeof(int));
+    memcpy(mesh.vertices, vertices, vertexCount * 3 * sizeof(float));
+    memcpy(mesh.indices, indices, triangleCount * 3 * sizeof(int));
+    buildBvh(&mesh);
+    return addMesh(&mesh);
+}
+
+int mesh_load(const char *path) {
+    size_t size;
+    char *text = readFile(path, &size);
+    if (!text) {
+        printf("Failed to open mesh %s\n", path);
+        return -1;
+    }
+    unsigned long long sourceHash = hashBytes((const unsigned char*)text, size);
+    char *cachePath = malloc(strlen(path) + 5);
+    sprintf(cachePath, "%s.bvh", path);
+
+    TriangleMesh mesh = {0};
+    if (readCache(cachePath, sourceHash, &mesh)) {
+        mesh.cached = 1;
+        free(text);
+        free(cachePath);
+        return addMesh(&mesh);
+    }
+
+    MeshData data = {0};
+    const char *extension = strrchr(path, '.');
+    int ok = extension && strcmp(extension, ".ply") == 0 ? parsePly(text, size, &data) : parseObj(text, &data);
+    free(text);
+    if (!ok || !data.triangleCount) {
+        printf("Failed to parse mesh %s\n", path);
+        free(data.vertices);
+        free(data.indices);
+        free(cachePath);
+        return -1;
+    }
+    mesh.vertices = data.vertices;
+    mesh.vertexCount = data.vertexCount;
+    mesh.indices = data.indices;
+    mesh.triangleCount = data.triangleCount;
+    buildBvh(&mesh);
+    writeCache(cachePath, sourceHash, &mesh);
+    free(cachePath);
+    return addMesh(&mesh);
+}
+
+void meshes_clear() {
+    for (int m = 0; m < meshes.count; m++) {
+        free(meshes.items[m].vertices);
+        free(meshes.items[m].indices);
+        free(meshes.items[m].nodes);
+        sdf_free(meshes.items[m].sdf);
+    }
+    free(meshes.items);
+    memset(&meshes, 0, sizeof(meshes));
+}
+
+int mesh_query(const TriangleMesh *mesh, const float min[3], const float max[3], int *triangles, int capacity) {
+    int stack[QUERY_STACK_SIZE];
+    int top = 0, found = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int index = stack[--top];
+        const BvhNode *node = &mesh->nodes[index];
+        if (node->min[0] > max[0] || node->max[0] < min[0]
+            || node->min[1] > max[1] || node->max[1] < min[1]
+            || node->min[2] > max[2] || node->max[2] < min[2])
+            continue;
+        if (node->count) {
+            for (int t = node->offset; t < node->offset + node->count; t++) {
+                if (found < capacity)
+                    triangles[found] = t;
+                found++;
+            }
+            continue;
+        }
+        stack[top++] = node->offset;
+        stack[top++] = index + 1;
+    }
+    return found;
+}
+
+void mesh_triangle(const TriangleMesh *mesh, int triangle, float out[9]) {
+    const int *t = &mesh->indices[triangle * 3];
+    for (int k = 0; k < 3; k++) {
+        memcpy(&out[k * 3], &mesh->vertices[t[k] * 3], 3 * sizeof(float));
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef MESH_H
+#define MESH_H
+
+#define MESH_CACHE_MAGIC "CSIMBVH1"
+#define MESH_CACHE_VERSION 1
+// triangles per BVH leaf at most; the SAH may stop splitting earlier
+#define MESH_LEAF_SIZE 4
+
+// 32 bytes, two to a cache line. Inner nodes have count 0, their left child right after them
+// and the right one at offset. Leaves hold count triangles starting at triangle offset.
+typedef struct {
+    float min[3];
+    float max[3];
+    int offset;
+    int count;
+} BvhNode;
+
+_Static_assert(sizeof(BvhNode) == 32, "BvhNode must stay 32 bytes");
+
+// A static triangle mesh collider. Triangles are stored in BVH leaf order.
+typedef struct {
+    float *vertices;
+    int vertexCount;
+    int *indices;
+    int triangleCount;
+    BvhNode *nodes;
+    int nodeCount;
+    // index of the first triangle among all meshes, so contacts get unique keys
+    int firstTriangle;
+    // the BVH came from the cache file instead of being built
+    int cached;
+    // baked signed distance field spheres collide with instead of the triangles, or NULL
+    struct SdfField *sdf;
+} TriangleMesh;
+
+typedef struct {
+    TriangleMesh *items;
+    int count;
+    int capacity;
+    int triangleCount;
+} Meshes;
+
+// Meshes are static world geometry that outlives physics_init, so a restored checkpoint
+// collides against the same meshes. Checkpoints don't save them; load them in the same order.
+extern Meshes meshes;
+
+// Loads an OBJ or PLY file. The BVH is read from path.bvh when that was built from the same
+// file contents, otherwise built and written there. Returns the mesh index or -1.
+int mesh_load(const char *path);
+// Builds a mesh from triangle indices into xyz vertices. Returns the mesh index or -1.
+int mesh_add(const float *vertices, int vertexCount, const int *indices, int triangleCount);
+void meshes_clear();
+
+// Triangles in leaves whose bounds overlap the box. Returns how many there are, of which the
+// first capacity are written to triangles.
+int mesh_query(const TriangleMesh *mesh, const float min[3], const float max[3], int *triangles, int capacity);
+void mesh_triangle(const TriangleMesh *mesh, int triangle, float out[9]);
+
+#endif
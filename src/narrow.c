@@ -0,0 +1,1176 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "narrow.h"
+
+#define GJK_MAX_ITERATIONS 32
+// GJK stops once a new support point gets less than this fraction closer
+#define GJK_TOLERANCE 1e-5f
+#define EPA_MAX_VERTICES 64
+#define EPA_MAX_FACES 128
+#define EPA_TOLERANCE 1e-4f
+// a face axis beats an edge axis unless the edge one is clearly shallower, so resting
+// boxes keep face contacts with stable points
+#define SAT_RELATIVE_TOLERANCE 0.95f
+#define SAT_ABSOLUTE_TOLERANCE 0.001f
+// a quad clipped against the four sides of a face has at most eight vertices
+#define CLIP_MAX_VERTICES 8
+
+typedef struct {
+    float w[3];
+    float a[3], b[3];
+    int indexA, indexB;
+} SimplexVertex;
+
+typedef struct {
+    SimplexVertex v[4];
+    float weight[4];
+    int count;
+} Simplex;
+
+typedef struct {
+    int v[3];
+    float n[3];
+    float dist;
+} EpaFace;
+
+typedef struct {
+    float p[3];
+    int id;
+} ClipVertex;
+
+PairSimplexCache pairSimplexCache;
+
+static float dot(const float a[3], const float b[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void sub(const float a[3], const float b[3], float out[3]) {
+    out[0] = a[0] - b[0];
+    out[1] = a[1] - b[1];
+    out[2] = a[2] - b[2];
+}
+
+static void cross(const float a[3], const float b[3], float out[3]) {
+    float x = a[1] * b[2] - a[2] * b[1];
+    float y = a[2] * b[0] - a[0] * b[2];
+    float z = a[0] * b[1] - a[1] * b[0];
+    out[0] = x;
+    out[1] = y;
+    out[2] = z;
+}
+
+// out = a + b * s
+static void addScaled(const float a[3], const float b[3], float s, float out[3]) {
+    out[0] = a[0] + b[0] * s;
+    out[1] = a[1] + b[1] * s;
+    out[2] = a[2] + b[2] * s;
+}
+
+static void axisOf(const ConvexShape *s, int axis, float out[3]) {
+    out[0] = s->rotation[axis];
+    out[1] = s->rotation[3 + axis];
+    out[2] = s->rotation[6 + axis];
+}
+
+static void toLocal(const ConvexShape *s, const float d[3], float out[3]) {
+    const float *r = s->rotation;
+    for (int k = 0; k < 3; k++) {
+        out[k] = r[k] * d[0] + r[3 + k] * d[1] + r[6 + k] * d[2];
+    }
+}
+
+static void toWorld(const ConvexShape *s, const float local[3], float out[3]) {
+    const float *r = s->rotation;
+    for (int k = 0; k < 3; k++) {
+        out[k] = s->position[k] + r[k * 3] * local[0] + r[k * 3 + 1] * local[1] + r[k * 3 + 2] * local[2];
+    }
+}
+
+static float margin(const ConvexShape *s) {
+    return s->type == SHAPE_SPHERE ? s->radius : 0.0f;
+}
+
+// Box vertex indices have one bit per axis set for the positive side.
+static void localVertex(const ConvexShape *s, int index, float out[3]) {
+    switch (s->type) {
+    case SHAPE_BOX:
+        for (int k = 0; k < 3; k++) {
+            out[k] = index & (1 << k) ? s->halfExtents[k] : -s->halfExtents[k];
+        }
+        break;
+    case SHAPE_HULL:
+        memcpy(out, s->vertices + index * 3, 3 * sizeof(float));
+        break;
+    default:
+        out[0] = out[1] = out[2] = 0.0f;
+        break;
+    }
+}
+
+static int supportIndex(const ConvexShape *s, const float d[3]) {
+    float l[3];
+    int best = 0;
+    switch (s->type) {
+    case SHAPE_BOX:
+        toLocal(s, d, l);
+        return (l[0] > 0.0f) | (l[1] > 0.0f) << 1 | (l[2] > 0.0f) << 2;
+    case SHAPE_HULL: {
+        toLocal(s, d, l);
+        float bestDot = -INFINITY;
+        for (int i = 0; i < s->vertexCount; i++) {
+            float p = dot(s->vertices + i * 3, l);
+            if (p > bestDot) {
+                bestDot = p;
+                best = i;
+            }
+        }
+        return best;
+    }
+    default:
+        return 0;
+    }
+}
+
+static void fillVertex(const ConvexShape *a, const ConvexShape *b, SimplexVertex *v) {
+    float local[3];
+    localVertex(a, v->indexA, local);
+    toWorld(a, local, v->a);
+    localVertex(b, v->indexB, local);
+    toWorld(b, local, v->b);
+    sub(v->a, v->b, v->w);
+}
+
+// Support point of the Minkowski difference a - b in direction d.
+static void support(const ConvexShape *a, const ConvexShape *b, const float d[3], SimplexVertex *v) {
+    float negative[3] = {-d[0], -d[1], -d[2]};
+    v->indexA = supportIndex(a, d);
+    v->indexB = supportIndex(b, negative);
+    fillVertex(a, b, v);
+}
+
+static void keep(Simplex *s, int count, const int *indices, const float *weights) {
+    SimplexVertex kept[4];
+    for (int i = 0; i < count; i++) {
+        kept[i] = s->v[indices[i]];
+    }
+    for (int i = 0; i < count; i++) {
+        s->v[i] = kept[i];
+        s->weight[i] = weights[i];
+    }
+    s->count = count;
+}
+
+static void solveSegment(Simplex *s, int i0, int i1) {
+    const float *a = s->v[i0].w;
+    const float *b = s->v[i1].w;
+    float ab[3];
+    sub(b, a, ab);
+    float len2 = dot(ab, ab);
+    float t = len2 > 0.0f ? -dot(a, ab) / len2 : 0.0f;
+    int indices[2] = {i0, i1};
+    if (t <= 0.0f) {
+        keep(s, 1, indices, (float[]){1.0f});
+    }
+    else if (t >= 1.0f) {
+        keep(s, 1, indices + 1, (float[]){1.0f});
+    }
+    else {
+        keep(s, 2, indices, (float[]){1.0f - t, t});
+    }
+}
+
+// Closest point of a triangle to the origin by Voronoi regions (Ericson, Real-Time
+// Collision Detection 5.1.5), keeping only the vertices of the closest feature.
+static void solveTriangle(Simplex *s, int i0, int i1, int i2) {
+    const float *a = s->v[i0].w;
+    const float *b = s->v[i1].w;
+    const float *c = s->v[i2].w;
+    float ab[3], ac[3];
+    sub(b, a, ab);
+    sub(c, a, ac);
+
+    float d1 = -dot(ab, a), d2 = -dot(ac, a);
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        keep(s, 1, (int[]){i0}, (float[]){1.0f});
+        return;
+    }
+    float d3 = -dot(ab, b), d4 = -dot(ac, b);
+    if (d3 >= 0.0f && d4 <= d3) {
+        keep(s, 1, (int[]){i1}, (float[]){1.0f});
+        return;
+    }
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        float t = d1 / (d1 - d3);
+        keep(s, 2, (int[]){i0, i1}, (float[]){1.0f - t, t});
+        return;
+    }
+    float d5 = -dot(ab, c), d6 = -dot(ac, c);
+    if (d6 >= 0.0f && d5 <= d6) {
+        keep(s, 1, (int[]){i2}, (float[]){1.0f});
+        return;
+    }
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        float t = d2 / (d2 - d6);
+        keep(s, 2, (int[]){i0, i2}, (float[]){1.0f - t, t});
+        return;
+    }
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        float t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        keep(s, 2, (int[]){i1, i2}, (float[]){1.0f - t, t});
+        return;
+    }
+    float denom = 1.0f / (va + vb + vc);
+    float v = vb * denom;
+    float w = vc * denom;
+    keep(s, 3, (int[]){i0, i1, i2}, (float[]){1.0f - v - w, v, w});
+}
+
+static void closestPoint(const Simplex *s, float out[3]) {
+    out[0] = out[1] = out[2] = 0.0f;
+    for (int i = 0; i < s->count; i++) {
+        addScaled(out, s->v[i].w, s->weight[i], out);
+    }
+}
+
+// Leaves the simplex at 4 vertices only when the tetrahedron contains the origin.
+static void solveTetrahedron(Simplex *s) {
+    static const int faces[4][4] = {{0, 1, 2, 3}, {0, 2, 3, 1}, {0, 3, 1, 2}, {1, 3, 2, 0}};
+    float ab[3], ac[3], ad[3], n[3];
+    sub(s->v[1].w, s->v[0].w, ab);
+    sub(s->v[2].w, s->v[0].w, ac);
+    sub(s->v[3].w, s->v[0].w, ad);
+    cross(ab, ac, n);
+    float volume = dot(n, ad);
+    // a flat tetrahedron can't enclose anything, drop the newest point
+    if (fabsf(volume) < 1e-12f) {
+        solveTriangle(s, 0, 1, 2);
+        return;
+    }
+
+    Simplex best = {0};
+    float bestDistance = INFINITY;
+    for (int f = 0; f < 4; f++) {
+        const float *a = s->v[faces[f][0]].w;
+        float e1[3], e2[3], e3[3];
+        sub(s->v[faces[f][1]].w, a, e1);
+        sub(s->v[faces[f][2]].w, a, e2);
+        sub(s->v[faces[f][3]].w, a, e3);
+        cross(e1, e2, n);
+        // the origin is outside this face when it is on the other side than the fourth vertex
+        if (-dot(n, a) * dot(n, e3) >= 0.0f)
+            continue;
+        Simplex candidate = *s;
+        solveTriangle(&candidate, faces[f][0], faces[f][1], faces[f][2]);
+        float p[3];
+        closestPoint(&candidate, p);
+        float distance = dot(p, p);
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            best = candidate;
+        }
+    }
+    if (bestDistance < INFINITY)
+        *s = best;
+}
+
+static void solveSimplex(Simplex *s) {
+    switch (s->count) {
+    case 1:
+        s->weight[0] = 1.0f;
+        break;
+    case 2:
+        solveSegment(s, 0, 1);
+        break;
+    case 3:
+        solveTriangle(s, 0, 1, 2);
+        break;
+    default:
+        solveTetrahedron(s);
+        break;
+    }
+}
+
+// GJK on the cores of the shapes. Returns 1 when they overlap, leaving the last simplex in s.
+static int gjk(const ConvexShape *a, const ConvexShape *b, SimplexCache *cache, Simplex *s) {
+    s->count = 0;
+    if (cache && cache->count) {
+        for (int i = 0; i < cache->count; i++) {
+            s->v[i].indexA = cache->indexA[i];
+            s->v[i].indexB = cache->indexB[i];
+            fillVertex(a, b, &s->v[i]);
+        }
+        s->count = cache->count;
+    }
+    else {
+        float d[3];
+        sub(b->position, a->position, d);
+        if (dot(d, d) < 1e-12f)
+            d[0] = 1.0f;
+        support(a, b, d, &s->v[0]);
+        s->count = 1;
+    }
+
+    int overlap = 0;
+    int iteration;
+    for (iteration = 0; iteration < GJK_MAX_ITERATIONS; iteration++) {
+        solveSimplex(s);
+        if (s->count == 4) {
+            overlap = 1;
+            break;
+        }
+        float v[3];
+        closestPoint(s, v);
+        float vv = dot(v, v);
+        if (vv < 1e-12f) {
+            overlap = 1;
+            break;
+        }
+
+        SimplexVertex w;
+        float d[3] = {-v[0], -v[1], -v[2]};
+        support(a, b, d, &w);
+        int duplicate = 0;
+        for (int i = 0; i < s->count; i++) {
+            duplicate |= s->v[i].indexA == w.indexA && s->v[i].indexB == w.indexB;
+        }
+        if (duplicate || vv - dot(v, w.w) <= GJK_TOLERANCE * vv)
+            break;
+        s->v[s->count++] = w;
+    }
+    if (iteration == GJK_MAX_ITERATIONS) {
+        solveSimplex(s);
+        overlap = s->count == 4;
+    }
+
+    if (cache) {
+        cache->count = s->count;
+        for (int i = 0; i < s->count; i++) {
+            cache->indexA[i] = s->v[i].indexA;
+            cache->indexB[i] = s->v[i].indexB;
+        }
+    }
+    return overlap;
+}
+
+static void witnessPoints(const Simplex *s, float pointA[3], float pointB[3]) {
+    pointA[0] = pointA[1] = pointA[2] = 0.0f;
+    pointB[0] = pointB[1] = pointB[2] = 0.0f;
+    for (int i = 0; i < s->count; i++) {
+        addScaled(pointA, s->v[i].a, s->weight[i], pointA);
+        addScaled(pointB, s->v[i].b, s->weight[i], pointB);
+    }
+}
+
+void narrow_body_shape(int body, ConvexShape *s) {
+    s->type = bodies.shape[body];
+    s->position[0] = bodies.px[body];
+    s->position[1] = bodies.py[body];
+    s->position[2] = bodies.pz[body];
+    physics_body_rotation(body, s->rotation);
+    s->radius = bodies.radius[body];
+    s->halfExtents[0] = s->halfExtents[1] = s->halfExtents[2] = bodies.halfExtent[body];
+}
+
+int narrow_distance(const ConvexShape *a, const ConvexShape *b, SimplexCache *cache, float *distance, float pointA[3], float pointB[3]) {
+    Simplex s;
+    if (gjk(a, b, cache, &s))
+        return 0;
+    float pa[3], pb[3], d[3];
+    witnessPoints(&s, pa, pb);
+    sub(pb, pa, d);
+    float core = sqrtf(dot(d, d));
+    float ma = margin(a), mb = margin(b);
+    if (core <= ma + mb)
+        return 0;
+    addScaled(pa, d, ma / core, pointA);
+    addScaled(pb, d, -mb / core, pointB);
+    *distance = core - ma - mb;
+    return 1;
+}
+
+// GJK can end on a point, segment or triangle touching the origin; EPA needs a tetrahedron.
+static int completeTetrahedron(const ConvexShape *a, const ConvexShape *b, Simplex *s) {
+    static const float axes[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    float e[3], d[3], n[3];
+    if (s->count == 1) {
+        for (int i = 0; i < 6 && s->count == 1; i++) {
+            support(a, b, axes[i], &s->v[1]);
+            sub(s->v[1].w, s->v[0].w, e);
+            if (dot(e, e) > 1e-10f)
+                s->count = 2;
+        }
+    }
+    if (s->count == 2) {
+        sub(s->v[1].w, s->v[0].w, e);
+        for (int i = 0; i < 6 && s->count == 2; i++) {
+            cross(e, axes[i], d);
+            if (dot(d, d) < 1e-10f)
+                continue;
+            support(a, b, d, &s->v[2]);
+            float f[3];
+            sub(s->v[2].w, s->v[0].w, f);
+            cross(e, f, n);
+            if (dot(n, n) > 1e-10f)
+                s->count = 3;
+        }
+    }
+    if (s->count == 3) {
+        float f[3];
+        sub(s->v[1].w, s->v[0].w, e);
+        sub(s->v[2].w, s->v[0].w, f);
+        cross(e, f, n);
+        for (int side = 0; side < 2 && s->count == 3; side++) {
+            support(a, b, n, &s->v[3]);
+            sub(s->v[3].w, s->v[0].w, d);
+            if (fabsf(dot(d, n)) > 1e-10f)
+                s->count = 4;
+            n[0] = -n[0];
+            n[1] = -n[1];
+            n[2] = -n[2];
+        }
+    }
+    return s->count == 4;
+}
+
+static int makeFace(const SimplexVertex *v, int i0, int i1, int i2, EpaFace *face) {
+    float ab[3], ac[3], n[3];
+    sub(v[i1].w, v[i0].w, ab);
+    sub(v[i2].w, v[i0].w, ac);
+    cross(ab, ac, n);
+    float len = sqrtf(dot(n, n));
+    if (len < 1e-12f)
+        return 0;
+    face->v[0] = i0;
+    face->v[1] = i1;
+    face->v[2] = i2;
+    face->n[0] = n[0] / len;
+    face->n[1] = n[1] / len;
+    face->n[2] = n[2] / len;
+    face->dist = dot(face->n, v[i0].w);
+    return 1;
+}
+
+// Barycentric coordinates of p in the triangle abc.
+static void barycentric(const float p[3], const float a[3], const float b[3], const float c[3], float out[3]) {
+    float v0[3], v1[3], v2[3];
+    sub(b, a, v0);
+    sub(c, a, v1);
+    sub(p, a, v2);
+    float d00 = dot(v0, v0), d01 = dot(v0, v1), d11 = dot(v1, v1);
+    float d20 = dot(v2, v0), d21 = dot(v2, v1);
+    float denom = d00 * d11 - d01 * d01;
+    if (fabsf(denom) < 1e-20f) {
+        out[0] = 1.0f;
+        out[1] = out[2] = 0.0f;
+        return;
+    }
+    out[1] = (d11 * d20 - d01 * d21) / denom;
+    out[2] = (d00 * d21 - d01 * d20) / denom;
+    out[0] = 1.0f - out[1] - out[2];
+}
+
+// Expanding polytope: grows the Minkowski difference polytope towards its face closest
+// to the origin until the support point doesn't get further, which gives the penetration.
+static int epa(const ConvexShape *a, const ConvexShape *b, Simplex *s, float normal[3], float *depth, float pointA[3], float pointB[3]) {
+    if (!completeTetrahedron(a, b, s))
+        return 0;
+
+    SimplexVertex v[EPA_MAX_VERTICES];
+    EpaFace faces[EPA_MAX_FACES];
+    int edges[EPA_MAX_FACES * 3][2];
+    int vertexCount = 4, faceCount = 0;
+    memcpy(v, s->v, 4 * sizeof(SimplexVertex));
+
+    // wind the tetrahedron faces outwards
+    static const int tetra[4][4] = {{0, 1, 2, 3}, {0, 3, 1, 2}, {0, 2, 3, 1}, {1, 3, 2, 0}};
+    for (int f = 0; f < 4; f++) {
+        float e[3], n[3], g[3];
+        sub(v[tetra[f][1]].w, v[tetra[f][0]].w, e);
+        sub(v[tetra[f][2]].w, v[tetra[f][0]].w, g);
+        cross(e, g, n);
+        sub(v[tetra[f][3]].w, v[tetra[f][0]].w, g);
+        int flip = dot(n, g) > 0.0f;
+        if (!makeFace(v, tetra[f][0], flip ? tetra[f][2] : tetra[f][1], flip ? tetra[f][1] : tetra[f][2], &faces[faceCount]))
+            return 0;
+        // the origin has to be inside the tetrahedron
+        if (faces[faceCount].dist < -1e-6f)
+            return 0;
+        faceCount++;
+    }
+
+    EpaFace best = faces[0];
+    for (int iteration = 0; iteration < EPA_MAX_VERTICES; iteration++) {
+        int closest = 0;
+        for (int f = 1; f < faceCount; f++) {
+            if (faces[f].dist < faces[closest].dist)
+                closest = f;
+        }
+        best = faces[closest];
+
+        SimplexVertex w;
+        support(a, b, best.n, &w);
+        if (dot(w.w, best.n) - best.dist < EPA_TOLERANCE || vertexCount == EPA_MAX_VERTICES)
+            break;
+        int added = vertexCount++;
+        v[added] = w;
+
+        // remove the faces the new point sees; their unshared edges form the horizon
+        int edgeCount = 0;
+        for (int f = 0; f < faceCount; ) {
+            float d[3];
+            sub(w.w, v[faces[f].v[0]].w, d);
+            if (dot(faces[f].n, d) <= 0.0f) {
+                f++;
+                continue;
+            }
+            for (int e = 0; e < 3; e++) {
+                int i0 = faces[f].v[e], i1 = faces[f].v[(e + 1) % 3];
+                int shared = -1;
+                for (int k = 0; k < edgeCount; k++) {
+                    if (edges[k][0] == i1 && edges[k][1] == i0)
+                        shared = k;
+                }
+                if (shared >= 0) {
+                    edges[shared][0] = edges[edgeCount - 1][0];
+                    edges[shared][1] = edges[edgeCount - 1][1];
+                    edgeCount--;
+                }
+                else {
+                    edges[edgeCount][0] = i0;
+                    edges[edgeCount][1] = i1;
+                    edgeCount++;
+                }
+            }
+            faces[f] = faces[--faceCount];
+        }
+
+        for (int k = 0; k < edgeCount && faceCount < EPA_MAX_FACES; k++) {
+            if (makeFace(v, edges[k][0], edges[k][1], added, &faces[faceCount]))
+                faceCount++;
+        }
+        if (faceCount == 0)
+            return 0;
+    }
+
+    float p[3], weights[3];
+    p[0] = best.n[0] * best.dist;
+    p[1] = best.n[1] * best.dist;
+    p[2] = best.n[2] * best.dist;
+    barycentric(p, v[best.v[0]].w, v[best.v[1]].w, v[best.v[2]].w, weights);
+    pointA[0] = pointA[1] = pointA[2] = 0.0f;
+    pointB[0] = pointB[1] = pointB[2] = 0.0f;
+    for (int i = 0; i < 3; i++) {
+        addScaled(pointA, v[best.v[i]].a, weights[i], pointA);
+        addScaled(pointB, v[best.v[i]].b, weights[i], pointB);
+    }
+    // a - b contains the origin, so the face normal points from a towards b
+    memcpy(normal, best.n, 3 * sizeof(float));
+    *depth = best.dist;
+    return 1;
+}
+
+int narrow_collide_convex(const ConvexShape *a, const ConvexShape *b, SimplexCache *cache, Manifold *manifold) {
+    float ma = margin(a), mb = margin(b);
+    float n[3], pa[3], pb[3], depth;
+    Simplex s;
+    manifold->count = 0;
+
+    if (!gjk(a, b, cache, &s)) {
+        float d[3];
+        witnessPoints(&s, pa, pb);
+        sub(pb, pa, d);
+        float core = sqrtf(dot(d, d));
+        if (core >= ma + mb || core == 0.0f)
+            return 0;
+        n[0] = d[0] / core;
+        n[1] = d[1] / core;
+        n[2] = d[2] / core;
+        depth = ma + mb - core;
+    }
+    else if (epa(a, b, &s, n, &depth, pa, pb)) {
+        depth += ma + mb;
+    }
+    else if (ma + mb > 0.0f) {
+        // coincident cores, any direction separates them
+        witnessPoints(&s, pa, pb);
+        n[0] = n[2] = 0.0f;
+        n[1] = 1.0f;
+        depth = ma + mb;
+    }
+    else {
+        return 0;
+    }
+
+    float sa[3], sb[3];
+    addScaled(pa, n, ma, sa);
+    addScaled(pb, n, -mb, sb);
+    memcpy(manifold->normal, n, sizeof(n));
+    manifold->count = 1;
+    ContactPoint *point = &manifold->points[0];
+    for (int k = 0; k < 3; k++) {
+        point->position[k] = 0.5f * (sa[k] + sb[k]);
+    }
+    point->depth = depth;
+    point->feature = 0;
+    return 1;
+}
+
+// Sutherland-Hodgman against the plane dot(normal, p) <= offset. Points made at the plane
+// get ids from the plane, so they match across steps as long as the same edges cross it.
+static int clipPolygon(const ClipVertex *in, int count, const float normal[3], float offset, int plane, ClipVertex *out) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const ClipVertex *p = &in[i];
+        const ClipVertex *q = &in[(i + 1) % count];
+        float dp = dot(normal, p->p) - offset;
+        float dq = dot(normal, q->p) - offset;
+        if (dp <= 0.0f && n < CLIP_MAX_VERTICES)
+            out[n++] = *p;
+        // only strict crossings, an end on the plane is kept as it is
+        if (n < CLIP_MAX_VERTICES && ((dp < 0.0f && dq > 0.0f) || (dp > 0.0f && dq < 0.0f))) {
+            float t = dp / (dp - dq);
+            float e[3];
+            sub(q->p, p->p, e);
+            addScaled(p->p, e, t, out[n].p);
+            out[n].id = 4 + plane * 2 + (dp > 0.0f);
+            n++;
+        }
+    }
+    return n;
+}
+
+// Keeps the deepest point, the one furthest from it and the two spanning the largest
+// area on either side of that line.
+static void reducePoints(Manifold *m, const ContactPoint *points, int count) {
+    if (count <= NARROW_MAX_POINTS) {
+        memcpy(m->points, points, count * sizeof(ContactPoint));
+        m->count = count;
+        return;
+    }
+    int chosen[4] = {0, -1, -1, -1};
+    for (int i = 1; i < count; i++) {
+        if (points[i].depth > points[chosen[0]].depth)
+            chosen[0] = i;
+    }
+    float bestDistance = -1.0f;
+    for (int i = 0; i < count; i++) {
+        float d[3];
+        sub(points[i].position, points[chosen[0]].position, d);
+        if (dot(d, d) > bestDistance) {
+            bestDistance = dot(d, d);
+            chosen[1] = i;
+        }
+    }
+    float maxArea = 0.0f, minArea = 0.0f;
+    float line[3];
+    sub(points[chosen[1]].position, points[chosen[0]].position, line);
+    for (int i = 0; i < count; i++) {
+        float d[3], c[3];
+        sub(points[i].position, points[chosen[0]].position, d);
+        cross(line, d, c);
+        float area = dot(c, m->normal);
+        if (area > maxArea) {
+            maxArea = area;
+            chosen[2] = i;
+        }
+        if (area < minArea) {
+            minArea = area;
+            chosen[3] = i;
+        }
+    }
+    m->count = 0;
+    for (int k = 0; k < 4; k++) {
+        if (chosen[k] >= 0)
+            m->points[m->count++] = points[chosen[k]];
+    }
+}
+
+// The face of box s most against direction d, as a polygon. Returns the face index.
+static unsigned int incidentFace(const ConvexShape *s, const float d[3], ClipVertex polygon[4]) {
+    float u[3][3];
+    for (int k = 0; k < 3; k++) {
+        axisOf(s, k, u[k]);
+    }
+    int axis = 0;
+    float best = 0.0f;
+    for (int k = 0; k < 3; k++) {
+        float dk = dot(u[k], d);
+        if (fabsf(dk) > fabsf(best)) {
+            best = dk;
+            axis = k;
+        }
+    }
+    float sign = best > 0.0f ? -1.0f : 1.0f;
+    int i1 = (axis + 1) % 3, i2 = (axis + 2) % 3;
+    float center[3];
+    addScaled(s->position, u[axis], sign * s->halfExtents[axis], center);
+
+    static const float corners[4][2] = {{1, 1}, {-1, 1}, {-1, -1}, {1, -1}};
+    for (int k = 0; k < 4; k++) {
+        addScaled(center, u[i1], corners[k][0] * s->halfExtents[i1], polygon[k].p);
+        addScaled(polygon[k].p, u[i2], corners[k][1] * s->halfExtents[i2], polygon[k].p);
+        polygon[k].id = k;
+    }
+    return axis * 2 + (sign > 0.0f);
+}
+
+// Clips the polygon in place against the four sides of face refAxis of box ref.
+static int clipToBoxFace(const ConvexShape *ref, int refAxis, ClipVertex polygon[CLIP_MAX_VERTICES], int count) {
+    ClipVertex clipped[CLIP_MAX_VERTICES];
+    int sides[2] = {(refAxis + 1) % 3, (refAxis + 2) % 3};
+    for (int side = 0; side < 2 && count > 0; side++) {
+        int axis = sides[side];
+        float u[3];
+        axisOf(ref, axis, u);
+        float c = dot(u, ref->position);
+        float negative[3] = {-u[0], -u[1], -u[2]};
+        count = clipPolygon(polygon, count, u, c + ref->halfExtents[axis], side * 2, clipped);
+        count = clipPolygon(clipped, count, negative, -c + ref->halfExtents[axis], side * 2 + 1, polygon);
+    }
+    return count;
+}
+
+// Keeps the points of the clipped polygon below the reference face, which lies at
+// dot(refNormal, p) == faceOffset.
+static void facePoints(const ClipVertex *polygon, int count, const float refNormal[3], float faceOffset, int flip, unsigned int feature, Manifold *m) {
+    ContactPoint points[CLIP_MAX_VERTICES];
+    int n = 0;
+    for (int k = 0; k < count; k++) {
+        float separation = dot(refNormal, polygon[k].p) - faceOffset;
+        if (separation > 0.0f)
+            continue;
+        addScaled(polygon[k].p, refNormal, -0.5f * separation, points[n].position);
+        points[n].depth = -separation;
+        points[n].feature = feature | polygon[k].id;
+        n++;
+    }
+
+    for (int k = 0; k < 3; k++) {
+        m->normal[k] = flip ? -refNormal[k] : refNormal[k];
+    }
+    reducePoints(m, points, n);
+}
+
+static void faceContacts(const ConvexShape *ref, const ConvexShape *inc, int refAxis, const float refNormal[3], int flip, unsigned int refFeature, Manifold *m) {
+    ClipVertex polygon[CLIP_MAX_VERTICES];
+    unsigned int incFace = incidentFace(inc, refNormal, polygon);
+    int count = clipToBoxFace(ref, refAxis, polygon, 4);
+    float faceOffset = dot(refNormal, ref->position) + ref->halfExtents[refAxis];
+    facePoints(polygon, count, refNormal, faceOffset, flip, refFeature << 8 | incFace << 4, m);
+}
+
+// Point on the edge of box s along axis that is furthest in direction d.
+static void supportEdge(const ConvexShape *s, int axis, const float d[3], float out[3]) {
+    memcpy(out, s->position, 3 * sizeof(float));
+    for (int k = 0; k < 3; k++) {
+        if (k == axis)
+            continue;
+        float u[3];
+        axisOf(s, k, u);
+        addScaled(out, u, dot(u, d) > 0.0f ? s->halfExtents[k] : -s->halfExtents[k], out);
+    }
+}
+
+// Midway between the closest points of the segments pa + ua * s, |s| <= la and
+// pb + ub * t, |t| <= lb, with ua and ub of unit length.
+static void closestSegments(const float pa[3], const float ua[3], float la, const float pb[3], const float ub[3], float lb, float out[3]) {
+    float r[3], qa[3], qb[3];
+    sub(pa, pb, r);
+    float d = dot(ua, ub);
+    float e = dot(ua, r), f = dot(ub, r);
+    float denom = 1.0f - d * d;
+    float s = denom > 1e-6f ? (d * f - e) / denom : 0.0f;
+    s = fmaxf(-la, fminf(la, s));
+    float t = d * s + f;
+    t = fmaxf(-lb, fminf(lb, t));
+
+    addScaled(pa, ua, s, qa);
+    addScaled(pb, ub, t, qb);
+    for (int k = 0; k < 3; k++) {
+        out[k] = 0.5f * (qa[k] + qb[k]);
+    }
+}
+
+static void edgeContact(const ConvexShape *a, const ConvexShape *b, int axisA, int axisB, const float n[3], float depth, Manifold *m) {
+    float pa[3], pb[3], ua[3], ub[3];
+    float negative[3] = {-n[0], -n[1], -n[2]};
+    supportEdge(a, axisA, n, pa);
+    supportEdge(b, axisB, negative, pb);
+    axisOf(a, axisA, ua);
+    axisOf(b, axisB, ub);
+
+    memcpy(m->normal, n, 3 * sizeof(float));
+    m->count = 1;
+    closestSegments(pa, ua, a->halfExtents[axisA], pb, ub, b->halfExtents[axisB], m->points[0].position);
+    m->points[0].depth = depth;
+    m->points[0].feature = 0x10000u | (axisA * 3 + axisB);
+}
+
+int narrow_collide_boxes(const ConvexShape *a, const ConvexShape *b, Manifold *manifold) {
+    float ua[3][3], ub[3][3], c[3][3], absC[3][3], d[3];
+    const float *ha = a->halfExtents, *hb = b->halfExtents;
+    manifold->count = 0;
+    for (int k = 0; k < 3; k++) {
+        axisOf(a, k, ua[k]);
+        axisOf(b, k, ub[k]);
+    }
+    sub(b->position, a->position, d);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            c[i][j] = dot(ua[i], ub[j]);
+            // parallel edges give a zero cross product; the epsilon keeps those axes from separating
+            absC[i][j] = fabsf(c[i][j]) + 1e-6f;
+        }
+    }
+
+    float faceSeparation[2] = {-INFINITY, -INFINITY};
+    int faceAxis[2] = {0, 0};
+    float faceSign[2] = {1.0f, 1.0f};
+    for (int i = 0; i < 3; i++) {
+        float distance = dot(d, ua[i]);
+        float separation = fabsf(distance) - (ha[i] + hb[0] * absC[i][0] + hb[1] * absC[i][1] + hb[2] * absC[i][2]);
+        if (separation > 0.0f)
+            return 0;
+        if (separation > faceSeparation[0]) {
+            faceSeparation[0] = separation;
+            faceAxis[0] = i;
+            faceSign[0] = distance < 0.0f ? -1.0f : 1.0f;
+        }
+    }
+    for (int j = 0; j < 3; j++) {
+        float distance = dot(d, ub[j]);
+        float separation = fabsf(distance) - (hb[j] + ha[0] * absC[0][j] + ha[1] * absC[1][j] + ha[2] * absC[2][j]);
+        if (separation > 0.0f)
+            return 0;
+        if (separation > faceSeparation[1]) {
+            faceSeparation[1] = separation;
+            faceAxis[1] = j;
+            faceSign[1] = distance < 0.0f ? -1.0f : 1.0f;
+        }
+    }
+
+    float edgeSeparation = -INFINITY;
+    float edgeNormal[3] = {0.0f, 0.0f, 0.0f};
+    int edgeA = 0, edgeB = 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            float axis[3];
+            cross(ua[i], ub[j], axis);
+            float len = sqrtf(dot(axis, axis));
+            if (len < 1e-5f)
+                continue;
+            for (int k = 0; k < 3; k++) {
+                axis[k] /= len;
+            }
+            float ra = 0.0f, rb = 0.0f;
+            for (int k = 0; k < 3; k++) {
+                ra += ha[k] * fabsf(dot(ua[k], axis));
+                rb += hb[k] * fabsf(dot(ub[k], axis));
+            }
+            float distance = dot(d, axis);
+            float separation = fabsf(distance) - (ra + rb);
+            if (separation > 0.0f)
+                return 0;
+            if (separation > edgeSeparation) {
+                edgeSeparation = separation;
+                edgeA = i;
+                edgeB = j;
+                float sign = distance < 0.0f ? -1.0f : 1.0f;
+                for (int k = 0; k < 3; k++) {
+                    edgeNormal[k] = axis[k] * sign;
+                }
+            }
+        }
+    }
+
+    int useB = faceSeparation[1] > SAT_RELATIVE_TOLERANCE * faceSeparation[0] + SAT_ABSOLUTE_TOLERANCE;
+    float bestFace = faceSeparation[useB];
+    if (edgeSeparation > SAT_RELATIVE_TOLERANCE * bestFace + SAT_ABSOLUTE_TOLERANCE) {
+        edgeContact(a, b, edgeA, edgeB, edgeNormal, -edgeSeparation, manifold);
+        return 1;
+    }
+
+    // the reference normal points from the reference box towards the incident one
+    int axis = faceAxis[useB];
+    float refNormal[3];
+    const float *u = useB ? ub[axis] : ua[axis];
+    float sign = useB ? -faceSign[1] : faceSign[0];
+    for (int k = 0; k < 3; k++) {
+        refNormal[k] = u[k] * sign;
+    }
+    unsigned int refFeature = useB << 3 | (axis * 2 + (sign > 0.0f));
+    if (useB)
+        faceContacts(b, a, axis, refNormal, 1, refFeature, manifold);
+    else
+        faceContacts(a, b, axis, refNormal, 0, refFeature, manifold);
+    return manifold->count > 0;
+}
+
+// Closest point to p on triangle abc, from the Voronoi regions of its vertices and edges.
+static void closestOnTriangle(const float p[3], const float a[3], const float b[3], const float c[3], float out[3]) {
+    float ab[3], ac[3], ap[3], bp[3], cp[3];
+    sub(b, a, ab);
+    sub(c, a, ac);
+    sub(p, a, ap);
+    float d1 = dot(ab, ap), d2 = dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        memcpy(out, a, 3 * sizeof(float));
+        return;
+    }
+    sub(p, b, bp);
+    float d3 = dot(ab, bp), d4 = dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) {
+        memcpy(out, b, 3 * sizeof(float));
+        return;
+    }
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        addScaled(a, ab, d1 / (d1 - d3), out);
+        return;
+    }
+    sub(p, c, cp);
+    float d5 = dot(ab, cp), d6 = dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) {
+        memcpy(out, c, 3 * sizeof(float));
+        return;
+    }
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        addScaled(a, ac, d2 / (d2 - d6), out);
+        return;
+    }
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        float bc[3];
+        sub(c, b, bc);
+        addScaled(b, bc, (d4 - d3) / ((d4 - d3) + (d5 - d6)), out);
+        return;
+    }
+    float denom = 1.0f / (va + vb + vc);
+    addScaled(a, ab, vb * denom, out);
+    addScaled(out, ac, vc * denom, out);
+}
+
+void narrow_closest_on_triangle(const float p[3], const float triangle[9], float out[3]) {
+    closestOnTriangle(p, triangle, triangle + 3, triangle + 6, out);
+}
+
+int narrow_collide_sphere_triangle(const float center[3], float radius, const float triangle[9], Manifold *manifold) {
+    float closest[3], d[3];
+    manifold->count = 0;
+    closestOnTriangle(center, triangle, triangle + 3, triangle + 6, closest);
+    sub(closest, center, d);
+    float d2 = dot(d, d);
+    if (d2 >= radius * radius)
+        return 0;
+
+    float distance = sqrtf(d2);
+    float *n = manifold->normal;
+    if (distance > 1e-6f) {
+        for (int k = 0; k < 3; k++) {
+            n[k] = d[k] / distance;
+        }
+    }
+    else {
+        // the center lies on the triangle, push it out of the front face
+        float e1[3], e2[3];
+        sub(triangle + 3, triangle, e1);
+        sub(triangle + 6, triangle, e2);
+        cross(e1, e2, n);
+        float len = sqrtf(dot(n, n));
+        if (len < 1e-12f)
+            return 0;
+        for (int k = 0; k < 3; k++) {
+            n[k] /= -len;
+        }
+    }
+    ContactPoint *point = &manifold->points[0];
+    point->depth = radius - distance;
+    addScaled(center, n, radius - 0.5f * point->depth, point->position);
+    point->feature = 0;
+    manifold->count = 1;
+    return 1;
+}
+
+// Distance between the box and the triangle along axis, negative when they overlap there.
+// sign tells on which side of the box the triangle lies.
+static float triangleSeparation(const ConvexShape *box, const float u[3][3], const float *v[3], const float axis[3], float *sign) {
+    float c = dot(axis, box->position);
+    float r = box->halfExtents[0] * fabsf(dot(u[0], axis))
+            + box->halfExtents[1] * fabsf(dot(u[1], axis))
+            + box->halfExtents[2] * fabsf(dot(u[2], axis));
+    float t0 = dot(axis, v[0]), t1 = dot(axis, v[1]), t2 = dot(axis, v[2]);
+    float above = fminf(t0, fminf(t1, t2)) - (c + r);
+    float below = (c - r) - fmaxf(t0, fmaxf(t1, t2));
+    *sign = above >= below ? 1.0f : -1.0f;
+    return fmaxf(above, below);
+}
+
+int narrow_collide_box_triangle(const ConvexShape *box, const float triangle[9], Manifold *manifold) {
+    const float *v[3] = {triangle, triangle + 3, triangle + 6};
+    float u[3][3], e[3][3], n[3], sign;
+    manifold->count = 0;
+    for (int k = 0; k < 3; k++) {
+        axisOf(box, k, u[k]);
+        sub(v[(k + 1) % 3], v[k], e[k]);
+    }
+    cross(e[0], e[1], n);
+    float len = sqrtf(dot(n, n));
+    if (len < 1e-12f)
+        return 0;
+    for (int k = 0; k < 3; k++) {
+        n[k] /= len;
+    }
+
+    float triangleFace = triangleSeparation(box, u, v, n, &sign);
+    if (triangleFace > 0.0f)
+        return 0;
+    float triangleSign = sign;
+
+    float boxFace = -INFINITY, boxSign = 1.0f;
+    int boxAxis = 0;
+    for (int i = 0; i < 3; i++) {
+        float separation = triangleSeparation(box, u, v, u[i], &sign);
+        if (separation > 0.0f)
+            return 0;
+        if (separation > boxFace) {
+            boxFace = separation;
+            boxAxis = i;
+            boxSign = sign;
+        }
+    }
+
+    float edgeSeparation = -INFINITY;
+    float edgeNormal[3] = {0.0f, 0.0f, 0.0f};
+    int edgeBox = 0, edgeTriangle = 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            float axis[3];
+            cross(u[i], e[j], axis);
+            float axisLength = sqrtf(dot(axis, axis));
+            if (axisLength < 1e-5f * sqrtf(dot(e[j], e[j])))
+                continue;
+            for (int k = 0; k < 3; k++) {
+                axis[k] /= axisLength;
+            }
+            float separation = triangleSeparation(box, u, v, axis, &sign);
+            if (separation > 0.0f)
+                return 0;
+            if (separation > edgeSeparation) {
+                edgeSeparation = separation;
+                edgeBox = i;
+                edgeTriangle = j;
+                for (int k = 0; k < 3; k++) {
+                    edgeNormal[k] = axis[k] * sign;
+                }
+            }
+        }
+    }
+
+    int useBox = boxFace > SAT_RELATIVE_TOLERANCE * triangleFace + SAT_ABSOLUTE_TOLERANCE;
+    float bestFace = useBox ? boxFace : triangleFace;
+    if (edgeSeparation > SAT_RELATIVE_TOLERANCE * bestFace + SAT_ABSOLUTE_TOLERANCE) {
+        float pa[3], pb[3], ub[3];
+        supportEdge(box, edgeBox, edgeNormal, pa);
+        float edgeLength = sqrtf(dot(e[edgeTriangle], e[edgeTriangle]));
+        for (int k = 0; k < 3; k++) {
+            ub[k] = e[edgeTriangle][k] / edgeLength;
+            pb[k] = v[edgeTriangle][k] + 0.5f * e[edgeTriangle][k];
+        }
+        memcpy(manifold->normal, edgeNormal, 3 * sizeof(float));
+        manifold->count = 1;
+        closestSegments(pa, u[edgeBox], box->halfExtents[edgeBox], pb, ub, 0.5f * edgeLength, manifold->points[0].position);
+        manifold->points[0].depth = -edgeSeparation;
+        manifold->points[0].feature = 0x10000u | (edgeBox * 3 + edgeTriangle);
+        return 1;
+    }
+
+    ClipVertex polygon[CLIP_MAX_VERTICES];
+    if (useBox) {
+        // the triangle clipped against the sides of the box face
+        float refNormal[3];
+        for (int k = 0; k < 3; k++) {
+            refNormal[k] = u[boxAxis][k] * boxSign;
+            memcpy(polygon[k].p, v[k], 3 * sizeof(float));
+            polygon[k].id = k;
+        }
+        int count = clipToBoxFace(box, boxAxis, polygon, 3);
+        float faceOffset = dot(refNormal, box->position) + box->halfExtents[boxAxis];
+        unsigned int refFeature = 1u << 3 | (boxAxis * 2 + (boxSign > 0.0f));
+        facePoints(polygon, count, refNormal, faceOffset, 0, refFeature << 8, manifold);
+    }
+    else {
+        // the box face clipped against the triangle edges, with the normal towards the box
+        float refNormal[3];
+        for (int k = 0; k < 3; k++) {
+            refNormal[k] = -n[k] * triangleSign;
+        }
+        unsigned int incFace = incidentFace(box, refNormal, polygon);
+        int count = 4;
+        for (int k = 0; k < 3 && count > 0; k++) {
+            ClipVertex clipped[CLIP_MAX_VERTICES];
+            float side[3];
+            cross(e[k], n, side);
+            count = clipPolygon(polygon, count, side, dot(side, v[k]), k, clipped);
+            memcpy(polygon, clipped, count * sizeof(ClipVertex));
+        }
+        facePoints(polygon, count, refNormal, dot(refNormal, v[0]), 1, incFace << 4, manifold);
+    }
+    return manifold->count > 0;
+}
+
+static unsigned int hashKey(unsigned long long key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return (unsigned int)key;
+}
+
+const SimplexCache *narrow_find_simplex(unsigned long long key) {
+    if (!pairSimplexCache.tableSize)
+        return NULL;
+    unsigned int mask = pairSimplexCache.tableSize - 1;
+    for (unsigned int slot = hashKey(key) & mask; pairSimplexCache.table[slot]; slot = (slot + 1) & mask) {
+        PairSimplex *entry = &pairSimplexCache.entries[pairSimplexCache.table[slot] - 1];
+        if (entry->key == key)
+            return &entry->simplex;
+    }
+    return NULL;
+}
+
+void narrow_store_simplices(const PairSimplex *entries, int count) {
+    if (count > pairSimplexCache.capacity) {
+        pairSimplexCache.capacity = count * 2;
+        pairSimplexCache.entries = realloc(pairSimplexCache.entries, pairSimplexCache.capacity * sizeof(PairSimplex));
+    }
+    if (count > 0)
+        memcpy(pairSimplexCache.entries, entries, count * sizeof(PairSimplex));
+    pairSimplexCache.count = count;
+
+    // the table only grows, so a pair count around a power of two doesn't reallocate it every step
+    int size = pairSimplexCache.tableSize ? pairSimplexCache.tableSize : 16;
+    while (size < count * 2)
+        size *= 2;
+    if (size != pairSimplexCache.tableSize) {
+        free(pairSimplexCache.table);
+        pairSimplexCache.table = malloc(size * sizeof(int));
+        pairSimplexCache.tableSize = size;
+    }
+    memset(pairSimplexCache.table, 0, size * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        unsigned int slot = hashKey(entries[i].key) & (size - 1);
+        while (pairSimplexCache.table[slot])
+            slot = (slot + 1) & (size - 1);
+        pairSimplexCache.table[slot] = i + 1;
+    }
+}
+
+void narrow_shutdown() {
+    free(pairSimplexCache.entries);
+    free(pairSimplexCache.table);
+    memset(&pairSimplexCache, 0, sizeof(pairSimplexCache));
+}
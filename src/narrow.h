@@ -0,0 +1,84 @@
+#ifndef NARROW_H
+#define NARROW_H
+
+#include "physics.h"
+
+#define NARROW_MAX_POINTS 4
+// simplex caches keep support vertex indices in a byte
+#define NARROW_MAX_HULL_VERTICES 256
+
+// A convex shape placed in the world. Spheres are a point with a margin of radius, so GJK
+// runs on their centers and the margin is added afterwards; boxes and hulls have no margin.
+typedef struct {
+    int type;
+    float position[3];
+    // row-major, the columns are the local axes in world space
+    float rotation[9];
+    float radius;
+    float halfExtents[3];
+    // SHAPE_HULL: vertexCount local space points, xyz
+    const float *vertices;
+    int vertexCount;
+} ConvexShape;
+
+// feature identifies the point across steps for warm starting
+typedef struct {
+    float position[3];
+    float depth;
+    unsigned int feature;
+} ContactPoint;
+
+// The normal points from a to b. Points lie midway between the two surfaces.
+typedef struct {
+    float normal[3];
+    int count;
+    ContactPoint points[NARROW_MAX_POINTS];
+} Manifold;
+
+// Support vertices of the last GJK simplex of a pair. GJK starts from them the next time,
+// which usually converges in one or two iterations for bodies that barely moved.
+typedef struct {
+    unsigned char count;
+    unsigned char indexA[4];
+    unsigned char indexB[4];
+} SimplexCache;
+
+typedef struct {
+    unsigned long long key;
+    SimplexCache simplex;
+} PairSimplex;
+
+// Same layout as the contact cache of the solver.
+typedef struct {
+    PairSimplex *entries;
+    int count;
+    int capacity;
+    int *table;
+    int tableSize;
+} PairSimplexCache;
+
+extern PairSimplexCache pairSimplexCache;
+
+// The shape of a body where it is now.
+void narrow_body_shape(int body, ConvexShape *shape);
+// GJK distance between the shapes, including the sphere margins. Returns 0 when the shapes
+// overlap, otherwise fills the closest points. cache may be NULL.
+int narrow_distance(const ConvexShape *a, const ConvexShape *b, SimplexCache *cache, float *distance, float pointA[3], float pointB[3]);
+// GJK, with EPA on the Minkowski difference when the shapes overlap deeper than their margins.
+// Gives at most one point. Returns 0 when the shapes don't touch.
+int narrow_collide_convex(const ConvexShape *a, const ConvexShape *b, SimplexCache *cache, Manifold *manifold);
+// Separating axis test over the 15 axes of two boxes. Face contacts clip the incident face
+// against the sides of the reference face for up to four points, edge contacts give one.
+int narrow_collide_boxes(const ConvexShape *a, const ConvexShape *b, Manifold *manifold);
+// Triangles are two-sided, the normal points from the sphere or box to the triangle. A sphere
+// gets one point; a box gets up to four from clipping, like box against box.
+void narrow_closest_on_triangle(const float p[3], const float triangle[9], float out[3]);
+int narrow_collide_sphere_triangle(const float center[3], float radius, const float triangle[9], Manifold *manifold);
+int narrow_collide_box_triangle(const ConvexShape *box, const float triangle[9], Manifold *manifold);
+
+const SimplexCache *narrow_find_simplex(unsigned long long key);
+// Replaces the cache with the simplices of this step's pairs.
+void narrow_store_simplices(const PairSimplex *entries, int count);
+void narrow_shutdown();
+
+#endif
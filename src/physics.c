@@ -0,0 +1,1232 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "physics.h"
+#include "jobs.h"
+#include "solver.h"
+#include "island.h"
+#include "ccd.h"
+#include "narrow.h"
+#include "mesh.h"
+#include "sdf.h"
+#include "sort.h"
+#include "arena.h"
+
+#define INTEGRATE_GRAIN 256
+#define SWEEP_GRAIN 128
+#define VERLET_GRAIN 1024
+#define MORTON_BITS 10
+#define NARROWPHASE_GRAIN 256
+// up to four box corners on each of three walls
+#define WALL_CONTACTS 12
+
+Bodies bodies;
+PhysicsConfig physicsConfig;
+PhysicsStats physicsStats;
+
+PhysicsPersistent physicsPersistent;
+
+static float stepDt;
+
+// Everything below that only lives for one step comes from the step arena, or the arena of
+// the worker that fills it, all reset when a step starts.
+static Arena stepArena;
+static Arena workerArenas[JOBS_MAX_THREADS];
+
+// min x of the bounds in sorted order, as of the last broadphase
+static float *sortedMinX;
+
+static BodyPair *workerPairs[JOBS_MAX_THREADS];
+static int workerPairCount[JOBS_MAX_THREADS];
+static int workerPairCapacity[JOBS_MAX_THREADS];
+
+static BodyPair *pairs;
+static int pairCount;
+
+// Verlet lists as one array of pairs, the neighbors of a body next to each other, with the
+// positions they were built at. verletBodies is -1 when they have to be rebuilt.
+static BodyPair *verletPairs;
+static int verletPairCount;
+static int verletPairCapacity;
+static float *verletX, *verletY, *verletZ;
+static int verletCapacity;
+static int verletBodies = -1;
+static float workerDisplacement[JOBS_MAX_THREADS];
+
+// new index of every old one for the last reorder, and the index of every id, rebuilt on
+// the first query after bodies were added or moved
+static int *reorderRemap;
+static int reorderCapacity;
+static int *idIndex;
+static int idIndexCapacity;
+static int idIndexValid;
+
+static Contact *wallContacts;
+static int *wallContactCount;
+
+// Mesh contacts of a body go to the buffer of the worker that found them; the body
+// remembers where, so they can be gathered in body order.
+static Contact *workerMeshContacts[JOBS_MAX_THREADS];
+static int workerMeshCount[JOBS_MAX_THREADS];
+static int workerMeshCapacity[JOBS_MAX_THREADS];
+static int *workerTriangles[JOBS_MAX_THREADS];
+static int workerTriangleCapacity[JOBS_MAX_THREADS];
+static int *meshContactStart;
+static int *meshContactCount;
+static unsigned char *meshContactWorker;
+
+// up to NARROW_MAX_POINTS contacts and the new simplex of every pair, in pair order
+static Contact *pairContacts;
+static int *pairContactCount;
+static PairSimplex *pairSimplices;
+static int workerGjk[JOBS_MAX_THREADS][2];
+
+static Contact *contacts;
+static int contactCount;
+static int contactCapacity;
+
+static double partialEnergy[JOBS_MAX_THREADS];
+static double *chunkEnergy;
+
+static void *growArray(void *array, int *capacity, int needed, size_t elementSize) {
+    if (needed <= *capacity)
+        return array;
+    int newCapacity = *capacity ? *capacity : 64;
+    while (newCapacity < needed)
+        newCapacity *= 2;
+    *capacity = newCapacity;
+    return realloc(array, newCapacity * elementSize);
+}
+
+// growArray for buffers of one worker during a step
+static void *growWorkerArray(int worker, void *array, int *capacity, int needed, size_t elementSize) {
+    if (needed <= *capacity)
+        return array;
+    int newCapacity = *capacity ? *capacity : 64;
+    while (newCapacity < needed)
+        newCapacity *= 2;
+    array = arena_grow(&workerArenas[worker], array, *capacity * elementSize, newCapacity * elementSize);
+    *capacity = newCapacity;
+    return array;
+}
+
+static void resetArenas() {
+    arena_reset(&stepArena);
+    for (int w = 0; w < JOBS_MAX_THREADS; w++) {
+        arena_reset(&workerArenas[w]);
+        workerPairs[w] = NULL;
+        workerPairCapacity[w] = 0;
+        workerMeshContacts[w] = NULL;
+        workerMeshCapacity[w] = 0;
+        workerTriangles[w] = NULL;
+        workerTriangleCapacity[w] = 0;
+    }
+}
+
+void physics_reserve_bodies(int needed) {
+    if (needed <= bodies.capacity)
+        return;
+    int capacity = bodies.capacity;
+    bodies.id = growArray(bodies.id, &capacity, needed, sizeof(unsigned int));
+    bodies.px = realloc(bodies.px, capacity * sizeof(float));
+    bodies.py = realloc(bodies.py, capacity * sizeof(float));
+    bodies.pz = realloc(bodies.pz, capacity * sizeof(float));
+    bodies.qx = realloc(bodies.qx, capacity * sizeof(float));
+    bodies.qy = realloc(bodies.qy, capacity * sizeof(float));
+    bodies.qz = realloc(bodies.qz, capacity * sizeof(float));
+    bodies.qw = realloc(bodies.qw, capacity * sizeof(float));
+    bodies.vx = realloc(bodies.vx, capacity * sizeof(float));
+    bodies.vy = realloc(bodies.vy, capacity * sizeof(float));
+    bodies.vz = realloc(bodies.vz, capacity * sizeof(float));
+    bodies.wx = realloc(bodies.wx, capacity * sizeof(float));
+    bodies.wy = realloc(bodies.wy, capacity * sizeof(float));
+    bodies.wz = realloc(bodies.wz, capacity * sizeof(float));
+    bodies.radius = realloc(bodies.radius, capacity * sizeof(float));
+    bodies.halfExtent = realloc(bodies.halfExtent, capacity * sizeof(float));
+    bodies.invMass = realloc(bodies.invMass, capacity * sizeof(float));
+    bodies.invIx = realloc(bodies.invIx, capacity * sizeof(float));
+    bodies.invIy = realloc(bodies.invIy, capacity * sizeof(float));
+    bodies.invIz = realloc(bodies.invIz, capacity * sizeof(float));
+    bodies.shape = realloc(bodies.shape, capacity * sizeof(unsigned char));
+    bodies.flags = realloc(bodies.flags, capacity * sizeof(unsigned char));
+    bodies.awake = realloc(bodies.awake, capacity * sizeof(unsigned char));
+    bodies.sleepTimer = realloc(bodies.sleepTimer, capacity * sizeof(unsigned short));
+    bodies.island = realloc(bodies.island, capacity * sizeof(int));
+    bodies.slot = realloc(bodies.slot, capacity * sizeof(int));
+    bodies.material = realloc(bodies.material, capacity * sizeof(unsigned short));
+    bodies.capacity = capacity;
+}
+
+static void freeBodies() {
+    free(bodies.id);
+    free(bodies.px);
+    free(bodies.py);
+    free(bodies.pz);
+    free(bodies.qx);
+    free(bodies.qy);
+    free(bodies.qz);
+    free(bodies.qw);
+    free(bodies.vx);
+    free(bodies.vy);
+    free(bodies.vz);
+    free(bodies.wx);
+    free(bodies.wy);
+    free(bodies.wz);
+    free(bodies.radius);
+    free(bodies.halfExtent);
+    free(bodies.invMass);
+    free(bodies.invIx);
+    free(bodies.invIy);
+    free(bodies.invIz);
+    free(bodies.shape);
+    free(bodies.flags);
+    free(bodies.awake);
+    free(bodies.sleepTimer);
+    free(bodies.island);
+    free(bodies.slot);
+    free(bodies.material);
+    memset(&bodies, 0, sizeof(bodies));
+}
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+PhysicsConfig physics_default_config() {
+    PhysicsConfig config = {
+        .deterministic = 0,
+        .threads = 0,
+        .gravity = {0.0f, -9.81f, 0.0f},
+        .boundsMin = {-10.0f, -5.0f, -20.0f},
+        .boundsMax = {10.0f, 20.0f, 5.0f},
+        .restitution = 0.5f,
+        .restitutionThreshold = 1.0f,
+        .friction = 0.5f,
+        .baumgarte = 0.2f,
+        .slop = 0.01f,
+        .solverIterations = 10,
+        .solverMode = SOLVER_COLORED_SIMD,
+        .sleepEnergy = 0.005f,
+        .sleepSteps = 60,
+        .ccdThreshold = 0.5f,
+        .broadphaseSkin = 0.0f,
+        .reorderInterval = 0,
+        .seed = 1
+    };
+    return config;
+}
+
+void physics_init(PhysicsConfig config) {
+    physicsConfig = config;
+    jobs_init(config.threads);
+
+    freeBodies();
+    physicsPersistent.sortedCount = 0;
+    physicsPersistent.nextId = 0;
+    physicsPersistent.rngState = config.seed;
+    pool_destroy(&physicsPersistent.bodyPool);
+    pool_init(&physicsPersistent.bodyPool, sizeof(int));
+    verletBodies = -1;
+    idIndexValid = 0;
+    solver_shutdown();
+    narrow_shutdown();
+    memset(&physicsStats, 0, sizeof(physicsStats));
+}
+
+void physics_shutdown() {
+    jobs_shutdown();
+    freeBodies();
+
+    free(physicsPersistent.sortedBodies);
+    physicsPersistent.sortedBodies = NULL;
+    physicsPersistent.sortedCount = physicsPersistent.sortedCapacity = 0;
+    pool_destroy(&physicsPersistent.bodyPool);
+    resetArenas();
+    arena_free(&stepArena);
+    for (int i = 0; i < JOBS_MAX_THREADS; i++) {
+        arena_free(&workerArenas[i]);
+        workerPairCount[i] = 0;
+        workerMeshCount[i] = 0;
+    }
+    sortedMinX = NULL;
+    pairs = NULL;
+    pairCount = 0;
+    free(verletPairs);
+    verletPairs = NULL;
+    verletPairCount = verletPairCapacity = 0;
+    free(verletX);
+    free(verletY);
+    free(verletZ);
+    verletX = verletY = verletZ = NULL;
+    verletCapacity = 0;
+    verletBodies = -1;
+    free(reorderRemap);
+    reorderRemap = NULL;
+    reorderCapacity = 0;
+    free(idIndex);
+    idIndex = NULL;
+    idIndexCapacity = 0;
+    idIndexValid = 0;
+    wallContacts = NULL;
+    wallContactCount = NULL;
+    meshContactStart = NULL;
+    meshContactCount = NULL;
+    meshContactWorker = NULL;
+    pairContacts = NULL;
+    pairContactCount = NULL;
+    pairSimplices = NULL;
+    contacts = NULL;
+    contactCount = contactCapacity = 0;
+    solver_shutdown();
+    narrow_shutdown();
+    islands_shutdown();
+    ccd_shutdown();
+    sort_shutdown();
+    chunkEnergy = NULL;
+}
+
+// splitmix64, so a seed fully determines the sequence
+float physics_random() {
+    unsigned long long z = (physicsPersistent.rngState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (z >> 40) * (1.0f / 16777216.0f);
+}
+
+int physics_add_body(const float position[3], const float velocity[3], float size, float mass, int shape) {
+    physics_reserve_bodies(bodies.count + 1);
+    int i = bodies.count++;
+    bodies.id[i] = physicsPersistent.nextId++;
+    bodies.px[i] = position[0];
+    bodies.py[i] = position[1];
+    bodies.pz[i] = position[2];
+    bodies.qx[i] = bodies.qy[i] = bodies.qz[i] = 0.0f;
+    bodies.qw[i] = 1.0f;
+    bodies.vx[i] = velocity[0];
+    bodies.vy[i] = velocity[1];
+    bodies.vz[i] = velocity[2];
+    bodies.wx[i] = bodies.wy[i] = bodies.wz[i] = 0.0f;
+    bodies.radius[i] = shape == SHAPE_BOX ? size * sqrtf(3.0f) : size;
+    bodies.halfExtent[i] = shape == SHAPE_BOX ? size : 0.0f;
+    bodies.invMass[i] = mass > 0.0f ? 1.0f / mass : 0.0f;
+    // solid sphere I = 2/5 m r^2, solid cube I = 2/3 m h^2 about every axis
+    float invInertia = shape == SHAPE_BOX ? 1.5f * bodies.invMass[i] / (size * size) : 2.5f * bodies.invMass[i] / (size * size);
+    bodies.invIx[i] = bodies.invIy[i] = bodies.invIz[i] = invInertia;
+    bodies.shape[i] = shape;
+    bodies.flags[i] = 0;
+    bodies.awake[i] = mass > 0.0f;
+    bodies.sleepTimer[i] = 0;
+    bodies.island[i] = i;
+    bodies.material[i] = 0;
+    PoolHandle handle = pool_alloc(&physicsPersistent.bodyPool);
+    bodies.slot[i] = pool_slot(handle);
+    *(int*)pool_get(&physicsPersistent.bodyPool, handle) = i;
+    idIndexValid = 0;
+    return i;
+}
+
+void physics_set_bullet(int body, int bullet) {
+    if (bullet)
+        bodies.flags[body] |= BODY_BULLET;
+    else
+        bodies.flags[body] &= ~BODY_BULLET;
+}
+
+void physics_set_orientation(int body, const float quaternion[4]) {
+    float len = sqrtf(quaternion[0] * quaternion[0] + quaternion[1] * quaternion[1]
+                    + quaternion[2] * quaternion[2] + quaternion[3] * quaternion[3]);
+    bodies.qx[body] = quaternion[0] / len;
+    bodies.qy[body] = quaternion[1] / len;
+    bodies.qz[body] = quaternion[2] / len;
+    bodies.qw[body] = quaternion[3] / len;
+}
+
+void physics_set_angular_velocity(int body, const float angularVelocity[3]) {
+    bodies.wx[body] = angularVelocity[0];
+    bodies.wy[body] = angularVelocity[1];
+    bodies.wz[body] = angularVelocity[2];
+}
+
+void physics_set_material(int body, int material) {
+    bodies.material[body] = material;
+}
+
+void physics_body_rotation(int body, float r[9]) {
+    float x = bodies.qx[body], y = bodies.qy[body], z = bodies.qz[body], w = bodies.qw[body];
+    r[0] = 1.0f - 2.0f * (y * y + z * z);
+    r[1] = 2.0f * (x * y - z * w);
+    r[2] = 2.0f * (x * z + y * w);
+    r[3] = 2.0f * (x * y + z * w);
+    r[4] = 1.0f - 2.0f * (x * x + z * z);
+    r[5] = 2.0f * (y * z - x * w);
+    r[6] = 2.0f * (x * z - y * w);
+    r[7] = 2.0f * (y * z + x * w);
+    r[8] = 1.0f - 2.0f * (x * x + y * y);
+}
+
+SortedBounds physics_sorted_bounds() {
+    SortedBounds sorted = {physicsPersistent.sortedBodies, sortedMinX, physicsPersistent.sortedCount};
+    return sorted;
+}
+
+int physics_body_index(unsigned int id) {
+    if (id >= physicsPersistent.nextId)
+        return -1;
+    if (!idIndexValid) {
+        idIndex = growArray(idIndex, &idIndexCapacity, physicsPersistent.nextId, sizeof(int));
+        for (unsigned int k = 0; k < physicsPersistent.nextId; k++) {
+            idIndex[k] = -1;
+        }
+        for (int i = 0; i < bodies.count; i++) {
+            idIndex[bodies.id[i]] = i;
+        }
+        idIndexValid = 1;
+    }
+    return idIndex[id];
+}
+
+const int *physics_reorder_remap() {
+    return physicsStats.reorders ? reorderRemap : NULL;
+}
+
+PoolHandle physics_body_handle(int body) {
+    return pool_handle(&physicsPersistent.bodyPool, bodies.slot[body]);
+}
+
+int physics_handle_index(PoolHandle handle) {
+    const int *index = pool_get(&physicsPersistent.bodyPool, handle);
+    return index ? *index : -1;
+}
+
+static int isSleeping(int i) {
+    return !bodies.awake[i] && bodies.invMass[i] != 0.0f;
+}
+
+// Relabels or wakes sleeping bodies only when an island label would change, so removing
+// awake bodies costs the same however many bodies there are.
+int physics_remove_body(PoolHandle handle) {
+    int *index = pool_get(&physicsPersistent.bodyPool, handle);
+    if (!index)
+        return 0;
+    int i = *index;
+    int last = bodies.count - 1;
+
+    // sleeping islands are labelled with the index of their root body; what rested on the
+    // removed body has to wake, and the last body's island takes the label of its new index
+    if (isSleeping(i)) {
+        int label = bodies.island[i];
+        for (int k = 0; k < bodies.count; k++) {
+            if (isSleeping(k) && bodies.island[k] == label) {
+                bodies.awake[k] = 1;
+                bodies.sleepTimer[k] = 0;
+            }
+        }
+    }
+    if (i != last && isSleeping(last) && bodies.island[last] == last) {
+        for (int k = 0; k < bodies.count; k++) {
+            if (isSleeping(k) && bodies.island[k] == last)
+                bodies.island[k] = i;
+        }
+    }
+
+#define BODY_ARRAY_MOVE(name) bodies.name[i] = bodies.name[last];
+    BODY_ARRAYS(BODY_ARRAY_MOVE)
+#undef BODY_ARRAY_MOVE
+    *(int*)pool_get(&physicsPersistent.bodyPool, physics_body_handle(i)) = i;
+    bodies.count--;
+    pool_free(&physicsPersistent.bodyPool, handle);
+
+    // indices past the end leave the sorted order with the next broadphase or reorder
+    verletBodies = -1;
+    idIndexValid = 0;
+    physicsStats.removedBodies++;
+    return 1;
+}
+
+static unsigned int spreadBits(unsigned int x) {
+    x &= 0x3FF;
+    x = (x | x << 16) & 0x030000FF;
+    x = (x | x << 8) & 0x0300F00F;
+    x = (x | x << 4) & 0x030C30C3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
+
+static void permuteBodies(void *array, size_t size, const int *order, void *scratch) {
+    unsigned char *src = array, *dst = scratch;
+    for (int k = 0; k < bodies.count; k++) {
+        memcpy(dst + k * size, src + order[k] * size, size);
+    }
+    memcpy(array, scratch, bodies.count * size);
+}
+
+// Brings the persistent sort order to the current bodies: removing bodies leaves indices past
+// the end, which are dropped, the rest are still each there once; new bodies go at the end.
+static void syncSortedBodies() {
+    if (physicsPersistent.sortedCount == bodies.count)
+        return;
+    int kept = 0;
+    for (int s = 0; s < physicsPersistent.sortedCount; s++) {
+        if (physicsPersistent.sortedBodies[s] < bodies.count)
+            physicsPersistent.sortedBodies[kept++] = physicsPersistent.sortedBodies[s];
+    }
+    physicsPersistent.sortedBodies = growArray(physicsPersistent.sortedBodies, &physicsPersistent.sortedCapacity, bodies.count, sizeof(int));
+    for (int i = kept; i < bodies.count; i++) {
+        physicsPersistent.sortedBodies[i] = i;
+    }
+    physicsPersistent.sortedCount = bodies.count;
+}
+
+// Sorts the bodies by the Morton code of their position in the world bounds; the sort is
+// stable, so ties stay in index order. Everything kept between steps that holds body indices is remapped; the contact
+// cache and simplices are keyed by id and stay as they are.
+static void reorderBodies() {
+    int count = bodies.count;
+    if (count > reorderCapacity) {
+        reorderCapacity = bodies.capacity;
+        reorderRemap = realloc(reorderRemap, reorderCapacity * sizeof(int));
+    }
+    unsigned int *codes = arena_alloc(&stepArena, count * sizeof(unsigned int));
+    int *order = arena_alloc(&stepArena, count * sizeof(int));
+    // no body array has elements larger than a float
+    void *scratch = arena_alloc(&stepArena, count * sizeof(float));
+    const float *min = physicsConfig.boundsMin, *max = physicsConfig.boundsMax;
+    float scale[3];
+    for (int k = 0; k < 3; k++) {
+        scale[k] = ((1 << MORTON_BITS) - 1) / fmaxf(max[k] - min[k], 1e-6f);
+    }
+    for (int i = 0; i < count; i++) {
+        float p[3] = {bodies.px[i], bodies.py[i], bodies.pz[i]};
+        unsigned int q[3];
+        for (int k = 0; k < 3; k++) {
+            float v = (p[k] - min[k]) * scale[k];
+            q[k] = v <= 0.0f ? 0 : v >= (1 << MORTON_BITS) - 1 ? (1 << MORTON_BITS) - 1 : (unsigned int)v;
+        }
+        codes[i] = spreadBits(q[0]) | spreadBits(q[1]) << 1 | spreadBits(q[2]) << 2;
+        order[i] = i;
+    }
+    sort_pairs32(codes, order, count);
+    for (int k = 0; k < count; k++) {
+        reorderRemap[order[k]] = k;
+    }
+
+#define BODY_ARRAY_PERMUTE(name) permuteBodies(bodies.name, sizeof(*bodies.name), order, scratch);
+    BODY_ARRAYS(BODY_ARRAY_PERMUTE)
+#undef BODY_ARRAY_PERMUTE
+    // bodies added since the last broadphase are not in the sort order yet
+    syncSortedBodies();
+    // sleeping islands are labelled with the index of their root body; other labels aren't
+    // kept up to date and can be past the end after a removal, so they start over as their own
+    for (int i = 0; i < count; i++) {
+        bodies.island[i] = isSleeping(i) ? reorderRemap[bodies.island[i]] : i;
+    }
+    for (int s = 0; s < physicsPersistent.sortedCount; s++) {
+        physicsPersistent.sortedBodies[s] = reorderRemap[physicsPersistent.sortedBodies[s]];
+    }
+    for (int i = 0; i < count; i++) {
+        *(int*)pool_get(&physicsPersistent.bodyPool, physics_body_handle(i)) = i;
+    }
+    verletBodies = -1;
+    idIndexValid = 0;
+    physicsStats.reorders++;
+}
+
+static void integrateVelocitiesRange(void *ctx, int begin, int end, int worker) {
+    const float *g = physicsConfig.gravity;
+    float dt = stepDt;
+
+    for (int i = begin; i < end; i++) {
+        if (!bodies.awake[i])
+            continue;
+        bodies.vx[i] += g[0] * dt;
+        bodies.vy[i] += g[1] * dt;
+        bodies.vz[i] += g[2] * dt;
+    }
+}
+
+// q += dt / 2 * (w, 0) * q, then one Newton step towards unit length instead of a square
+// root: near 1, 1 / sqrt(n) is about (3 - n) / 2, and every step starts almost normalized.
+static void integrateOrientation(int i, float h) {
+    float x = bodies.qx[i], y = bodies.qy[i], z = bodies.qz[i], w = bodies.qw[i];
+    float ax = bodies.wx[i] * h, ay = bodies.wy[i] * h, az = bodies.wz[i] * h;
+    float nx = x + (ax * w + ay * z - az * y);
+    float ny = y + (ay * w + az * x - ax * z);
+    float nz = z + (az * w + ax * y - ay * x);
+    float nw = w - (ax * x + ay * y + az * z);
+    float s = 0.5f * (3.0f - (nx * nx + ny * ny + nz * nz + nw * nw));
+    bodies.qx[i] = nx * s;
+    bodies.qy[i] = ny * s;
+    bodies.qz[i] = nz * s;
+    bodies.qw[i] = nw * s;
+}
+
+#ifdef __SSE2__
+// Four bodies per iteration straight from the arrays, in the same operation order as
+// integrateOrientation so both give the same bits. Sleeping bodies keep their orientation.
+static int integrateOrientationsSimd(int begin, int end, float h) {
+    __m128 half = _mm_set1_ps(h);
+    __m128 three = _mm_set1_ps(3.0f);
+    __m128 oneHalf = _mm_set1_ps(0.5f);
+    __m128 zero = _mm_setzero_ps();
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 awake = _mm_cmpneq_ps(_mm_setr_ps(bodies.awake[i], bodies.awake[i + 1], bodies.awake[i + 2], bodies.awake[i + 3]), zero);
+        __m128 x = _mm_loadu_ps(bodies.qx + i), y = _mm_loadu_ps(bodies.qy + i);
+        __m128 z = _mm_loadu_ps(bodies.qz + i), w = _mm_loadu_ps(bodies.qw + i);
+        __m128 ax = _mm_mul_ps(_mm_loadu_ps(bodies.wx + i), half);
+        __m128 ay = _mm_mul_ps(_mm_loadu_ps(bodies.wy + i), half);
+        __m128 az = _mm_mul_ps(_mm_loadu_ps(bodies.wz + i), half);
+        __m128 nx = _mm_add_ps(x, _mm_sub_ps(_mm_add_ps(_mm_mul_ps(ax, w), _mm_mul_ps(ay, z)), _mm_mul_ps(az, y)));
+        __m128 ny = _mm_add_ps(y, _mm_sub_ps(_mm_add_ps(_mm_mul_ps(ay, w), _mm_mul_ps(az, x)), _mm_mul_ps(ax, z)));
+        __m128 nz = _mm_add_ps(z, _mm_sub_ps(_mm_add_ps(_mm_mul_ps(az, w), _mm_mul_ps(ax, y)), _mm_mul_ps(ay, x)));
+        __m128 nw = _mm_sub_ps(w, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, x), _mm_mul_ps(ay, y)), _mm_mul_ps(az, z)));
+        __m128 n = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)), _mm_mul_ps(nw, nw));
+        __m128 s = _mm_mul_ps(oneHalf, _mm_sub_ps(three, n));
+        _mm_storeu_ps(bodies.qx + i, _mm_or_ps(_mm_and_ps(awake, _mm_mul_ps(nx, s)), _mm_andnot_ps(awake, x)));
+        _mm_storeu_ps(bodies.qy + i, _mm_or_ps(_mm_and_ps(awake, _mm_mul_ps(ny, s)), _mm_andnot_ps(awake, y)));
+        _mm_storeu_ps(bodies.qz + i, _mm_or_ps(_mm_and_ps(awake, _mm_mul_ps(nz, s)), _mm_andnot_ps(awake, z)));
+        _mm_storeu_ps(bodies.qw + i, _mm_or_ps(_mm_and_ps(awake, _mm_mul_ps(nw, s)), _mm_andnot_ps(awake, w)));
+    }
+    return i;
+}
+#endif
+
+static void integratePositionsRange(void *ctx, int begin, int end, int worker) {
+    float dt = stepDt;
+
+    for (int i = begin; i < end; i++) {
+        if (!bodies.awake[i])
+            continue;
+        if (bodies.flags[i] & BODY_CCD_STEPPED) {
+            bodies.flags[i] &= ~BODY_CCD_STEPPED;
+            continue;
+        }
+        bodies.px[i] += bodies.vx[i] * dt;
+        bodies.py[i] += bodies.vy[i] * dt;
+        bodies.pz[i] += bodies.vz[i] * dt;
+    }
+
+    // CCD only moves bullets, so they are rotated here like everything else
+    int i = begin;
+#ifdef __SSE2__
+    i = integrateOrientationsSimd(begin, end, 0.5f * dt);
+#endif
+    for (; i < end; i++) {
+        if (bodies.awake[i])
+            integrateOrientation(i, 0.5f * dt);
+    }
+}
+
+static void addPair(int worker, int i, int j) {
+    if (bodies.id[i] > bodies.id[j]) {
+        int t = i;
+        i = j;
+        j = t;
+    }
+    int n = workerPairCount[worker];
+    workerPairs[worker] = growWorkerArray(worker, workerPairs[worker], &workerPairCapacity[worker], n + 1, sizeof(BodyPair));
+    workerPairs[worker][n] = (BodyPair){i, j};
+    workerPairCount[worker] = n + 1;
+}
+
+// ctx points to the skin when building Verlet lists, which also keep pairs of sleeping
+// bodies since either may wake before the next rebuild.
+static void sweepRange(void *ctx, int begin, int end, int worker) {
+    float margin = ctx ? 0.5f * *(const float*)ctx : 0.0f;
+    for (int s = begin; s < end; s++) {
+        int i = physicsPersistent.sortedBodies[s];
+        float ri = bodies.radius[i] + margin;
+        float maxX = bodies.px[i] + ri;
+
+        for (int t = s + 1; t < physicsPersistent.sortedCount; t++) {
+            int j = physicsPersistent.sortedBodies[t];
+            float rj = bodies.radius[j] + margin;
+            if (bodies.px[j] - rj > maxX)
+                break;
+            if (!ctx && !bodies.awake[i] && !bodies.awake[j])
+                continue;
+            float r = ri + rj;
+            if (fabsf(bodies.py[i] - bodies.py[j]) > r || fabsf(bodies.pz[i] - bodies.pz[j]) > r)
+                continue;
+            addPair(worker, i, j);
+        }
+    }
+}
+
+// The pairs of the Verlet lists whose bounds overlap now.
+static void verletRange(void *ctx, int begin, int end, int worker) {
+    for (int k = begin; k < end; k++) {
+        int i = verletPairs[k].a, j = verletPairs[k].b;
+        if (!bodies.awake[i] && !bodies.awake[j])
+            continue;
+        float r = bodies.radius[i] + bodies.radius[j];
+        if (fabsf(bodies.px[i] - bodies.px[j]) > r || fabsf(bodies.py[i] - bodies.py[j]) > r
+            || fabsf(bodies.pz[i] - bodies.pz[j]) > r)
+            continue;
+        addPair(worker, i, j);
+    }
+}
+
+static void displacementRange(void *ctx, int begin, int end, int worker) {
+    float moved = workerDisplacement[worker];
+    for (int i = begin; i < end; i++) {
+        float dx = bodies.px[i] - verletX[i], dy = bodies.py[i] - verletY[i], dz = bodies.pz[i] - verletZ[i];
+        moved = fmaxf(moved, dx * dx + dy * dy + dz * dz);
+    }
+    workerDisplacement[worker] = moved;
+}
+
+static int workerPairTotal() {
+    int total = 0;
+    for (int w = 0; w < jobs_thread_count(); w++) {
+        total += workerPairCount[w];
+    }
+    return total;
+}
+
+static void gatherPairs(BodyPair *out) {
+    int count = 0;
+    for (int w = 0; w < jobs_thread_count(); w++) {
+        if (workerPairCount[w])
+            memcpy(out + count, workerPairs[w], workerPairCount[w] * sizeof(BodyPair));
+        count += workerPairCount[w];
+        workerPairCount[w] = 0;
+    }
+}
+
+// Pairs can only start to overlap after one of the bodies covered half the skin, so the
+// lists hold until then.
+static int verletListsValid() {
+    if (verletBodies != bodies.count)
+        return 0;
+    int workers = jobs_thread_count();
+    for (int w = 0; w < workers; w++) {
+        workerDisplacement[w] = 0.0f;
+    }
+    jobs_parallel_for(bodies.count, INTEGRATE_GRAIN, displacementRange, NULL);
+    float moved = 0.0f;
+    for (int w = 0; w < workers; w++) {
+        moved = fmaxf(moved, workerDisplacement[w]);
+    }
+    float half = 0.5f * physicsConfig.broadphaseSkin;
+    return moved <= half * half;
+}
+
+static void buildVerletLists() {
+    jobs_parallel_for(physicsPersistent.sortedCount, SWEEP_GRAIN, sweepRange, &physicsConfig.broadphaseSkin);
+    verletPairCount = workerPairTotal();
+    verletPairs = growArray(verletPairs, &verletPairCapacity, verletPairCount, sizeof(BodyPair));
+    gatherPairs(verletPairs);
+
+    if (bodies.count > verletCapacity) {
+        verletCapacity = bodies.capacity;
+        verletX = realloc(verletX, verletCapacity * sizeof(float));
+        verletY = realloc(verletY, verletCapacity * sizeof(float));
+        verletZ = realloc(verletZ, verletCapacity * sizeof(float));
+    }
+    memcpy(verletX, bodies.px, bodies.count * sizeof(float));
+    memcpy(verletY, bodies.py, bodies.count * sizeof(float));
+    memcpy(verletZ, bodies.pz, bodies.count * sizeof(float));
+    verletBodies = bodies.count;
+    physicsStats.verletRebuilds++;
+}
+
+// Pairs in order of the id of a, then of b.
+static void sortPairs() {
+    unsigned long long *sortKeys = arena_alloc(&stepArena, pairCount * sizeof(unsigned long long));
+    int *pairOrder = arena_alloc(&stepArena, pairCount * sizeof(int));
+    BodyPair *sortedPairs = arena_alloc(&stepArena, pairCount * sizeof(BodyPair));
+    for (int k = 0; k < pairCount; k++) {
+        sortKeys[k] = (unsigned long long)bodies.id[pairs[k].a] << 32 | bodies.id[pairs[k].b];
+        pairOrder[k] = k;
+    }
+    sort_pairs64(sortKeys, pairOrder, pairCount);
+    for (int k = 0; k < pairCount; k++) {
+        sortedPairs[k] = pairs[pairOrder[k]];
+    }
+    memcpy(pairs, sortedPairs, pairCount * sizeof(BodyPair));
+}
+
+// Sort and sweep along x, or with a skin a pass over the Verlet lists. Each worker collects
+// pairs in its own buffer and the buffers are concatenated in worker order, so without
+// deterministic mode the pair order depends on which worker happened to grab which chunk.
+static void broadphase() {
+    syncSortedBodies();
+    // by min x, ties by id; CCD queries the sorted bounds, so they stay current even when the lists hold
+    unsigned long long *sortKeys = arena_alloc(&stepArena, bodies.count * sizeof(unsigned long long));
+    for (int s = 0; s < physicsPersistent.sortedCount; s++) {
+        int i = physicsPersistent.sortedBodies[s];
+        sortKeys[s] = (unsigned long long)sort_float_key(bodies.px[i] - bodies.radius[i]) << 32 | bodies.id[i];
+    }
+    sort_pairs64(sortKeys, physicsPersistent.sortedBodies, physicsPersistent.sortedCount);
+    sortedMinX = arena_alloc(&stepArena, bodies.count * sizeof(float));
+    for (int s = 0; s < physicsPersistent.sortedCount; s++) {
+        int i = physicsPersistent.sortedBodies[s];
+        sortedMinX[s] = bodies.px[i] - bodies.radius[i];
+    }
+
+    int workers = jobs_thread_count();
+    for (int w = 0; w < workers; w++) {
+        workerPairCount[w] = 0;
+    }
+    if (physicsConfig.broadphaseSkin > 0.0f) {
+        if (!verletListsValid())
+            buildVerletLists();
+        jobs_parallel_for(verletPairCount, VERLET_GRAIN, verletRange, NULL);
+    }
+    else {
+        jobs_parallel_for(physicsPersistent.sortedCount, SWEEP_GRAIN, sweepRange, NULL);
+    }
+    pairCount = workerPairTotal();
+    pairs = arena_alloc(&stepArena, pairCount * sizeof(BodyPair));
+    gatherPairs(pairs);
+
+    if (physicsConfig.deterministic)
+        sortPairs();
+}
+
+static int sphereSphere(int a, int b, Manifold *m) {
+    float dx = bodies.px[b] - bodies.px[a];
+    float dy = bodies.py[b] - bodies.py[a];
+    float dz = bodies.pz[b] - bodies.pz[a];
+    float r = bodies.radius[a] + bodies.radius[b];
+    float d2 = dx * dx + dy * dy + dz * dz;
+    if (d2 >= r * r)
+        return 0;
+
+    float d = sqrtf(d2);
+    float *n = m->normal;
+    if (d > 1e-6f) {
+        n[0] = dx / d;
+        n[1] = dy / d;
+        n[2] = dz / d;
+    }
+    else {
+        n[0] = 0.0f;
+        n[1] = 1.0f;
+        n[2] = 0.0f;
+    }
+    ContactPoint *point = &m->points[0];
+    point->depth = r - d;
+    // midway between the surfaces
+    float t = bodies.radius[a] - 0.5f * point->depth;
+    point->position[0] = bodies.px[a] + n[0] * t;
+    point->position[1] = bodies.py[a] + n[1] * t;
+    point->position[2] = bodies.pz[a] + n[2] * t;
+    point->feature = 0;
+    m->count = 1;
+    return 1;
+}
+
+// Spheres against spheres stay analytic and boxes against boxes go through SAT; anything
+// else is GJK/EPA, warm started from the simplex the pair ended with last step.
+static void narrowphaseRange(void *ctx, int begin, int end, int worker) {
+    for (int k = begin; k < end; k++) {
+        int a = pairs[k].a;
+        int b = pairs[k].b;
+        unsigned long long key = (unsigned long long)bodies.id[a] << 32 | bodies.id[b];
+        PairSimplex *simplex = &pairSimplices[k];
+        simplex->key = key;
+        simplex->simplex.count = 0;
+
+        Manifold m = {.count = 0};
+        int shapeA = bodies.shape[a], shapeB = bodies.shape[b];
+        if (shapeA == SHAPE_SPHERE && shapeB == SHAPE_SPHERE) {
+            sphereSphere(a, b, &m);
+        }
+        else {
+            ConvexShape sa, sb;
+            narrow_body_shape(a, &sa);
+            narrow_body_shape(b, &sb);
+            if (shapeA == SHAPE_BOX && shapeB == SHAPE_BOX) {
+                narrow_collide_boxes(&sa, &sb, &m);
+            }
+            else {
+                const SimplexCache *previous = narrow_find_simplex(key);
+                if (previous) {
+                    simplex->simplex = *previous;
+                    workerGjk[worker][1]++;
+                }
+                workerGjk[worker][0]++;
+                narrow_collide_convex(&sa, &sb, &simplex->simplex, &m);
+            }
+        }
+
+        pairContactCount[k] = m.count;
+        for (int p = 0; p < m.count; p++) {
+            Contact *c = &pairContacts[k * NARROW_MAX_POINTS + p];
+            c->a = a;
+            c->b = b;
+            c->nx = m.normal[0];
+            c->ny = m.normal[1];
+            c->nz = m.normal[2];
+            c->px = m.points[p].position[0];
+            c->py = m.points[p].position[1];
+            c->pz = m.points[p].position[2];
+            c->depth = m.points[p].depth;
+            c->key = key;
+            c->feature = m.points[p].feature;
+        }
+    }
+}
+
+static void wallContact(int i, int wall, float depth, const float point[3], unsigned int feature, Contact *c) {
+    int axis = wall / 2;
+    // the normal points from the body into the wall
+    float normal[3] = {0.0f, 0.0f, 0.0f};
+    normal[axis] = wall & 1 ? 1.0f : -1.0f;
+    c->a = i;
+    c->b = -1;
+    c->nx = normal[0];
+    c->ny = normal[1];
+    c->nz = normal[2];
+    c->depth = depth;
+    // midway between the point inside the wall and the wall surface
+    c->px = point[0] - normal[0] * 0.5f * depth;
+    c->py = point[1] - normal[1] * 0.5f * depth;
+    c->pz = point[2] - normal[2] * 0.5f * depth;
+    c->key = (unsigned long long)bodies.id[i] << 32 | (0xFFFFFFF0u + wall);
+    c->feature = feature;
+}
+
+// A sphere touches each wall in one point, a box with up to four of its corners.
+static int boxWallContacts(int i, int axis, Contact *out) {
+    const float *min = physicsConfig.boundsMin;
+    const float *max = physicsConfig.boundsMax;
+    float r[9];
+    physics_body_rotation(i, r);
+    float h = bodies.halfExtent[i];
+    float p[3] = {bodies.px[i], bodies.py[i], bodies.pz[i]};
+
+    float extent = h * (fabsf(r[axis * 3]) + fabsf(r[axis * 3 + 1]) + fabsf(r[axis * 3 + 2]));
+    float depthMin = min[axis] - (p[axis] - extent);
+    float depthMax = p[axis] + extent - max[axis];
+    if (depthMin <= 0.0f && depthMax <= 0.0f)
+        return 0;
+    int wall = depthMin > depthMax ? axis * 2 : axis * 2 + 1;
+
+    // corners inside the wall, deepest first
+    float corners[8][3], depths[8];
+    int order[8], n = 0;
+    for (int k = 0; k < 8; k++) {
+        float local[3] = {k & 1 ? h : -h, k & 2 ? h : -h, k & 4 ? h : -h};
+        for (int j = 0; j < 3; j++) {
+            corners[k][j] = p[j] + r[j * 3] * local[0] + r[j * 3 + 1] * local[1] + r[j * 3 + 2] * local[2];
+        }
+        depths[k] = wall & 1 ? corners[k][axis] - max[axis] : min[axis] - corners[k][axis];
+        if (depths[k] <= 0.0f)
+            continue;
+        int at = n++;
+        while (at > 0 && depths[order[at - 1]] < depths[k]) {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = k;
+    }
+    if (n > 4)
+        n = 4;
+    for (int c = 0; c < n; c++) {
+        wallContact(i, wall, depths[order[c]], corners[order[c]], order[c], &out[c]);
+    }
+    return n;
+}
+
+// Each body touches at most three walls of the bounds at once, one per axis.
+static void wallRange(void *ctx, int begin, int end, int worker) {
+    const float *min = physicsConfig.boundsMin;
+    const float *max = physicsConfig.boundsMax;
+
+    for (int i = begin; i < end; i++) {
+        int n = 0;
+        Contact *out = &wallContacts[i * WALL_CONTACTS];
+        if (bodies.awake[i]) {
+            float p[3] = {bodies.px[i], bodies.py[i], bodies.pz[i]};
+            float r = bodies.radius[i];
+            for (int axis = 0; axis < 3; axis++) {
+                if (bodies.shape[i] == SHAPE_BOX) {
+                    n += boxWallContacts(i, axis, out + n);
+                    continue;
+                }
+                float depthMin = min[axis] - (p[axis] - r);
+                float depthMax = p[axis] + r - max[axis];
+                if (depthMin <= 0.0f && depthMax <= 0.0f)
+                    continue;
+                int wall = depthMin > depthMax ? axis * 2 : axis * 2 + 1;
+                float point[3] = {p[0], p[1], p[2]};
+                point[axis] += wall & 1 ? r : -r;
+                wallContact(i, wall, fmaxf(depthMin, depthMax), point, 0, &out[n++]);
+            }
+        }
+        wallContactCount[i] = n;
+    }
+}
+
+static void addMeshContacts(int worker, int i, const Manifold *m, unsigned int triangle) {
+    workerMeshContacts[worker] = growWorkerArray(worker, workerMeshContacts[worker], &workerMeshCapacity[worker], workerMeshCount[worker] + m->count, sizeof(Contact));
+    for (int p = 0; p < m->count; p++) {
+        Contact *c = &workerMeshContacts[worker][workerMeshCount[worker]++];
+        c->a = i;
+        c->b = -1;
+        c->nx = m->normal[0];
+        c->ny = m->normal[1];
+        c->nz = m->normal[2];
+        c->px = m->points[p].position[0];
+        c->py = m->points[p].position[1];
+        c->pz = m->points[p].position[2];
+        c->depth = m->points[p].depth;
+        // the top bit keeps triangle keys apart from body ids, the walls use the top 16 values
+        c->key = (unsigned long long)bodies.id[i] << 32 | (0x80000000u + triangle);
+        c->feature = m->points[p].feature;
+    }
+}
+
+// One point where the sphere reaches below the zero level of the field, pushed out along the gradient.
+static int sphereSdf(const SdfField *sdf, const float p[3], float r, Manifold *m) {
+    float gradient[3];
+    float d = sdf_sample(sdf, p, gradient);
+    float length = sqrtf(gradient[0] * gradient[0] + gradient[1] * gradient[1] + gradient[2] * gradient[2]);
+    if (d >= r || length < 1e-6f)
+        return 0;
+    ContactPoint *point = &m->points[0];
+    point->depth = r - d;
+    float t = r - 0.5f * point->depth;
+    for (int k = 0; k < 3; k++) {
+        m->normal[k] = -gradient[k] / length;
+        point->position[k] = p[k] + m->normal[k] * t;
+    }
+    point->feature = 0;
+    m->count = 1;
+    return 1;
+}
+
+// Awake bodies against the triangles of every mesh under their bounding sphere's box, or
+// against its SDF for spheres when the mesh has one.
+static void meshRange(void *ctx, int begin, int end, int worker) {
+    for (int i = begin; i < end; i++) {
+        meshContactWorker[i] = worker;
+        meshContactStart[i] = workerMeshCount[worker];
+        if (!bodies.awake[i]) {
+            meshContactCount[i] = 0;
+            continue;
+        }
+        float p[3] = {bodies.px[i], bodies.py[i], bodies.pz[i]};
+        float r = bodies.radius[i];
+        float min[3] = {p[0] - r, p[1] - r, p[2] - r};
+        float max[3] = {p[0] + r, p[1] + r, p[2] + r};
+        ConvexShape box;
+        if (bodies.shape[i] == SHAPE_BOX)
+            narrow_body_shape(i, &box);
+
+        for (int m = 0; m < meshes.count; m++) {
+            const TriangleMesh *mesh = &meshes.items[m];
+            if (mesh->sdf && bodies.shape[i] == SHAPE_SPHERE) {
+                Manifold manifold = {.count = 0};
+                // one contact per mesh, keyed by its first triangle
+                if (sphereSdf(mesh->sdf, p, r, &manifold))
+                    addMeshContacts(worker, i, &manifold, mesh->firstTriangle);
+                continue;
+            }
+            int found = mesh_query(mesh, min, max, workerTriangles[worker], workerTriangleCapacity[worker]);
+            if (found > workerTriangleCapacity[worker]) {
+                workerTriangles[worker] = growWorkerArray(worker, workerTriangles[worker], &workerTriangleCapacity[worker], found, sizeof(int));
+                mesh_query(mesh, min, max, workerTriangles[worker], workerTriangleCapacity[worker]);
+            }
+            const int *triangles = workerTriangles[worker];
+            for (int t = 0; t < found; t++) {
+                float triangle[9];
+                mesh_triangle(mesh, triangles[t], triangle);
+                Manifold manifold = {.count = 0};
+                if (bodies.shape[i] == SHAPE_BOX)
+                    narrow_collide_box_triangle(&box, triangle, &manifold);
+                else
+                    narrow_collide_sphere_triangle(p, r, triangle, &manifold);
+                if (manifold.count)
+                    addMeshContacts(worker, i, &manifold, mesh->firstTriangle + triangles[t]);
+            }
+        }
+        meshContactCount[i] = workerMeshCount[worker] - meshContactStart[i];
+    }
+}
+
+static void meshContacts() {
+    memset(workerMeshCount, 0, sizeof(workerMeshCount));
+    jobs_parallel_for(bodies.count, NARROWPHASE_GRAIN, meshRange, NULL);
+
+    int total = 0;
+    for (int w = 0; w < jobs_thread_count(); w++) {
+        total += workerMeshCount[w];
+    }
+    if (contactCount + total > contactCapacity) {
+        contacts = arena_grow(&stepArena, contacts, contactCapacity * sizeof(Contact), (contactCount + total) * sizeof(Contact));
+        contactCapacity = contactCount + total;
+    }
+    for (int i = 0; i < bodies.count; i++) {
+        const Contact *found = &workerMeshContacts[meshContactWorker[i]][meshContactStart[i]];
+        for (int n = 0; n < meshContactCount[i]; n++) {
+            contacts[contactCount++] = found[n];
+        }
+    }
+}
+
+static void narrowphase() {
+    pairContacts = arena_alloc(&stepArena, pairCount * NARROW_MAX_POINTS * sizeof(Contact));
+    pairContactCount = arena_alloc(&stepArena, pairCount * sizeof(int));
+    pairSimplices = arena_alloc(&stepArena, pairCount * sizeof(PairSimplex));
+    memset(workerGjk, 0, sizeof(workerGjk));
+    jobs_parallel_for(pairCount, NARROWPHASE_GRAIN, narrowphaseRange, NULL);
+
+    wallContacts = arena_alloc(&stepArena, bodies.count * WALL_CONTACTS * sizeof(Contact));
+    wallContactCount = arena_alloc(&stepArena, bodies.count * sizeof(int));
+    if (meshes.count) {
+        meshContactStart = arena_alloc(&stepArena, bodies.count * sizeof(int));
+        meshContactCount = arena_alloc(&stepArena, bodies.count * sizeof(int));
+        meshContactWorker = arena_alloc(&stepArena, bodies.count);
+    }
+    // allocated last, so the mesh contacts extend it in place
+    contactCapacity = pairCount * NARROW_MAX_POINTS + bodies.count * WALL_CONTACTS;
+    contacts = arena_alloc(&stepArena, contactCapacity * sizeof(Contact));
+    contactCount = 0;
+    int simplexCount = 0;
+    for (int k = 0; k < pairCount; k++) {
+        for (int p = 0; p < pairContactCount[k]; p++) {
+            contacts[contactCount++] = pairContacts[k * NARROW_MAX_POINTS + p];
+        }
+        if (pairSimplices[k].simplex.count)
+            pairSimplices[simplexCount++] = pairSimplices[k];
+    }
+    narrow_store_simplices(pairSimplices, simplexCount);
+    physicsStats.gjkQueries = physicsStats.gjkWarmStarts = 0;
+    for (int w = 0; w < jobs_thread_count(); w++) {
+        physicsStats.gjkQueries += workerGjk[w][0];
+        physicsStats.gjkWarmStarts += workerGjk[w][1];
+    }
+    islands_wake_touched(contacts, contactCount);
+
+    jobs_parallel_for(bodies.count, INTEGRATE_GRAIN, wallRange, NULL);
+    for (int i = 0; i < bodies.count; i++) {
+        for (int n = 0; n < wallContactCount[i]; n++) {
+            contacts[contactCount++] = wallContacts[i * WALL_CONTACTS + n];
+        }
+    }
+    if (meshes.count)
+        meshContacts();
+}
+
+static void energyRange(void *ctx, int begin, int end, int worker) {
+    double sum = 0.0;
+    for (int i = begin; i < end; i++) {
+        if (bodies.invMass[i] == 0.0f)
+            continue;
+        double v2 = (double)bodies.vx[i] * bodies.vx[i]
+                  + (double)bodies.vy[i] * bodies.vy[i]
+                  + (double)bodies.vz[i] * bodies.vz[i];
+        sum += 0.5 * v2 / bodies.invMass[i];
+
+        // rotational energy with the angular velocity in the body frame
+        float r[9];
+        physics_body_rotation(i, r);
+        float w[3] = {bodies.wx[i], bodies.wy[i], bodies.wz[i]};
+        const float *invI[3] = {bodies.invIx, bodies.invIy, bodies.invIz};
+        for (int k = 0; k < 3; k++) {
+            double local = (double)r[k] * w[0] + (double)r[3 + k] * w[1] + (double)r[6 + k] * w[2];
+            sum += 0.5 * local * local / invI[k][i];
+        }
+    }
+
+    if (physicsConfig.deterministic)
+        chunkEnergy[begin / PHYSICS_REDUCE_CHUNK] = sum;
+    else
+        partialEnergy[worker] += sum;
+}
+
+// Per-worker partial sums depend on scheduling; per-chunk sums added in chunk order don't.
+static double kineticEnergy() {
+    int chunks = (bodies.count + PHYSICS_REDUCE_CHUNK - 1) / PHYSICS_REDUCE_CHUNK;
+    chunkEnergy = arena_alloc(&stepArena, chunks * sizeof(double));
+    memset(partialEnergy, 0, sizeof(partialEnergy));
+
+    jobs_parallel_for(bodies.count, PHYSICS_REDUCE_CHUNK, energyRange, NULL);
+
+    double total = 0.0;
+    if (physicsConfig.deterministic) {
+        for (int c = 0; c < chunks; c++) {
+            total += chunkEnergy[c];
+        }
+    }
+    else {
+        for (int w = 0; w < jobs_thread_count(); w++) {
+            total += partialEnergy[w];
+        }
+    }
+    return total;
+}
+
+static unsigned long long hashBytes(unsigned long long h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// FNV-1a over the step counter and every body's id, position, orientation and velocities.
+unsigned long long physics_state_hash() {
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    size_t size = bodies.count * sizeof(float);
+    h = hashBytes(h, &physicsStats.step, sizeof(physicsStats.step));
+    h = hashBytes(h, bodies.id, bodies.count * sizeof(unsigned int));
+    h = hashBytes(h, bodies.px, size);
+    h = hashBytes(h, bodies.py, size);
+    h = hashBytes(h, bodies.pz, size);
+    h = hashBytes(h, bodies.qx, size);
+    h = hashBytes(h, bodies.qy, size);
+    h = hashBytes(h, bodies.qz, size);
+    h = hashBytes(h, bodies.qw, size);
+    h = hashBytes(h, bodies.vx, size);
+    h = hashBytes(h, bodies.vy, size);
+    h = hashBytes(h, bodies.vz, size);
+    h = hashBytes(h, bodies.wx, size);
+    h = hashBytes(h, bodies.wy, size);
+    h = hashBytes(h, bodies.wz, size);
+    return h;
+}
+
+void physics_step(float dt) {
+    double start = now();
+    stepDt = dt;
+
+    resetArenas();
+    if (physicsConfig.reorderInterval && physicsStats.step % physicsConfig.reorderInterval == 0)
+        reorderBodies();
+    jobs_parallel_for(bodies.count, INTEGRATE_GRAIN, integrateVelocitiesRange, NULL);
+    broadphase();
+    narrowphase();
+    solver_solve(contacts, contactCount, dt);
+    ccd_advance(dt);
+    jobs_parallel_for(bodies.count, INTEGRATE_GRAIN, integratePositionsRange, NULL);
+    islands_update(contacts, contactCount);
+
+    physicsStats.step++;
+    physicsStats.pairs = pairCount;
+    physicsStats.verletPairs = physicsConfig.broadphaseSkin > 0.0f ? verletPairCount : 0;
+    physicsStats.contacts = contactCount;
+    physicsStats.kineticEnergy = kineticEnergy();
+    physicsStats.arenaHighWater = stepArena.highWater;
+    physicsStats.arenaAllocations = stepArena.heapAllocations;
+    for (int w = 0; w < JOBS_MAX_THREADS; w++) {
+        physicsStats.arenaHighWater += workerArenas[w].highWater;
+        physicsStats.arenaAllocations += workerArenas[w].heapAllocations;
+    }
+    physicsStats.bodySlots = physicsPersistent.bodyPool.capacity;
+    physicsStats.freeBodySlots = physicsPersistent.bodyPool.capacity - physicsPersistent.bodyPool.count;
+    physicsStats.stateHash = physicsConfig.deterministic ? physics_state_hash() : 0;
+    physicsStats.stepTime = now() - start;
+}
@@ -0,0 +1,199 @@
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include "pool.h"
+
+#define PHYSICS_REDUCE_CHUNK 1024
+
+enum {
+    SHAPE_SPHERE,
+    SHAPE_BOX,
+    // convex point clouds, only for narrowphase queries so far
+    SHAPE_HULL
+};
+
+// Body data is stored as structure of arrays so the per-body kernels stream through memory.
+typedef struct {
+    int count;
+    int capacity;
+    unsigned int *id;
+    float *px, *py, *pz;
+    // orientation quaternion, x y z w
+    float *qx, *qy, *qz, *qw;
+    float *vx, *vy, *vz;
+    // angular velocity in world space
+    float *wx, *wy, *wz;
+    // radius of the bounding sphere, the shape itself for spheres
+    float *radius;
+    // boxes are cubes with this half extent, 0 for spheres
+    float *halfExtent;
+    float *invMass;
+    // inverse principal moments of inertia in the body frame, 0 for static bodies
+    float *invIx, *invIy, *invIz;
+    unsigned char *shape;
+    unsigned char *flags;
+    // static bodies are never awake; sleeping bodies are skipped by integration and
+    // broadphase until a contact with an awake body wakes their island
+    unsigned char *awake;
+    unsigned short *sleepTimer;
+    int *island;
+    // slot in physicsPersistent.bodyPool, which holds the index of the body
+    int *slot;
+    // what the renderer draws the body with, 0 unless set
+    unsigned short *material;
+} Bodies;
+
+// Every per-body array, for code that has to copy or move all of them.
+#define BODY_ARRAYS(X) X(id) X(px) X(py) X(pz) X(qx) X(qy) X(qz) X(qw) X(vx) X(vy) X(vz) X(wx) X(wy) X(wz) \
+    X(radius) X(halfExtent) X(invMass) X(invIx) X(invIy) X(invIz) X(shape) X(flags) X(awake) X(sleepTimer) X(island) X(slot) X(material)
+
+enum {
+    // fast bodies with this flag are moved by continuous collision detection
+    BODY_BULLET = 1,
+    // set for the rest of the step once CCD has moved a body
+    BODY_CCD_STEPPED = 2
+};
+
+enum {
+    SOLVER_SERIAL,
+    SOLVER_COLORED,
+    SOLVER_COLORED_SIMD
+};
+
+typedef struct {
+    int a, b;
+} BodyPair;
+
+// b is -1 for contacts against the walls of the world bounds. The key identifies the
+// body pair (or body and wall) across steps, the feature one of the manifold points of
+// the pair. The normal points from a to b, the point lies midway between the surfaces.
+typedef struct {
+    int a, b;
+    float nx, ny, nz;
+    float px, py, pz;
+    float depth;
+    unsigned long long key;
+    unsigned int feature;
+} Contact;
+
+typedef struct {
+    // Deterministic mode gives bit-identical results for any thread count: pairs are
+    // processed in body id order and reductions are summed over fixed-size chunks in
+    // chunk order. The build also compiles with -ffp-contract=off so the compiler
+    // can't fuse multiply-adds differently between builds.
+    int deterministic;
+    int threads;
+    float gravity[3];
+    float boundsMin[3];
+    float boundsMax[3];
+    float restitution;
+    float restitutionThreshold;
+    float friction;
+    // fraction of the penetration beyond slop removed per step
+    float baumgarte;
+    float slop;
+    int solverIterations;
+    int solverMode;
+    // kinetic energy per unit mass under which a body counts as resting
+    float sleepEnergy;
+    // steps a whole island has to rest before it sleeps, 0 disables sleeping
+    int sleepSteps;
+    // bullets moving more than this fraction of their radius in a step go through CCD
+    float ccdThreshold;
+    // Above 0 the broadphase keeps Verlet lists: candidate pairs whose bounds, grown by half
+    // the skin each, overlap. They stand in for the sweep until some body has moved more than
+    // half the skin since they were built.
+    float broadphaseSkin;
+    // Every this many steps the bodies are put in Morton order of their position, so bodies
+    // close in space are close in memory; 0 never. Body indices change then, ids don't.
+    int reorderInterval;
+    unsigned long long seed;
+} PhysicsConfig;
+
+typedef struct {
+    unsigned long long step;
+    int pairs;
+    // Verlet list size and how many times the lists were built in total
+    int verletPairs;
+    int verletRebuilds;
+    // reorders so far, see physics_reorder_remap
+    int reorders;
+    // bodies removed so far, and the slots of the body pool with how many of them are free
+    int removedBodies;
+    int bodySlots;
+    int freeBodySlots;
+    int contacts;
+    float solverResidual;
+    int solverColors;
+    double solverTime;
+    int islands;
+    int awakeBodies;
+    int ccdBodies;
+    // bullets still hitting something after CCD_MAX_SUBSTEPS bounces, which stop there for the step
+    int ccdClamped;
+    // pairs that went through GJK and how many of them started from a cached simplex
+    int gjkQueries;
+    int gjkWarmStarts;
+    double kineticEnergy;
+    // most bytes the step arenas ever held at once, and how often they had to go to the heap
+    unsigned long long arenaHighWater;
+    int arenaAllocations;
+    unsigned long long stateHash;
+    double stepTime;
+} PhysicsStats;
+
+// State besides the bodies that the next step depends on; checkpoints save it.
+typedef struct {
+    unsigned long long rngState;
+    unsigned int nextId;
+    // broadphase body indices sorted by the min x of their bounds, kept between
+    // steps so the sort starts from an almost sorted order
+    int *sortedBodies;
+    int sortedCount;
+    int sortedCapacity;
+    // handle slots of the bodies, each holding the index of its body
+    Pool bodyPool;
+} PhysicsPersistent;
+
+// Bounds sorted by the last broadphase, for queries during a step.
+typedef struct {
+    const int *bodies;
+    const float *minX;
+    int count;
+} SortedBounds;
+
+extern Bodies bodies;
+extern PhysicsConfig physicsConfig;
+extern PhysicsStats physicsStats;
+extern PhysicsPersistent physicsPersistent;
+
+PhysicsConfig physics_default_config();
+void physics_init(PhysicsConfig config);
+void physics_shutdown();
+void physics_reserve_bodies(int count);
+// size is the radius of a sphere or the half extent of a box.
+int physics_add_body(const float position[3], const float velocity[3], float size, float mass, int shape);
+void physics_set_bullet(int body, int bullet);
+void physics_set_orientation(int body, const float quaternion[4]);
+void physics_set_angular_velocity(int body, const float angularVelocity[3]);
+void physics_set_material(int body, int material);
+// Rotation matrix of the body orientation, row-major with the body axes as columns.
+void physics_body_rotation(int body, float rotation[9]);
+void physics_step(float dt);
+SortedBounds physics_sorted_bounds();
+// Index of the body with this id, -1 if there is none. Indices returned by physics_add_body
+// only hold until the next reorder or removal, ids for good.
+int physics_body_index(unsigned int id);
+// New index of every old one for the last reorder, NULL before the first.
+const int *physics_reorder_remap();
+// Handles stay valid until their body is removed and are cheap to check after that: the slot's
+// generation no longer matches. The index a handle gives holds until bodies are removed or reordered.
+PoolHandle physics_body_handle(int body);
+// -1 for handles of removed bodies.
+int physics_handle_index(PoolHandle handle);
+// Moves the last body into the removed one's index. Returns 0 if the handle is stale.
+int physics_remove_body(PoolHandle handle);
+float physics_random();
+unsigned long long physics_state_hash();
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define POOL_MIN_CAPACITY 64
+
+void pool_init(Pool *pool, size_t itemSize) {
+    memset(pool, 0, sizeof(Pool));
+    pool->itemSize = itemSize;
+    pool->freeHead = -1;
+}
+
+void pool_destroy(Pool *pool) {
+    free(pool->items);
+    free(pool->generations);
+    free(pool->nextFree);
+    pool_init(pool, pool->itemSize);
+}
+
+static int grow(Pool *pool) {
+    int capacity = pool->capacity ? 2 * pool->capacity : POOL_MIN_CAPACITY;
+    unsigned char *items = realloc(pool->items, capacity * pool->itemSize);
+    unsigned int *generations = realloc(pool->generations, capacity * sizeof(unsigned int));
+    int *nextFree = realloc(pool->nextFree, capacity * sizeof(int));
+    if (items)
+        pool->items = items;
+    if (generations)
+        pool->generations = generations;
+    if (nextFree)
+        pool->nextFree = nextFree;
+    if (!items || !generations || !nextFree)
+        return 0;
+
+    // new slots go on the free list lowest first
+    for (int s = capacity - 1; s >= pool->capacity; s--) {
+        generations[s] = 1;
+        nextFree[s] = pool->freeHead;
+        pool->freeHead = s;
+    }
+    pool->capacity = capacity;
+    return 1;
+}
+
+PoolHandle pool_alloc(Pool *pool) {
+    if (pool->freeHead < 0 && !grow(pool))
+        return POOL_NULL;
+    int slot = pool->freeHead;
+    pool->freeHead = pool->nextFree[slot];
+    pool->nextFree[slot] = POOL_IN_USE;
+    pool->count++;
+    return pool_handle(pool, slot);
+}
+
+static int live(const Pool *pool, PoolHandle handle) {
+    unsigned int slot = (unsigned int)pool_slot(handle);
+    return slot < (unsigned int)pool->capacity && pool->nextFree[slot] == POOL_IN_USE
+        && pool->generations[slot] == (unsigned int)(handle >> 32);
+}
+
+int pool_free(Pool *pool, PoolHandle handle) {
+    if (!live(pool, handle))
+        return 0;
+    int slot = pool_slot(handle);
+    // generation 0 would make POOL_NULL a valid handle
+    if (++pool->generations[slot] == 0)
+        pool->generations[slot] = 1;
+    pool->nextFree[slot] = pool->freeHead;
+    pool->freeHead = slot;
+    pool->count--;
+    return 1;
+}
+
+void *pool_get(const Pool *pool, PoolHandle handle) {
+    if (!live(pool, handle))
+        return NULL;
+    return pool->items + (size_t)pool_slot(handle) * pool->itemSize;
+}
+
+PoolHandle pool_handle(const Pool *pool, int slot) {
+    return (PoolHandle)pool->generations[slot] << 32 | (unsigned int)slot;
+}
+
+int pool_slot(PoolHandle handle) {
+    return (int)(handle & 0xFFFFFFFFu);
+}
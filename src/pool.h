@@ -0,0 +1,39 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Slot in the low 32 bits, the slot's generation when the handle was made in the high ones.
+// Generations start at 1, so no handle is ever POOL_NULL.
+typedef unsigned long long PoolHandle;
+
+#define POOL_NULL 0ULL
+
+// Fixed size items in slots that are reused through a free list. Freeing a slot bumps its
+// generation, which makes every handle to the old item stale.
+typedef struct {
+    size_t itemSize;
+    unsigned char *items;
+    unsigned int *generations;
+    // next free slot after this one, -1 at the end of the list, POOL_IN_USE for live slots
+    int *nextFree;
+    int freeHead;
+    int count;
+    int capacity;
+} Pool;
+
+#define POOL_IN_USE -2
+
+void pool_init(Pool *pool, size_t itemSize);
+void pool_destroy(Pool *pool);
+// O(1) unless the pool is full, when it doubles. The item isn't cleared.
+PoolHandle pool_alloc(Pool *pool);
+// Returns 0 for stale or invalid handles.
+int pool_free(Pool *pool, PoolHandle handle);
+// The item, or NULL for stale or invalid handles.
+void *pool_get(const Pool *pool, PoolHandle handle);
+// Current handle of a live slot.
+PoolHandle pool_handle(const Pool *pool, int slot);
+int pool_slot(PoolHandle handle);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "program.h"
+#include "shadercache.h"
+
+#define MAX_STAGES 4
+#define MAX_PROGRAMS 32
+
+// the cache key of every live program built here, for removing its binary once it is replaced
+typedef struct {
+    GLuint program;
+    unsigned long long key;
+} ProgramKey;
+
+static ProgramKey programKeys[MAX_PROGRAMS];
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int checkStatus(GLuint objectID, PFNGLGETSHADERIVPROC ivFun, PFNGLGETSHADERINFOLOGPROC infoLogFun, GLenum statusType) {
+    GLint status;
+    ivFun(objectID, statusType, &status);
+    if (status != GL_TRUE) {
+        GLint logLen;
+        ivFun(objectID, GL_INFO_LOG_LENGTH, &logLen);
+
+        char buff[logLen];
+        infoLogFun(objectID, logLen, NULL, buff);
+        printf("ERROR COMPILING OBJECT %d: %s\n", objectID, buff);
+        return 0;
+    }
+    return 1;
+}
+
+int checkShader(GLuint shaderID) {
+    return checkStatus(shaderID, glGetShaderiv, glGetShaderInfoLog, GL_COMPILE_STATUS);
+}
+
+int checkProgram(GLuint programID) {
+    return checkStatus(programID, glGetProgramiv, glGetProgramInfoLog, GL_LINK_STATUS);
+}
+
+static ProgramKey *findKey(GLuint program) {
+    for (int p = 0; p < MAX_PROGRAMS; p++) {
+        if (programKeys[p].program == program)
+            return &programKeys[p];
+    }
+    return NULL;
+}
+
+// Without a free entry the program is not tracked, and its binary is just left when it's replaced.
+// Programs deleted elsewhere keep their entry until their name is handed out again.
+static GLuint remember(GLuint program, unsigned long long key) {
+    ProgramKey *entry = findKey(program);
+    if (!entry)
+        entry = findKey(0);
+    if (entry)
+        *entry = (ProgramKey){program, key};
+    return program;
+}
+
+void program_replace(GLuint program, GLuint replacement) {
+    ProgramKey *old = findKey(program);
+    ProgramKey *current = findKey(replacement);
+    if (old && (!current || current->key != old->key))
+        shadercache_remove(old->key);
+    if (old)
+        old->program = 0;
+    glDeleteProgram(program);
+}
+
+GLuint program_build(const GLenum *stages, const char **sources, int count) {
+    double start = now();
+    GLint binaryFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+    unsigned long long key = shadercache_key(stages, sources, count, (const char*)glGetString(GL_VENDOR),
+        (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION));
+
+    GLuint program = glCreateProgram();
+    if (binaryFormats > 0) {
+        unsigned int format;
+        size_t size;
+        void *binary = shadercache_load(key, &format, &size);
+        if (binary) {
+            glProgramBinary(program, format, binary, size);
+            free(binary);
+            GLint linked;
+            glGetProgramiv(program, GL_LINK_STATUS, &linked);
+            if (linked == GL_TRUE) {
+                printf("Loaded shader program %016llx from cache in %.2f ms\n", key, (now() - start) * 1000);
+                return remember(program, key);
+            }
+            shadercache_remove(key);
+            glDeleteProgram(program);
+            program = glCreateProgram();
+        }
+    }
+
+    GLuint shaders[MAX_STAGES];
+    int compiled = count <= MAX_STAGES;
+    for (int s = 0; s < count && s < MAX_STAGES; s++) {
+        shaders[s] = glCreateShader(stages[s]);
+        glShaderSource(shaders[s], 1, &sources[s], NULL);
+        glCompileShader(shaders[s]);
+        compiled = checkShader(shaders[s]) && compiled;
+        glAttachShader(program, shaders[s]);
+    }
+    if (compiled) {
+        if (binaryFormats > 0)
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+    }
+    for (int s = 0; s < count && s < MAX_STAGES; s++) {
+        glDeleteShader(shaders[s]);
+    }
+    if (!compiled || !checkProgram(program)) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    printf("Compiled shader program %016llx in %.2f ms\n", key, (now() - start) * 1000);
+
+    if (binaryFormats > 0) {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length > 0) {
+            void *binary = malloc(length);
+            GLenum format;
+            glGetProgramBinary(program, length, &length, &format, binary);
+            shadercache_store(key, format, binary, length);
+            free(binary);
+        }
+    }
+    return remember(program, key);
+}
@@ -0,0 +1,18 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <glad/glad.h>
+
+// Print the info log and return 0 if the shader didn't compile or the program didn't link.
+int checkShader(GLuint shaderID);
+int checkProgram(GLuint programID);
+// Links a program from count stages, or takes the binary a previous run linked from the same
+// sources on the same driver. A binary the driver rejects, after an update it didn't show in
+// its version string, is compiled again and replaced. Returns 0 if the sources don't compile or link.
+GLuint program_build(const GLenum *stages, const char **sources, int count);
+// Deletes program now that replacement took its place, with its cached binary unless the
+// replacement was built from the same sources: the old binary would only be loaded again
+// if an edit were undone.
+void program_replace(GLuint program, GLuint replacement);
+
+#endif
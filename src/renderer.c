@@ -1,113 +1,405 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <math.h>
 #include <stdio.h>
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "renderer.h"
+#include "physics.h"
+#include "instance.h"
+#include "arena.h"
+#include "texture.h"
+#include "assets.h"
+#include "program.h"
+#include "shaders.h"
 #include <cglm/cglm.h>
 
+// size of the material table in the fragment shader
+#define MAX_MATERIALS 16
+// bytes a frame may hand to the driver for streamed textures; a level larger than this goes alone
+#define UPLOAD_BUDGET (256 * 1024)
+// unchanged instances between two changed ones are uploaded along with them when there are
+// fewer than this, as a call costs more than copying a few hundred bytes
+#define UPLOAD_GAP 16
+
+#define FIELD_OF_VIEW 45.0f
+#define NEAR_PLANE 0.1f
+#define FAR_PLANE 100.0f
+// layers of the shadow map, each fitted to one slice of the view frustum
+#define SHADOW_CASCADES 4
+// texels per side of a cascade
+#define SHADOW_SIZE 2048
+// how far in front of the camera shadows reach; the last cascade ends here
+#define SHADOW_DISTANCE 60.0f
+// 1 splits the cascades logarithmically, 0 evenly
+#define SHADOW_SPLIT_LAMBDA 0.75f
+// bodies this far beyond a cascade toward the light still cast into it
+#define SHADOW_CASTER_MARGIN 30.0f
+
+// from EXT_texture_compression_s3tc, which glad doesn't load
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
 GLFWwindow *window;
 GLuint vao;
 GLuint shader;
+// shaders_generation() when shader was last built
+unsigned int shaderGeneration;
 GLuint texture;
+GLuint instanceBuffer;
+// depth only, draws the same instances into each cascade
+GLuint shadowShader;
+GLuint shadowTexture;
+GLuint shadowFramebuffer;
+// the direction the light travels in, normalized at init
+vec3 lightDirection = {-0.4f, -1.0f, -0.3f};
+
+// instances that pass frustum and occlusion culling, drawn indirectly by the main pass
+GLuint cullShader;
+GLuint visibleBuffer;
+GLuint visibleVao;
+int visibleCapacity;
+// a DrawArraysIndirectCommand whose instance count the culling pass fills in
+GLuint drawBuffer;
+int occlusionCulling = 1;
 
-vec3 positions[] = {
-    {0.0f, 0.0f, 0.0f},
-    {2.0f, 5.0f, -15.0f},
-    {-1.5f, -2.2f, -2.5f},
-    {-3.8f, -2.0f, -12.3f},
-    {2.4f, -0.4f, -3.5f},
-    {-1.7f, 3.0f, -7.5f},
-    {1.3f, -2.0f, -2.5f},
-    {1.5f, 2.0f, -2.5},
-    {1.5f, 0.2f, -1.5f},
-    {-1.3f, 1.0f, -1.5f}
+// the main pass renders here, so its depth can be read back into the pyramid
+GLuint sceneFramebuffer;
+GLuint sceneColor;
+GLuint sceneDepth;
+int sceneWidth, sceneHeight;
+// farthest depth of the last frame, each level half the size of the one before
+GLuint hizShader;
+GLuint hizTexture;
+int hizLevels;
+int hizValid;
+mat4 hizViewProjection;
+
+enum {
+    TIMER_SHADOW,
+    TIMER_CULL,
+    TIMER_MAIN,
+    TIMER_HIZ,
+    TIMER_COUNT
 };
 
-int checkStatus(GLuint objectID, PFNGLGETSHADERIVPROC ivFun, PFNGLGETSHADERINFOLOGPROC infoLogFun, GLenum statusType) {
-    GLint status;
-    ivFun(objectID, statusType, &status);
-    if (status != GL_TRUE) {
-        GLint logLen;
-        ivFun(objectID, GL_INFO_LOG_LENGTH, &logLen);
+// two frames of GPU timers, so reading one frame's results doesn't wait for the frame in flight
+GLuint timerQueries[2][TIMER_COUNT];
+int timerPending[2];
+int timerFrame;
+// instance counts of the frame that used each timer set, and the fence after its culling pass
+GLuint visibleCounts;
+int submittedCounts[2];
+GLsync cullFences[2];
+RendererStats rendererStats;
+
+// instances are only repacked and uploaded for bodies that were awake since the last frame
+Instance *instances;
+unsigned char *instanceAwake;
+int instanceCount;
+int instancesValid;
+// physicsStats.reorders as of the last update
+int instanceReorders;
+// physicsStats.removedBodies as of the last update; the last body moves into a removed one's index
+int instanceRemovals;
+// instances written on the GPU, drawn instead of the bodies while set
+GLuint externalInstances;
+int externalCount;
+// scratch memory for one frame
+Arena frameArena;
+
+typedef struct {
+    const char *texture;
+    float tint[3];
+} Material;
+
+// Every distinct texture is a layer of one texture array, so bodies of all materials are
+// drawn by one instanced draw; the instance's material picks the layer and the tint.
+const Material materials[] = {
+    {"textures/test.png", {1.0f, 1.0f, 1.0f}},
+    {"textures/planks.png", {1.0f, 1.0f, 1.0f}},
+    {"textures/test.png", {0.5f, 0.8f, 1.0f}},
+    {"textures/planks.png", {0.6f, 1.0f, 0.55f}}
+};
+const int materialCount = sizeof(materials) / sizeof(materials[0]);
+_Static_assert(sizeof(materials) / sizeof(materials[0]) <= MAX_MATERIALS, "too many materials for the shader");
+// tint and layer of every material, as the shader takes them
+GLfloat materialTable[MAX_MATERIALS][4];
+
+// A layer coming in from the asset loader, coarsest level first, each through the upload buffer.
+typedef struct {
+    const char *path;
+    int asset;
+    // next level to upload, -1 once they all are
+    int nextLevel;
+    size_t bytes;
+    int frames;
+    int failed;
+} LayerStream;
+
+LayerStream layers[MAX_MATERIALS];
+int layerCount;
+// the array all layers go into, made like the first layer that is loaded
+GLuint layerTexture;
+GLenum layerFormat;
+int layerLevels, layerWidth, layerHeight;
+GLuint placeholderTexture;
+GLuint uploadBuffer;
+
+void loadMaterials() {
+    for (int m = 0; m < materialCount; m++) {
+        int layer = 0;
+        while (layer < layerCount && strcmp(layers[layer].path, materials[m].texture) != 0) {
+            layer++;
+        }
+        if (layer == layerCount) {
+            layers[layerCount].path = materials[m].texture;
+            layers[layerCount].asset = -1;
+            layerCount++;
+        }
+        memcpy(materialTable[m], materials[m].tint, sizeof(materials[m].tint));
+        materialTable[m][3] = layer;
+    }
+
+    // grey and magenta checks on every layer until the real textures are up
+    unsigned char checks[4 * 4 * 4];
+    for (int i = 0; i < 16; i++) {
+        int odd = (i % 4 + i / 4) % 2;
+        checks[i * 4] = odd ? 255 : 128;
+        checks[i * 4 + 1] = odd ? 0 : 128;
+        checks[i * 4 + 2] = odd ? 255 : 128;
+        checks[i * 4 + 3] = 255;
+    }
+    glGenTextures(1, &placeholderTexture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, placeholderTexture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, 4, 4, layerCount);
+    for (int l = 0; l < layerCount; l++) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, l, 4, 4, 1, GL_RGBA, GL_UNSIGNED_BYTE, checks);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    texture = placeholderTexture;
+
+    glGenBuffers(1, &uploadBuffer);
+    // BC1 halves the upload where the extension is there, BC7 is core since 4.2
+    int format = glfwExtensionSupported("GL_EXT_texture_compression_s3tc") ? TEXTURE_BC1 : TEXTURE_BC7;
+    for (int l = 0; l < layerCount; l++) {
+        layers[l].asset = assets_request_texture(layers[l].path, format);
+        layers[l].failed = layers[l].asset < 0;
+    }
+}
+
+// Storage for every layer in the format and size of the first one loaded.
+void createLayerTexture(const TextureImage *image) {
+    layerFormat = image->format == TEXTURE_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+                : image->format == TEXTURE_BC7 ? GL_COMPRESSED_RGBA_BPTC_UNORM : GL_RGBA8;
+    layerLevels = image->levels;
+    layerWidth = image->width;
+    layerHeight = image->height;
+    glGenTextures(1, &layerTexture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, layerTexture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, layerLevels, layerFormat, layerWidth, layerHeight, layerCount);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    for (int l = 0; l < layerCount; l++) {
+        layers[l].nextLevel = layerLevels - 1;
+    }
+}
+
+typedef struct {
+    int layer;
+    int level;
+    size_t offset;
+} LayerUpload;
+
+void streamTextures() {
+    // levels of the layers that are ready, coarsest first, as many as fit the budget but at least one
+    LayerUpload uploads[MAX_MATERIALS * TEXTURE_MAX_LEVELS];
+    const TextureImage *images[MAX_MATERIALS];
+    int uploadCount = 0;
+    size_t bytes = 0;
+    for (int l = 0; l < layerCount; l++) {
+        LayerStream *stream = &layers[l];
+        if (stream->failed || stream->asset < 0)
+            continue;
+        int state = assets_state(stream->asset);
+        if (state == ASSET_FAILED) {
+            printf("Failed to load texture %s\n", stream->path);
+            stream->failed = 1;
+            continue;
+        }
+        if (state != ASSET_READY)
+            continue;
+        const TextureImage *image = assets_image(stream->asset);
+        if (!layerTexture)
+            createLayerTexture(image);
+        if (image->width != layerWidth || image->height != layerHeight || image->levels != layerLevels) {
+            printf("Texture %s is %dx%d, the material array is %dx%d\n", stream->path, image->width, image->height,
+                   layerWidth, layerHeight);
+            assets_release(stream->asset);
+            stream->failed = 1;
+            continue;
+        }
+        images[l] = image;
+        int uploaded = 0;
+        while (stream->nextLevel - uploaded >= 0) {
+            size_t size = image->size[stream->nextLevel - uploaded];
+            if (uploadCount > 0 && bytes + size > UPLOAD_BUDGET)
+                break;
+            uploads[uploadCount++] = (LayerUpload){l, stream->nextLevel - uploaded, bytes};
+            bytes += size;
+            uploaded++;
+        }
+    }
+    if (uploadCount == 0)
+        return;
+
+    // orphaned every frame, so the copy never waits for the last transfer out of it
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadBuffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    unsigned char *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!staging) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return;
+    }
+    for (int u = 0; u < uploadCount; u++) {
+        const TextureImage *image = images[uploads[u].layer];
+        memcpy(staging + uploads[u].offset, image->data[uploads[u].level], image->size[uploads[u].level]);
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, layerTexture);
+    for (int u = 0; u < uploadCount; u++) {
+        LayerStream *stream = &layers[uploads[u].layer];
+        const TextureImage *image = images[uploads[u].layer];
+        int level = uploads[u].level;
+        int w = texture_level_width(image, level), h = texture_level_height(image, level);
+        void *offset = (void*)uploads[u].offset;
+        if (image->format == TEXTURE_RGBA8)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, uploads[u].layer, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, offset);
+        else
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, uploads[u].layer, w, h, 1, layerFormat, image->size[level], offset);
+        if (stream->nextLevel == level)
+            stream->frames++;
+        stream->nextLevel = level - 1;
+        stream->bytes += image->size[level];
+        if (level == 0) {
+            printf("Streamed %s, %d levels in %zu KB, loaded %.2f ms after the request and uploaded over %d frames\n",
+                   stream->path, image->levels, stream->bytes / 1024, assets_load_time(stream->asset) * 1000.0, stream->frames);
+            assets_release(stream->asset);
+            stream->asset = -1;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // sampling starts at the finest level every layer has, once each has one
+    int base = 0;
+    for (int l = 0; l < layerCount; l++) {
+        if (!layers[l].failed && layers[l].nextLevel + 1 > base)
+            base = layers[l].nextLevel + 1;
+    }
+    if (base < layerLevels) {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, base);
+        texture = layerTexture;
+    }
+}
+
+int renderer_material_count() {
+    return materialCount;
+}
 
-        char buff[logLen];
-        infoLogFun(objectID, logLen, NULL, buff);
-        printf("ERROR COMPILING OBJECT %d: %s\n", objectID, buff);
+// Builds *program from files in shaders/. The program in use stays if the files can't be read
+// or don't compile, so a broken edit only costs its error message.
+int loadProgram(GLuint *program, const GLenum *stages, const char **files, int count) {
+    char *sources[2] = {NULL, NULL};
+    int read = 1;
+    for (int s = 0; s < count; s++) {
+        sources[s] = shaders_read(files[s]);
+        read = read && sources[s];
+    }
+    GLuint built = read ? program_build(stages, (const char**)sources, count) : 0;
+    for (int s = 0; s < count; s++) {
+        free(sources[s]);
+    }
+    if (!built) {
+        if (*program)
+            printf("Keeping the previous %s program\n", files[0]);
         return 0;
     }
+    if (*program)
+        program_replace(*program, built);
+    *program = built;
     return 1;
 }
 
-int checkShader(GLuint shaderID) {
-    return checkStatus(shaderID, glGetShaderiv, glGetShaderInfoLog, GL_COMPILE_STATUS);
-}
-
-int checkProgram(GLuint programID) {
-    return checkStatus(programID, glGetProgramiv, glGetProgramInfoLog, GL_LINK_STATUS);
-}
-
-void loadTexture() {
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    int width, height, nrChannels;
-    unsigned char *data = stbi_load("textures/test.png", &width, &height, &nrChannels, 0);
-    if (data) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        printf("Failed to load texture\n");
-    }
-    stbi_image_free(data);
-}
-
-void compileShaderProgram() {
-    const char *vertexShaderSource =
-        "#version 430 core\n"
-        "in vec3 pos;"
-        "in vec2 textCoord;"
-        "out vec2 coord;"
-        "uniform mat4 model;"
-        "uniform mat4 view;"
-        "uniform mat4 projection;"
-        "void main() {"
-        "   gl_Position = projection * view * model * vec4(pos, 1.0);"
-        "   coord = textCoord;"
-        "}";
-    const char *fragmentShaderSource =
-        "#version 430 core\n"
-        "out vec4 fragColor;"
-        "in vec2 coord;"
-        "uniform sampler2D text;"
-        "void main() {"
-        "   fragColor = texture(text, coord);"
-        "}";
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-
-    if (!checkShader(vertexShader) || !checkShader(fragmentShader))
+// Returns how many of the programs were rebuilt.
+int loadShaderPrograms() {
+    GLenum stages[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+    const char *bodyFiles[] = {"body.vert", "body.frag"};
+    const char *shadowFiles[] = {"shadow.vert"};
+    int loaded = loadProgram(&shader, stages, bodyFiles, 2);
+    if (loaded) {
+        glUseProgram(shader);
+        glUniform4fv(glGetUniformLocation(shader, "materials"), materialCount, &materialTable[0][0]);
+        glUniform1ui(glGetUniformLocation(shader, "materialCount"), materialCount);
+        glUniform1i(glGetUniformLocation(shader, "text"), 0);
+        glUniform1i(glGetUniformLocation(shader, "shadowMap"), 1);
+    }
+    GLenum compute = GL_COMPUTE_SHADER;
+    const char *cullFiles[] = {"cull.comp"};
+    const char *hizFiles[] = {"hiz.comp"};
+    loaded += loadProgram(&shadowShader, stages, shadowFiles, 1);
+    loaded += loadProgram(&cullShader, &compute, cullFiles, 1);
+    return loaded + loadProgram(&hizShader, &compute, hizFiles, 1);
+}
+
+// Between frames, so no draw ever sees half of an edit.
+void reloadShaders() {
+    unsigned int generation = shaders_generation();
+    if (generation == shaderGeneration)
         return;
+    shaderGeneration = generation;
+    if (loadShaderPrograms())
+        printf("Reloaded shaders\n");
+}
+
+// Points the instanced attributes of a vertex array at a buffer of Instance records.
+void bindInstanceAttributes(GLuint vertexArray, GLuint buffer) {
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, position));
+    glVertexAttribDivisor(2, 1);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_SHORT, GL_TRUE, sizeof(Instance), (void*)offsetof(Instance, rotation));
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(4);
+    glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(Instance), (void*)offsetof(Instance, material));
+    glVertexAttribDivisor(4, 1);
+}
 
-    shader = glCreateProgram();
-    glAttachShader(shader, fragmentShader);
-    glAttachShader(shader, vertexShader);
-    glLinkProgram(shader);
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+void renderer_use_instances(GLuint buffer, int count) {
+    externalInstances = buffer;
+    externalCount = count;
+    bindInstanceAttributes(vao, buffer ? buffer : instanceBuffer);
+    instancesValid = 0;
+}
 
-    if (!checkProgram(shader))
-        return;
+GLuint createVertexArray(GLuint cube, GLuint instances) {
+    GLuint vertexArray;
+    glGenVertexArrays(1, &vertexArray);
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, cube);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), NULL);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (char*)(sizeof(GLfloat)*3));
+    bindInstanceAttributes(vertexArray, instances);
+    return vertexArray;
 }
 
 void setupRenderer() {
@@ -160,12 +452,262 @@ void setupRenderer() {
     glBindBuffer(GL_ARRAY_BUFFER, bufferID);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
-    glGenVertexArrays(1, &vao);
+    // one Instance per body, advanced once per instance
+    glGenBuffers(1, &instanceBuffer);
+    vao = createVertexArray(bufferID, instanceBuffer);
+    // the same cube over the instances that survive culling
+    glGenBuffers(1, &visibleBuffer);
+    visibleVao = createVertexArray(bufferID, visibleBuffer);
+    glGenBuffers(1, &drawBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, 4 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void createShadowMap() {
+    glm_vec3_normalize(lightDirection);
+    glGenTextures(1, &shadowTexture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowTexture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F, SHADOW_SIZE, SHADOW_SIZE, SHADOW_CASCADES);
+    // linear filtering of a comparison gives 2x2 PCF per tap
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    GLfloat far[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, far);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+    glGenFramebuffers(1, &shadowFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glGenQueries(2 * TIMER_COUNT, &timerQueries[0][0]);
+    glGenBuffers(1, &visibleCounts);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, visibleCounts);
+    glBufferData(GL_COPY_WRITE_BUFFER, 2 * sizeof(GLuint), NULL, GL_DYNAMIC_READ);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Splits the view frustum up to SHADOW_DISTANCE and fits an orthographic light projection
+// around each slice, returning the view depth each one ends at.
+void fitCascades(mat4 view, float aspect, mat4 matrices[SHADOW_CASCADES], float ends[SHADOW_CASCADES]) {
+    float begin = NEAR_PLANE;
+    for (int c = 0; c < SHADOW_CASCADES; c++) {
+        float t = (c + 1) / (float)SHADOW_CASCADES;
+        float end = SHADOW_SPLIT_LAMBDA * NEAR_PLANE * powf(SHADOW_DISTANCE / NEAR_PLANE, t)
+                  + (1.0f - SHADOW_SPLIT_LAMBDA) * (NEAR_PLANE + (SHADOW_DISTANCE - NEAR_PLANE) * t);
+        mat4 projection, viewProjection, inverse;
+        glm_perspective(glm_rad(FIELD_OF_VIEW), aspect, begin, end, projection);
+        glm_mat4_mul(projection, view, viewProjection);
+        glm_mat4_inv(viewProjection, inverse);
+        vec4 corners[8];
+        glm_frustum_corners(inverse, corners);
+
+        // a sphere around the slice keeps the cascade the same size however the camera turns
+        vec3 center = {0.0f, 0.0f, 0.0f};
+        for (int k = 0; k < 8; k++) {
+            glm_vec3_muladds(corners[k], 1.0f / 8.0f, center);
+        }
+        float radius = 0.0f;
+        for (int k = 0; k < 8; k++) {
+            vec3 d;
+            glm_vec3_sub(corners[k], center, d);
+            radius = fmaxf(radius, glm_vec3_norm(d));
+        }
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        vec3 eye, up = {0.0f, 1.0f, 0.0f};
+        glm_vec3_scale(lightDirection, -(radius + SHADOW_CASTER_MARGIN), eye);
+        glm_vec3_add(center, eye, eye);
+        mat4 lightView, lightProjection;
+        glm_lookat(eye, center, up, lightView);
+        glm_ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius + SHADOW_CASTER_MARGIN, lightProjection);
+        glm_mat4_mul(lightProjection, lightView, matrices[c]);
+
+        // move the projection by whole texels, so shadow edges don't crawl as the camera moves
+        vec4 origin = {0.0f, 0.0f, 0.0f, 1.0f}, projected;
+        glm_mat4_mulv(matrices[c], origin, projected);
+        float texels = SHADOW_SIZE * 0.5f;
+        matrices[c][3][0] += (roundf(projected[0] * texels) - projected[0] * texels) / texels;
+        matrices[c][3][1] += (roundf(projected[1] * texels) - projected[1] * texels) / texels;
+        ends[c] = end;
+        begin = end;
+    }
+}
+
+// Depth of every instance into each cascade, with the same vertex buffers as the main pass.
+void renderShadows(mat4 matrices[SHADOW_CASCADES], int count) {
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+    glViewport(0, 0, SHADOW_SIZE, SHADOW_SIZE);
+    glUseProgram(shadowShader);
+    GLint matrixLoc = glGetUniformLocation(shadowShader, "lightViewProjection");
+    // slope-scaled, against acne on faces at a grazing angle to the light
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
     glBindVertexArray(vao);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), NULL);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (char*)(sizeof(GLfloat)*3));
+    for (int c = 0; c < SHADOW_CASCADES; c++) {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowTexture, 0, c);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUniformMatrix4fv(matrixLoc, 1, GL_FALSE, &matrices[c][0][0]);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 36, count);
+    }
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Adds up the timers of the frame that used this set two frames ago, unless the GPU is still
+// on it: that frame goes untimed rather than stalling this one.
+void collectTimers(int set) {
+    if (!timerPending[set])
+        return;
+    timerPending[set] = 0;
+    GLint available = 0;
+    glGetQueryObjectiv(timerQueries[set][TIMER_COUNT - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return;
+    GLuint64 times[TIMER_COUNT];
+    for (int t = 0; t < TIMER_COUNT; t++) {
+        glGetQueryObjectui64v(timerQueries[set][t], GL_QUERY_RESULT, &times[t]);
+    }
+    rendererStats.shadowTime += times[TIMER_SHADOW] * 1e-9;
+    rendererStats.cullTime += (times[TIMER_CULL] + times[TIMER_HIZ]) * 1e-9;
+    rendererStats.mainTime += times[TIMER_MAIN] * 1e-9;
+    rendererStats.timedFrames++;
+}
+
+// The share of instances the culling pass of the frame two back rejected. Its fence has
+// passed by now unless the GPU is far behind, in which case the last figure stays.
+void collectCulling(int set) {
+    if (!cullFences[set])
+        return;
+    GLenum status = glClientWaitSync(cullFences[set], 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        return;
+    glDeleteSync(cullFences[set]);
+    cullFences[set] = 0;
+    GLuint visible;
+    glBindBuffer(GL_COPY_READ_BUFFER, visibleCounts);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, set * sizeof(GLuint), sizeof(GLuint), &visible);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    int count = submittedCounts[set];
+    rendererStats.visible = visible;
+    rendererStats.culledPercent = count ? 100.0 * (count - (int)visible) / count : 0.0;
+    rendererStats.culledSum += rendererStats.culledPercent;
+    rendererStats.culledFrames++;
+
+    // in the title, where it updates every frame without flooding the terminal
+    int shown = (int)(rendererStats.culledPercent + 0.5);
+    if (shown != rendererStats.shownPercent) {
+        rendererStats.shownPercent = shown;
+        char title[96];
+        snprintf(title, sizeof(title), "Collision Simulation - %d%% of %d instances culled", shown, count);
+        glfwSetWindowTitle(window, title);
+    }
+}
+
+// Main pass targets the size of the window, and a depth pyramid to match.
+void resizeTargets(int width, int height) {
+    if (width == sceneWidth && height == sceneHeight)
+        return;
+    sceneWidth = width;
+    sceneHeight = height;
+    if (sceneFramebuffer) {
+        glDeleteFramebuffers(1, &sceneFramebuffer);
+        glDeleteRenderbuffers(1, &sceneColor);
+        glDeleteTextures(1, &sceneDepth);
+        glDeleteTextures(1, &hizTexture);
+    }
+    glGenRenderbuffers(1, &sceneColor);
+    glBindRenderbuffer(GL_RENDERBUFFER, sceneColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenTextures(1, &sceneDepth);
+    glBindTexture(GL_TEXTURE_2D, sceneDepth);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenFramebuffers(1, &sceneFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneColor);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sceneDepth, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Scene framebuffer incomplete\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    hizLevels = 1;
+    while ((width | height) >> hizLevels)
+        hizLevels++;
+    glGenTextures(1, &hizTexture);
+    glBindTexture(GL_TEXTURE_2D, hizTexture);
+    glTexStorage2D(GL_TEXTURE_2D, hizLevels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    hizValid = 0;
+}
+
+// Packs the instances in the view frustum, and in front of last frame's depth where there is
+// one, into visibleBuffer and counts them into the indirect draw.
+void cullInstances(GLuint source, int count, mat4 viewProjection) {
+    if (count > visibleCapacity) {
+        visibleCapacity = count + count / 4;
+        glBindBuffer(GL_ARRAY_BUFFER, visibleBuffer);
+        glBufferData(GL_ARRAY_BUFFER, visibleCapacity * sizeof(Instance), NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    GLuint command[4] = {36, 0, 0, 0};
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawBuffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(command), command);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    if (!count)
+        return;
+
+    vec4 planes[6];
+    glm_frustum_planes(viewProjection, planes);
+    glUseProgram(cullShader);
+    glUniform1ui(glGetUniformLocation(cullShader, "count"), count);
+    glUniform4fv(glGetUniformLocation(cullShader, "frustumPlanes"), 6, &planes[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(cullShader, "previousViewProjection"), 1, GL_FALSE, &hizViewProjection[0][0]);
+    glUniform1i(glGetUniformLocation(cullShader, "hiz"), 2);
+    glUniform1i(glGetUniformLocation(cullShader, "hizLevels"), hizLevels);
+    glUniform1i(glGetUniformLocation(cullShader, "occlusion"), occlusionCulling && hizValid);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, hizTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, source);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, drawBuffer);
+    glDispatchCompute((count + 127) / 128, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+// Reduces the depth the main pass just wrote into the pyramid the next frame culls against.
+void buildHiz(mat4 viewProjection) {
+    glUseProgram(hizShader);
+    glUniform1i(glGetUniformLocation(hizShader, "depth"), 2);
+    GLint levelLoc = glGetUniformLocation(hizShader, "level");
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, sceneDepth);
+    glActiveTexture(GL_TEXTURE0);
+    for (int level = 0; level < hizLevels; level++) {
+        glUniform1i(levelLoc, level);
+        glBindImageTexture(0, hizTexture, level > 0 ? level - 1 : 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, hizTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        int width = sceneWidth >> level > 1 ? sceneWidth >> level : 1;
+        int height = sceneHeight >> level > 1 ? sceneHeight >> level : 1;
+        glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glm_mat4_copy(viewProjection, hizViewProjection);
+    hizValid = 1;
+}
+
+int renderer_toggle_occlusion() {
+    occlusionCulling = !occlusionCulling;
+    return occlusionCulling;
 }
 
 void renderer_init(GLFWwindow *w) {
@@ -173,39 +715,171 @@ void renderer_init(GLFWwindow *w) {
 
     glEnable(GL_DEPTH_TEST);
     setupRenderer();
-    loadTexture();
-    compileShaderProgram();
+    loadMaterials();
+    createShadowMap();
+    shaderGeneration = shaders_generation();
+    loadShaderPrograms();
+}
+
+void renderer_invalidate_bodies() {
+    instancesValid = 0;
+}
+
+void updateInstances() {
+    if (bodies.count != instanceCount) {
+        instances = realloc(instances, bodies.count * sizeof(Instance));
+        instanceAwake = realloc(instanceAwake, bodies.count);
+        instanceCount = bodies.count;
+        instancesValid = 0;
+    }
+    if (physicsStats.removedBodies != instanceRemovals) {
+        instanceRemovals = physicsStats.removedBodies;
+        instancesValid = 0;
+    }
+    // instances that differ from what the buffer holds
+    unsigned char *dirty = arena_alloc(&frameArena, instanceCount);
+    memset(dirty, 0, instanceCount);
+    // sleeping bodies keep their packed instance when the bodies are reordered, unless
+    // more than one reorder happened since the last frame
+    if (physicsStats.reorders != instanceReorders) {
+        const int *remap = physics_reorder_remap();
+        if (instancesValid && remap && physicsStats.reorders == instanceReorders + 1) {
+            Instance *moved = arena_alloc(&frameArena, instanceCount * sizeof(Instance));
+            unsigned char *movedAwake = arena_alloc(&frameArena, instanceCount);
+            for (int i = 0; i < instanceCount; i++) {
+                moved[remap[i]] = instances[i];
+                movedAwake[remap[i]] = instanceAwake[i];
+                dirty[remap[i]] = remap[i] != i;
+            }
+            memcpy(instances, moved, instanceCount * sizeof(Instance));
+            memcpy(instanceAwake, movedAwake, instanceCount);
+        }
+        else {
+            instancesValid = 0;
+        }
+        instanceReorders = physicsStats.reorders;
+    }
+
+    for (int i = 0; i < bodies.count; i++) {
+        if (instancesValid && !bodies.awake[i] && !instanceAwake[i])
+            continue;
+        instance_pack(i, &instances[i]);
+        instanceAwake[i] = bodies.awake[i];
+        dirty[i] = 1;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    if (!instancesValid) {
+        glBufferData(GL_ARRAY_BUFFER, instanceCount * sizeof(Instance), instances, GL_DYNAMIC_DRAW);
+        instancesValid = 1;
+        rendererStats.uploadedBytes += instanceCount * sizeof(Instance);
+        rendererStats.uploadedRanges++;
+        rendererStats.uploadedFrames++;
+        return;
+    }
+    // the changed instances in runs, each run taking in gaps shorter than UPLOAD_GAP
+    for (int i = 0; i < instanceCount;) {
+        if (!dirty[i]) {
+            i++;
+            continue;
+        }
+        int begin = i, end = ++i;
+        while (i < instanceCount && i - end < UPLOAD_GAP) {
+            if (dirty[i])
+                end = i + 1;
+            i++;
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(Instance), (end - begin) * sizeof(Instance), instances + begin);
+        rendererStats.uploadedBytes += (end - begin) * sizeof(Instance);
+        rendererStats.uploadedRanges++;
+    }
+    rendererStats.uploadedFrames++;
 }
 
 void renderer_render(double deltaTime, vec3 cameraPos, vec3 cameraFront, vec3 cameraUp) {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    arena_reset(&frameArena);
+    reloadShaders();
+    streamTextures();
+    int set = timerFrame++ & 1;
+    collectTimers(set);
+    collectCulling(set);
 
     int width, height;
     glfwGetWindowSize(window, &width, &height);
+    float aspect = (float)width/(float)height;
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    // minimized
+    if (framebufferWidth <= 0 || framebufferHeight <= 0)
+        return;
+    resizeTargets(framebufferWidth, framebufferHeight);
 
     mat4 projection;
     glm_mat4_identity(projection);
-    glm_perspective(glm_rad(45.0f), (float)width/(float)height, 0.1f, 100.0f, projection);
-    unsigned int projectionLoc  = glGetUniformLocation(shader, "projection");
-    glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, &projection[0][0]);
-    
+    glm_perspective(glm_rad(FIELD_OF_VIEW), aspect, NEAR_PLANE, FAR_PLANE, projection);
+
     mat4 view;
     glm_mat4_identity(view);
     vec3 at;
     glm_vec3_add(cameraPos, cameraFront, at);
     glm_lookat(cameraPos, at, cameraUp, view);
-    unsigned int viewLoc  = glGetUniformLocation(shader, "view");
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &view[0][0]);
+    mat4 viewProjection;
+    glm_mat4_mul(projection, view, viewProjection);
+
+    if (!externalInstances)
+        updateInstances();
+    int count = externalInstances ? externalCount : instanceCount;
+
+    // hidden bodies still cast shadows, so this pass draws all of them
+    mat4 lightMatrices[SHADOW_CASCADES];
+    float cascadeEnds[SHADOW_CASCADES];
+    fitCascades(view, aspect, lightMatrices, cascadeEnds);
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[set][TIMER_SHADOW]);
+    renderShadows(lightMatrices, count);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[set][TIMER_CULL]);
+    cullInstances(externalInstances ? externalInstances : instanceBuffer, count, viewProjection);
+    glEndQuery(GL_TIME_ELAPSED);
+    glBindBuffer(GL_COPY_READ_BUFFER, drawBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, visibleCounts);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sizeof(GLuint), set * sizeof(GLuint), sizeof(GLuint));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (cullFences[set])
+        glDeleteSync(cullFences[set]);
+    cullFences[set] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    submittedCounts[set] = count;
+
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[set][TIMER_MAIN]);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glUseProgram(shader);
-    unsigned int modelLoc = glGetUniformLocation(shader, "model");
-    glBindVertexArray(vao);
-    for (int i = 0; i < 10; i++) {
-        mat4 model;
-        glm_mat4_identity(model);
-        glm_translate(model, positions[i]);
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, &model[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(shader, "projection"), 1, GL_FALSE, &projection[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(shader, "view"), 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(shader, "lightMatrices"), SHADOW_CASCADES, GL_FALSE, &lightMatrices[0][0][0]);
+    glUniform1fv(glGetUniformLocation(shader, "cascadeEnds"), SHADOW_CASCADES, cascadeEnds);
+    glUniform3fv(glGetUniformLocation(shader, "lightDirection"), 1, lightDirection);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glBindVertexArray(visibleVao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawBuffer);
+    glDrawArraysIndirect(GL_TRIANGLES, NULL);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-    }
-}
\ No newline at end of file
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, framebufferWidth, framebufferHeight, 0, 0, framebufferWidth, framebufferHeight,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[set][TIMER_HIZ]);
+    buildHiz(viewProjection);
+    glEndQuery(GL_TIME_ELAPSED);
+    timerPending[set] = 1;
+}
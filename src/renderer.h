@@ -4,8 +4,44 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <cglm/cglm.h>
+#include "arena.h"
+
+typedef struct {
+    // GPU seconds of each pass, summed over the frames whose timers came back
+    double shadowTime;
+    // the culling pass and building the depth pyramid for the next frame's
+    double cullTime;
+    double mainTime;
+    int timedFrames;
+    // of the last frame whose culling came back: instances drawn, and the share culled
+    int visible;
+    double culledPercent;
+    double culledSum;
+    int culledFrames;
+    // the percentage in the window title
+    int shownPercent;
+    // instance data sent to the GPU, summed over the frames that drew the bodies
+    long long uploadedBytes;
+    long long uploadedRanges;
+    int uploadedFrames;
+} RendererStats;
+
+extern RendererStats rendererStats;
+
+// scratch memory of the current frame, reset when a frame starts
+extern Arena frameArena;
 
 void renderer_init(GLFWwindow *w);
 void renderer_render(double deltaTime, vec3 cameraPos, vec3 cameraFront, vec3 cameraUp);
+// call when bodies moved outside of a physics step, e.g. after restoring a checkpoint
+void renderer_invalidate_bodies();
+// Draws count Instance records from buffer in place of the bodies, e.g. the ones the compute
+// backend writes; 0 goes back to the bodies.
+void renderer_use_instances(GLuint buffer, int count);
+// Switches testing instances against last frame's depth pyramid, returning whether it is on now.
+// Frustum culling always runs.
+int renderer_toggle_occlusion();
+// Materials set with physics_set_material index the renderer's table, which has this many.
+int renderer_material_count();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sdf.h"
+#include "narrow.h"
+#include "jobs.h"
+
+#define BAKE_GRAIN 4
+#define NEAREST_STACK_SIZE 72
+// bricks in the grid at most, the brick index alone takes 4 bytes each
+#define MAX_BRICKS (1 << 26)
+
+typedef struct {
+    const TriangleMesh *mesh;
+    SdfField *sdf;
+    const int *candidates;
+    short *samples;
+    unsigned char *keep;
+} Bake;
+
+typedef struct {
+    float distance2;
+    // how square the offset is to the triangle, which decides between triangles sharing the closest point
+    float alignment;
+    float sign;
+    int triangle;
+} Nearest;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static float boundsDistance2(const BvhNode *node, const float p[3]) {
+    float d2 = 0.0f;
+    for (int k = 0; k < 3; k++) {
+        float d = fmaxf(fmaxf(node->min[k] - p[k], p[k] - node->max[k]), 0.0f);
+        d2 += d * d;
+    }
+    return d2;
+}
+
+static void testTriangle(const TriangleMesh *mesh, int t, const float p[3], Nearest *best) {
+    float triangle[9], closest[3], d[3], e1[3], e2[3], n[3];
+    mesh_triangle(mesh, t, triangle);
+    narrow_closest_on_triangle(p, triangle, closest);
+    for (int k = 0; k < 3; k++) {
+        d[k] = p[k] - closest[k];
+        e1[k] = triangle[3 + k] - triangle[k];
+        e2[k] = triangle[6 + k] - triangle[k];
+    }
+    float d2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    if (d2 > best->distance2 * 1.0001f)
+        return;
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+    float side = d[0] * n[0] + d[1] * n[1] + d[2] * n[2];
+    float length2 = (n[0] * n[0] + n[1] * n[1] + n[2] * n[2]) * d2;
+    float alignment = length2 > 0.0f ? fabsf(side) / sqrtf(length2) : 1.0f;
+    if (d2 < best->distance2 * 0.9999f || alignment > best->alignment) {
+        best->distance2 = fminf(d2, best->distance2);
+        best->alignment = alignment;
+        best->sign = side < 0.0f ? -1.0f : 1.0f;
+        best->triangle = t;
+    }
+}
+
+// Signed distance to the closest triangle within maxDistance, signed by its face normal.
+// Returns 0 when there is none. Where several triangles share the closest point (an edge or
+// a vertex) the one facing p most directly decides the sign. Neighbouring samples mostly share
+// their closest triangle, so testing the last one first prunes most of the tree.
+static int signedDistance(const TriangleMesh *mesh, const float p[3], float maxDistance, int *hint, float *distance) {
+    Nearest best = {maxDistance * maxDistance, 0.0f, 0.0f, -1};
+    if (*hint >= 0)
+        testTriangle(mesh, *hint, p, &best);
+    // nodes are pushed with the distance to their bounds, so popping one needs no recomputing
+    int stack[NEAREST_STACK_SIZE];
+    float stackDistance[NEAREST_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    stackDistance[top++] = boundsDistance2(&mesh->nodes[0], p);
+    while (top > 0) {
+        top--;
+        int index = stack[top];
+        if (stackDistance[top] > best.distance2 * 1.0001f)
+            continue;
+        const BvhNode *node = &mesh->nodes[index];
+        if (node->count) {
+            for (int t = node->offset; t < node->offset + node->count; t++) {
+                testTriangle(mesh, t, p, &best);
+            }
+            continue;
+        }
+        // the nearer child goes on top
+        int near = index + 1, far = node->offset;
+        float nearDistance = boundsDistance2(&mesh->nodes[near], p);
+        float farDistance = boundsDistance2(&mesh->nodes[far], p);
+        if (farDistance < nearDistance) {
+            int swap = near;
+            near = far;
+            far = swap;
+            float swapDistance = nearDistance;
+            nearDistance = farDistance;
+            farDistance = swapDistance;
+        }
+        float limit = best.distance2 * 1.0001f;
+        if (farDistance <= limit) {
+            stack[top] = far;
+            stackDistance[top++] = farDistance;
+        }
+        if (nearDistance <= limit) {
+            stack[top] = near;
+            stackDistance[top++] = nearDistance;
+        }
+    }
+    *distance = best.sign * sqrtf(best.distance2);
+    if (best.triangle >= 0)
+        *hint = best.triangle;
+    return best.sign != 0.0f;
+}
+
+// Samples beyond the band got no sign from the search. No surface fits between two neighbours
+// when one of them is that far from it, as cells are smaller than the band, so they take the
+// sign of any signed neighbour.
+static void fillSigns(short *samples) {
+    const int row = SDF_BRICK + 1, slice = row * row;
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int z = 0; z <= SDF_BRICK; z++) {
+            for (int y = 0; y <= SDF_BRICK; y++) {
+                for (int x = 0; x <= SDF_BRICK; x++) {
+                    short *s = &samples[z * slice + y * row + x];
+                    if (*s)
+                        continue;
+                    short neighbour = 0;
+                    if (x > 0 && s[-1])
+                        neighbour = s[-1];
+                    else if (x < SDF_BRICK && s[1])
+                        neighbour = s[1];
+                    else if (y > 0 && s[-row])
+                        neighbour = s[-row];
+                    else if (y < SDF_BRICK && s[row])
+                        neighbour = s[row];
+                    else if (z > 0 && s[-slice])
+                        neighbour = s[-slice];
+                    else if (z < SDF_BRICK && s[slice])
+                        neighbour = s[slice];
+                    if (neighbour) {
+                        *s = neighbour > 0 ? 32767 : -32767;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void bakeRange(void *ctx, int begin, int end, int worker) {
+    Bake *bake = ctx;
+    const SdfField *sdf = bake->sdf;
+    int bx = sdf->bricks[0], by = sdf->bricks[1];
+    for (int c = begin; c < end; c++) {
+        int brick = bake->candidates[c];
+        int base[3] = {brick % bx * SDF_BRICK, brick / bx % by * SDF_BRICK, brick / (bx * by) * SDF_BRICK};
+        short *out = &bake->samples[(size_t)c * SDF_BRICK_SAMPLES];
+        int near = 0, hint = -1;
+        for (int z = 0; z <= SDF_BRICK; z++) {
+            for (int y = 0; y <= SDF_BRICK; y++) {
+                for (int x = 0; x <= SDF_BRICK; x++) {
+                    float p[3] = {
+                        sdf->origin[0] + (base[0] + x) * sdf->cellSize,
+                        sdf->origin[1] + (base[1] + y) * sdf->cellSize,
+                        sdf->origin[2] + (base[2] + z) * sdf->cellSize
+                    };
+                    // 0 marks a sample without a sign yet, so the ones in the band never round to it
+                    float d;
+                    short value = 0;
+                    if (signedDistance(bake->mesh, p, sdf->band, &hint, &d)) {
+                        d = fmaxf(-1.0f, fminf(1.0f, d / sdf->band));
+                        value = (short)(d * 32767.0f + (d < 0.0f ? -0.5f : 0.5f));
+                        if (!value)
+                            value = d < 0.0f ? -1 : 1;
+                        near = 1;
+                    }
+                    *out++ = value;
+                }
+            }
+        }
+        if (near)
+            fillSigns(&bake->samples[(size_t)c * SDF_BRICK_SAMPLES]);
+        bake->keep[c] = near;
+    }
+}
+
+int sdf_bake(int meshIndex, float cellSize, float band) {
+    double start = now();
+    TriangleMesh *mesh = &meshes.items[meshIndex];
+    const BvhNode *root = &mesh->nodes[0];
+    SdfField *sdf = calloc(1, sizeof(SdfField));
+    sdf->cellSize = cellSize;
+    sdf->band = band;
+    double brickTotal = 1.0;
+    for (int k = 0; k < 3; k++) {
+        sdf->origin[k] = root->min[k] - band;
+        float extent = root->max[k] - root->min[k] + 2.0f * band;
+        sdf->bricks[k] = (int)ceilf(extent / (cellSize * SDF_BRICK));
+        brickTotal *= sdf->bricks[k];
+    }
+    // filling in the signs relies on cells being smaller than the band
+    if (brickTotal > MAX_BRICKS || cellSize >= band) {
+        free(sdf);
+        return 0;
+    }
+
+    // bricks with a triangle within the band of their bounds might hold part of the surface
+    int total = sdf->bricks[0] * sdf->bricks[1] * sdf->bricks[2];
+    int *candidates = malloc(total * sizeof(int));
+    int candidateCount = 0;
+    float brickSize = cellSize * SDF_BRICK;
+    for (int brick = 0; brick < total; brick++) {
+        int cell[3] = {brick % sdf->bricks[0], brick / sdf->bricks[0] % sdf->bricks[1], brick / (sdf->bricks[0] * sdf->bricks[1])};
+        float min[3], max[3];
+        for (int k = 0; k < 3; k++) {
+            min[k] = sdf->origin[k] + cell[k] * brickSize - band;
+            max[k] = min[k] + brickSize + 2.0f * band;
+        }
+        if (mesh_query(mesh, min, max, NULL, 0))
+            candidates[candidateCount++] = brick;
+    }
+
+    Bake bake = {
+        .mesh = mesh,
+        .sdf = sdf,
+        .candidates = candidates,
+        .samples = malloc((size_t)candidateCount * SDF_BRICK_SAMPLES * sizeof(short)),
+        .keep = malloc(candidateCount)
+    };
+    jobs_parallel_for(candidateCount, BAKE_GRAIN, bakeRange, &bake);
+
+    // the leaf bounds overestimate, so some candidates turn out to be all outside the band
+    sdf->brickIndex = malloc(total * sizeof(int));
+    for (int brick = 0; brick < total; brick++) {
+        sdf->brickIndex[brick] = -1;
+    }
+    for (int c = 0; c < candidateCount; c++) {
+        if (!bake.keep[c])
+            continue;
+        if (sdf->brickCount != c) {
+            memcpy(&bake.samples[(size_t)sdf->brickCount * SDF_BRICK_SAMPLES], &bake.samples[(size_t)c * SDF_BRICK_SAMPLES],
+                   SDF_BRICK_SAMPLES * sizeof(short));
+        }
+        sdf->brickIndex[candidates[c]] = sdf->brickCount++;
+    }
+    sdf->samples = realloc(bake.samples, ((size_t)sdf->brickCount * SDF_BRICK_SAMPLES + 1) * sizeof(short));
+    free(bake.keep);
+    free(candidates);
+
+    sdf_free(mesh->sdf);
+    mesh->sdf = sdf;
+    sdf->bakeTime = now() - start;
+    return 1;
+}
+
+void sdf_free(SdfField *sdf) {
+    if (!sdf)
+        return;
+    free(sdf->brickIndex);
+    free(sdf->samples);
+    free(sdf);
+}
+
+size_t sdf_memory(const SdfField *sdf) {
+    size_t bricks = (size_t)sdf->bricks[0] * sdf->bricks[1] * sdf->bricks[2];
+    return sizeof(SdfField) + bricks * sizeof(int) + (size_t)sdf->brickCount * SDF_BRICK_SAMPLES * sizeof(short);
+}
+
+// After finding the brick, the interpolation has no branches: the eight corners are fixed
+// offsets in the brick and the weights are products of the cell fractions.
+float sdf_sample(const SdfField *sdf, const float p[3], float gradient[3]) {
+    float inv = 1.0f / sdf->cellSize;
+    float g[3];
+    int cell[3], brick[3];
+    for (int k = 0; k < 3; k++) {
+        g[k] = (p[k] - sdf->origin[k]) * inv;
+        cell[k] = (int)floorf(g[k]);
+        brick[k] = cell[k] / SDF_BRICK;
+    }
+    gradient[0] = gradient[1] = gradient[2] = 0.0f;
+    if (g[0] < 0.0f || g[1] < 0.0f || g[2] < 0.0f
+        || brick[0] >= sdf->bricks[0] || brick[1] >= sdf->bricks[1] || brick[2] >= sdf->bricks[2])
+        return sdf->band;
+    int index = sdf->brickIndex[(brick[2] * sdf->bricks[1] + brick[1]) * sdf->bricks[0] + brick[0]];
+    if (index < 0)
+        return sdf->band;
+
+    const int row = SDF_BRICK + 1, slice = row * row;
+    const short *s = &sdf->samples[(size_t)index * SDF_BRICK_SAMPLES
+                                   + (cell[2] - brick[2] * SDF_BRICK) * slice
+                                   + (cell[1] - brick[1] * SDF_BRICK) * row
+                                   + (cell[0] - brick[0] * SDF_BRICK)];
+    float fx = g[0] - cell[0], fy = g[1] - cell[1], fz = g[2] - cell[2];
+    float scale = sdf->band / 32767.0f;
+    float c000 = s[0] * scale, c100 = s[1] * scale;
+    float c010 = s[row] * scale, c110 = s[row + 1] * scale;
+    float c001 = s[slice] * scale, c101 = s[slice + 1] * scale;
+    float c011 = s[slice + row] * scale, c111 = s[slice + row + 1] * scale;
+
+    float c00 = c000 + (c100 - c000) * fx, c10 = c010 + (c110 - c010) * fx;
+    float c01 = c001 + (c101 - c001) * fx, c11 = c011 + (c111 - c011) * fx;
+    float c0 = c00 + (c10 - c00) * fy, c1 = c01 + (c11 - c01) * fy;
+
+    // derivatives of the trilinear interpolation, per cell
+    float dx0 = (c100 - c000) + ((c110 - c010) - (c100 - c000)) * fy;
+    float dx1 = (c101 - c001) + ((c111 - c011) - (c101 - c001)) * fy;
+    gradient[0] = (dx0 + (dx1 - dx0) * fz) * inv;
+    gradient[1] = ((c10 - c00) + ((c11 - c01) - (c10 - c00)) * fz) * inv;
+    gradient[2] = (c1 - c0) * inv;
+    return c0 + (c1 - c0) * fz;
+}
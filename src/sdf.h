@@ -0,0 +1,35 @@
+#ifndef SDF_H
+#define SDF_H
+
+#include "mesh.h"
+
+// cells along each side of a brick; a brick stores the samples at its 9^3 cell corners, so
+// the corners of any cell are in the same brick
+#define SDF_BRICK 8
+#define SDF_BRICK_SAMPLES ((SDF_BRICK + 1) * (SDF_BRICK + 1) * (SDF_BRICK + 1))
+
+// Signed distance to a mesh on a regular grid, positive on the front side of its triangles.
+// Only bricks within band of the surface are stored; distances are clamped to the band and
+// kept as 16 bit fractions of it.
+typedef struct SdfField {
+    float origin[3];
+    float cellSize;
+    float band;
+    int bricks[3];
+    // brick grid in x, then y, then z order; -1 for bricks with no surface within the band
+    int *brickIndex;
+    short *samples;
+    int brickCount;
+    double bakeTime;
+} SdfField;
+
+// Bakes an SDF for a mesh, which from then on collides with spheres through it. The band must
+// be larger than the biggest sphere radius and the cell size. Returns 0 when it isn't or the
+// grid would be too large.
+int sdf_bake(int mesh, float cellSize, float band);
+void sdf_free(SdfField *sdf);
+size_t sdf_memory(const SdfField *sdf);
+// Trilinear distance at p and its gradient. Away from the surface it's the band, with a zero gradient.
+float sdf_sample(const SdfField *sdf, const float p[3], float gradient[3]);
+
+#endif
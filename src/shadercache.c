@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "shadercache.h"
+
+ShaderCacheStats shaderCacheStats;
+
+// followed by size bytes of program binary
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int format;
+    unsigned long long key;
+    unsigned long long size;
+} ProgramHeader;
+
+static unsigned long long hashBytes(unsigned long long h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// the terminating zero goes in too, so moving text from one string to the next changes the key
+static unsigned long long hashString(unsigned long long h, const char *s) {
+    return hashBytes(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+unsigned long long shadercache_key(const unsigned int *stages, const char **sources, int count, const char *vendor, const char *renderer, const char *version) {
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < count; i++) {
+        h = hashBytes(h, &stages[i], sizeof(stages[i]));
+        h = hashString(h, sources[i]);
+    }
+    h = hashString(h, vendor);
+    h = hashString(h, renderer);
+    return hashString(h, version);
+}
+
+static void cachePath(unsigned long long key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx.bin", SHADERCACHE_DIR, key);
+}
+
+void *shadercache_load(unsigned long long key, unsigned int *format, size_t *size) {
+    char path[64];
+    cachePath(key, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    ProgramHeader header;
+    void *binary = NULL;
+    if (f && fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, SHADERCACHE_MAGIC, 8) == 0
+        && header.version == SHADERCACHE_VERSION && header.key == key && header.size > 0 && header.size < (1ULL << 31)) {
+        binary = malloc(header.size);
+        if (fread(binary, header.size, 1, f) != 1) {
+            free(binary);
+            binary = NULL;
+        }
+    }
+    if (f)
+        fclose(f);
+    if (binary) {
+        *format = header.format;
+        *size = header.size;
+        shaderCacheStats.hits++;
+    }
+    else {
+        shaderCacheStats.misses++;
+    }
+    return binary;
+}
+
+// Written next to the final path and renamed over it, so a half written binary is never read.
+int shadercache_store(unsigned long long key, unsigned int format, const void *binary, size_t size) {
+    mkdir(SHADERCACHE_DIR, 0755);
+    char path[64], temporary[68];
+    cachePath(key, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    ProgramHeader header = {SHADERCACHE_MAGIC, SHADERCACHE_VERSION, format, key, size};
+    FILE *f = fopen(temporary, "wb");
+    int ok = f && fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(binary, size, 1, f) == 1;
+    ok = f && fclose(f) == 0 && ok;
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+        printf("Failed to write program cache %s\n", path);
+        remove(temporary);
+        return 0;
+    }
+    shaderCacheStats.stores++;
+    return 1;
+}
+
+void shadercache_remove(unsigned long long key) {
+    char path[64];
+    cachePath(key, path, sizeof(path));
+    remove(path);
+}
@@ -0,0 +1,28 @@
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+#include <stddef.h>
+
+#define SHADERCACHE_DIR "shadercache"
+#define SHADERCACHE_MAGIC "CSIMPROG"
+#define SHADERCACHE_VERSION 1
+
+typedef struct {
+    int hits;
+    int misses;
+    int stores;
+} ShaderCacheStats;
+
+extern ShaderCacheStats shaderCacheStats;
+
+// Identifies a program: its stages and their sources in order, and the driver, whose binaries
+// another driver or version can't take.
+unsigned long long shadercache_key(const unsigned int *stages, const char **sources, int count, const char *vendor, const char *renderer, const char *version);
+// The binary stored under key and its driver format, NULL if there is none. Free it with free.
+void *shadercache_load(unsigned long long key, unsigned int *format, size_t *size);
+// Returns 0 if the binary couldn't be written.
+int shadercache_store(unsigned long long key, unsigned int format, const void *binary, size_t size);
+// Forgets the binary under key, for one the driver rejected or whose sources were edited.
+void shadercache_remove(unsigned long long key);
+
+#endif
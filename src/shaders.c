@@ -0,0 +1,117 @@
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "shaders.h"
+
+static pthread_t watcher;
+static pthread_mutex_t shadersMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int generation;
+static int watching;
+static int inotifyFd = -1;
+// written to wake the watcher when it should stop
+static int stopPipe[2] = {-1, -1};
+static char watchedDir[256] = SHADERS_DIR;
+
+// editors either write the file in place or write another one and rename it over the original
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+static void *watcherMain(void *arg) {
+    // room for at least one event with the longest name
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0)
+            continue;
+        int changes = 0;
+        for (char *p = buffer; p < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            // skip the temporary files editors save through
+            const char *dot = event->len ? strrchr(event->name, '.') : NULL;
+            if (dot && (strcmp(dot, ".vert") == 0 || strcmp(dot, ".frag") == 0 || strcmp(dot, ".comp") == 0))
+                changes++;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (changes) {
+            pthread_mutex_lock(&shadersMutex);
+            generation++;
+            pthread_mutex_unlock(&shadersMutex);
+        }
+    }
+    return NULL;
+}
+
+int shaders_watch(const char *dir) {
+    if (watching || strlen(dir) >= sizeof(watchedDir))
+        return watching;
+    strcpy(watchedDir, dir);
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd < 0 || inotify_add_watch(inotifyFd, dir, WATCH_EVENTS) < 0 || pipe(stopPipe) != 0) {
+        printf("Failed to watch %s, shaders won't reload\n", dir);
+        shaders_unwatch();
+        return 0;
+    }
+    if (pthread_create(&watcher, NULL, watcherMain, NULL) != 0) {
+        printf("Failed to start shader watcher\n");
+        shaders_unwatch();
+        return 0;
+    }
+    watching = 1;
+    return 1;
+}
+
+void shaders_unwatch() {
+    if (watching) {
+        write(stopPipe[1], "", 1);
+        pthread_join(watcher, NULL);
+        watching = 0;
+    }
+    if (inotifyFd >= 0)
+        close(inotifyFd);
+    for (int i = 0; i < 2; i++) {
+        if (stopPipe[i] >= 0)
+            close(stopPipe[i]);
+        stopPipe[i] = -1;
+    }
+    inotifyFd = -1;
+}
+
+unsigned int shaders_generation() {
+    pthread_mutex_lock(&shadersMutex);
+    unsigned int g = generation;
+    pthread_mutex_unlock(&shadersMutex);
+    return g;
+}
+
+char *shaders_read(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", watchedDir, name);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Failed to open shader %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *source = size >= 0 ? malloc(size + 1) : NULL;
+    if (source && fread(source, 1, size, f) != (size_t)size) {
+        free(source);
+        source = NULL;
+    }
+    fclose(f);
+    if (!source) {
+        printf("Failed to read shader %s\n", path);
+        return NULL;
+    }
+    source[size] = 0;
+    return source;
+}
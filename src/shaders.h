@@ -0,0 +1,15 @@
+#ifndef SHADERS_H
+#define SHADERS_H
+
+#define SHADERS_DIR "shaders"
+
+// Starts a thread that watches dir with inotify and counts the shader files written or moved
+// into it. Returns 0 if the directory can't be watched; shaders are still read, just not reloaded.
+int shaders_watch(const char *dir);
+void shaders_unwatch();
+// Goes up each time a file in the watched directory changed. Compare it at a frame boundary.
+unsigned int shaders_generation();
+// The contents of dir/name as a string, NULL if it can't be read. Free it with free.
+char *shaders_read(const char *name);
+
+#endif
@@ -0,0 +1,552 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "solver.h"
+#include "jobs.h"
+
+#define SOLVER_GRAIN 64
+
+enum {
+    ROW_NORMAL,
+    ROW_TANGENT1,
+    ROW_TANGENT2
+};
+
+// One direction d of a contact. ja and jb are the angular parts r x d of the two bodies,
+// ka and kb the same mapped through their world space inverse inertia.
+typedef struct {
+    float d[3];
+    float ja[3], jb[3];
+    float ka[3], kb[3];
+    float mass;
+    float impulse;
+} SolverRow;
+
+// a is always a dynamic body, b is -1 when the other side is the world or a static body
+typedef struct {
+    int a, b;
+    SolverRow rows[3];
+    float bias;
+    unsigned long long key;
+    unsigned int feature;
+} SolverContact;
+
+ContactCache contactCache;
+
+static SolverContact *solverContacts;
+static SolverContact *coloredContacts;
+static int solverCapacity;
+
+// contacts of one color never share a dynamic body, so a color is solved in parallel without atomics
+static unsigned long long *bodyColors;
+static int bodyColorCapacity;
+static unsigned char *contactColor;
+static int colorStart[SOLVER_MAX_COLORS + 2];
+static int colorCount;
+
+static float workerResidual[JOBS_MAX_THREADS];
+
+// the points of one pair differ only in feature
+static unsigned int hashKey(unsigned long long key, unsigned int feature) {
+    key ^= (unsigned long long)feature * 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return (unsigned int)key;
+}
+
+static void rebuildTable() {
+    int size = 16;
+    while (size < contactCache.count * 2)
+        size *= 2;
+    if (size != contactCache.tableSize) {
+        free(contactCache.table);
+        contactCache.table = malloc(size * sizeof(int));
+        contactCache.tableSize = size;
+    }
+    memset(contactCache.table, 0, size * sizeof(int));
+
+    for (int i = 0; i < contactCache.count; i++) {
+        unsigned int slot = hashKey(contactCache.entries[i].key, contactCache.entries[i].feature) & (size - 1);
+        while (contactCache.table[slot])
+            slot = (slot + 1) & (size - 1);
+        contactCache.table[slot] = i + 1;
+    }
+}
+
+static CachedImpulse *findCached(unsigned long long key, unsigned int feature) {
+    if (!contactCache.tableSize)
+        return NULL;
+    unsigned int mask = contactCache.tableSize - 1;
+    for (unsigned int slot = hashKey(key, feature) & mask; contactCache.table[slot]; slot = (slot + 1) & mask) {
+        CachedImpulse *entry = &contactCache.entries[contactCache.table[slot] - 1];
+        if (entry->key == key && entry->feature == feature)
+            return entry;
+    }
+    return NULL;
+}
+
+static void reserveCache(int count) {
+    if (count <= contactCache.capacity)
+        return;
+    contactCache.capacity = count * 2;
+    contactCache.entries = realloc(contactCache.entries, contactCache.capacity * sizeof(CachedImpulse));
+}
+
+void solver_restore_cache(const CachedImpulse *entries, int count) {
+    reserveCache(count);
+    memcpy(contactCache.entries, entries, count * sizeof(CachedImpulse));
+    contactCache.count = count;
+    rebuildTable();
+}
+
+void solver_shutdown() {
+    free(contactCache.entries);
+    free(contactCache.table);
+    memset(&contactCache, 0, sizeof(contactCache));
+    free(solverContacts);
+    free(coloredContacts);
+    free(contactColor);
+    solverContacts = coloredContacts = NULL;
+    contactColor = NULL;
+    solverCapacity = 0;
+    free(bodyColors);
+    bodyColors = NULL;
+    bodyColorCapacity = 0;
+}
+
+// Picks tangents from the normal alone, so cached friction impulses keep their meaning between steps.
+static void tangents(const float n[3], float t1[3], float t2[3]) {
+    if (fabsf(n[0]) >= 0.57735f) {
+        t1[0] = n[1];
+        t1[1] = -n[0];
+        t1[2] = 0.0f;
+    }
+    else {
+        t1[0] = 0.0f;
+        t1[1] = n[2];
+        t1[2] = -n[1];
+    }
+    float len = sqrtf(t1[0] * t1[0] + t1[1] * t1[1] + t1[2] * t1[2]);
+    t1[0] /= len;
+    t1[1] /= len;
+    t1[2] /= len;
+    t2[0] = n[1] * t1[2] - n[2] * t1[1];
+    t2[1] = n[2] * t1[0] - n[0] * t1[2];
+    t2[2] = n[0] * t1[1] - n[1] * t1[0];
+}
+
+static float dot(const float a[3], const float b[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross(const float a[3], const float b[3], float out[3]) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// R diag(invI) R^T
+static void worldInvInertia(int i, float out[9]) {
+    float r[9];
+    physics_body_rotation(i, r);
+    float invI[3] = {bodies.invIx[i], bodies.invIy[i], bodies.invIz[i]};
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            out[row * 3 + col] = r[row * 3] * invI[0] * r[col * 3]
+                               + r[row * 3 + 1] * invI[1] * r[col * 3 + 1]
+                               + r[row * 3 + 2] * invI[2] * r[col * 3 + 2];
+        }
+    }
+}
+
+static void transform(const float m[9], const float v[3], float out[3]) {
+    for (int k = 0; k < 3; k++) {
+        out[k] = m[k * 3] * v[0] + m[k * 3 + 1] * v[1] + m[k * 3 + 2] * v[2];
+    }
+}
+
+// ia is NULL when b is the world
+static void prepareRow(SolverRow *row, const float d[3], const float ra[3], const float rb[3], const float ia[9], const float ib[9],
+                       float wa, float wb) {
+    memcpy(row->d, d, 3 * sizeof(float));
+    cross(ra, d, row->ja);
+    transform(ia, row->ja, row->ka);
+    if (ib) {
+        cross(rb, d, row->jb);
+        transform(ib, row->jb, row->kb);
+    }
+    else {
+        memset(row->jb, 0, sizeof(row->jb));
+        memset(row->kb, 0, sizeof(row->kb));
+    }
+    float k = wa + wb + dot(row->ja, row->ka) + dot(row->jb, row->kb);
+    row->mass = k > 0.0f ? 1.0f / k : 0.0f;
+}
+
+// Velocity of b's contact point relative to a's along the row direction.
+static float relativeVelocity(const SolverContact *c, const SolverRow *row) {
+    const float *d = row->d;
+    int a = c->a, b = c->b;
+    float v = -(bodies.vx[a] * d[0] + bodies.vy[a] * d[1] + bodies.vz[a] * d[2]);
+    v -= bodies.wx[a] * row->ja[0] + bodies.wy[a] * row->ja[1] + bodies.wz[a] * row->ja[2];
+    if (b >= 0) {
+        v += bodies.vx[b] * d[0] + bodies.vy[b] * d[1] + bodies.vz[b] * d[2];
+        v += bodies.wx[b] * row->jb[0] + bodies.wy[b] * row->jb[1] + bodies.wz[b] * row->jb[2];
+    }
+    return v;
+}
+
+static void applyImpulse(const SolverContact *c, const SolverRow *row, float impulse) {
+    const float *d = row->d;
+    int a = c->a, b = c->b;
+    float wa = bodies.invMass[a] * impulse;
+    bodies.vx[a] -= d[0] * wa;
+    bodies.vy[a] -= d[1] * wa;
+    bodies.vz[a] -= d[2] * wa;
+    bodies.wx[a] -= row->ka[0] * impulse;
+    bodies.wy[a] -= row->ka[1] * impulse;
+    bodies.wz[a] -= row->ka[2] * impulse;
+    if (b >= 0) {
+        float wb = bodies.invMass[b] * impulse;
+        bodies.vx[b] += d[0] * wb;
+        bodies.vy[b] += d[1] * wb;
+        bodies.vz[b] += d[2] * wb;
+        bodies.wx[b] += row->kb[0] * impulse;
+        bodies.wy[b] += row->kb[1] * impulse;
+        bodies.wz[b] += row->kb[2] * impulse;
+    }
+}
+
+static void prepare(Contact *contacts, int count, float dt) {
+    float beta = physicsConfig.baumgarte / dt;
+
+    for (int k = 0; k < count; k++) {
+        Contact *contact = &contacts[k];
+        SolverContact *c = &solverContacts[k];
+        float sign = 1.0f;
+        c->a = contact->a;
+        c->b = contact->b;
+        if (bodies.invMass[c->a] == 0.0f) {
+            c->a = contact->b;
+            c->b = contact->a;
+            sign = -1.0f;
+        }
+        if (c->b >= 0 && bodies.invMass[c->b] == 0.0f)
+            c->b = -1;
+        c->key = contact->key;
+        c->feature = contact->feature;
+
+        float n[3] = {contact->nx * sign, contact->ny * sign, contact->nz * sign};
+        float t1[3], t2[3];
+        tangents(n, t1, t2);
+        float ra[3] = {contact->px - bodies.px[c->a], contact->py - bodies.py[c->a], contact->pz - bodies.pz[c->a]};
+        float rb[3] = {0.0f, 0.0f, 0.0f};
+        float ia[9], ib[9];
+        float wa = bodies.invMass[c->a], wb = 0.0f;
+        worldInvInertia(c->a, ia);
+        if (c->b >= 0) {
+            rb[0] = contact->px - bodies.px[c->b];
+            rb[1] = contact->py - bodies.py[c->b];
+            rb[2] = contact->pz - bodies.pz[c->b];
+            wb = bodies.invMass[c->b];
+            worldInvInertia(c->b, ib);
+        }
+        const float *bInertia = c->b >= 0 ? ib : NULL;
+        prepareRow(&c->rows[ROW_NORMAL], n, ra, rb, ia, bInertia, wa, wb);
+        prepareRow(&c->rows[ROW_TANGENT1], t1, ra, rb, ia, bInertia, wa, wb);
+        prepareRow(&c->rows[ROW_TANGENT2], t2, ra, rb, ia, bInertia, wa, wb);
+
+        // restitution only above a threshold, otherwise resting contacts keep bouncing
+        float vn = relativeVelocity(c, &c->rows[ROW_NORMAL]);
+        float bounce = vn < -physicsConfig.restitutionThreshold ? -physicsConfig.restitution * vn : 0.0f;
+        float push = beta * fmaxf(contact->depth - physicsConfig.slop, 0.0f);
+        c->bias = fmaxf(bounce, push);
+
+        CachedImpulse *cached = findCached(contact->key, contact->feature);
+        c->rows[ROW_NORMAL].impulse = cached ? cached->normal : 0.0f;
+        c->rows[ROW_TANGENT1].impulse = cached ? cached->tangent1 : 0.0f;
+        c->rows[ROW_TANGENT2].impulse = cached ? cached->tangent2 : 0.0f;
+    }
+}
+
+// Greedy coloring in contact order: each contact takes the lowest color neither of its
+// dynamic bodies uses yet. Contacts that find no free color go to a last batch solved serially.
+static void colorContacts(int count) {
+    if (bodies.count > bodyColorCapacity) {
+        bodyColorCapacity = bodies.capacity;
+        bodyColors = realloc(bodyColors, bodyColorCapacity * sizeof(unsigned long long));
+    }
+    memset(bodyColors, 0, bodies.count * sizeof(unsigned long long));
+
+    int counts[SOLVER_MAX_COLORS + 1] = {0};
+    colorCount = 0;
+    for (int k = 0; k < count; k++) {
+        SolverContact *c = &solverContacts[k];
+        unsigned long long used = bodyColors[c->a] | (c->b >= 0 ? bodyColors[c->b] : 0);
+        int color = SOLVER_MAX_COLORS;
+        if (~used) {
+            color = __builtin_ctzll(~used);
+            bodyColors[c->a] |= 1ULL << color;
+            if (c->b >= 0)
+                bodyColors[c->b] |= 1ULL << color;
+            if (color + 1 > colorCount)
+                colorCount = color + 1;
+        }
+        contactColor[k] = color;
+        counts[color]++;
+    }
+
+    colorStart[0] = 0;
+    for (int color = 0; color <= SOLVER_MAX_COLORS; color++) {
+        colorStart[color + 1] = colorStart[color] + counts[color];
+    }
+    int next[SOLVER_MAX_COLORS + 1];
+    memcpy(next, colorStart, sizeof(next));
+    for (int k = 0; k < count; k++) {
+        coloredContacts[next[contactColor[k]]++] = solverContacts[k];
+    }
+
+    SolverContact *t = solverContacts;
+    solverContacts = coloredContacts;
+    coloredContacts = t;
+}
+
+static void warmStartRange(void *ctx, int begin, int end, int worker) {
+    SolverContact *batch = ctx;
+    for (int k = begin; k < end; k++) {
+        SolverContact *c = &batch[k];
+        for (int r = 0; r < 3; r++) {
+            applyImpulse(c, &c->rows[r], c->rows[r].impulse);
+        }
+    }
+}
+
+// Friction first, clamped by the normal impulse of the last iteration, then the normal.
+static void iterateRange(void *ctx, int begin, int end, int worker) {
+    float friction = physicsConfig.friction;
+    float residual = workerResidual[worker];
+    SolverContact *batch = ctx;
+
+    for (int k = begin; k < end; k++) {
+        SolverContact *c = &batch[k];
+        float limit = friction * c->rows[ROW_NORMAL].impulse;
+
+        for (int r = ROW_TANGENT1; r <= ROW_TANGENT2; r++) {
+            SolverRow *row = &c->rows[r];
+            float old = row->impulse;
+            row->impulse = fminf(fmaxf(old - relativeVelocity(c, row) * row->mass, -limit), limit);
+            applyImpulse(c, row, row->impulse - old);
+            residual = fmaxf(residual, fabsf(row->impulse - old));
+        }
+
+        SolverRow *row = &c->rows[ROW_NORMAL];
+        float old = row->impulse;
+        row->impulse = fmaxf(old + (c->bias - relativeVelocity(c, row)) * row->mass, 0.0f);
+        applyImpulse(c, row, row->impulse - old);
+        residual = fmaxf(residual, fabsf(row->impulse - old));
+    }
+    workerResidual[worker] = residual;
+}
+
+#ifdef __SSE2__
+static __m128 gather(const float *array, const int index[4]) {
+    return _mm_setr_ps(
+        index[0] >= 0 ? array[index[0]] : 0.0f,
+        index[1] >= 0 ? array[index[1]] : 0.0f,
+        index[2] >= 0 ? array[index[2]] : 0.0f,
+        index[3] >= 0 ? array[index[3]] : 0.0f);
+}
+
+static void scatter(float *array, const int index[4], __m128 value) {
+    float lanes[4];
+    _mm_storeu_ps(lanes, value);
+    for (int i = 0; i < 4; i++) {
+        if (index[i] >= 0)
+            array[index[i]] = lanes[i];
+    }
+}
+
+// Velocities of four bodies, one per lane; bodies of index -1 read as zero.
+typedef struct {
+    __m128 v[3];
+    __m128 w[3];
+    __m128 invMass;
+} BodyLanes;
+
+static void gatherBodies(BodyLanes *lanes, const int index[4]) {
+    lanes->v[0] = gather(bodies.vx, index);
+    lanes->v[1] = gather(bodies.vy, index);
+    lanes->v[2] = gather(bodies.vz, index);
+    lanes->w[0] = gather(bodies.wx, index);
+    lanes->w[1] = gather(bodies.wy, index);
+    lanes->w[2] = gather(bodies.wz, index);
+    lanes->invMass = gather(bodies.invMass, index);
+}
+
+static void scatterBodies(const BodyLanes *lanes, const int index[4]) {
+    scatter(bodies.vx, index, lanes->v[0]);
+    scatter(bodies.vy, index, lanes->v[1]);
+    scatter(bodies.vz, index, lanes->v[2]);
+    scatter(bodies.wx, index, lanes->w[0]);
+    scatter(bodies.wy, index, lanes->w[1]);
+    scatter(bodies.wz, index, lanes->w[2]);
+}
+
+static __m128 dot4(const __m128 a[3], const __m128 b[3]) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+#define LANES(field) _mm_setr_ps(c[0]->field, c[1]->field, c[2]->field, c[3]->field)
+#define LANES3(field) {LANES(field[0]), LANES(field[1]), LANES(field[2])}
+
+// One row for four contacts, in the same operation order as the scalar path.
+static __m128 solveRow(BodyLanes *a, BodyLanes *b, SolverContact *c[4], int r, __m128 target, __m128 low, __m128 high) {
+    __m128 d[3] = LANES3(rows[r].d);
+    __m128 ja[3] = LANES3(rows[r].ja);
+    __m128 jb[3] = LANES3(rows[r].jb);
+    __m128 vr = _mm_sub_ps(_mm_setzero_ps(), dot4(a->v, d));
+    vr = _mm_sub_ps(vr, dot4(a->w, ja));
+    vr = _mm_add_ps(vr, dot4(b->v, d));
+    vr = _mm_add_ps(vr, dot4(b->w, jb));
+
+    __m128 old = LANES(rows[r].impulse);
+    __m128 value = _mm_add_ps(old, _mm_mul_ps(_mm_sub_ps(target, vr), LANES(rows[r].mass)));
+    value = _mm_min_ps(_mm_max_ps(value, low), high);
+    float lanes[4];
+    _mm_storeu_ps(lanes, value);
+    for (int i = 0; i < 4; i++) {
+        c[i]->rows[r].impulse = lanes[i];
+    }
+
+    __m128 delta = _mm_sub_ps(value, old);
+    __m128 da = _mm_mul_ps(a->invMass, delta);
+    __m128 db = _mm_mul_ps(b->invMass, delta);
+    __m128 ka[3] = LANES3(rows[r].ka);
+    __m128 kb[3] = LANES3(rows[r].kb);
+    for (int i = 0; i < 3; i++) {
+        a->v[i] = _mm_sub_ps(a->v[i], _mm_mul_ps(d[i], da));
+        a->w[i] = _mm_sub_ps(a->w[i], _mm_mul_ps(ka[i], delta));
+        b->v[i] = _mm_add_ps(b->v[i], _mm_mul_ps(d[i], db));
+        b->w[i] = _mm_add_ps(b->w[i], _mm_mul_ps(kb[i], delta));
+    }
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), delta);
+}
+
+// Contacts of a color touch distinct bodies, so four of them are solved at once in SSE lanes.
+static void iterateRangeSimd(void *ctx, int begin, int end, int worker) {
+    __m128 friction = _mm_set1_ps(physicsConfig.friction);
+    __m128 zero = _mm_setzero_ps();
+    __m128 infinity = _mm_set1_ps(INFINITY);
+    __m128 residual = _mm_set1_ps(workerResidual[worker]);
+    SolverContact *batch = ctx;
+
+    int k = begin;
+    for (; k + 4 <= end; k += 4) {
+        SolverContact *c[4] = {&batch[k], &batch[k + 1], &batch[k + 2], &batch[k + 3]};
+        int a[4] = {c[0]->a, c[1]->a, c[2]->a, c[3]->a};
+        int b[4] = {c[0]->b, c[1]->b, c[2]->b, c[3]->b};
+        BodyLanes la, lb;
+        gatherBodies(&la, a);
+        gatherBodies(&lb, b);
+
+        __m128 limit = _mm_mul_ps(friction, LANES(rows[ROW_NORMAL].impulse));
+        __m128 low = _mm_sub_ps(zero, limit);
+        residual = _mm_max_ps(residual, solveRow(&la, &lb, c, ROW_TANGENT1, zero, low, limit));
+        residual = _mm_max_ps(residual, solveRow(&la, &lb, c, ROW_TANGENT2, zero, low, limit));
+        residual = _mm_max_ps(residual, solveRow(&la, &lb, c, ROW_NORMAL, LANES(bias), zero, infinity));
+
+        scatterBodies(&la, a);
+        scatterBodies(&lb, b);
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, residual);
+    workerResidual[worker] = fmaxf(fmaxf(lanes[0], lanes[1]), fmaxf(lanes[2], lanes[3]));
+    if (k < end)
+        iterateRange(ctx, k, end, worker);
+}
+
+#undef LANES3
+#undef LANES
+#endif
+
+// Runs fn over every color batch, each one in parallel. The overflow batch is not colored,
+// so its contacts can share bodies: it runs serially with serialFn, which has to be scalar.
+static void forEachBatch(JobFn fn, JobFn serialFn) {
+    for (int color = 0; color < colorCount; color++) {
+        jobs_parallel_for(colorStart[color + 1] - colorStart[color], SOLVER_GRAIN, fn, solverContacts + colorStart[color]);
+    }
+    int overflow = colorStart[SOLVER_MAX_COLORS + 1] - colorStart[SOLVER_MAX_COLORS];
+    if (overflow > 0)
+        serialFn(solverContacts + colorStart[SOLVER_MAX_COLORS], 0, overflow, 0);
+}
+
+static void storeCache(int count) {
+    reserveCache(count);
+    for (int k = 0; k < count; k++) {
+        contactCache.entries[k] = (CachedImpulse){
+            solverContacts[k].key,
+            solverContacts[k].feature,
+            solverContacts[k].rows[ROW_NORMAL].impulse,
+            solverContacts[k].rows[ROW_TANGENT1].impulse,
+            solverContacts[k].rows[ROW_TANGENT2].impulse
+        };
+    }
+    contactCache.count = count;
+    rebuildTable();
+}
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void solver_solve(Contact *contacts, int count, float dt) {
+    double start = now();
+    if (count > solverCapacity) {
+        solverCapacity = count * 2;
+        solverContacts = realloc(solverContacts, solverCapacity * sizeof(SolverContact));
+        coloredContacts = realloc(coloredContacts, solverCapacity * sizeof(SolverContact));
+        contactColor = realloc(contactColor, solverCapacity);
+    }
+
+    prepare(contacts, count, dt);
+
+    JobFn iterate = iterateRange;
+    if (physicsConfig.solverMode == SOLVER_SERIAL) {
+        // one batch in contact order, solved on the calling thread
+        colorCount = 0;
+        memset(colorStart, 0, sizeof(colorStart));
+        colorStart[SOLVER_MAX_COLORS + 1] = count;
+    }
+    else {
+        colorContacts(count);
+#ifdef __SSE2__
+        if (physicsConfig.solverMode == SOLVER_COLORED_SIMD)
+            iterate = iterateRangeSimd;
+#endif
+    }
+
+    // the batch functions index from the start of their batch
+    forEachBatch(warmStartRange, warmStartRange);
+    float residual = 0.0f;
+    for (int i = 0; i < physicsConfig.solverIterations; i++) {
+        memset(workerResidual, 0, sizeof(workerResidual));
+        forEachBatch(iterate, iterateRange);
+        residual = 0.0f;
+        for (int w = 0; w < jobs_thread_count(); w++) {
+            residual = fmaxf(residual, workerResidual[w]);
+        }
+    }
+    storeCache(count);
+
+    physicsStats.solverResidual = residual;
+    physicsStats.solverColors = colorCount;
+    physicsStats.solverTime = now() - start;
+}
@@ -0,0 +1,36 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include "physics.h"
+
+#define SOLVER_MAX_COLORS 64
+
+// Accumulated impulses of one contact, kept from one step to the next to warm start the solver.
+typedef struct {
+    unsigned long long key;
+    unsigned int feature;
+    float normal;
+    float tangent1;
+    float tangent2;
+} CachedImpulse;
+
+typedef struct {
+    CachedImpulse *entries;
+    int count;
+    int capacity;
+    // open addressing table of entry indices + 1, 0 is empty
+    int *table;
+    int tableSize;
+} ContactCache;
+
+extern ContactCache contactCache;
+
+// Sequential impulses (projected Gauss-Seidel) on the velocities, with Coulomb friction,
+// restitution and Baumgarte position correction. Contacts with b == -1 are against the world.
+// Unless physicsConfig.solverMode is SOLVER_SERIAL the contacts are graph colored first and
+// each color is solved in parallel, which changes the order but not the determinism.
+void solver_solve(Contact *contacts, int count, float dt);
+void solver_restore_cache(const CachedImpulse *entries, int count);
+void solver_shutdown();
+
+#endif
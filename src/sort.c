@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sort.h"
+#include "jobs.h"
+
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+// fewer keys than this per worker aren't worth a chunk of their own
+#define RADIX_MIN_GRAIN 16384
+
+typedef struct {
+    const void *keys;
+    void *outKeys;
+    const int *values;
+    int *outValues;
+    int wide;
+    int shift;
+    int grain;
+} Pass;
+
+// digit counts of every chunk, turned into the chunk's first output slot for every digit
+static int histograms[JOBS_MAX_THREADS][RADIX_BUCKETS];
+
+static void *scratchKeys;
+static size_t scratchKeyBytes;
+static int *scratchValues;
+static int scratchValueCapacity;
+
+static void histogramRange(void *ctx, int begin, int end, int worker) {
+    const Pass *p = ctx;
+    int *h = histograms[begin / p->grain];
+    memset(h, 0, sizeof(histograms[0]));
+    if (p->wide) {
+        const unsigned long long *keys = p->keys;
+        for (int i = begin; i < end; i++) {
+            h[(keys[i] >> p->shift) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+    else {
+        const unsigned int *keys = p->keys;
+        for (int i = begin; i < end; i++) {
+            h[(keys[i] >> p->shift) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+}
+
+static void scatterRange(void *ctx, int begin, int end, int worker) {
+    const Pass *p = ctx;
+    int *offset = histograms[begin / p->grain];
+    if (p->wide) {
+        const unsigned long long *keys = p->keys;
+        unsigned long long *out = p->outKeys;
+        for (int i = begin; i < end; i++) {
+            int o = offset[(keys[i] >> p->shift) & (RADIX_BUCKETS - 1)]++;
+            out[o] = keys[i];
+            if (p->values)
+                p->outValues[o] = p->values[i];
+        }
+    }
+    else {
+        const unsigned int *keys = p->keys;
+        unsigned int *out = p->outKeys;
+        for (int i = begin; i < end; i++) {
+            int o = offset[(keys[i] >> p->shift) & (RADIX_BUCKETS - 1)]++;
+            out[o] = keys[i];
+            if (p->values)
+                p->outValues[o] = p->values[i];
+        }
+    }
+}
+
+static void radixSort(void *keys, int *values, int count, int wide) {
+    if (count < 2)
+        return;
+    size_t keySize = wide ? sizeof(unsigned long long) : sizeof(unsigned int);
+    if (count * keySize > scratchKeyBytes) {
+        scratchKeyBytes = count * keySize;
+        scratchKeys = realloc(scratchKeys, scratchKeyBytes);
+    }
+    if (values && count > scratchValueCapacity) {
+        scratchValueCapacity = count;
+        scratchValues = realloc(scratchValues, scratchValueCapacity * sizeof(int));
+    }
+
+    // one chunk per worker, each with its own histogram
+    int workers = jobs_thread_count();
+    int grain = (count + workers - 1) / workers;
+    if (grain < RADIX_MIN_GRAIN)
+        grain = RADIX_MIN_GRAIN;
+    int chunks = (count + grain - 1) / grain;
+
+    Pass p = {keys, scratchKeys, values, values ? scratchValues : NULL, wide, 0, grain};
+    for (int shift = 0; shift < 8 * (int)keySize; shift += RADIX_BITS) {
+        p.shift = shift;
+        jobs_parallel_for(count, grain, histogramRange, &p);
+
+        // output slots by digit, then by chunk, which keeps equal digits in input order
+        int sum = 0, skip = 0;
+        for (int d = 0; d < RADIX_BUCKETS && !skip; d++) {
+            int start = sum;
+            for (int c = 0; c < chunks; c++) {
+                int n = histograms[c][d];
+                histograms[c][d] = sum;
+                sum += n;
+            }
+            skip = sum - start == count;
+        }
+        if (skip)
+            continue;
+        jobs_parallel_for(count, grain, scatterRange, &p);
+
+        const void *sortedKeys = p.outKeys;
+        p.outKeys = (void*)p.keys;
+        p.keys = sortedKeys;
+        const int *sortedValues = p.outValues;
+        p.outValues = (int*)p.values;
+        p.values = sortedValues;
+    }
+
+    if (p.keys != keys) {
+        memcpy(keys, p.keys, count * keySize);
+        if (values)
+            memcpy(values, p.values, count * sizeof(int));
+    }
+}
+
+void sort_pairs32(unsigned int *keys, int *values, int count) {
+    radixSort(keys, values, count, 0);
+}
+
+void sort_pairs64(unsigned long long *keys, int *values, int count) {
+    radixSort(keys, values, count, 1);
+}
+
+unsigned int sort_float_key(float f) {
+    unsigned int u;
+    memcpy(&u, &f, sizeof(u));
+    return u & 0x80000000u ? ~u : u | 0x80000000u;
+}
+
+void sort_shutdown() {
+    free(scratchKeys);
+    free(scratchValues);
+    scratchKeys = NULL;
+    scratchValues = NULL;
+    scratchKeyBytes = 0;
+    scratchValueCapacity = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef SORT_H
+#define SORT_H
+
+// Stable LSD radix sort of unsigned keys, each carrying an int value, on the job pool. Digits
+// are 11 bits and every worker counts its own part of the keys, passes where all keys share a
+// digit are skipped. Equal keys keep their order, so results don't depend on the thread count.
+// values may be NULL. Scratch buffers are kept for the next call; call it from one thread at a time.
+void sort_pairs32(unsigned int *keys, int *values, int count);
+void sort_pairs64(unsigned long long *keys, int *values, int count);
+// Frees the scratch buffers.
+void sort_shutdown();
+
+// Unsigned key that orders like the float.
+unsigned int sort_float_key(float f);
+
+#endif
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#include "texture.h"
+#include "jobs.h"
+
+// rows of blocks per job
+#define ENCODE_GRAIN 4
+#define LEVEL_ALIGN 16
+
+// followed by the offset and size of every level, then the levels, smallest last
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int format;
+    // what the cache was built for, which differs from format when BC1 fell back to BC7
+    unsigned int requestedFormat;
+    unsigned int width, height;
+    unsigned int levels;
+    // size and modification time of the source, for telling whether the cache is stale
+    unsigned long long sourceSize;
+    long long sourceTime;
+} TextureHeader;
+
+typedef struct {
+    unsigned long long offset;
+    unsigned long long size;
+} TextureLevel;
+
+typedef struct {
+    const unsigned char *rgba;
+    int width, height;
+    int format;
+    unsigned char *out;
+} Encode;
+
+static const int bc7Weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+static int maxInt(int a, int b) {
+    return a > b ? a : b;
+}
+
+static int levelDimension(int size, int level) {
+    return maxInt(size >> level, 1);
+}
+
+static size_t levelBytes(int format, int width, int height) {
+    size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+    if (format == TEXTURE_BC1)
+        return blocks * 8;
+    if (format == TEXTURE_BC7)
+        return blocks * 16;
+    return (size_t)width * height * 4;
+}
+
+static size_t alignUp(size_t size) {
+    return (size + LEVEL_ALIGN - 1) & ~(size_t)(LEVEL_ALIGN - 1);
+}
+
+int texture_level_width(const TextureImage *image, int level) {
+    return levelDimension(image->width, level);
+}
+
+int texture_level_height(const TextureImage *image, int level) {
+    return levelDimension(image->height, level);
+}
+
+// 2x2 box filter; an odd last row or column is averaged with itself
+static unsigned char *downsample(const unsigned char *src, int width, int height) {
+    int w = levelDimension(width, 1), h = levelDimension(height, 1);
+    unsigned char *dst = malloc((size_t)w * h * 4);
+    for (int y = 0; y < h; y++) {
+        int y0 = 2 * y < height ? 2 * y : height - 1;
+        int y1 = 2 * y + 1 < height ? 2 * y + 1 : y0;
+        for (int x = 0; x < w; x++) {
+            int x0 = 2 * x < width ? 2 * x : width - 1;
+            int x1 = 2 * x + 1 < width ? 2 * x + 1 : x0;
+            for (int c = 0; c < 4; c++) {
+                int sum = src[((size_t)y0 * width + x0) * 4 + c] + src[((size_t)y0 * width + x1) * 4 + c]
+                        + src[((size_t)y1 * width + x0) * 4 + c] + src[((size_t)y1 * width + x1) * 4 + c];
+                dst[((size_t)y * w + x) * 4 + c] = (sum + 2) >> 2;
+            }
+        }
+    }
+    return dst;
+}
+
+// Texels of the block, edges repeated where the level is smaller than the block.
+static void fetchBlock(const Encode *e, int bx, int by, unsigned char block[16][4]) {
+    for (int y = 0; y < 4; y++) {
+        int sy = by * 4 + y < e->height ? by * 4 + y : e->height - 1;
+        for (int x = 0; x < 4; x++) {
+            int sx = bx * 4 + x < e->width ? bx * 4 + x : e->width - 1;
+            memcpy(block[y * 4 + x], e->rgba + ((size_t)sy * e->width + sx) * 4, 4);
+        }
+    }
+}
+
+// Ends of the bounding box along its diagonal that best follows the texels: channels that fall
+// while the one with the widest range rises run from max to min.
+static void boxEndpoints(unsigned char block[16][4], int channels, int lo[4], int hi[4]) {
+    int mean[4] = {0, 0, 0, 0};
+    for (int c = 0; c < channels; c++) {
+        lo[c] = 255;
+        hi[c] = 0;
+        for (int i = 0; i < 16; i++) {
+            int v = block[i][c];
+            mean[c] += v;
+            if (v < lo[c])
+                lo[c] = v;
+            if (v > hi[c])
+                hi[c] = v;
+        }
+    }
+    int ref = 0;
+    for (int c = 1; c < channels; c++) {
+        if (hi[c] - lo[c] > hi[ref] - lo[ref])
+            ref = c;
+    }
+    for (int c = 0; c < channels; c++) {
+        if (c == ref)
+            continue;
+        int covariance = 0;
+        for (int i = 0; i < 16; i++) {
+            covariance += (16 * block[i][c] - mean[c]) * (16 * block[i][ref] - mean[ref]);
+        }
+        if (covariance < 0) {
+            int t = lo[c];
+            lo[c] = hi[c];
+            hi[c] = t;
+        }
+    }
+}
+
+static int nearest(const unsigned char pixel[4], int palette[][4], int colors, int channels) {
+    int best = 0, bestError = 1 << 30;
+    for (int k = 0; k < colors; k++) {
+        int error = 0;
+        for (int c = 0; c < channels; c++) {
+            int d = pixel[c] - palette[k][c];
+            error += d * d;
+        }
+        if (error < bestError) {
+            bestError = error;
+            best = k;
+        }
+    }
+    return best;
+}
+
+static int to565(const int rgb[3]) {
+    return ((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | (rgb[2] * 31 + 127) / 255;
+}
+
+static void from565(int c, int rgb[4]) {
+    int r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+    rgb[0] = r << 3 | r >> 2;
+    rgb[1] = g << 2 | g >> 4;
+    rgb[2] = b << 3 | b >> 2;
+    rgb[3] = 255;
+}
+
+static void bc1Palette(int c0, int c1, int palette[4][4]) {
+    from565(c0, palette[0]);
+    from565(c1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        if (c0 > c1) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        else {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = c0 > c1 ? 255 : 0;
+}
+
+// Always the four color mode; endpoints that quantize to the same color use index 0 only.
+static void encodeBc1(unsigned char block[16][4], unsigned char *out) {
+    int lo[4], hi[4];
+    boxEndpoints(block, 3, lo, hi);
+    int c0 = to565(hi), c1 = to565(lo);
+    if (c0 < c1) {
+        int t = c0;
+        c0 = c1;
+        c1 = t;
+    }
+    unsigned int indices = 0;
+    if (c0 != c1) {
+        int palette[4][4];
+        bc1Palette(c0, c1, palette);
+        for (int i = 0; i < 16; i++) {
+            indices |= (unsigned int)nearest(block[i], palette, 4, 3) << (2 * i);
+        }
+    }
+    unsigned char bytes[8] = {c0 & 0xFF, c0 >> 8, c1 & 0xFF, c1 >> 8,
+                              indices & 0xFF, indices >> 8 & 0xFF, indices >> 16 & 0xFF, indices >> 24};
+    memcpy(out, bytes, 8);
+}
+
+static void decodeBc1(const unsigned char *in, unsigned char block[16][4]) {
+    int c0 = in[0] | in[1] << 8, c1 = in[2] | in[3] << 8;
+    unsigned int indices = in[4] | in[5] << 8 | in[6] << 16 | (unsigned int)in[7] << 24;
+    int palette[4][4];
+    bc1Palette(c0, c1, palette);
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 4; c++) {
+            block[i][c] = palette[indices >> (2 * i) & 3][c];
+        }
+    }
+}
+
+static void putBits(unsigned char *out, int *pos, unsigned int value, int bits) {
+    for (int b = 0; b < bits; b++, (*pos)++) {
+        if (value >> b & 1)
+            out[*pos >> 3] |= 1 << (*pos & 7);
+    }
+}
+
+static unsigned int getBits(const unsigned char *in, int *pos, int bits) {
+    unsigned int value = 0;
+    for (int b = 0; b < bits; b++, (*pos)++) {
+        value |= (unsigned int)(in[*pos >> 3] >> (*pos & 7) & 1) << b;
+    }
+    return value;
+}
+
+// 7 bit RGBA plus a shared low bit, whichever low bit lands closer to the endpoint
+static void quantizeBc7(const int endpoint[4], int color[4], int *pbit) {
+    int bestError = 1 << 30;
+    for (int p = 0; p < 2; p++) {
+        int q[4], error = 0;
+        for (int c = 0; c < 4; c++) {
+            q[c] = (endpoint[c] + 1 - p) >> 1;
+            q[c] = q[c] < 0 ? 0 : q[c] > 127 ? 127 : q[c];
+            int d = (q[c] << 1 | p) - endpoint[c];
+            error += d * d;
+        }
+        if (error < bestError) {
+            bestError = error;
+            memcpy(color, q, sizeof(q));
+            *pbit = p;
+        }
+    }
+}
+
+static void bc7Palette(const int color[2][4], const int pbit[2], int palette[16][4]) {
+    for (int k = 0; k < 16; k++) {
+        for (int c = 0; c < 4; c++) {
+            int e0 = color[0][c] << 1 | pbit[0], e1 = color[1][c] << 1 | pbit[1];
+            palette[k][c] = ((64 - bc7Weights[k]) * e0 + bc7Weights[k] * e1 + 32) >> 6;
+        }
+    }
+}
+
+// Mode 6: one subset, RGBA endpoints and 4 bit indices. The first index has its top bit
+// implied zero, so the endpoints are swapped when it would be set.
+static void encodeBc7(unsigned char block[16][4], unsigned char *out) {
+    int lo[4], hi[4], color[2][4], pbit[2], palette[16][4], indices[16];
+    boxEndpoints(block, 4, lo, hi);
+    quantizeBc7(lo, color[0], &pbit[0]);
+    quantizeBc7(hi, color[1], &pbit[1]);
+    bc7Palette(color, pbit, palette);
+    for (int i = 0; i < 16; i++) {
+        indices[i] = nearest(block[i], palette, 16, 4);
+    }
+    if (indices[0] & 8) {
+        for (int c = 0; c < 4; c++) {
+            int t = color[0][c];
+            color[0][c] = color[1][c];
+            color[1][c] = t;
+        }
+        int t = pbit[0];
+        pbit[0] = pbit[1];
+        pbit[1] = t;
+        for (int i = 0; i < 16; i++) {
+            indices[i] = 15 - indices[i];
+        }
+    }
+
+    memset(out, 0, 16);
+    int pos = 0;
+    putBits(out, &pos, 1 << 6, 7);
+    for (int c = 0; c < 4; c++) {
+        putBits(out, &pos, color[0][c], 7);
+        putBits(out, &pos, color[1][c], 7);
+    }
+    putBits(out, &pos, pbit[0], 1);
+    putBits(out, &pos, pbit[1], 1);
+    for (int i = 0; i < 16; i++) {
+        putBits(out, &pos, indices[i], i == 0 ? 3 : 4);
+    }
+}
+
+static int decodeBc7(const unsigned char *in, unsigned char block[16][4]) {
+    if ((in[0] & 0x7F) != 0x40)
+        return 0;
+    int pos = 7, color[2][4], pbit[2], palette[16][4];
+    for (int c = 0; c < 4; c++) {
+        color[0][c] = getBits(in, &pos, 7);
+        color[1][c] = getBits(in, &pos, 7);
+    }
+    pbit[0] = getBits(in, &pos, 1);
+    pbit[1] = getBits(in, &pos, 1);
+    bc7Palette(color, pbit, palette);
+    for (int i = 0; i < 16; i++) {
+        int index = getBits(in, &pos, i == 0 ? 3 : 4);
+        for (int c = 0; c < 4; c++) {
+            block[i][c] = palette[index][c];
+        }
+    }
+    return 1;
+}
+
+static void encodeRange(void *ctx, int begin, int end, int worker) {
+    const Encode *e = ctx;
+    int blocksX = (e->width + 3) / 4;
+    size_t blockSize = e->format == TEXTURE_BC1 ? 8 : 16;
+    unsigned char block[16][4];
+    for (int by = begin; by < end; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            fetchBlock(e, bx, by, block);
+            unsigned char *out = e->out + ((size_t)by * blocksX + bx) * blockSize;
+            if (e->format == TEXTURE_BC1)
+                encodeBc1(block, out);
+            else
+                encodeBc7(block, out);
+        }
+    }
+}
+
+static void encodeLevel(const unsigned char *rgba, int width, int height, int format, int parallel, unsigned char *out) {
+    if (format == TEXTURE_RGBA8) {
+        memcpy(out, rgba, (size_t)width * height * 4);
+        return;
+    }
+    Encode e = {rgba, width, height, format, out};
+    if (parallel)
+        jobs_parallel_for((height + 3) / 4, ENCODE_GRAIN, encodeRange, &e);
+    else
+        encodeRange(&e, 0, (height + 3) / 4, 0);
+}
+
+static int sourceStamp(const char *source, unsigned long long *size, long long *time) {
+    struct stat st;
+    if (stat(source, &st) != 0)
+        return 0;
+    *size = st.st_size;
+    *time = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return 1;
+}
+
+char *texture_cache_path(const char *source, int format) {
+    static const char *formatNames[] = {"rgba8", "bc1", "bc7"};
+    const char *name = formatNames[format];
+    char *path = malloc(strlen(source) + strlen(name) + 1 + sizeof(TEXTURE_CACHE_SUFFIX));
+    sprintf(path, "%s.%s%s", source, name, TEXTURE_CACHE_SUFFIX);
+    return path;
+}
+
+// Written next to the final path and renamed over it, so a half written cache is never read.
+static int buildCache(const char *source, const char *path, int format, int parallel) {
+    int width, height, channels;
+    unsigned char *rgba = stbi_load(source, &width, &height, &channels, 4);
+    if (!rgba) {
+        printf("Failed to load texture %s: %s\n", source, stbi_failure_reason());
+        return 0;
+    }
+
+    TextureHeader header = {TEXTURE_MAGIC, TEXTURE_VERSION, format, format, width, height, 1, 0, 0};
+    sourceStamp(source, &header.sourceSize, &header.sourceTime);
+    if (format == TEXTURE_BC1) {
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            if (rgba[i * 4 + 3] != 255) {
+                header.format = TEXTURE_BC7;
+                break;
+            }
+        }
+    }
+    while (header.levels < TEXTURE_MAX_LEVELS && (width >> header.levels || height >> header.levels)) {
+        header.levels++;
+    }
+
+    TextureLevel table[TEXTURE_MAX_LEVELS];
+    size_t offset = alignUp(sizeof(TextureHeader) + header.levels * sizeof(TextureLevel));
+    for (unsigned int l = 0; l < header.levels; l++) {
+        table[l].offset = offset;
+        table[l].size = levelBytes(header.format, levelDimension(width, l), levelDimension(height, l));
+        offset = alignUp(offset + table[l].size);
+    }
+    unsigned char *file = calloc(1, offset);
+    memcpy(file, &header, sizeof(header));
+    memcpy(file + sizeof(header), table, header.levels * sizeof(TextureLevel));
+
+    unsigned char *level = rgba;
+    for (unsigned int l = 0; l < header.levels; l++) {
+        int w = levelDimension(width, l), h = levelDimension(height, l);
+        encodeLevel(level, w, h, header.format, parallel, file + table[l].offset);
+        if (l + 1 < header.levels) {
+            unsigned char *next = downsample(level, w, h);
+            if (level != rgba)
+                free(level);
+            level = next;
+        }
+    }
+    if (level != rgba)
+        free(level);
+    stbi_image_free(rgba);
+
+    char *temporary = malloc(strlen(path) + 5);
+    strcpy(temporary, path);
+    strcat(temporary, ".tmp");
+    FILE *f = fopen(temporary, "wb");
+    int ok = f && fwrite(file, offset, 1, f) == 1;
+    ok = f && fclose(f) == 0 && ok;
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+        printf("Failed to write texture cache %s\n", path);
+        remove(temporary);
+    }
+    free(temporary);
+    free(file);
+    return ok;
+}
+
+// Maps the cache if it is complete and was built from this source in this format.
+static int mapCache(const char *source, const char *path, int format, TextureImage *image) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TextureHeader))
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return 0;
+
+    size_t fileSize = st.st_size;
+    const TextureHeader *header = mapping;
+    unsigned long long sourceSize;
+    long long sourceTime;
+    int ok = memcmp(header->magic, TEXTURE_MAGIC, 8) == 0 && header->version == TEXTURE_VERSION
+          && header->requestedFormat == (unsigned int)format && header->format <= TEXTURE_BC7
+          && header->levels >= 1 && header->levels <= TEXTURE_MAX_LEVELS && header->width > 0 && header->height > 0
+          && sizeof(TextureHeader) + header->levels * sizeof(TextureLevel) <= fileSize;
+    // without the source the cache is all there is
+    if (ok && sourceStamp(source, &sourceSize, &sourceTime))
+        ok = header->sourceSize == sourceSize && header->sourceTime == sourceTime;
+    const TextureLevel *table = (const TextureLevel*)(header + 1);
+    for (unsigned int l = 0; ok && l < header->levels; l++) {
+        ok = table[l].offset <= fileSize && table[l].size <= fileSize - table[l].offset
+          && table[l].size == levelBytes(header->format, levelDimension(header->width, l), levelDimension(header->height, l));
+    }
+    if (!ok) {
+        munmap(mapping, fileSize);
+        return 0;
+    }
+
+    memset(image, 0, sizeof(TextureImage));
+    image->format = header->format;
+    image->width = header->width;
+    image->height = header->height;
+    image->levels = header->levels;
+    for (int l = 0; l < image->levels; l++) {
+        image->data[l] = (const unsigned char*)mapping + table[l].offset;
+        image->size[l] = table[l].size;
+    }
+    image->mapping = mapping;
+    image->mappingSize = fileSize;
+    return 1;
+}
+
+static int load(const char *source, int format, int parallel, TextureImage *image) {
+    char *path = texture_cache_path(source, format);
+    int ok = mapCache(source, path, format, image);
+    if (!ok && buildCache(source, path, format, parallel)) {
+        ok = mapCache(source, path, format, image);
+        image->built = ok;
+    }
+    free(path);
+    return ok;
+}
+
+int texture_load(const char *source, int format, TextureImage *image) {
+    return load(source, format, 1, image);
+}
+
+int texture_load_serial(const char *source, int format, TextureImage *image) {
+    return load(source, format, 0, image);
+}
+
+void texture_release(TextureImage *image) {
+    if (image->mapping)
+        munmap(image->mapping, image->mappingSize);
+    memset(image, 0, sizeof(TextureImage));
+}
+
+int texture_decode_level(const TextureImage *image, int level, unsigned char *rgba) {
+    int width = texture_level_width(image, level), height = texture_level_height(image, level);
+    const unsigned char *data = image->data[level];
+    if (image->format == TEXTURE_RGBA8) {
+        memcpy(rgba, data, (size_t)width * height * 4);
+        return 1;
+    }
+    int blocksX = (width + 3) / 4;
+    size_t blockSize = image->format == TEXTURE_BC1 ? 8 : 16;
+    unsigned char block[16][4];
+    for (int by = 0; by < (height + 3) / 4; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            const unsigned char *in = data + ((size_t)by * blocksX + bx) * blockSize;
+            if (image->format == TEXTURE_BC1)
+                decodeBc1(in, block);
+            else if (!decodeBc7(in, block))
+                return 0;
+            for (int i = 0; i < 16; i++) {
+                int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+                if (x < width && y < height)
+                    memcpy(rgba + ((size_t)y * width + x) * 4, block[i], 4);
+            }
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,49 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <stddef.h>
+
+#define TEXTURE_MAGIC "CSIMMIPS"
+#define TEXTURE_VERSION 1
+#define TEXTURE_MAX_LEVELS 16
+// appended to the source path after the format, as in test.png.bc7.ctex
+#define TEXTURE_CACHE_SUFFIX ".ctex"
+
+enum {
+    TEXTURE_RGBA8,
+    // 8 bytes per 4x4 block, opaque only: textures with alpha fall back to BC7
+    TEXTURE_BC1,
+    // 16 bytes per 4x4 block, always written in mode 6
+    TEXTURE_BC7
+};
+
+// A texture with its whole mip chain, levels next to each other in a cache file that stays
+// mapped until the image is released.
+typedef struct {
+    int format;
+    int width, height;
+    int levels;
+    const unsigned char *data[TEXTURE_MAX_LEVELS];
+    size_t size[TEXTURE_MAX_LEVELS];
+    void *mapping;
+    size_t mappingSize;
+    // set when the cache was missing or stale and this load rebuilt it
+    int built;
+} TextureImage;
+
+// Maps the cache of source in format, first building it if it is missing or older than the
+// source: the source is decoded to RGBA, mipmapped down to 1x1 and encoded in format. A
+// cache without its source is used as it is. Returns 0 if neither can be read.
+// Every format has a cache of its own, so loading one never invalidates another.
+int texture_load(const char *source, int format, TextureImage *image);
+// The same without the job pool, for threads other than the one that drives it.
+int texture_load_serial(const char *source, int format, TextureImage *image);
+void texture_release(TextureImage *image);
+// The path of the cache of source in format, to be freed by the caller.
+char *texture_cache_path(const char *source, int format);
+int texture_level_width(const TextureImage *image, int level);
+int texture_level_height(const TextureImage *image, int level);
+// Decodes a level to RGBA, for checking the encoders. Returns 0 for blocks they can't write.
+int texture_decode_level(const TextureImage *image, int level, unsigned char *rgba);
+
+#endif